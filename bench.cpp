@@ -0,0 +1,458 @@
+// bench.cpp
+//
+// Measure the speed of the 6502 core on a set of built-in workloads:
+//     cpusim-bench [options] [workload...]
+// or on each opcode alone:
+//     cpusim-bench --opcodes [options]
+// Options:
+//     --6502 --6502-undocumented --65c02 --w65c02
+//                      The CPU variant, as for cpusim; the default is --6502
+//     --jit            Enable native translation
+//     --count N        Instructions to run for each workload or opcode; the
+//                      defaults are 50000000 and 1000000
+// With no workloads named, all of them run. The output is a table of tab-
+// separated values with a header line: for each workload, and then for all
+// of them together, the instructions and cycles run, the host time per
+// instruction, the instructions and emulated cycles per second, and the
+// share of each kind of instruction. In the instrumented build (see
+// CPU6502::GetOpcodeCosts()), a second table ranks the opcodes that the
+// workloads ran by their host time.
+//
+// With --opcodes, each opcode runs in a loop of copies of itself, and the
+// table gives the host time and emulated cycles for each, slowest first.
+// Opcodes that return, stop the CPU or jump through memory are left out.
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <regex>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "cpu6502.h"
+#include "memory.h"
+
+// Each workload is loaded at $0200, runs from there and loops for ever
+struct Workload {
+    const char *name;
+    std::vector<std::uint8_t> code;
+};
+
+static const Workload workloads[] = {
+    { "alu", {
+        0xA2, 0x00,             // 0200  LDX #$00
+        0xA9, 0x00,             // 0202  LDA #$00
+        0x18,                   // 0204  CLC
+        0x69, 0x03,             // 0205  ADC #$03
+        0x49, 0x5A,             // 0207  EOR #$5A
+        0x2A,                   // 0209  ROL A
+        0x09, 0x01,             // 020A  ORA #$01
+        0xE8,                   // 020C  INX
+        0xD0, 0xF5,             // 020D  BNE $0204
+        0xC8,                   // 020F  INY
+        0x4C, 0x04, 0x02,       // 0210  JMP $0204
+    } },
+    { "copy", {
+        0xA0, 0x00,             // 0200  LDY #$00
+        0xB9, 0x00, 0x10,       // 0202  LDA $1000,Y
+        0x99, 0x00, 0x20,       // 0205  STA $2000,Y
+        0xB9, 0x00, 0x11,       // 0208  LDA $1100,Y
+        0x99, 0x00, 0x21,       // 020B  STA $2100,Y
+        0xC8,                   // 020E  INY
+        0xD0, 0xF1,             // 020F  BNE $0202
+        0x4C, 0x00, 0x02,       // 0211  JMP $0200
+    } },
+    { "indirect", {
+        0xA9, 0x00,             // 0200  LDA #$00
+        0x85, 0x80,             // 0202  STA $80
+        0xA9, 0x10,             // 0204  LDA #$10
+        0x85, 0x81,             // 0206  STA $81
+        0xA0, 0x00,             // 0208  LDY #$00
+        0xB1, 0x80,             // 020A  LDA ($80),Y
+        0x65, 0x82,             // 020C  ADC $82
+        0x85, 0x82,             // 020E  STA $82
+        0xC8,                   // 0210  INY
+        0xD0, 0xF7,             // 0211  BNE $020A
+        0xE6, 0x81,             // 0213  INC $81
+        0xA5, 0x81,             // 0215  LDA $81
+        0xC9, 0x20,             // 0217  CMP #$20
+        0xD0, 0xEF,             // 0219  BNE $020A
+        0x4C, 0x00, 0x02,       // 021B  JMP $0200
+    } },
+    { "bcd", {
+        0xF8,                   // 0200  SED
+        0xA9, 0x00,             // 0201  LDA #$00
+        0x85, 0x80,             // 0203  STA $80
+        0x85, 0x81,             // 0205  STA $81
+        0x18,                   // 0207  CLC
+        0xA5, 0x80,             // 0208  LDA $80
+        0x69, 0x01,             // 020A  ADC #$01
+        0x85, 0x80,             // 020C  STA $80
+        0xA5, 0x81,             // 020E  LDA $81
+        0x69, 0x00,             // 0210  ADC #$00
+        0x85, 0x81,             // 0212  STA $81
+        0x38,                   // 0214  SEC
+        0xA5, 0x82,             // 0215  LDA $82
+        0xE9, 0x07,             // 0217  SBC #$07
+        0x85, 0x82,             // 0219  STA $82
+        0x4C, 0x07, 0x02,       // 021B  JMP $0207
+    } },
+    { "recursion", {
+        0xA2, 0xFF,             // 0200  LDX #$FF
+        0x9A,                   // 0202  TXS
+        0xA9, 0x08,             // 0203  LDA #$08
+        0x20, 0x0B, 0x02,       // 0205  JSR $020B
+        0x4C, 0x03, 0x02,       // 0208  JMP $0203
+        0x38,                   // 020B  SEC         ; calls itself twice
+        0xE9, 0x01,             // 020C  SBC #$01    ; with A one less,
+        0xF0, 0x0A,             // 020E  BEQ $021A   ; down to 1
+        0x48,                   // 0210  PHA
+        0x20, 0x0B, 0x02,       // 0211  JSR $020B
+        0x68,                   // 0214  PLA
+        0x48,                   // 0215  PHA
+        0x20, 0x0B, 0x02,       // 0216  JSR $020B
+        0x68,                   // 0219  PLA
+        0x60,                   // 021A  RTS
+    } },
+    { "sort", {
+        0xA2, 0x3F,             // 0200  LDX #$3F    ; scramble 64 bytes
+        0x8A,                   // 0202  TXA
+        0x49, 0xA5,             // 0203  EOR #$A5
+        0x9D, 0x00, 0x10,       // 0205  STA $1000,X
+        0xCA,                   // 0208  DEX
+        0x10, 0xF7,             // 0209  BPL $0202
+        0xA0, 0x00,             // 020B  LDY #$00    ; bubble sort them
+        0xA2, 0x00,             // 020D  LDX #$00
+        0xBD, 0x00, 0x10,       // 020F  LDA $1000,X
+        0xDD, 0x01, 0x10,       // 0212  CMP $1001,X
+        0x90, 0x0F,             // 0215  BCC $0226
+        0xF0, 0x0D,             // 0217  BEQ $0226
+        0x48,                   // 0219  PHA
+        0xBD, 0x01, 0x10,       // 021A  LDA $1001,X
+        0x9D, 0x00, 0x10,       // 021D  STA $1000,X
+        0x68,                   // 0220  PLA
+        0x9D, 0x01, 0x10,       // 0221  STA $1001,X
+        0xA0, 0x01,             // 0224  LDY #$01
+        0xE8,                   // 0226  INX
+        0xE0, 0x3F,             // 0227  CPX #$3F
+        0xD0, 0xE4,             // 0229  BNE $020F
+        0x88,                   // 022B  DEY
+        0xF0, 0xDD,             // 022C  BEQ $020B
+        0x4C, 0x00, 0x02,       // 022E  JMP $0200
+    } },
+};
+
+// Kinds of instruction, by mnemonic, for the mix
+static const char *const kind_names[] = {
+    "load_store", "alu", "branch", "jump", "stack", "other"
+};
+static const unsigned num_kinds = sizeof(kind_names) / sizeof(kind_names[0]);
+
+static unsigned
+kindOf(const std::string& mnemonic)
+{
+    static const char *const kinds[num_kinds - 1] = {
+        "LDA LDX LDY STA STX STY STZ TAX TAY TXA TYA TSX TXS",
+        "ADC SBC AND ORA EOR CMP CPX CPY BIT ASL LSR ROL ROR INC DEC INX INY "
+            "DEX DEY TRB TSB",
+        "BCC BCS BEQ BNE BMI BPL BVC BVS BRA",
+        "JMP JSR RTS RTI BRK",
+        "PHA PLA PHP PLP PHX PLX PHY PLY"
+    };
+    for (unsigned k = 0; k < num_kinds - 1; ++k) {
+        if (mnemonic.size() == 3 && std::strstr(kinds[k], mnemonic.c_str())) {
+            return k;
+        }
+    }
+    return num_kinds - 1;
+}
+
+static CPU6502 *
+newCPU(CPU6502::Variant variant, const std::vector<std::uint8_t>& code)
+{
+    auto memory = new LittleEndianMemory(65536);
+    auto cpu = new CPU6502(memory, variant);
+    memory->LoadBlock(0x0200, code.data(), code.size());
+    cpu->SetRegister("PC", "200");
+    return cpu;
+}
+
+// The instruction at addr, with its operand shown only by its size, as in
+// "LDA ($nn),Y"
+static std::string
+instructionForm(const CPU6502& cpu, std::uint16_t addr)
+{
+    static const std::regex word("\\$[0-9A-F]{4}");
+    static const std::regex byte("\\$[0-9A-F]{2}");
+    auto text = cpu.Disassemble(addr).disasm;
+    return std::regex_replace(std::regex_replace(text, word, "$$nnnn"),
+                              byte, "$$nn");
+}
+
+struct Result {
+    unsigned long instructions;
+    unsigned long cycles;
+    double seconds;
+    unsigned long mix[num_kinds];
+};
+
+static void
+report(const char *name, const Result& result)
+{
+    unsigned long sampled = 0;
+    for (auto n : result.mix) {
+        sampled += n;
+    }
+    double secs = (result.seconds > 1e-9) ? result.seconds : 1e-9;
+    std::printf("%s\t%lu\t%lu\t%.3f\t%.2f\t%.2f", name, result.instructions,
+                result.cycles, secs * 1e9 / result.instructions,
+                result.instructions / secs / 1e6,
+                result.cycles / secs / 1e6);
+    for (auto n : result.mix) {
+        std::printf("\t%.3f", sampled ? static_cast<double>(n) / sampled : 0.0);
+    }
+    std::printf("\n");
+}
+
+// Run the workloads, and rank the opcodes that they ran if the core is
+// instrumented
+static void
+runWorkloads(CPU6502::Variant variant, bool jit, unsigned long count,
+             const std::vector<const Workload *>& chosen)
+{
+    // Instructions stepped through to find the mix, which is untimed
+    static const unsigned long mix_sample = 1000000;
+
+    std::printf("workload\tinstructions\tcycles\tns_per_instr\tmips\t"
+                "emulated_mhz");
+    for (auto name : kind_names) {
+        std::printf("\t%s", name);
+    }
+    std::printf("\n");
+
+    Result total = {};
+    unsigned long long op_counts[256] = {};
+    double op_seconds[256] = {};
+    for (auto workload : chosen) {
+        Result result = {};
+
+        std::unique_ptr<CPU6502> sampler(newCPU(variant, workload->code));
+        for (unsigned long i = 0; i < mix_sample && i < count; ++i) {
+            auto text = sampler->Disassemble(sampler->GetPC()).disasm;
+            ++result.mix[kindOf(text.substr(0, text.find(' ')))];
+            sampler->Step();
+        }
+
+        std::unique_ptr<CPU6502> cpu(newCPU(variant, workload->code));
+        cpu->SetJIT(jit);
+        cpu->ClearOpcodeCosts();
+        auto start = std::chrono::steady_clock::now();
+        auto run = cpu->RunInstructions(count);
+        std::chrono::duration<double> elapsed =
+                std::chrono::steady_clock::now() - start;
+        result.instructions = run.instructions;
+        result.cycles = run.cycles;
+        result.seconds = elapsed.count();
+        report(workload->name, result);
+
+        for (auto const &cost : cpu->GetOpcodeCosts()) {
+            op_counts[cost.opcode] += cost.count;
+            op_seconds[cost.opcode] += cost.seconds;
+        }
+        total.instructions += result.instructions;
+        total.cycles += result.cycles;
+        total.seconds += result.seconds;
+        for (unsigned k = 0; k < num_kinds; ++k) {
+            total.mix[k] += result.mix[k];
+        }
+    }
+    report("all", total);
+
+    std::vector<unsigned> ranked;
+    double total_seconds = 0;
+    for (unsigned op = 0; op < 256; ++op) {
+        if (op_counts[op] != 0) {
+            ranked.push_back(op);
+            total_seconds += op_seconds[op];
+        }
+    }
+    if (ranked.empty()) {
+        return;
+    }
+    std::sort(ranked.begin(), ranked.end(), [&op_seconds](unsigned a,
+                                                          unsigned b) {
+        return op_seconds[a] > op_seconds[b];
+    });
+
+    // The samples are timed with overheads of their own, so the estimates
+    // are scaled to add up to the time of the runs
+    double scale = (total_seconds > 0) ? total.seconds / total_seconds : 0;
+
+    std::unique_ptr<CPU6502> scratch(newCPU(variant, {}));
+    std::printf("\nopcode\tinstruction\tcount\tns_per_instr\thost_share\n");
+    for (auto op : ranked) {
+        scratch->GetMemory()->Load8(0x0200, op);
+        scratch->GetMemory()->Load8(0x0201, 0x80);
+        scratch->GetMemory()->Load8(0x0202, 0x10);
+        std::printf("%02X\t%s\t%llu\t%.3f\t%.3f\n", op,
+                    instructionForm(*scratch, 0x0200).c_str(), op_counts[op],
+                    op_seconds[op] * scale * 1e9 / op_counts[op],
+                    total_seconds > 0 ? op_seconds[op] / total_seconds : 0.0);
+    }
+}
+
+// A loop of copies of the opcode, with operands that keep it in the loop,
+// or nothing if the opcode cannot be run so
+static std::vector<std::uint8_t>
+opcodeLoop(CPU6502::Variant variant, std::uint8_t opcode)
+{
+    static const unsigned copies = 256;
+
+    std::unique_ptr<CPU6502> scratch(newCPU(variant, { opcode, 0x80, 0x10 }));
+    auto disasm = scratch->Disassemble(0x0200);
+    auto mnemonic = disasm.disasm.substr(0, disasm.disasm.find(' '));
+    if (std::strstr("??? BRK RTI RTS JAM STP WAI", mnemonic.c_str()) != nullptr
+    ||  disasm.disasm.compare(0, 5, "JMP (") == 0) {
+        return {};
+    }
+
+    // Zero page and absolute operands are $80 and $1000; branches go on to
+    // the next copy, whether taken or not, as do jumps and calls
+    auto length = disasm.num_bytes;
+    std::vector<std::uint8_t> code;
+    for (unsigned i = 0; i < copies; ++i) {
+        std::uint16_t next = 0x0200 + (i + 1) * length;
+        code.push_back(opcode);
+        if (mnemonic == "JMP" || mnemonic == "JSR") {
+            code.push_back(next & 0xFF);
+            code.push_back(next >> 8);
+        } else if (mnemonic.compare(0, 2, "BB") == 0) {
+            code.push_back(0x80);
+            code.push_back(0x00);
+        } else if (length == 2 && kindOf(mnemonic) == 2) {
+            code.push_back(0x00);
+        } else if (length == 2) {
+            code.push_back(0x80);
+        } else if (length == 3) {
+            code.push_back(0x00);
+            code.push_back(0x10);
+        }
+    }
+    code.push_back(0x4C);       // JMP $0200
+    code.push_back(0x00);
+    code.push_back(0x02);
+    return code;
+}
+
+static void
+runOpcodes(CPU6502::Variant variant, bool jit, unsigned long count)
+{
+    struct Timing {
+        unsigned opcode;
+        std::string form;
+        double ns;
+        double cycles;
+    };
+    std::vector<Timing> timings;
+
+    for (unsigned op = 0; op < 256; ++op) {
+        auto code = opcodeLoop(variant, op);
+        if (code.empty()) {
+            continue;
+        }
+        std::unique_ptr<CPU6502> cpu(newCPU(variant, code));
+        cpu->SetJIT(jit);
+        auto start = std::chrono::steady_clock::now();
+        auto run = cpu->RunInstructions(count);
+        std::chrono::duration<double> elapsed =
+                std::chrono::steady_clock::now() - start;
+        timings.push_back({ op, instructionForm(*cpu, 0x0200),
+                            elapsed.count() * 1e9 / run.instructions,
+                            static_cast<double>(run.cycles)
+                                / run.instructions });
+    }
+    std::sort(timings.begin(), timings.end(),
+              [](const Timing& a, const Timing& b) { return a.ns > b.ns; });
+
+    std::printf("opcode\tinstruction\tns_per_instr\tcycles_per_instr\n");
+    for (auto const &t : timings) {
+        std::printf("%02X\t%s\t%.3f\t%.2f\n", t.opcode, t.form.c_str(), t.ns,
+                    t.cycles);
+    }
+}
+
+static void
+usage(const char *prog)
+{
+    std::fprintf(stderr,
+            "Usage: %s [--6502 | --6502-undocumented | --65c02 | --w65c02]\n"
+            "       [--jit] [--count N] [--opcodes | workload...]\n", prog);
+    std::exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+    CPU6502::Variant variant = CPU6502::nmos;
+    bool jit = false;
+    bool opcodes = false;
+    unsigned long count = 0;
+    std::vector<const Workload *> chosen;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--6502") {
+            variant = CPU6502::nmos;
+        } else if (arg == "--6502-undocumented") {
+            variant = CPU6502::nmos_undocumented;
+        } else if (arg == "--65c02") {
+            variant = CPU6502::cmos;
+        } else if (arg == "--w65c02") {
+            variant = CPU6502::wdc;
+        } else if (arg == "--jit") {
+            jit = true;
+        } else if (arg == "--opcodes") {
+            opcodes = true;
+        } else if (arg == "--count" && i + 1 < argc) {
+            char *end;
+            count = std::strtoul(argv[++i], &end, 10);
+            if (*end != '\0' || count == 0) {
+                usage(argv[0]);
+            }
+        } else if (arg.compare(0, 2, "--") == 0) {
+            usage(argv[0]);
+        } else {
+            const Workload *found = nullptr;
+            for (auto const &w : workloads) {
+                if (arg == w.name) {
+                    found = &w;
+                }
+            }
+            if (found == nullptr) {
+                std::fprintf(stderr, "%s: no workload %s\n", argv[0],
+                             arg.c_str());
+                return 2;
+            }
+            chosen.push_back(found);
+        }
+    }
+
+    if (opcodes) {
+        if (!chosen.empty()) {
+            usage(argv[0]);
+        }
+        runOpcodes(variant, jit, count ? count : 1000000);
+        return 0;
+    }
+
+    if (chosen.empty()) {
+        for (auto const &w : workloads) {
+            chosen.push_back(&w);
+        }
+    }
+    runWorkloads(variant, jit, count ? count : 50000000, chosen);
+    return 0;
+}
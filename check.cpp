@@ -0,0 +1,784 @@
+// check.cpp
+//
+// Run the checks that the test vectors cannot express, and report any that
+// fail:
+//     cpusim-check
+// The vectors in tests/ cover the 6502 variants one instruction or one
+// short program at a time; these cover the Z80 and the parts of the
+// simulator around the cores. The exit status is 0 if every check passes
+// and 1 if any fails.
+
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include <cstdint>
+#include <cstdio>
+#include <zlib.h>
+#include "condition.h"
+#include "coverage.h"
+#include "cpu6502.h"
+#include "cpuz80.h"
+#include "memory.h"
+
+static unsigned long checks_run;
+static unsigned long checks_failed;
+
+static void
+Check(bool ok, const std::string& name, const char *what)
+{
+    ++checks_run;
+    if (!ok) {
+        ++checks_failed;
+        std::printf("FAIL: %s: %s\n", name.c_str(), what);
+    }
+}
+
+// A device that counts its reads, and reads as a byte that goes up by step
+// with each read
+class CountingDevice : public MemoryDevice {
+public:
+    CountingDevice(std::uint8_t first, std::uint8_t step_) :
+        value(first), step(step_), reads(0) {}
+
+    virtual std::uint8_t Read(std::size_t offset) override
+    {
+        ++reads;
+        std::uint8_t data = value;
+        value += step;
+        return data;
+    }
+    virtual void Write(std::size_t offset, std::uint8_t data) override {}
+
+    std::uint8_t value;
+    std::uint8_t step;
+    unsigned long reads;
+};
+
+// A Z80 program, loaded at $0000 and run until it reaches a HALT, with
+// the registers and bytes it should leave
+struct Z80Program {
+    const char *name;
+    std::vector<std::uint8_t> code;
+    std::vector<std::pair<std::uint16_t, std::uint8_t>> data;
+    std::vector<std::pair<const char *, std::uint64_t>> registers;
+    std::vector<std::pair<std::uint16_t, std::uint8_t>> bytes;
+    unsigned long cycles;
+};
+
+static const Z80Program z80_programs[] = {
+    {
+        "z80 djnz sum",
+        {
+            0x06, 0x0A,         // LD B,10
+            0xAF,               // XOR A
+            0x80,               // loop: ADD A,B
+            0x10, 0xFD,         // DJNZ loop
+            0x76,               // HALT
+        },
+        {},
+        { { "A", 55 }, { "BC", 0x0000 } },
+        {},
+        176
+    },
+    {
+        "z80 ldir",
+        {
+            0x21, 0x00, 0x10,   // LD HL,$1000
+            0x11, 0x00, 0x20,   // LD DE,$2000
+            0x01, 0x05, 0x00,   // LD BC,5
+            0xED, 0xB0,         // LDIR
+            0x76,               // HALT
+        },
+        { { 0x1000, 0x11 }, { 0x1001, 0x22 }, { 0x1002, 0x33 },
+          { 0x1003, 0x44 }, { 0x1004, 0x55 } },
+        { { "HL", 0x1005 }, { "DE", 0x2005 }, { "BC", 0x0000 } },
+        { { 0x2000, 0x11 }, { 0x2002, 0x33 }, { 0x2004, 0x55 },
+          { 0x2005, 0x00 } },
+        130
+    },
+    {
+        "z80 call and stack",
+        {
+            0x31, 0x00, 0x80,   // LD SP,$8000
+            0x21, 0x34, 0x12,   // LD HL,$1234
+            0xE5,               // PUSH HL
+            0xD1,               // POP DE
+            0xCD, 0x0C, 0x00,   // CALL sub
+            0x76,               // HALT
+            0x3E, 0x42,         // sub: LD A,$42
+            0xC9,               // RET
+        },
+        {},
+        { { "SP", 0x8000 }, { "DE", 0x1234 }, { "A", 0x42 } },
+        { { 0x7FFE, 0x0B }, { 0x7FFF, 0x00 } },
+        75
+    },
+    {
+        "z80 daa",
+        {
+            0x3E, 0x15,         // LD A,$15
+            0xC6, 0x27,         // ADD A,$27
+            0x27,               // DAA
+            0x47,               // LD B,A
+            0xD6, 0x15,         // SUB $15
+            0x27,               // DAA
+            0x76,               // HALT
+        },
+        {},
+        { { "A", 0x27 }, { "BC", 0x4200 } },
+        {},
+        33
+    },
+    {
+        "z80 indexed",
+        {
+            0xDD, 0x21, 0x00, 0x30,     // LD IX,$3000
+            0xDD, 0x36, 0x05, 0x99,     // LD (IX+5),$99
+            0xDD, 0x7E, 0x05,           // LD A,(IX+5)
+            0xDD, 0x34, 0x05,           // INC (IX+5)
+            0x76,                       // HALT
+        },
+        {},
+        { { "IX", 0x3000 }, { "A", 0x99 } },
+        { { 0x3005, 0x9A } },
+        75
+    },
+    {
+        "z80 bit operations",
+        {
+            0x3E, 0x81,         // LD A,$81
+            0x07,               // RLCA
+            0xCB, 0xFF,         // SET 7,A
+            0xCB, 0x47,         // BIT 0,A
+            0x76,               // HALT
+        },
+        {},
+        { { "A", 0x83 } },
+        {},
+        27
+    },
+};
+
+static void
+CheckZ80Program(const Z80Program& program)
+{
+    auto memory = new LittleEndianMemory(65536);
+    CPUZ80 cpu(memory);
+    for (std::size_t i = 0; i < program.code.size(); ++i) {
+        memory->Load8(i, program.code[i]);
+    }
+    for (auto& byte : program.data) {
+        memory->Load8(byte.first, byte.second);
+    }
+    cpu.SetBreakStop(true);
+    auto result = cpu.RunInstructions(100000);
+    Check(result.reason == CPU::stop_break, program.name,
+          "did not reach the HALT");
+    for (auto& reg : program.registers) {
+        auto value = cpu.GetRegisterValue(cpu.GetRegisterIndex(reg.first));
+        Check(value == reg.second, program.name, reg.first);
+    }
+    for (auto& byte : program.bytes) {
+        Check(memory->Peek8(byte.first) == byte.second, program.name,
+              "memory");
+    }
+    Check(cpu.GetEmuCycles() == program.cycles, program.name, "cycles");
+}
+
+// Code fetched from a device reads the device
+static void
+CheckZ80DeviceFetch(void)
+{
+    static const char name[] = "z80 fetch from a device";
+
+    auto memory = new LittleEndianMemory(65536);
+    auto device = std::make_shared<CountingDevice>(0x00, 0);     // NOP
+    memory->MapDevice(0xC000, 0x100, device);
+    CPUZ80 cpu(memory);
+    cpu.SetRegister("PC", "C000");
+    cpu.RunInstructions(3);
+    Check(device->reads == 3, name, "reads");
+    Check(cpu.GetPC() == 0xC003, name, "PC");
+}
+
+// As for the 6502, Next() counts one hit for each arrival at a breakpoint
+static void
+CheckZ80NextHits(void)
+{
+    static const char name[] = "z80 breakpoint hits in Next";
+
+    for (std::uint16_t addr : { 0x0010, 0x0011 }) {
+        auto memory = new LittleEndianMemory(65536);
+        memory->Load8(0x0000, 0xCD);    // $0000: CALL $0010
+        memory->Load8(0x0001, 0x10);
+        memory->Load8(0x0002, 0x00);
+        memory->Load8(0x0010, 0x00);    // $0010: NOP
+        memory->Load8(0x0011, 0xC9);    // $0011: RET
+        CPUZ80 cpu(memory);
+        cpu.SetRegister("SP", "F000");
+        cpu.SetBreakpoint(addr, "", 3);
+        cpu.Next();
+        Check(cpu.GetBreakpointHits(addr) == 1, name, "hits");
+        Check(cpu.GetPC() == 0x0003, name, "PC");
+    }
+}
+
+// The instruction bytes of each record of a 6502 trace, in the format
+// described in cpu6502.cpp; empty if the file cannot be read
+static std::vector<std::vector<std::uint8_t>>
+ReadTraceOps(const std::string& path)
+{
+    std::vector<std::vector<std::uint8_t>> ops;
+    gzFile file = gzopen(path.c_str(), "rb");
+    if (file == nullptr) {
+        return ops;
+    }
+    int ch;
+    do {
+        ch = gzgetc(file);
+    } while (ch != '\n' && ch != -1);
+    while ((ch = gzgetc(file)) != -1) {
+        unsigned flags = ch;
+        unsigned counts = gzgetc(file);
+        std::vector<std::uint8_t> bytes;
+        for (unsigned k = 0; k < (flags & 3); ++k) {
+            bytes.push_back(gzgetc(file));
+        }
+        ops.push_back(bytes);
+        unsigned skip = (flags & 4) ? 2 : 0;
+        for (unsigned bit = 0x08; bit <= 0x80; bit <<= 1) {
+            skip += (flags & bit) ? 1 : 0;
+        }
+        skip += (counts & 0x1F) == 0x1F ? 8 : 0;
+        for (unsigned k = 0; k < skip; ++k) {
+            gzgetc(file);
+        }
+        unsigned writes = counts >> 5;
+        if (writes == 7) {
+            writes = gzgetc(file);
+        }
+        for (unsigned k = 0; k < writes * 3; ++k) {
+            gzgetc(file);
+        }
+    }
+    gzclose(file);
+    return ops;
+}
+
+// A store that rewrites the next instruction frees the decoded block
+// that the store came from, while the trace and the coverage still need
+// its length
+static const std::uint8_t self_modifying[] = {
+    0xA9, 0xE8,                 // LDA #$E8
+    0x8D, 0x05, 0x02,           // STA $0205
+    0xEA,                       // NOP, which becomes INX
+    0x4C, 0x00, 0x02,           // JMP $0200
+};
+
+static void
+LoadSelfModifying(CPU6502& cpu, Memory *memory)
+{
+    for (std::size_t i = 0; i < sizeof(self_modifying); ++i) {
+        memory->Load8(0x0200 + i, self_modifying[i]);
+    }
+    cpu.SetRegister("PC", "0200");
+    cpu.SetRegister("X", "00");
+}
+
+static void
+CheckSelfModifyingTrace(void)
+{
+    static const char name[] = "6502 trace of self-modifying code";
+    static const char path[] = "cpusim-check.trace.gz";
+
+    auto memory = new LittleEndianMemory(65536);
+    CPU6502 cpu(memory);
+    LoadSelfModifying(cpu, memory);
+    cpu.StartTrace(path);
+    cpu.RunInstructions(8);
+    cpu.StopTrace();
+
+    Check(cpu.GetRegisterValue(cpu.GetRegisterIndex("X")) == 2, name, "X");
+    auto ops = ReadTraceOps(path);
+    std::remove(path);
+    static const std::vector<std::uint8_t> expected[] = {
+        { 0xA9, 0xE8 }, { 0x8D, 0x05, 0x02 }, { 0xE8 }, { 0x4C, 0x00, 0x02 },
+        { 0xA9, 0xE8 }, { 0x8D, 0x05, 0x02 }, { 0xE8 }, { 0x4C, 0x00, 0x02 },
+    };
+    bool same = ops.size() == 8;
+    for (std::size_t k = 0; same && k < ops.size(); ++k) {
+        same = ops[k] == expected[k];
+    }
+    Check(same, name, "trace records");
+}
+
+static void
+CheckSelfModifyingCoverage(void)
+{
+    static const char name[] = "6502 coverage of self-modifying code";
+
+    auto memory = new LittleEndianMemory(65536);
+    CPU6502 cpu(memory);
+    LoadSelfModifying(cpu, memory);
+    memory->SetCoverage(true);
+    cpu.RunInstructions(8);
+
+    Check(cpu.GetRegisterValue(cpu.GetRegisterIndex("X")) == 2, name, "X");
+    auto& marks = memory->GetCoverage();
+    Check(marks[0x0202] & Memory::cover_opcode, name, "STA");
+    Check((marks[0x0203] & marks[0x0204] & Memory::cover_operand) != 0,
+          name, "STA operand");
+    Check(marks[0x0205] == (Memory::cover_opcode | Memory::cover_write),
+          name, "INX");
+    Check(marks[0x0206] & Memory::cover_opcode, name, "JMP");
+}
+
+// Code that straddles two pages, rewritten by its own stores and then
+// loaded over from outside, runs as written each time
+static void
+CheckStraddlingCode(void)
+{
+    static const std::uint8_t code[] = {
+        0xA9, 0xE8,             // $02FA: LDA #$E8
+        0x8D, 0x02, 0x03,       // $02FC: STA $0302
+        0xEA, 0xEA, 0xEA,       // $02FF: NOP; NOP; NOP
+        0xEA,                   // $0302: NOP, which becomes INX
+        0x4C, 0xFA, 0x02,       // $0303: JMP $02FA
+    };
+
+    for (int jit = 0; jit < 2; ++jit) {
+        std::string name = jit ? "6502 straddling code, translated"
+                               : "6502 straddling code";
+        auto memory = new LittleEndianMemory(65536);
+        for (std::size_t i = 0; i < sizeof(code); ++i) {
+            memory->Load8(0x02FA + i, code[i]);
+        }
+        CPU6502 cpu(memory);
+        cpu.SetRegister("PC", "02FA");
+        cpu.SetRegister("X", "00");
+        cpu.SetJIT(jit != 0);
+        int x_index = cpu.GetRegisterIndex("X");
+        cpu.RunInstructions(7 * 100);
+        Check(cpu.GetRegisterValue(x_index) == 100, name, "stores");
+        memory->Load8(0x0300, 0xE8);    // INX
+        cpu.RunInstructions(7 * 100);
+        Check(cpu.GetRegisterValue(x_index) == 44, name, "loads");
+        Check(cpu.GetPC() == 0x02FA, name, "PC");
+    }
+}
+
+// Saving coverage and merging it into another run gives the same marks,
+// even when coverage was never on, and a file for another size of memory
+// is refused
+static void
+CheckCoverageFiles(void)
+{
+    static const char name[] = "coverage files";
+    static const char path[] = "cpusim-check.coverage";
+
+    LittleEndianMemory never(65536);
+    LittleEndianMemory covered(65536);
+    LittleEndianMemory merged(65536);
+    LittleEndianMemory smaller(4096);
+    covered.SetCoverage(true);
+    covered.Write8(0x1234, 0x56);
+    covered.MarkExecuted(0x0300, 3);
+    try {
+        SaveCoverage(never, path);
+        MergeCoverage(&merged, path);
+        SaveCoverage(covered, path);
+        MergeCoverage(&merged, path);
+        Check(merged.GetCoverage() == covered.GetCoverage(), name, "merge");
+    }
+    catch (const CoverageExcept& e) {
+        Check(false, name, e.what());
+    }
+    bool refused = false;
+    try {
+        MergeCoverage(&smaller, path);
+    }
+    catch (const CoverageExcept& e) {
+        refused = true;
+    }
+    Check(refused, name, "merge into another size of memory");
+    std::remove(path);
+}
+
+// A 6502 runs code from a device, reading it each time, and a block of
+// plain memory ends where the device begins
+static void
+Check6502DeviceFetch(void)
+{
+    static const char name[] = "6502 fetch from a device";
+
+    auto memory = new LittleEndianMemory(65536);
+    auto device = std::make_shared<CountingDevice>(0xEA, 0);     // NOP
+    memory->MapDevice(0xC000, 0x100, device);
+    for (unsigned addr = 0xBFFC; addr < 0xC000; ++addr) {
+        memory->Load8(addr, 0xEA);
+    }
+    CPU6502 cpu(memory);
+    cpu.SetRegister("PC", "BFFC");
+    cpu.RunInstructions(8);
+    Check(device->reads == 4, name, "reads");
+    Check(cpu.GetPC() == 0xC004, name, "PC");
+}
+
+// Memory whose subclass handles a page, which reads as NOP and counts
+// the reads
+class CountingMemory : public LittleEndianMemory {
+public:
+    CountingMemory(void) : LittleEndianMemory(65536), reads(0)
+        { SetSlowPages(0xD000, 0x100); }
+
+    virtual std::uint8_t Read8(std::size_t addr) const override
+    {
+        if ((addr & 0xFF00) == 0xD000) {
+            ++reads;
+            return 0xEA;
+        }
+        return LittleEndianMemory::Read8(addr);
+    }
+
+    mutable unsigned long reads;
+};
+
+// Code on a page that a subclass handles is read through it each time
+static void
+Check6502SlowPages(void)
+{
+    static const char name[] = "6502 fetch from a slow page";
+
+    auto memory = new CountingMemory();
+    CPU6502 cpu(memory);
+    cpu.SetRegister("PC", "D000");
+    cpu.SetJIT(true);
+    cpu.RunInstructions(40);
+    Check(memory->reads == 40, name, "reads");
+    Check(cpu.GetPC() == 0xD028, name, "PC");
+}
+
+// Going back over reads from a device gives what was read the first time,
+// without reading the device again
+static void
+Check6502DeviceHistory(void)
+{
+    static const char name[] = "6502 history with a device";
+    static const std::uint8_t code[] = {
+        0xAD, 0x00, 0xC0,       // LDA $C000
+        0xE8,                   // INX
+        0x4C, 0x00, 0x02,       // JMP $0200
+    };
+
+    auto memory = new LittleEndianMemory(65536);
+    auto device = std::make_shared<CountingDevice>(0x00, 1);
+    memory->MapDevice(0xC000, 0x100, device);
+    for (std::size_t i = 0; i < sizeof(code); ++i) {
+        memory->Load8(0x0200 + i, code[i]);
+    }
+    CPU6502 cpu(memory);
+    cpu.SetRegister("PC", "0200");
+    cpu.SetHistory(1 << 20, 100);
+    int a_index = cpu.GetRegisterIndex("A");
+    int x_index = cpu.GetRegisterIndex("X");
+
+    cpu.RunInstructions(301);
+    auto a = cpu.GetRegisterValue(a_index);
+    auto x = cpu.GetRegisterValue(x_index);
+    cpu.RunInstructions(3);
+    auto a_later = cpu.GetRegisterValue(a_index);
+    auto reads = device->reads;
+    for (int k = 0; k < 3; ++k) {
+        cpu.StepBack();
+    }
+    Check(cpu.GetRegisterValue(a_index) == a
+          && cpu.GetRegisterValue(x_index) == x, name, "stepping back");
+    cpu.RunInstructions(3);
+    Check(cpu.GetRegisterValue(a_index) == a_later, name, "going forward");
+    Check(device->reads == reads, name, "device read again");
+    cpu.RunInstructions(3);
+    Check(device->reads == reads + 1, name, "device read after history");
+}
+
+// Loops of random straight-line instructions, which translation covers,
+// give the same registers, memory and cycles translated as interpreted
+static void
+Check6502Translation(void)
+{
+    static const std::uint8_t opcodes[] = {
+        // Immediate, zero page and zero page indexed
+        0x09, 0x29, 0x49, 0x69, 0xA0, 0xA2, 0xA9, 0xC0, 0xC9, 0xE0, 0xE9,
+        0x05, 0x06, 0x24, 0x25, 0x26, 0x45, 0x46, 0x65, 0x66, 0x84, 0x85,
+        0x86, 0xA4, 0xA5, 0xA6, 0xC4, 0xC5, 0xC6, 0xE4, 0xE5, 0xE6,
+        0x15, 0x16, 0x35, 0x36, 0x55, 0x56, 0x75, 0x76, 0x94, 0x95, 0x96,
+        0xB4, 0xB5, 0xB6, 0xD5, 0xD6, 0xF5, 0xF6,
+        // Loads through pointers in zero page
+        0x01, 0x21, 0x41, 0x61, 0xA1, 0xC1, 0xE1,
+        0x11, 0x31, 0x51, 0x71, 0xB1, 0xD1, 0xF1,
+        // Absolute and absolute indexed, all on $1000-$11FE
+        0x0D, 0x0E, 0x2C, 0x2D, 0x2E, 0x4D, 0x4E, 0x6D, 0x6E, 0x8C, 0x8D,
+        0x8E, 0xAC, 0xAD, 0xAE, 0xCC, 0xCD, 0xCE, 0xEC, 0xED, 0xEE,
+        0x19, 0x1D, 0x1E, 0x39, 0x3D, 0x3E, 0x59, 0x5D, 0x5E, 0x79, 0x7D,
+        0x7E, 0x99, 0x9D, 0xB9, 0xBC, 0xBD, 0xBE, 0xD9, 0xDD, 0xDE, 0xF9,
+        0xFD, 0xFE,
+        // One byte
+        0x0A, 0x2A, 0x4A, 0x6A, 0x18, 0x38, 0x58, 0x78, 0xB8, 0xD8, 0xF8,
+        0x88, 0xC8, 0xCA, 0xE8, 0x8A, 0x98, 0xAA, 0xA8, 0xBA, 0x9A, 0xEA,
+        0x48, 0x68, 0x08, 0x28,
+    };
+    static const CPU6502::Variant variants[] = { CPU6502::nmos, CPU6502::cmos };
+    static const char *const registers[] = { "A", "X", "Y", "S", "FLAGS", "PC" };
+
+    std::uint32_t seed = 6502;
+    auto random = [&seed](void) -> std::uint8_t {
+        seed = seed * 1103515245 + 12345;
+        return seed >> 16;
+    };
+    for (unsigned trial = 0; trial < 40; ++trial) {
+        std::vector<std::uint8_t> bytes(0x1200);
+        for (auto& byte : bytes) {
+            byte = random();
+        }
+        std::vector<std::uint8_t> code;
+        for (unsigned k = 0; k < 24; ++k) {
+            auto opcode = opcodes[random() % sizeof(opcodes)];
+            code.push_back(opcode);
+            if ((opcode & 0x0C) == 0x0C || (opcode & 0x1F) == 0x19) {
+                code.push_back(random());
+                code.push_back(0x10);
+            } else if ((opcode & 0x0F) != 0x08 && (opcode & 0x0F) != 0x0A) {
+                code.push_back(random());
+            }
+        }
+        code.insert(code.end(), { 0x4C, 0x00, 0x02 });  // JMP $0200
+        std::copy(code.begin(), code.end(), bytes.begin() + 0x0200);
+
+        auto variant = variants[trial % 2];
+        std::string name = "6502 translation, trial " + std::to_string(trial);
+        std::unique_ptr<CPU6502> cpus[2];
+        for (int jit = 0; jit < 2; ++jit) {
+            auto memory = new LittleEndianMemory(65536);
+            for (std::size_t addr = 0; addr < bytes.size(); ++addr) {
+                memory->Load8(addr, bytes[addr]);
+            }
+            cpus[jit].reset(new CPU6502(memory, variant));
+            cpus[jit]->SetRegister("PC", "0200");
+            cpus[jit]->SetJIT(jit != 0);
+            cpus[jit]->RunInstructions(25 * 200);
+        }
+        for (auto reg : registers) {
+            int index = cpus[0]->GetRegisterIndex(reg);
+            Check(cpus[0]->GetRegisterValue(index)
+                  == cpus[1]->GetRegisterValue(index), name, reg);
+        }
+        Check(cpus[0]->GetEmuCycles() == cpus[1]->GetEmuCycles(), name,
+              "cycles");
+        bool same = true;
+        for (std::size_t addr = 0; addr < bytes.size(); ++addr) {
+            same = same && cpus[0]->GetMemory()->Peek8(addr)
+                           == cpus[1]->GetMemory()->Peek8(addr);
+        }
+        Check(same, name, "memory");
+    }
+}
+
+// A translated block that writes over cached code still stops at a
+// breakpoint where it leaves
+static void
+Check6502TranslatedStop(void)
+{
+    static const char name[] = "6502 stop after translated code";
+    static const std::uint8_t code[] = {
+        0xA9, 0x4C,             // $0200: LDA #$4C
+        0x8D, 0x00, 0x03,       // $0202: STA $0300
+        0x6C, 0x10, 0x02,       // $0205: JMP ($0210)
+    };
+
+    auto memory = new LittleEndianMemory(65536);
+    for (std::size_t i = 0; i < sizeof(code); ++i) {
+        memory->Load8(0x0200 + i, code[i]);
+    }
+    memory->Load8(0x0210, 0x00);
+    memory->Load8(0x0211, 0x03);
+    memory->Load8(0x0300, 0x4C);        // $0300: JMP $0200
+    memory->Load8(0x0301, 0x00);
+    memory->Load8(0x0302, 0x02);
+    CPU6502 cpu(memory);
+    cpu.SetRegister("PC", "0200");
+    cpu.SetJIT(true);
+    cpu.RunInstructions(4 * 100);
+    cpu.SetBreakpoint(0x0205);
+    auto result = cpu.RunInstructions(1000);
+    Check(result.reason == CPU::stop_breakpoint, name, "reason");
+    Check(cpu.GetPC() == 0x0205, name, "PC");
+}
+
+// A device that writes DEX over the INX at $0200 when $80 is written to it
+class PatchingDevice : public MemoryDevice {
+public:
+    PatchingDevice(Memory *memory_) : memory(memory_) {}
+
+    virtual std::uint8_t Read(std::size_t offset) override { return 0xFF; }
+    virtual void Write(std::size_t offset, std::uint8_t data) override
+    {
+        if (data == 0x80) {
+            memory->Write8(0x0200, 0xCA);
+        }
+    }
+
+    Memory *memory;
+};
+
+// Code changed from outside the CPU in the middle of a run, by an event or
+// by a device, replaces any that the CPU decoded or translated from there
+static void
+Check6502LoadedCode(void)
+{
+    static const char name[] = "6502 code loaded during a run";
+    static const std::uint8_t dex[] = { 0xCA };
+    static const std::vector<std::pair<const char *,
+                                       void (*)(CPU *)>> patches = {
+        { "Write8", [](CPU *c) { c->GetMemory()->Write8(0x0200, 0xCA); } },
+        { "Load8", [](CPU *c) { c->GetMemory()->Load8(0x0200, 0xCA); } },
+        { "WriteBlock",
+          [](CPU *c) { c->GetMemory()->WriteBlock(0x0200, dex, 1); } },
+    };
+
+    for (bool jit : { false, true }) {
+        // INX; JMP $0200 takes 5 cycles a time, and runs 200 times before
+        // the event and as DEX 200 times after
+        for (auto& patch : patches) {
+            auto memory = new LittleEndianMemory(65536);
+            memory->Load8(0x0200, 0xE8);        // $0200: INX
+            memory->Load8(0x0201, 0x4C);        // $0201: JMP $0200
+            memory->Load8(0x0202, 0x00);
+            memory->Load8(0x0203, 0x02);
+            CPU6502 cpu(memory);
+            cpu.SetRegister("PC", "0200");
+            cpu.SetJIT(jit);
+            cpu.ScheduleEvent(1000, patch.second);
+            cpu.RunCycles(2000);
+            auto x = cpu.GetRegisterValue(cpu.GetRegisterIndex("X"));
+            Check(x == 0, name + std::string(", ") + patch.first, "X");
+        }
+
+        // INX; STX $C000; JMP $0200 counts up to $80, and then down
+        auto memory = new LittleEndianMemory(65536);
+        memory->MapDevice(0xC000, 0x100,
+                          std::make_shared<PatchingDevice>(memory));
+        static const std::uint8_t code[] = {
+            0xE8,                   // $0200: INX
+            0x8E, 0x00, 0xC0,       // $0201: STX $C000
+            0x4C, 0x00, 0x02,       // $0204: JMP $0200
+        };
+        for (std::size_t i = 0; i < sizeof(code); ++i) {
+            memory->Load8(0x0200 + i, code[i]);
+        }
+        CPU6502 cpu(memory);
+        cpu.SetRegister("PC", "0200");
+        cpu.SetJIT(jit);
+        cpu.RunInstructions(3 * (0x80 + 0x10));
+        auto x = cpu.GetRegisterValue(cpu.GetRegisterIndex("X"));
+        Check(x == 0x70, name + std::string(", device"), "X");
+    }
+}
+
+// Next() counts one hit for each arrival at a breakpoint, whether on the
+// first step or on the way to the return
+static void
+Check6502NextHits(void)
+{
+    static const char name[] = "6502 breakpoint hits in Next";
+    static const std::uint8_t code[] = {
+        0x20, 0x10, 0x02,       // $0200: JSR $0210
+    };
+
+    for (std::uint16_t addr : { 0x0210, 0x0211 }) {
+        auto memory = new LittleEndianMemory(65536);
+        for (std::size_t i = 0; i < sizeof(code); ++i) {
+            memory->Load8(0x0200 + i, code[i]);
+        }
+        memory->Load8(0x0210, 0xEA);    // $0210: NOP
+        memory->Load8(0x0211, 0x60);    // $0211: RTS
+        CPU6502 cpu(memory);
+        cpu.SetRegister("PC", "0200");
+        cpu.SetBreakpoint(addr, "", 3);
+        cpu.Next();
+        Check(cpu.GetBreakpointHits(addr) == 1, name, "hits");
+        Check(cpu.GetPC() == 0x0203, name, "PC");
+    }
+}
+
+// Conditions nested past the depth that the parser allows are refused,
+// however deep, rather than overflowing the host's stack
+static void
+CheckConditionNesting(void)
+{
+    static const char name[] = "condition nesting";
+
+    auto memory = new LittleEndianMemory(65536);
+    CPU6502 cpu(memory);
+    auto parses = [&cpu](const std::string& expr) {
+        try {
+            Condition condition(&cpu, expr);
+            return true;
+        }
+        catch (const CPUExcept& e) {
+            return false;
+        }
+    };
+    Check(parses(std::string(20, '(') + "A" + std::string(20, ')')), name,
+          "20 brackets");
+    Check(parses(std::string(20, '-') + "A"), name, "20 negations");
+    Check(!parses(std::string(100000, '(') + "A" + std::string(100000, ')')),
+          name, "100000 brackets");
+    Check(!parses(std::string(100000, '!') + "A"), name, "100000 negations");
+    Check(!parses(std::string(100000, '[') + "0" + std::string(100000, ']')),
+          name, "100000 loads");
+}
+
+static void
+CheckZ80Programs(void)
+{
+    for (auto& program : z80_programs) {
+        CheckZ80Program(program);
+    }
+}
+
+static void (*const checks[])(void) = {
+    CheckZ80Programs,
+    CheckZ80DeviceFetch,
+    CheckZ80NextHits,
+    CheckConditionNesting,
+    Check6502Translation,
+    Check6502TranslatedStop,
+    Check6502NextHits,
+    Check6502LoadedCode,
+    Check6502DeviceFetch,
+    Check6502SlowPages,
+    Check6502DeviceHistory,
+    CheckSelfModifyingTrace,
+    CheckSelfModifyingCoverage,
+    CheckStraddlingCode,
+    CheckCoverageFiles,
+};
+
+int
+main(int argc, char **argv)
+{
+    // A check that throws fails, and the rest still run
+    for (auto check : checks) {
+        try {
+            check();
+        }
+        catch (const std::exception& e) {
+            Check(false, "exception", e.what());
+        }
+    }
+
+    std::printf("%lu checks, %lu failed\n", checks_run, checks_failed);
+    return checks_failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,221 @@
+// cli.cpp
+//
+// Run a program without the GUI, and report where it stopped:
+//     cpusim-cli [options] image
+// Options:
+//     --6502 --6502-undocumented --65c02 --w65c02 --z80
+//                      The CPU, as for cpusim; the default is --6502
+//     --jit            Enable native translation
+//     --load ADDR      Load the image at ADDR; the default is 0
+//     --from-file      Load the image at the address in its first two bytes
+//     --pc ADDR        Start at ADDR; the default is where the image loaded
+//     --reg NAME=VALUE Set a register before the run, as in the GUI
+//     --break ADDR     Stop at a breakpoint at ADDR; may be repeated
+//     --cycles N       Stop once N cycles have run; the default is no limit
+//     --dump ADDR-END  Show memory from ADDR to END; may be repeated
+//     --rom ADDR-END   Make the pages from ADDR to END read-only, after
+//                      the image loads; may be repeated
+// Addresses are in hex. The run also stops before BRK, or HALT on the Z80.
+// The exit status is 0 if the program stopped at a break instruction or a
+// breakpoint, 1 if it ran out of cycles, and 2 for an error in the options
+// or the image, or an invalid instruction.
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include "cpu6502.h"
+#include "cpuz80.h"
+#include "image.h"
+#include "memory.h"
+
+static void
+usage(const char *prog)
+{
+    std::fprintf(stderr,
+            "Usage: %s [--6502 | --6502-undocumented | --65c02 | --w65c02 |\n"
+            "       --z80] [--jit] [--load ADDR | --from-file] [--pc ADDR]\n"
+            "       [--reg NAME=VALUE]... [--break ADDR]... [--cycles N]\n"
+            "       [--dump ADDR-END]... [--rom ADDR-END]... image\n", prog);
+    std::exit(2);
+}
+
+// Parse a hex address, or give the usage message
+static std::uint64_t
+address(const char *prog, const char *str)
+{
+    char *end;
+    auto addr = std::strtoull(str, &end, 16);
+    if (end == str || *end != '\0') {
+        usage(prog);
+    }
+    return addr;
+}
+
+static const char *
+reasonName(CPU::StopReason reason)
+{
+    switch (reason) {
+    case CPU::stop_breakpoint:
+        return "breakpoint";
+    case CPU::stop_cycles:
+        return "cycle limit";
+    case CPU::stop_watchpoint:
+        return "watchpoint";
+    case CPU::stop_break:
+        return "break instruction";
+    default:
+        return "pause";
+    }
+}
+
+// Show memory from start to end, sixteen bytes to a line
+static void
+dump(const Memory& memory, std::uint64_t start, std::uint64_t end)
+{
+    for (auto line = start; line <= end; line += 16) {
+        std::printf("%04llX:", static_cast<unsigned long long>(line));
+        for (auto addr = line; addr <= end && addr < line + 16; ++addr) {
+            std::printf(" %02X", memory.Peek8(addr));
+        }
+        std::printf("\n");
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    std::string cpu_option = "--6502";
+    bool jit = false;
+    std::uint64_t load_addr = 0;
+    bool from_file = false;
+    bool pc_set = false;
+    std::uint64_t pc = 0;
+    std::vector<std::pair<std::string, std::string>> regs;
+    std::vector<std::uint64_t> breakpoints;
+    unsigned long cycles = ULONG_MAX;
+    std::vector<std::pair<std::uint64_t, std::uint64_t>> dumps;
+    std::vector<std::pair<std::uint64_t, std::uint64_t>> roms;
+    std::string image_path;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--6502" || arg == "--6502-undocumented"
+        ||  arg == "--65c02" || arg == "--w65c02" || arg == "--z80") {
+            cpu_option = arg;
+        } else if (arg == "--jit") {
+            jit = true;
+        } else if (arg == "--from-file") {
+            from_file = true;
+        } else if (arg == "--load" && has_value) {
+            load_addr = address(argv[0], argv[++i]);
+        } else if (arg == "--pc" && has_value) {
+            pc = address(argv[0], argv[++i]);
+            pc_set = true;
+        } else if (arg == "--break" && has_value) {
+            breakpoints.push_back(address(argv[0], argv[++i]));
+        } else if (arg == "--reg" && has_value) {
+            std::string setting = argv[++i];
+            auto eq = setting.find('=');
+            if (eq == std::string::npos) {
+                usage(argv[0]);
+            }
+            regs.push_back({ setting.substr(0, eq), setting.substr(eq + 1) });
+        } else if (arg == "--cycles" && has_value) {
+            char *end;
+            cycles = std::strtoul(argv[++i], &end, 10);
+            if (*end != '\0') {
+                usage(argv[0]);
+            }
+        } else if ((arg == "--dump" || arg == "--rom") && has_value) {
+            std::string range = argv[++i];
+            auto dash = range.find('-');
+            if (dash == std::string::npos) {
+                usage(argv[0]);
+            }
+            auto start = address(argv[0], range.substr(0, dash).c_str());
+            auto end = address(argv[0], range.substr(dash + 1).c_str());
+            end = std::min<std::uint64_t>(end, 0xFFFF);
+            if (end < start) {
+                usage(argv[0]);
+            }
+            (arg == "--dump" ? dumps : roms).push_back({ start, end });
+        } else if (arg.compare(0, 2, "--") == 0 || !image_path.empty()) {
+            usage(argv[0]);
+        } else {
+            image_path = arg;
+        }
+    }
+    if (image_path.empty()) {
+        usage(argv[0]);
+    }
+
+    auto memory = new LittleEndianMemory(65536);
+    std::unique_ptr<CPU> cpu;
+    if (cpu_option == "--z80") {
+        cpu.reset(new CPUZ80(memory));
+    } else {
+        CPU6502::Variant variant = CPU6502::nmos;
+        if (cpu_option == "--6502-undocumented") {
+            variant = CPU6502::nmos_undocumented;
+        } else if (cpu_option == "--65c02") {
+            variant = CPU6502::cmos;
+        } else if (cpu_option == "--w65c02") {
+            variant = CPU6502::wdc;
+        }
+        cpu.reset(new CPU6502(memory, variant));
+    }
+
+    CPU::RunResult result(CPU::stop_count, 0, 0);
+    try {
+        auto image = LoadImage(memory, image_path, load_addr, from_file);
+        if (!pc_set) {
+            pc = image.start;
+        }
+        for (auto const &range : roms) {
+            memory->MapROM(range.first, range.second - range.first + 1);
+        }
+        char pc_str[20];
+        std::snprintf(pc_str, sizeof(pc_str), "%llX",
+                      static_cast<unsigned long long>(pc));
+        cpu->SetRegister("PC", pc_str);
+        for (auto const &reg : regs) {
+            if (!cpu->SetRegister(reg.first, reg.second)) {
+                std::fprintf(stderr, "%s: cannot set %s to %s\n", argv[0],
+                             reg.first.c_str(), reg.second.c_str());
+                return 2;
+            }
+        }
+        for (auto addr : breakpoints) {
+            cpu->SetBreakpoint(addr);
+        }
+        cpu->SetJIT(jit);
+        cpu->SetBreakStop(true);
+        result = cpu->RunCycles(cycles);
+    }
+    catch (const std::exception& e) {
+        std::fprintf(stderr, "%s: %s\n", argv[0], e.what());
+        return 2;
+    }
+
+    std::printf("Stopped at %s\n", reasonName(result.reason));
+    const char *separator = "";
+    for (auto const &name : cpu->GetRegisterList()) {
+        std::printf("%s%s=%s", separator, name.c_str(),
+                    cpu->GetRegister(name).c_str());
+        separator = " ";
+    }
+    std::printf("\n%lu instructions, %lu cycles\n", result.instructions,
+                result.cycles);
+    for (auto const &range : dumps) {
+        dump(*memory, range.first, range.second);
+    }
+
+    return (result.reason == CPU::stop_cycles) ? 1 : 0;
+}
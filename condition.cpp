@@ -0,0 +1,266 @@
+// condition.cpp
+
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include "condition.h"
+#include "cpu.h"
+#include "memory.h"
+
+Condition::Condition(const CPU *cpu, const std::string& expr) :
+    text(expr),
+    parse_cpu(cpu),
+    pos(text.c_str()),
+    depth(0),
+    nesting(0)
+{
+    ParseBinary(1);
+    SkipSpace();
+    if (*pos != '\0') {
+        Error("Unexpected text in condition");
+    }
+    parse_cpu = nullptr;
+    pos = nullptr;
+}
+
+bool
+Condition::Evaluate(const CPU *cpu) const
+{
+    std::int64_t stack[max_depth];
+    unsigned sp = 0;
+
+    for (auto const &op : program) {
+        if (op.code <= op_mem) {
+            switch (op.code) {
+            case op_const:
+                stack[sp++] = op.value;
+                break;
+
+            case op_reg:
+                stack[sp++] = cpu->GetRegisterValue(op.value);
+                break;
+
+            default:
+                stack[sp++] = cpu->GetMemory()->Peek8(op.value);
+                break;
+            }
+            continue;
+        }
+        if (op.code <= op_lnot) {
+            auto &x = stack[sp - 1];
+            switch (op.code) {
+            case op_load:
+                x = cpu->GetMemory()->Peek8(x);
+                break;
+
+            case op_neg:
+                x = -x;
+                break;
+
+            case op_not:
+                x = ~x;
+                break;
+
+            default:
+                x = !x;
+                break;
+            }
+            continue;
+        }
+
+        auto y = stack[--sp];
+        auto &x = stack[sp - 1];
+        switch (op.code) {
+        case op_add:  x = x + y;  break;
+        case op_sub:  x = x - y;  break;
+        case op_shl:  x = x << (y & 63); break;
+        case op_shr:  x = x >> (y & 63); break;
+        case op_lt:   x = x < y;  break;
+        case op_le:   x = x <= y; break;
+        case op_gt:   x = x > y;  break;
+        case op_ge:   x = x >= y; break;
+        case op_eq:   x = x == y; break;
+        case op_ne:   x = x != y; break;
+        case op_and:  x = x & y;  break;
+        case op_xor:  x = x ^ y;  break;
+        case op_or:   x = x | y;  break;
+        case op_land: x = x && y; break;
+        default:      x = x || y; break;
+        }
+    }
+    return stack[0] != 0;
+}
+
+// Parse operands joined by operators of at least min_prec
+void
+Condition::ParseBinary(int min_prec)
+{
+    // Where one operator is a prefix of another, the longer comes first
+    static const struct {
+        char text[3];
+        int prec;
+        OpCode code;
+    } binary_ops[] = {
+        { "||", 1, op_lor  },
+        { "&&", 2, op_land },
+        { "==", 6, op_eq   },
+        { "!=", 6, op_ne   },
+        { "<=", 7, op_le   },
+        { ">=", 7, op_ge   },
+        { "<<", 8, op_shl  },
+        { ">>", 8, op_shr  },
+        { "|",  3, op_or   },
+        { "^",  4, op_xor  },
+        { "&",  5, op_and  },
+        { "<",  7, op_lt   },
+        { ">",  7, op_gt   },
+        { "+",  9, op_add  },
+        { "-",  9, op_sub  }
+    };
+
+    ParseUnary();
+    while (true) {
+        SkipSpace();
+        const auto *found = &binary_ops[0];
+        const auto *ops_end = found + sizeof(binary_ops)/sizeof(binary_ops[0]);
+        for (; found != ops_end; ++found) {
+            if (std::strncmp(pos, found->text, std::strlen(found->text)) == 0) {
+                break;
+            }
+        }
+        if (found == ops_end || found->prec < min_prec) {
+            return;
+        }
+        pos += std::strlen(found->text);
+        // All operators associate to the left
+        ParseBinary(found->prec + 1);
+        Emit(found->code);
+    }
+}
+
+void
+Condition::ParseUnary(void)
+{
+    // Each unary operator and each level of brackets comes through here,
+    // so that this bounds the recursion of the parser
+    if (++nesting > max_depth) {
+        Error("Condition is nested too deeply");
+    }
+    SkipSpace();
+    switch (*pos) {
+    case '-':
+        ++pos;
+        ParseUnary();
+        Emit(op_neg);
+        break;
+
+    case '~':
+        ++pos;
+        ParseUnary();
+        Emit(op_not);
+        break;
+
+    case '!':
+        ++pos;
+        ParseUnary();
+        Emit(op_lnot);
+        break;
+
+    default:
+        ParsePrimary();
+        break;
+    }
+    --nesting;
+}
+
+void
+Condition::ParsePrimary(void)
+{
+    SkipSpace();
+    if (*pos == '(') {
+        ++pos;
+        ParseBinary(1);
+        SkipSpace();
+        if (*pos != ')') {
+            Error("Missing ) in condition");
+        }
+        ++pos;
+    } else if (*pos == '[') {
+        // A memory byte at a constant address is read directly; otherwise
+        // the address is computed
+        ++pos;
+        auto start = program.size();
+        ParseBinary(1);
+        SkipSpace();
+        if (*pos != ']') {
+            Error("Missing ] in condition");
+        }
+        ++pos;
+        if (program.size() == start + 1 && program[start].code == op_const) {
+            program[start].code = op_mem;
+        } else {
+            Emit(op_load);
+        }
+    } else if (*pos == '$' || std::isdigit(static_cast<unsigned char>(*pos))) {
+        int base = 10;
+        if (*pos == '$') {
+            base = 16;
+            ++pos;
+        } else if (pos[0] == '0' && (pos[1] == 'x' || pos[1] == 'X')) {
+            base = 16;
+            pos += 2;
+        }
+        char *end;
+        auto value = std::strtoull(pos, &end, base);
+        if (end == pos) {
+            Error("Invalid number in condition");
+        }
+        pos = end;
+        Emit(op_const, value);
+    } else if (std::isalpha(static_cast<unsigned char>(*pos))) {
+        std::string name;
+        while (std::isalnum(static_cast<unsigned char>(*pos)) || *pos == '_') {
+            name += std::toupper(static_cast<unsigned char>(*pos));
+            ++pos;
+        }
+        int index = parse_cpu->GetRegisterIndex(name);
+        if (index < 0) {
+            Error(("Unknown register " + name + " in condition").c_str());
+        }
+        Emit(op_reg, index);
+    } else {
+        Error("Expected a number, register or [address] in condition");
+    }
+}
+
+void
+Condition::SkipSpace(void)
+{
+    while (std::isspace(static_cast<unsigned char>(*pos))) {
+        ++pos;
+    }
+}
+
+// Append an operation, and track the stack depth that it needs
+void
+Condition::Emit(OpCode code, std::int64_t value)
+{
+    if (code <= op_mem) {
+        if (++depth > max_depth) {
+            Error("Condition is too complex");
+        }
+    } else if (code > op_lnot) {
+        --depth;
+    }
+
+    Op op;
+    op.code = code;
+    op.value = value;
+    program.push_back(op);
+}
+
+void
+Condition::Error(const char *msg) const
+{
+    throw CPUExcept(msg);
+}
@@ -0,0 +1,64 @@
+// condition.h
+
+#ifndef CONDITION_H
+#define CONDITION_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class CPU;
+
+// The condition of a breakpoint, such as
+//     X == $10 && [$FB] > 3
+// It is parsed once into a postfix program, which runs only when the PC
+// reaches the breakpoint.
+//
+// Operands are numbers (decimal, or hexadecimal after $ or 0x), register
+// names, and [address] for a byte of memory. The operators are those of C,
+// with C precedence:
+//     ! ~ - (unary)   + -   << >>   < <= > >=   == !=   &   ^   |   &&   ||
+class Condition {
+public:
+    // Throws CPUExcept if the expression is not valid for the CPU
+    Condition(const CPU *cpu, const std::string& expr);
+
+    bool Evaluate(const CPU *cpu) const;
+    const std::string& GetText(void) const { return text; }
+
+private:
+    // Operations that push a value, then those that replace the top of the
+    // stack, then those that combine the top two
+    enum OpCode {
+        op_const, op_reg, op_mem,
+        op_load, op_neg, op_not, op_lnot,
+        op_add, op_sub, op_shl, op_shr,
+        op_lt, op_le, op_gt, op_ge, op_eq, op_ne,
+        op_and, op_xor, op_or, op_land, op_lor
+    };
+    struct Op {
+        OpCode code;
+        std::int64_t value;     // Constant, register index or address
+    };
+
+    // Deepest stack that Evaluate() supports
+    static const unsigned max_depth = 32;
+
+    void ParseBinary(int min_prec);
+    void ParseUnary(void);
+    void ParsePrimary(void);
+    void SkipSpace(void);
+    void Emit(OpCode code, std::int64_t value = 0);
+    void Error(const char *msg) const;
+
+    std::string text;
+    std::vector<Op> program;
+
+    // Used only while parsing
+    const CPU *parse_cpu;
+    const char *pos;
+    unsigned depth;
+    unsigned nesting;           // Of unary operators and brackets
+};
+
+#endif
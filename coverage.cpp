@@ -0,0 +1,87 @@
+// coverage.cpp
+
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+#include "coverage.h"
+#include "memory.h"
+
+static const char coverage_magic[] = "cpusim-coverage 1";
+
+// The bitmaps, in the order of the kinds
+static const std::uint8_t coverage_kinds[] = {
+    Memory::cover_opcode,
+    Memory::cover_operand,
+    Memory::cover_read,
+    Memory::cover_write
+};
+
+void
+SaveCoverage(const Memory& memory, const std::string& path)
+{
+    // Coverage that was never turned on has no marks, and saves as
+    // nothing covered
+    auto const &marks = memory.GetCoverage();
+    std::size_t size = memory.GetSize();
+    std::ofstream fp(path, std::ios::binary);
+    if (!fp) {
+        throw CoverageExcept(path + ": cannot create");
+    }
+    fp << coverage_magic << ' ' << size << '\n';
+
+    std::vector<char> bitmap((size + 7) / 8);
+    for (auto kind : coverage_kinds) {
+        std::fill(bitmap.begin(), bitmap.end(), 0);
+        for (std::size_t addr = 0; addr < marks.size(); ++addr) {
+            if (marks[addr] & kind) {
+                bitmap[addr / 8] |= 1 << (addr % 8);
+            }
+        }
+        fp.write(bitmap.data(), bitmap.size());
+    }
+    fp.close();
+    if (!fp) {
+        throw CoverageExcept(path + ": cannot write");
+    }
+}
+
+void
+MergeCoverage(Memory *memory, const std::string& path)
+{
+    std::ifstream fp(path, std::ios::binary);
+    if (!fp) {
+        throw CoverageExcept(path + ": cannot open");
+    }
+    std::string line;
+    std::getline(fp, line);
+    std::string magic = coverage_magic;
+    char *end = nullptr;
+    std::size_t size = 0;
+    if (line.compare(0, magic.size() + 1, magic + " ") == 0) {
+        size = std::strtoul(line.c_str() + magic.size() + 1, &end, 10);
+    }
+    if (end == nullptr || *end != '\0' || size == 0) {
+        throw CoverageExcept(path + ": not a coverage file");
+    }
+    if (size != memory->GetSize()) {
+        throw CoverageExcept(path + ": coverage is of another size of memory");
+    }
+
+    std::vector<std::uint8_t> marks(size);
+    std::vector<char> bitmap((size + 7) / 8);
+    for (auto kind : coverage_kinds) {
+        if (!fp.read(bitmap.data(), bitmap.size())) {
+            throw CoverageExcept(path + ": file is cut short");
+        }
+        for (std::size_t addr = 0; addr < size; ++addr) {
+            if (bitmap[addr / 8] & (1 << (addr % 8))) {
+                marks[addr] |= kind;
+            }
+        }
+    }
+
+    memory->MergeCoverage(marks);
+}
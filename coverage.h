@@ -0,0 +1,31 @@
+// coverage.h
+
+#ifndef COVERAGE_H
+#define COVERAGE_H
+
+#include <stdexcept>
+#include <string>
+
+class Memory;
+
+class CoverageExcept : public std::runtime_error {
+public:
+    CoverageExcept(const std::string& msg) : std::runtime_error(msg) {}
+    CoverageExcept(const char *msg) : std::runtime_error(msg) {}
+};
+
+// Coverage files hold the marks of Memory::GetCoverage(): a line of text,
+// "cpusim-coverage 1" and the size of memory, then four bitmaps of that
+// many bits, for bytes executed as opcodes, executed as operands, read and
+// written. Bit 0 of the first byte of each is for address 0.
+
+// Write the coverage of memory to path. Throws CoverageExcept if the file
+// cannot be written.
+void SaveCoverage(const Memory& memory, const std::string& path);
+
+// Add the coverage in path to that of memory, as from earlier runs. Throws
+// CoverageExcept if the file cannot be read, is not valid or is for
+// another size of memory.
+void MergeCoverage(Memory *memory, const std::string& path);
+
+#endif
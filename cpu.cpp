@@ -1,5 +1,6 @@
 // cpu.cpp
 
+#include <cstdlib>
 #include "cpu.h"
 #include "memory.h"
 
@@ -16,25 +17,418 @@ CPU::GetMemZones(void) const
     return empty;
 }
 
+CPU::StopReason
+CPU::Run(void)
+{
+    return StepUntil(ULONG_MAX, ULONG_MAX, nullptr).reason;
+}
+
+CPU::RunResult
+CPU::RunCycles(unsigned long budget)
+{
+    return StepUntil(ULONG_MAX, budget, nullptr);
+}
+
+CPU::RunResult
+CPU::RunInstructions(unsigned long count)
+{
+    return StepUntil(count, ULONG_MAX, nullptr);
+}
+
+CPU::RunResult
+CPU::RunUntil(const std::set<std::uint64_t>& stops, unsigned long max_count)
+{
+    return StepUntil(max_count, ULONG_MAX, &stops);
+}
+
+// Common to the default run functions
+CPU::RunResult
+CPU::StepUntil(unsigned long count, unsigned long cycles,
+               const std::set<std::uint64_t> *stops)
+{
+    pause_request.store(false, std::memory_order_relaxed);
+    mem->ResetWatchHit();
+
+    auto start_cycles = GetEmuCycles();
+    unsigned long done = 0;
+    StopReason reason = stop_count;
+    while (done < count) {
+        Step();
+        ++done;
+        if (GetEmuCycles() >= NextEventCycle()) {
+            RunEvents(GetEmuCycles());
+        }
+        unsigned long elapsed = GetEmuCycles() - start_cycles;
+        run_cycles.store(GetEmuCycles(), std::memory_order_relaxed);
+        if (mem->WatchTriggered()) {
+            reason = stop_watchpoint;
+        } else if (BreakpointHit(GetPC(), 1)) {
+            reason = stop_breakpoint;
+        } else if (stops != nullptr && stops->count(GetPC()) != 0) {
+            reason = stop_address;
+        } else if (elapsed >= cycles) {
+            reason = stop_cycles;
+        } else if (pause_request.load(std::memory_order_relaxed)) {
+            reason = stop_pause;
+        } else {
+            continue;
+        }
+        break;
+    }
+    return RunResult(reason, done, GetEmuCycles() - start_cycles);
+}
+
+void
+CPU::SetIRQ(bool asserted)
+{
+    // Default behavior is to have no interrupts
+}
+
+void
+CPU::NMI(void)
+{
+}
+
+void
+CPU::Reset(void)
+{
+}
+
+unsigned long
+CPU::ScheduleEvent(unsigned long cycle, EventAction action)
+{
+    auto id = next_event_id++;
+    events.emplace(std::make_pair(cycle, id), std::move(action));
+    EventScheduled(cycle);
+    return id;
+}
+
+bool
+CPU::CancelEvent(unsigned long id)
+{
+    for (auto e = events.begin(); e != events.end(); ++e) {
+        if (e->first.second == id) {
+            events.erase(e);
+            return true;
+        }
+    }
+    return false;
+}
+
+void
+CPU::ClearEvents(void)
+{
+    events.clear();
+}
+
+void
+CPU::RunEvents(unsigned long cycle)
+{
+    while (!events.empty() && events.begin()->first.first <= cycle) {
+        // Remove the event first, as the action may change the queue
+        auto e = events.begin();
+        auto action = std::move(e->second);
+        events.erase(e);
+        action(this);
+    }
+}
+
+void
+CPU::EventScheduled(unsigned long cycle)
+{
+    // Default behavior is to notice events after each Step()
+}
+
+void
+CPU::RebaseEvents(unsigned long cycles)
+{
+    decltype(events) moved;
+    for (auto& e : events) {
+        auto cycle = (e.first.first > cycles) ? e.first.first - cycles : 0;
+        moved.emplace(std::make_pair(cycle, e.first.second),
+                      std::move(e.second));
+    }
+    events.swap(moved);
+}
+
+struct CPU::Snapshot {
+    const CPU *cpu;
+    std::shared_ptr<const void> state;
+    std::shared_ptr<const MemorySnapshot> memory;
+};
+
+std::shared_ptr<const CPU::Snapshot>
+CPU::TakeSnapshot(void)
+{
+    auto snapshot = std::make_shared<Snapshot>();
+    snapshot->cpu = this;
+    snapshot->state = SaveState();
+    snapshot->memory = mem->TakeSnapshot();
+    return snapshot;
+}
+
+void
+CPU::RestoreSnapshot(const Snapshot& snapshot)
+{
+    if (snapshot.cpu != this) {
+        throw CPUExcept("Snapshot is of another CPU");
+    }
+    RestoreState(snapshot.state.get());
+    mem->RestoreSnapshot(snapshot.memory);
+}
+
+std::shared_ptr<const void>
+CPU::SaveState(void) const
+{
+    return nullptr;
+}
+
+void
+CPU::RestoreState(const void *state)
+{
+}
+
+bool
+CPU::SetJIT(bool enable)
+{
+    // Default behavior is to interpret only
+    return false;
+}
+
+bool
+CPU::SetBreakStop(bool enable)
+{
+    // Default behavior is to run through them
+    return false;
+}
+
+bool
+CPU::StartTrace(const std::string& path)
+{
+    // Default behavior is not to trace
+    return false;
+}
+
+void
+CPU::StopTrace(void)
+{
+}
+
+bool
+CPU::StartProfile(void)
+{
+    // Default behavior is not to profile
+    return false;
+}
+
+void
+CPU::StopProfile(void)
+{
+}
+
+const CallProfile *
+CPU::GetProfile(void)
+{
+    return nullptr;
+}
+
+bool
+CPU::SetHistory(std::size_t budget, unsigned long interval)
+{
+    // Default behavior is to keep no history
+    return false;
+}
+
+bool
+CPU::StepBack(void)
+{
+    return false;
+}
+
+CPU::StopReason
+CPU::ReverseContinue(void)
+{
+    return stop_count;
+}
+
+int
+CPU::GetRegisterIndex(const std::string& reg_name) const
+{
+    auto regs = GetRegisterList();
+    for (std::size_t i = 0; i < regs.size(); ++i) {
+        if (regs[i] == reg_name) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+std::uint64_t
+CPU::GetRegisterValue(int index) const
+{
+    // Default behavior is to read the register as hexadecimal
+    auto regs = GetRegisterList();
+    return std::strtoull(GetRegister(regs.at(index)).c_str(), nullptr, 16);
+}
+
 void
 CPU::SetBreakpoint(std::uint64_t addr)
 {
-    breakpoints.insert(addr);
+    SetBreakpoint(addr, "", 1);
+}
+
+void
+CPU::SetBreakpoint(std::uint64_t addr, const std::string& condition,
+                   unsigned long hit_target)
+{
+    // Parse first, so that a bad condition changes nothing
+    std::unique_ptr<Condition> cond;
+    if (condition.find_first_not_of(" \t") != std::string::npos) {
+        cond.reset(new Condition(this, condition));
+    }
+
+    auto& info = breakpoint_info[addr];
+    info.condition = std::move(cond);
+    info.hit_target = hit_target;
+    info.hits = 0;
+
+    auto word = BreakpointWord(addr, true);
+    std::uint64_t bit = std::uint64_t(1) << (addr % 64);
+    if ((*word & bit) == 0) {
+        *word |= bit;
+        ++num_breakpoints;
+    }
 }
 
 void
 CPU::ClearBreakpoint(std::uint64_t addr)
 {
-    breakpoints.erase(addr);
+    auto word = BreakpointWord(addr, false);
+    std::uint64_t bit = std::uint64_t(1) << (addr % 64);
+    if (word != nullptr && (*word & bit) != 0) {
+        *word &= ~bit;
+        --num_breakpoints;
+    }
+    breakpoint_info.erase(addr);
+}
+
+std::string
+CPU::GetBreakpointCondition(std::uint64_t addr) const
+{
+    auto p = breakpoint_info.find(addr);
+    if (p == breakpoint_info.end() || p->second.condition == nullptr) {
+        return "";
+    }
+    return p->second.condition->GetText();
+}
+
+unsigned long
+CPU::GetBreakpointHits(std::uint64_t addr) const
+{
+    auto p = breakpoint_info.find(addr);
+    return (p == breakpoint_info.end()) ? 0 : p->second.hits;
+}
+
+void
+CPU::ResetBreakpointHits(void)
+{
+    for (auto &p : breakpoint_info) {
+        p.second.hits = 0;
+    }
+}
+
+// Slow path for BreakpointHit(), once some breakpoint is known to be there
+bool
+CPU::CountHits(std::uint64_t addr, unsigned count)
+{
+    bool stop = false;
+    for (unsigned i = 0; i < count; ++i) {
+        auto p = breakpoint_info.find(addr + i);
+        if (p == breakpoint_info.end()) {
+            continue;
+        }
+        auto &info = p->second;
+        if (info.condition == nullptr || info.condition->Evaluate(this)) {
+            if (++info.hits >= info.hit_target) {
+                stop = true;
+            }
+        }
+    }
+    return stop;
+}
+
+bool
+CPU::BreakpointMatches(std::uint64_t addr, unsigned count) const
+{
+    if (!FindBreakpoint(addr, count)) {
+        return false;
+    }
+    for (unsigned i = 0; i < count; ++i) {
+        auto p = breakpoint_info.find(addr + i);
+        if (p != breakpoint_info.end()
+        &&  (p->second.condition == nullptr
+        ||   p->second.condition->Evaluate(this))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void
+CPU::HideBreakpoints(bool hide)
+{
+    if (hide) {
+        hidden_breakpoints = num_breakpoints;
+        num_breakpoints = 0;
+    } else if (hidden_breakpoints != 0) {
+        num_breakpoints = hidden_breakpoints;
+        hidden_breakpoints = 0;
+    }
+}
+
+// Return the word that holds the bit for addr. If addr is on a page with no
+// breakpoints, create the page, or return nullptr if create is false.
+std::uint64_t *
+CPU::BreakpointWord(std::uint64_t addr, bool create)
+{
+    if (addr < dense_breakpoints) {
+        return &breakpoint_bits[addr / 64];
+    }
+
+    auto page_num = addr >> breakpoint_page_shift;
+    auto p = breakpoint_pages.find(page_num);
+    if (p == breakpoint_pages.end()) {
+        if (!create) {
+            return nullptr;
+        }
+        std::vector<std::uint64_t> page((1 << breakpoint_page_shift) / 64);
+        p = breakpoint_pages.emplace(page_num, page).first;
+    }
+    auto offset = addr & ((1 << breakpoint_page_shift) - 1);
+    return &p->second[offset / 64];
 }
 
 bool
-CPU::HasBreakpoint(std::uint64_t addr, unsigned count) const
+CPU::FindBreakpoint(std::uint64_t addr, unsigned count) const
 {
     for (unsigned i = 0; i < count; ++i) {
-        if (breakpoints.find(addr + i) != breakpoints.end()) {
+        if (TestBreakpoint(addr + i)) {
             return true;
         }
     }
     return false;
 }
+
+bool
+CPU::TestBreakpoint(std::uint64_t addr) const
+{
+    if (addr < dense_breakpoints) {
+        return (breakpoint_bits[addr / 64] >> (addr % 64)) & 1;
+    }
+    auto p = breakpoint_pages.find(addr >> breakpoint_page_shift);
+    if (p == breakpoint_pages.end()) {
+        return false;
+    }
+    auto offset = addr & ((1 << breakpoint_page_shift) - 1);
+    return (p->second[offset / 64] >> (offset % 64)) & 1;
+}
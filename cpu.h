@@ -3,13 +3,23 @@
 #ifndef CPU_H
 #define CPU_H
 
+#include <atomic>
+#include <climits>
+#include <functional>
+#include <map>
 #include <stdexcept>
 #include <string>
 #include <set>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 #include <cstdint>
+#include <memory>
+#include "condition.h"
 
+class CallProfile;
 class Memory;
+struct MemorySnapshot;
 
 class CPUExcept : public std::runtime_error {
 public:
@@ -19,16 +29,95 @@ public:
 
 class CPU {
 public:
-    CPU(Memory *memory) : max_len(3), mem(memory) {}
+    CPU(Memory *memory) :
+        max_len(3), pause_request(false), run_cycles(0), mem(memory),
+        breakpoint_bits(dense_breakpoints / 64), num_breakpoints(0),
+        hidden_breakpoints(0), next_event_id(0) {}
     virtual ~CPU(void);
 
     virtual std::vector<std::string> GetRegisterList(void) const = 0;
     virtual std::string GetRegister(const std::string& reg_name) const = 0;
     virtual bool SetRegister(const std::string& reg_name, const std::string& value) = 0;
+
+    // Numeric access to registers, for breakpoint conditions.
+    // GetRegisterIndex returns -1 for an unknown register. The default
+    // versions use GetRegisterList() and GetRegister().
+    virtual int GetRegisterIndex(const std::string& reg_name) const;
+    virtual std::uint64_t GetRegisterValue(int index) const;
     virtual void Step(void) = 0;
     virtual void Next(void) = 0;
     virtual void ToReturn(void) = 0;
 
+    // Why a run returned
+    enum StopReason {
+        stop_breakpoint,    // The PC reached a breakpoint
+        stop_pause,         // Pause() was called
+        stop_count,         // The requested instructions were executed
+        stop_cycles,        // The cycle budget was used up
+        stop_address,       // The PC reached an address given to RunUntil()
+        stop_watchpoint,    // An instruction hit a watchpoint; see
+                            // Memory::GetWatchHit()
+        stop_break          // The PC reached a break instruction, with
+                            // SetBreakStop() on
+    };
+
+    struct RunResult {
+        StopReason reason;
+        unsigned long instructions; // Number executed
+        unsigned long cycles;       // Emulated cycles that they took
+        RunResult(StopReason reason_, unsigned long instructions_,
+                  unsigned long cycles_) :
+            reason(reason_), instructions(instructions_), cycles(cycles_) {}
+    };
+
+    // Execute freely until a breakpoint or a call to Pause(). Invalid
+    // instructions throw CPUExcept as they do for Step().
+    virtual StopReason Run(void);
+
+    // Execute until at least budget cycles have passed, until count
+    // instructions have executed, or until the PC reaches one of stops.
+    // These also stop at breakpoints, after any instruction that hits a
+    // watchpoint, and on Pause(), and the first
+    // instruction always executes, so that a run can continue from a
+    // breakpoint. The default versions call Step() for each instruction.
+    virtual RunResult RunCycles(unsigned long budget);
+    virtual RunResult RunInstructions(unsigned long count);
+    virtual RunResult RunUntil(const std::set<std::uint64_t>& stops,
+                               unsigned long max_count = ULONG_MAX);
+
+    // These may be called from a thread other than the one in Run()
+    void Pause(void) { pause_request.store(true, std::memory_order_relaxed); }
+    unsigned long GetRunCycles(void) const
+        { return run_cycles.load(std::memory_order_relaxed); }
+
+    // Translate frequently run code to native code, where that is
+    // supported; returns true if translation is now enabled
+    virtual bool SetJIT(bool enable);
+
+    // Stop runs before any instruction that programs use to end, where that
+    // is supported: BRK on the 6502 and HALT on the Z80. As for a
+    // breakpoint, the first instruction of a run still executes. Returns
+    // true if runs now stop there.
+    virtual bool SetBreakStop(bool enable);
+
+    // Record every instruction executed to a trace file at path, where that
+    // is supported, until StopTrace(); returns true if tracing is now on.
+    // Each record holds the PC, the instruction bytes, the registers that
+    // changed, the cycles and the memory written. Starting a trace throws
+    // CPUExcept if the file cannot be created, and stopping one throws it
+    // if the file could not be written.
+    virtual bool StartTrace(const std::string& path);
+    virtual void StopTrace(void);
+
+    // Profile the cycles spent in each subroutine, where that is supported,
+    // by following calls, interrupts and returns (see CallProfile).
+    // StartProfile drops any earlier profile, and returns true if profiling
+    // is now on. GetProfile returns the profile so far, or the last one
+    // taken, or nullptr if there is none.
+    virtual bool StartProfile(void);
+    virtual void StopProfile(void);
+    virtual const CallProfile *GetProfile(void);
+
     virtual std::uint64_t GetPC(void) const = 0;
 
     struct MemZone {
@@ -64,19 +153,139 @@ public:
     virtual unsigned long GetEmuCycles(void) const = 0;
     virtual void ClearEmuCycles(void) = 0;
 
+    // Interrupt inputs. SetIRQ() sets the level of the maskable interrupt
+    // line, and NMI() signals the non-maskable one; either is taken before
+    // the next instruction. Reset() resets the CPU at once, loading the PC
+    // from its reset vector. Like the other functions here, these must not
+    // be called while another thread runs the CPU. The defaults do nothing.
+    virtual void SetIRQ(bool asserted);
+    virtual void NMI(void);
+    virtual void Reset(void);
+
+    // Events scheduled for an emulated cycle, such as a timer that raises
+    // an interrupt:
+    //     cpu->ScheduleEvent(cycle, [](CPU *c) { c->SetIRQ(true); });
+    // Each action runs once, between instructions, when GetEmuCycles()
+    // reaches its cycle, and may schedule further events. Events for the
+    // same cycle run in the order they were scheduled. ScheduleEvent
+    // returns an id for CancelEvent.
+    typedef std::function<void(CPU *cpu)> EventAction;
+    unsigned long ScheduleEvent(unsigned long cycle, EventAction action);
+    bool CancelEvent(unsigned long id);
+    void ClearEvents(void);
+    unsigned long NextEventCycle(void) const // ULONG_MAX if there is none
+        { return events.empty() ? ULONG_MAX : events.begin()->first.first; }
+
+    // A breakpoint stops execution on its hit_target'th hit and later
+    // ones. If it has a condition, only passes where the condition holds
+    // count as hits. SetBreakpoint throws CPUExcept if the condition is not
+    // valid.
     void SetBreakpoint(std::uint64_t addr);
+    void SetBreakpoint(std::uint64_t addr, const std::string& condition,
+                       unsigned long hit_target = 1);
     void ClearBreakpoint(std::uint64_t addr);
-    bool HasBreakpoint(std::uint64_t addr, unsigned count) const;
+    bool HasBreakpoint(std::uint64_t addr, unsigned count) const
+        { return num_breakpoints != 0 && FindBreakpoint(addr, count); }
+    bool AnyBreakpoints(void) const { return num_breakpoints != 0; }
+    std::string GetBreakpointCondition(std::uint64_t addr) const;
+    unsigned long GetBreakpointHits(std::uint64_t addr) const;
+    void ResetBreakpointHits(void);
+
+    // For the CPU implementations: execution has reached an instruction of
+    // count bytes at addr. Count hits on any breakpoints within it, and
+    // return true if execution should stop.
+    bool BreakpointHit(std::uint64_t addr, unsigned count)
+        { return HasBreakpoint(addr, count) && CountHits(addr, count); }
+
+    // For the CPU implementations: make breakpoints invisible to
+    // AnyBreakpoints(), HasBreakpoint() and BreakpointHit(), or visible
+    // again, while executing again what has run before.
+    // BreakpointMatches() still sees them.
+    void HideBreakpoints(bool hide);
+
+    // For the CPU implementations: run the actions of all events due at or
+    // before cycle
+    void RunEvents(unsigned long cycle);
+
+    // Snapshots of the CPU and its memory, to go back to later. A snapshot
+    // holds the registers, the cycle count, the interrupt inputs and
+    // memory, which it shares page by page with memory and with other
+    // snapshots (see Memory::TakeSnapshot()), so that taking and restoring
+    // one are cheap. Breakpoints, watchpoints and scheduled events are not
+    // part of it. RestoreSnapshot throws CPUExcept for a snapshot of
+    // another CPU.
+    struct Snapshot;
+    std::shared_ptr<const Snapshot> TakeSnapshot(void);
+    void RestoreSnapshot(const Snapshot& snapshot);
+
+    // Execution history, for going backward, where it is supported. While
+    // budget is not zero, execution keeps a checkpoint every interval
+    // instructions, dropping the oldest ones to stay within about budget
+    // bytes, and going back executes forward again from a checkpoint.
+    // SetHistory returns true if history is now kept. StepBack goes back
+    // one instruction, and returns false at the start of the history.
+    // ReverseContinue goes back to the last instruction that reached a
+    // breakpoint whose condition held, not counting hits; it returns
+    // stop_breakpoint, or stop_count if it got to the start of the history.
+    virtual bool SetHistory(std::size_t budget, unsigned long interval);
+    virtual bool StepBack(void);
+    virtual StopReason ReverseContinue(void);
+
+    // Whether a breakpoint within count bytes at addr has a condition that
+    // holds now, or none; unlike BreakpointHit(), this counts no hit
+    bool BreakpointMatches(std::uint64_t addr, unsigned count) const;
 
     Memory *GetMemory(void) const { return mem; }
     unsigned GetMaxLen(void) const { return max_len; }
 
 protected:
     unsigned max_len;
+    std::atomic<bool> pause_request;
+    std::atomic<unsigned long> run_cycles;
+
+    // Called when an event is scheduled, possibly by an action or a memory
+    // access in the middle of a run, so that the CPU can stop for it
+    virtual void EventScheduled(unsigned long cycle);
+
+    // Move all events back by cycles, as the cycle count is cleared
+    void RebaseEvents(unsigned long cycles);
+
+    // For snapshots: copy the registers, cycle count and interrupt state of
+    // the CPU, and restore them from such a copy. The defaults keep
+    // nothing.
+    virtual std::shared_ptr<const void> SaveState(void) const;
+    virtual void RestoreState(const void *state);
 
 private:
+    RunResult StepUntil(unsigned long count, unsigned long cycles,
+                        const std::set<std::uint64_t> *stops);
+
     Memory *mem;
-    std::set<std::uint64_t> breakpoints;
+
+    // Breakpoints are kept as bits: one bitmap for the low addresses, and
+    // pages of bits for any others
+    static const std::uint64_t dense_breakpoints = 0x10000;
+    static const unsigned breakpoint_page_shift = 12;
+    std::uint64_t *BreakpointWord(std::uint64_t addr, bool create);
+    bool FindBreakpoint(std::uint64_t addr, unsigned count) const;
+    bool TestBreakpoint(std::uint64_t addr) const;
+    bool CountHits(std::uint64_t addr, unsigned count);
+    std::vector<std::uint64_t> breakpoint_bits;
+    std::unordered_map<std::uint64_t, std::vector<std::uint64_t>> breakpoint_pages;
+    std::size_t num_breakpoints;
+    std::size_t hidden_breakpoints;    // While hidden
+
+    // Details of each breakpoint, consulted only when one is reached
+    struct BreakpointInfo {
+        std::unique_ptr<Condition> condition;   // nullptr if none
+        unsigned long hit_target;
+        unsigned long hits;
+    };
+    std::unordered_map<std::uint64_t, BreakpointInfo> breakpoint_info;
+
+    // Scheduled events, keyed by cycle and then id
+    std::map<std::pair<unsigned long, unsigned long>, EventAction> events;
+    unsigned long next_event_id;
 };
 
 #endif
@@ -1,12 +1,33 @@
 // cpu6502.cpp
 
+#include <algorithm>
+#include <deque>
 #include <regex>
 #include <cctype>
+#include <cstddef>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <memory>
 #include "cpu6502.h"
+#include "jitbuf.h"
 #include "memory.h"
+#include "profile.h"
+#include "trace.h"
+
+// The instrumented build times instructions with the time stamp counter
+// where there is one
+#ifdef CPU6502_INSTRUMENT
+#include <chrono>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#endif
+
+// Translation to native code is available on x86-64 hosts
+#if defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__))
+#define CPU6502_JIT 1
+#endif
 
 namespace {
 
@@ -24,115 +45,499 @@ enum AddrMode {
     am_ind_x,
     am_ind_y,
     am_ind,
-    am_rel
+    am_rel,
+    am_zp_ind,      // 65C02 (zp)
+    am_abs_ind_x,   // 65C02 JMP (abs,X)
+    am_zp_rel       // Rockwell BBR and BBS: zp, then a branch offset
 };
 
-struct CPU6502Impl {
+// The registers are kept in a standard-layout base, so that translated code
+// can address them by offset
+struct CPU6502Regs {
     std::uint8_t reg_a;
     std::uint8_t reg_x;
     std::uint8_t reg_y;
     std::uint8_t reg_s;
-    std::uint8_t reg_flags;
     std::uint16_t reg_pc;
     unsigned long emu_cycles;
 
+    // N, V, Z and C are kept as the last instruction to change them left
+    // them, and are packed into a status byte only when something reads it.
+    // The other bits live in reg_flags.
+    std::uint8_t reg_flags;
+    std::uint8_t flag_n;    // N is bit 7
+    std::uint8_t flag_v;    // V is bit 7
+    std::uint8_t flag_z;    // Z is set if this is zero
+    std::uint8_t flag_c;    // C is this; always 0 or 1
+
+    CPU6502Regs(void) :
+        reg_a(0),
+        reg_x(0),
+        reg_y(0),
+        reg_s(0),
+        reg_pc(0),
+        emu_cycles(0),
+        reg_flags(0x20),
+        flag_n(0),
+        flag_v(0),
+        flag_z(1),
+        flag_c(0)
+    {
+    }
+
+    std::uint8_t PackFlags(void) const
+    {
+        return (reg_flags & 0x3C)
+             | (flag_n & 0x80)
+             | ((flag_v >> 1) & 0x40)
+             | (flag_z == 0 ? 0x02 : 0x00)
+             | flag_c;
+    }
+
+    void UnpackFlags(std::uint8_t flags)
+    {
+        reg_flags = flags;
+        flag_n = flags;
+        flag_v = flags << 1;
+        flag_z = ~flags & 0x02;
+        flag_c = flags & 0x01;
+    }
+};
+
+// Translated code for a block. Returns the number of instructions executed,
+// which is less than the number translated only if the block wrote over
+// cached code.
+typedef unsigned (*NativeBlock)(CPU6502Regs *regs);
+
+struct CPU6502Impl : CPU6502Regs {
     CPU *cpu;
     Memory *memory;
 
-    CPU6502Impl(CPU *cpu, Memory *mem);
+    // Operand of the instruction being executed: the byte or little-endian
+    // word that follows the opcode
+    std::uint16_t operand;
+
+    CPU6502Impl(CPU *cpu, Memory *mem, CPU6502::Variant variant);
     ~CPU6502Impl(void);
-    bool DoStep(void);
-    bool HasBreakpoint(void);
+    bool DoStep(CPU::StopReason& reason);
+    CPU::StopReason Execute(unsigned long count, unsigned long end_cycle,
+                            unsigned long& done)
+        { return (this->*execute)(count, end_cycle, done); }
+    bool BreakpointHit(void);
+
+    // Addresses for RunUntil(); empty at other times
+    std::vector<bool> stop_at;
+    // Set to stop before BRK
+    bool break_stop;
+
+    void SetIRQ(bool asserted);
+    void NMI(void);
+    void Reset(void);
+    void EventScheduled(unsigned long cycle);
+
+    // What a snapshot keeps of the CPU
+    struct State : CPU6502Regs {
+        bool irq_line;
+        bool nmi_pending;
+        bool waiting;
+    };
+    std::shared_ptr<const void> SaveState(void) const;
+    void RestoreState(const void *state);
+
+    // Execution history, kept while history is not null; Advance() is
+    // Execute() for runs and steps, which records history as it goes
+    struct History;
+    std::unique_ptr<History> history;
+    bool SetHistory(std::size_t budget, unsigned long interval);
+    CPU::StopReason Advance(unsigned long count, unsigned long end_cycle,
+                            unsigned long& done);
+    bool StepBack(void);
+    CPU::StopReason ReverseContinue(void);
+    void HistoryChanged(bool restart);
+
+    bool SetJIT(bool enable);
+
+    // The trace being recorded, or null
+    std::unique_ptr<TraceWriter> trace;
+    void StartTrace(const std::string& path);
+    void StopTrace(void);
+
+    // The profile being taken while profiling is set, or the last one
+    std::unique_ptr<CallProfile> profile;
+    bool profiling;
+
+#ifdef CPU6502_INSTRUMENT
+    // For CPU6502::GetOpcodeCosts(): counts of each opcode, and host ticks
+    // taken by those sampled. Ticks are converted to seconds by comparing
+    // the ticks and the time since the counts were cleared.
+    struct OpcodeStats {
+        unsigned long long count;
+        unsigned long long sampled;
+        std::uint64_t ticks;
+    };
+    OpcodeStats op_stats[256];
+    unsigned sample_gap;            // Instructions to the next sample
+    std::uint32_t sample_seed;
+    std::uint64_t tick_overhead;    // Of reading the ticks, taken off each
+    std::uint64_t start_ticks;
+    std::chrono::steady_clock::time_point start_time;
+    void ClearOpcodeCosts(void);
+    std::vector<CPU6502::OpcodeCost> GetOpcodeCosts(void) const;
+#endif
 
     CPU::Disasm Disassemble(std::uint64_t address) const;
     CPU::Assem Assemble(std::uint64_t pc, const std::string& code) const;
 
+    const CPU6502::Variant variant;
+
 private:
-    void DoAdd(std::uint8_t byte);
-    std::uint16_t GetAddress(std::uint8_t opcode);
+    // Execute() for each variant is a separate instantiation, which calls
+    // that variant's Dispatch(), and so is execution that is observed, by
+    // tracing or coverage, so that execution without them checks for
+    // nothing more
+    typedef CPU::StopReason (CPU6502Impl::*ExecuteFunc)(
+            unsigned long count, unsigned long end_cycle, unsigned long& done);
+    ExecuteFunc execute;
+    template <CPU6502::Variant variant_, bool observed_>
+    CPU::StopReason ExecuteVariant(unsigned long count, unsigned long end_cycle,
+                                   unsigned long& done);
+    void SelectExecute(bool traced);
+
+    // Straight-line runs of instructions are decoded once and kept in
+    // blocks, indexed by starting address. A block ends at the first
+    // instruction that can change the flow of control.
+    struct Decoded {
+        std::uint8_t opcode;
+        std::uint8_t length;
+        std::uint16_t operand;
+    };
+    struct Block {
+        std::uint16_t start;
+        unsigned length; // in bytes
+        std::vector<Decoded> ops;
+
+        // Native code for the first native_ops instructions, which occupy
+        // native_length bytes; translated once the block has run
+        // jit_threshold times
+        NativeBlock native;
+        unsigned native_ops;
+        unsigned native_length;
+        unsigned runs;
+        bool translated;
+    };
+    static const unsigned max_block_ops = 32;
+    // No instruction takes more cycles than this
+    static const unsigned max_op_cycles = 7;
+
+    std::vector<std::unique_ptr<Block>> blocks;
+    // Starting addresses of blocks that cover any byte of each page
+    std::vector<std::vector<std::uint16_t>> page_blocks;
+    // Number of blocks covering each byte; saturates at 255
+    std::vector<std::uint8_t> code_bytes;
+    // Set when a write removes a block, or an interrupt changes the PC, so
+    // that the current block is left
+    bool code_written;
+    // An instruction that is not all on plain memory, decoded afresh each
+    // time it runs and never kept
+    Block uncached;
+    // Memory::GetLoadGeneration() when the cache was last known valid
+    std::uint64_t load_generation;
+
+    // Translation to native code; jit is created on first use
+    std::unique_ptr<JITBuffer> jit;
+    bool jit_enabled;
+    unsigned jit_threshold;
+
+    // Interrupt inputs; an NMI waits in nmi_pending until it is taken
+    bool irq_line;
+    bool nmi_pending;
+    // Set while WAI repeats, waiting for an interrupt
+    bool waiting;
+
+    // Execution checks the cycle count against a single deadline: the end
+    // of the run, the next scheduled event, or zero if an interrupt may be
+    // waiting. Reaching it calls TakeEvents().
+    unsigned long end_cycle;
+    unsigned long deadline;
+
+    void UpdateDeadline(void);
+    void TakeEvents(void);
+    void Interrupt(std::uint16_t vector);
+
+    CPU::StopReason CheckStop(void);
+    bool HasStop(std::uint16_t addr, unsigned count) const;
+
+    void AddCheckpoint(void);
+    void DropOldest(void);
+    void DropFuture(void);
+    void RestoreCheckpoint(std::size_t index);
+    void Replay(unsigned long target, unsigned long *found);
+    void ScheduleInput(void);
+    void ApplyInputs(void);
+    // Kinds of input in the journal of history
+    enum InputKind {
+        input_irq_off,
+        input_irq_on,
+        input_nmi,
+        input_reset
+    };
+    void RecordInput(InputKind kind);
+
+    // Set while execution writes trace records. Writes by the instruction
+    // being executed, and by an interrupt taken before it, wait in
+    // trace_writes for its record; the rest is what the last record left.
+    bool tracing;
+    bool trace_sync;            // The next record gives everything
+    static const unsigned max_trace_writes = 12;
+    struct TraceWrite {
+        std::uint16_t addr;
+        std::uint8_t byte;
+    };
+    TraceWrite trace_writes[max_trace_writes];
+    unsigned trace_write_count;
+    std::uint16_t trace_pc;     // Where the next record's PC is assumed
+    std::uint8_t trace_regs[5]; // A, X, Y, S and P
+    unsigned long trace_cycles;
+    void TraceOp(std::uint16_t pc, const Decoded& op);
+
+    // Reports to the profile; return_s is where the matching return will
+    // leave S
+    void ProfileCall(std::uint8_t return_s);
+    void ProfileReturn(void);
+
+    Block *DecodeBlock(std::uint16_t start);
+    Block *DecodeUncached(std::uint16_t start);
+    bool PlainCode(std::uint16_t addr) const;
+    void InvalidateCode(std::uint16_t addr);
+    void DropBlock(std::uint16_t start, unsigned skip_page);
+    // Remove the blocks on pages loaded since the cache was last checked;
+    // a write from outside the CPU to a page holding code counts as a load
+    void CheckLoads(void)
+    {
+        if (memory->GetLoadGeneration() != load_generation) {
+            FlushLoadedPages();
+        }
+    }
+    void FlushLoadedPages(void);
+    void TranslateBlock(Block *block);
+    void DropTranslations(void);
+    template <CPU6502::Variant variant_> void Dispatch(std::uint8_t opcode);
+#ifdef CPU6502_INSTRUMENT
+    template <CPU6502::Variant variant_>
+    void InstrumentedDispatch(std::uint8_t opcode);
+#endif
+    void DispatchUndocumented(std::uint8_t opcode);
+    template <CPU6502::Variant variant_> void DispatchCMOS(std::uint8_t opcode);
+    void Write8(std::uint16_t addr, std::uint8_t byte);
+    static unsigned Length(AddrMode mode);
+
+    template <bool cmos> void DoAdd(std::uint8_t byte);
+    template <bool cmos> void DoSubtract(std::uint8_t byte);
+    // Whether an instruction reads its operand or writes it; indexed writes
+    // always take the page crossing cycle
+    enum Access {
+        acc_read,
+        acc_write
+    };
+    template <AddrMode mode, Access access = acc_read>
+    std::uint16_t Address(void);
+    template <AddrMode mode>
+    std::uint8_t ReadOperand(void);
+    template <Access access>
+    void IndexCycles(std::uint16_t base, std::uint16_t addr);
     void Compare(std::uint8_t reg, std::uint8_t byte);
     void PushByte(std::uint8_t byte);
     std::uint8_t PopByte(void);
     void SetNZ(std::uint8_t result);
     void SetZ(std::uint8_t result);
-    void SetV(bool overflow);
     void SetC(bool carry);
+    void StoreHigh(std::uint16_t addr, std::uint8_t index, std::uint8_t byte);
 
     void do_invalid(std::uint8_t opcode);
-    void do_ORA(std::uint8_t opcode);
-    void do_AND(std::uint8_t opcode);
-    void do_EOR(std::uint8_t opcode);
-    void do_ADC(std::uint8_t opcode);
-    void do_STA(std::uint8_t opcode);
-    void do_LDA(std::uint8_t opcode);
-    void do_CMP(std::uint8_t opcode);
-    void do_SBC(std::uint8_t opcode);
-    void do_ASL(std::uint8_t opcode);
-    void do_LSR(std::uint8_t opcode);
-    void do_ROL(std::uint8_t opcode);
-    void do_ROR(std::uint8_t opcode);
-    void do_ASL_A(std::uint8_t opcode);
-    void do_LSR_A(std::uint8_t opcode);
-    void do_ROL_A(std::uint8_t opcode);
-    void do_ROR_A(std::uint8_t opcode);
-    void do_BIT(std::uint8_t opcode);
-    void do_branch(std::uint8_t opcode);
-    void do_BRK(std::uint8_t opcode);
-    void do_CLC(std::uint8_t opcode);
-    void do_CLD(std::uint8_t opcode);
-    void do_CLI(std::uint8_t opcode);
-    void do_CLV(std::uint8_t opcode);
-    void do_CPX(std::uint8_t opcode);
-    void do_CPX_imm(std::uint8_t opcode);
-    void do_CPY(std::uint8_t opcode);
-    void do_CPY_imm(std::uint8_t opcode);
-    void do_DEC(std::uint8_t opcode);
-    void do_DEX(std::uint8_t opcode);
-    void do_DEY(std::uint8_t opcode);
-    void do_INC(std::uint8_t opcode);
-    void do_INX(std::uint8_t opcode);
-    void do_INY(std::uint8_t opcode);
-    void do_JMP_abs(std::uint8_t opcode);
-    void do_JMP_ind(std::uint8_t opcode);
-    void do_JSR(std::uint8_t opcode);
-    void do_LDX(std::uint8_t opcode);
-    void do_LDX_imm(std::uint8_t opcode);
-    void do_LDY(std::uint8_t opcode);
-    void do_LDY_imm(std::uint8_t opcode);
-    void do_NOP(std::uint8_t opcode);
-    void do_PHA(std::uint8_t opcode);
-    void do_PHP(std::uint8_t opcode);
-    void do_PLA(std::uint8_t opcode);
-    void do_PLP(std::uint8_t opcode);
-    void do_RTI(std::uint8_t opcode);
-    void do_RTS(std::uint8_t opcode);
-    void do_SEC(std::uint8_t opcode);
-    void do_SED(std::uint8_t opcode);
-    void do_SEI(std::uint8_t opcode);
-    void do_STX(std::uint8_t opcode);
-    void do_STY(std::uint8_t opcode);
-    void do_TAX(std::uint8_t opcode);
-    void do_TAY(std::uint8_t opcode);
-    void do_TSX(std::uint8_t opcode);
-    void do_TXA(std::uint8_t opcode);
-    void do_TXS(std::uint8_t opcode);
-    void do_TYA(std::uint8_t opcode);
-
-    typedef void (CPU6502Impl::*opcode_handler)(std::uint8_t opcode);
+    template <AddrMode mode> void do_ORA(void);
+    template <AddrMode mode> void do_AND(void);
+    template <AddrMode mode> void do_EOR(void);
+    template <AddrMode mode, bool cmos = false> void do_ADC(void);
+    template <AddrMode mode> void do_STA(void);
+    template <AddrMode mode> void do_LDA(void);
+    template <AddrMode mode> void do_CMP(void);
+    template <AddrMode mode, bool cmos = false> void do_SBC(void);
+    template <AddrMode mode, Access access = acc_write> void do_ASL(void);
+    template <AddrMode mode, Access access = acc_write> void do_LSR(void);
+    template <AddrMode mode, Access access = acc_write> void do_ROL(void);
+    template <AddrMode mode, Access access = acc_write> void do_ROR(void);
+    void do_ASL_A(void);
+    void do_LSR_A(void);
+    void do_ROL_A(void);
+    void do_ROR_A(void);
+    template <AddrMode mode> void do_BIT(void);
+    template <std::uint8_t flag, bool set> void do_branch(void);
+    template <bool cmos> void do_BRK(void);
+    void do_CLC(void);
+    void do_CLD(void);
+    void do_CLI(void);
+    void do_CLV(void);
+    template <AddrMode mode> void do_CPX(void);
+    template <AddrMode mode> void do_CPY(void);
+    template <AddrMode mode> void do_DEC(void);
+    void do_DEX(void);
+    void do_DEY(void);
+    template <AddrMode mode> void do_INC(void);
+    void do_INX(void);
+    void do_INY(void);
+    void do_JMP_abs(void);
+    template <bool cmos> void do_JMP_ind(void);
+    void do_JSR(void);
+    template <AddrMode mode> void do_LDX(void);
+    template <AddrMode mode> void do_LDY(void);
+    void do_NOP(void);
+    void do_PHA(void);
+    void do_PHP(void);
+    void do_PLA(void);
+    void do_PLP(void);
+    void do_RTI(void);
+    void do_RTS(void);
+    void do_SEC(void);
+    void do_SED(void);
+    void do_SEI(void);
+    template <AddrMode mode> void do_STX(void);
+    template <AddrMode mode> void do_STY(void);
+    void do_TAX(void);
+    void do_TAY(void);
+    void do_TSX(void);
+    void do_TXA(void);
+    void do_TXS(void);
+    void do_TYA(void);
+
+    // Undocumented NMOS instructions
+    template <AddrMode mode> void do_SLO(void);
+    template <AddrMode mode> void do_RLA(void);
+    template <AddrMode mode> void do_SRE(void);
+    template <AddrMode mode> void do_RRA(void);
+    template <AddrMode mode> void do_SAX(void);
+    template <AddrMode mode> void do_LAX(void);
+    template <AddrMode mode> void do_DCP(void);
+    template <AddrMode mode> void do_ISC(void);
+    void do_ANC(void);
+    void do_ALR(void);
+    void do_ARR(void);
+    void do_SBX(void);
+    void do_LXA(void);
+    void do_ANE(void);
+    template <AddrMode mode> void do_SHA(void);
+    void do_SHX(void);
+    void do_SHY(void);
+    void do_TAS(void);
+    void do_LAS(void);
+    template <AddrMode mode> void do_NOP_operand(void);
+    void do_JAM(std::uint8_t opcode);
+
+    // 65C02 instructions
+    void do_PHX(void);
+    void do_PHY(void);
+    void do_PLX(void);
+    void do_PLY(void);
+    template <AddrMode mode> void do_STZ(void);
+    template <AddrMode mode> void do_TSB(void);
+    template <AddrMode mode> void do_TRB(void);
+    void do_INC_A(void);
+    void do_DEC_A(void);
+    void do_BIT_imm(void);
+    void do_JMP_abs_x(void);
+    void do_NOP1(void);
+
+    // Rockwell and WDC instructions
+    template <unsigned bit> void do_RMB(void);
+    template <unsigned bit> void do_SMB(void);
+    template <unsigned bit> void do_BBR(void);
+    template <unsigned bit> void do_BBS(void);
+    void do_WAI(void);
+    void do_STP(void);
+
+    // Used for disassembly and assembly; execution is in Execute().
+    // documented is the NMOS set, which the other variants extend.
     struct Instruction {
-        char name[4];
+        char name[5];
         AddrMode addr_mode;
-        opcode_handler handler;
     };
-    static const Instruction instructions[256];
-    static int FindOpcode(std::string const &instr, AddrMode mode);
+    static const Instruction documented[256];
+    static const Instruction *InstructionTable(CPU6502::Variant variant);
+    const Instruction *instructions;
+
+    // Called from translated code
+    static unsigned JitRead8(CPU6502Regs *regs, unsigned addr);
+    static unsigned JitRead16ZP(CPU6502Regs *regs, unsigned zp_addr);
+    static unsigned JitWrite8(CPU6502Regs *regs, unsigned addr, unsigned byte);
+    static unsigned JitPush(CPU6502Regs *regs, unsigned byte);
+    static unsigned JitPop(CPU6502Regs *regs);
+    static unsigned JitPushFlags(CPU6502Regs *regs);
+    static void JitPullFlags(CPU6502Regs *regs);
+    static void JitRTS(CPU6502Regs *regs);
+    template <bool cmos> static void JitADC(CPU6502Regs *regs, unsigned byte);
+    template <bool cmos> static void JitSBC(CPU6502Regs *regs, unsigned byte);
+    int FindOpcode(std::string const &instr, AddrMode mode) const;
+};
+
+// Going back restores the last checkpoint before the place to go, and
+// executes forward from there. Checkpoints are snapshots, which share the
+// pages that did not change. Between them, a journal keeps the interrupt
+// inputs that event actions raised during runs, and another the bytes read
+// from devices, as the things that executing again would not bring about;
+// changes from outside between runs start a new checkpoint instead.
+// Positions count the instructions executed since history began.
+struct CPU6502Impl::History {
+    struct Checkpoint {
+        unsigned long position;
+        std::shared_ptr<const CPU::Snapshot> snapshot;
+        std::size_t bytes;          // Estimated size of what it added
+        std::size_t first_input;    // Inputs recorded before it, in all
+        std::size_t first_read;     // Likewise bytes read from devices
+    };
+    struct Input {
+        unsigned long cycle;        // emu_cycles when it came
+        InputKind kind;
+    };
+
+    std::size_t budget;
+    unsigned long interval;
+    std::deque<Checkpoint> checkpoints;
+    std::deque<Input> inputs;       // In order of cycle
+    std::size_t inputs_dropped;     // From the front of inputs
+    Memory::ReadJournal reads;
+    std::size_t reads_dropped;      // From the front of reads
+    std::size_t reads_counted;      // Of reads, in bytes below
+    std::size_t bytes;              // Estimated size of all three
+
+    // Where the CPU is now, the first input after emu_cycles, and the id
+    // of the event that brings it in, or ULONG_MAX if none is scheduled
+    unsigned long position;
+    std::size_t next_input;
+    unsigned long input_event;
+
+    // Memory::GetLoadGeneration() when history last looked, and whether
+    // the CPU was changed from outside since
+    std::uint64_t load_generation;
+    bool changed;
+
+    // Set during Advance(), when inputs come from events, and while going
+    // over recorded history, when they come from the journal
+    bool running;
+    bool replaying;
+
+    History(void) :
+        budget(0), interval(1), inputs_dropped(0), reads_dropped(0),
+        reads_counted(0), bytes(0), position(0),
+        next_input(0), input_event(ULONG_MAX),
+        load_generation(0), changed(true), running(false), replaying(false)
+    {
+    }
 };
 
 }
 
-CPU6502::CPU6502(Memory *mem) :
+CPU6502::CPU6502(Memory *mem, Variant variant) :
     CPU(mem),
-    impl(new CPU6502Impl(this, mem))
+    impl(new CPU6502Impl(this, mem, variant))
 {
     max_len = 3;
 }
@@ -199,14 +604,15 @@ CPU6502::GetRegister(const std::string& reg_name) const
         width = 2;
         value = impl_->reg_s;
     } else if (reg_name == "FLAGS") {
+        auto flags = impl_->PackFlags();
         std::snprintf(str, sizeof(str), "%c%c-%c%c%c%c%c",
-                (impl_->reg_flags & 0x80) ? 'N' : '-',
-                (impl_->reg_flags & 0x40) ? 'V' : '-',
-                (impl_->reg_flags & 0x10) ? 'B' : '-',
-                (impl_->reg_flags & 0x08) ? 'D' : '-',
-                (impl_->reg_flags & 0x04) ? 'I' : '-',
-                (impl_->reg_flags & 0x02) ? 'Z' : '-',
-                (impl_->reg_flags & 0x01) ? 'C' : '-');
+                (flags & 0x80) ? 'N' : '-',
+                (flags & 0x40) ? 'V' : '-',
+                (flags & 0x10) ? 'B' : '-',
+                (flags & 0x08) ? 'D' : '-',
+                (flags & 0x04) ? 'I' : '-',
+                (flags & 0x02) ? 'Z' : '-',
+                (flags & 0x01) ? 'C' : '-');
         return str;
     } else if (reg_name == "PC") {
         width = 4;
@@ -219,6 +625,22 @@ CPU6502::GetRegister(const std::string& reg_name) const
     return str;
 }
 
+// Index is as in GetRegisterList()
+std::uint64_t
+CPU6502::GetRegisterValue(int index) const
+{
+    auto impl_ = reinterpret_cast<CPU6502Impl *>(impl);
+    switch (index) {
+    case 0: return impl_->reg_a;
+    case 1: return impl_->reg_x;
+    case 2: return impl_->reg_y;
+    case 3: return impl_->reg_s;
+    case 4: return impl_->PackFlags();
+    case 5: return impl_->reg_pc;
+    default: return 0;
+    }
+}
+
 bool
 CPU6502::SetRegister(const std::string& reg_name, const std::string& value)
 {
@@ -241,7 +663,8 @@ CPU6502::SetRegister(const std::string& reg_name, const std::string& value)
             }
             num |= 0x80 >> (p - flags);
         }
-        impl_->reg_flags = num;
+        impl_->UnpackFlags(num);
+        impl_->HistoryChanged(false);
         return true;
     }
 
@@ -269,6 +692,7 @@ CPU6502::SetRegister(const std::string& reg_name, const std::string& value)
         return false;
     }
 
+    impl_->HistoryChanged(false);
     return true;
 }
 
@@ -295,14 +719,16 @@ void
 CPU6502::Step(void)
 {
     auto impl_ = reinterpret_cast<CPU6502Impl *>(impl);
-    impl_->DoStep();
+    CPU::StopReason reason;
+    impl_->DoStep(reason);
 }
 
 void
 CPU6502::Next(void)
 {
     auto impl_ = reinterpret_cast<CPU6502Impl *>(impl);
-    if (impl_->DoStep() && !impl_->HasBreakpoint()) {
+    CPU::StopReason reason;
+    if (impl_->DoStep(reason) && reason != CPU::stop_breakpoint) {
         ToReturn();
     }
 }
@@ -315,8 +741,9 @@ CPU6502::ToReturn(void)
     std::uint8_t delta_s;
 
     do {
-        Step();
-        if (impl_->HasBreakpoint()) {
+        CPU::StopReason reason;
+        impl_->DoStep(reason);
+        if (reason == CPU::stop_breakpoint) {
             break;
         }
         // reg_s < saved_s will wrap; reg_s == saved_s will give zero;
@@ -325,6 +752,195 @@ CPU6502::ToReturn(void)
     } while (delta_s == 0 || delta_s > 3);
 }
 
+CPU::StopReason
+CPU6502::Run(void)
+{
+    return RunLimited(ULONG_MAX, ULONG_MAX, nullptr).reason;
+}
+
+CPU::RunResult
+CPU6502::RunCycles(unsigned long budget)
+{
+    return RunLimited(ULONG_MAX, budget, nullptr);
+}
+
+CPU::RunResult
+CPU6502::RunInstructions(unsigned long count)
+{
+    return RunLimited(count, ULONG_MAX, nullptr);
+}
+
+CPU::RunResult
+CPU6502::RunUntil(const std::set<std::uint64_t>& stops, unsigned long max_count)
+{
+    return RunLimited(max_count, ULONG_MAX, &stops);
+}
+
+// Common to the run functions
+CPU::RunResult
+CPU6502::RunLimited(unsigned long count, unsigned long cycles,
+                    const std::set<std::uint64_t> *stops)
+{
+    // Number of instructions between checks for a pause request
+    static const unsigned long batch_size = 65536;
+
+    auto impl_ = reinterpret_cast<CPU6502Impl *>(impl);
+    pause_request.store(false, std::memory_order_relaxed);
+    impl_->memory->ResetWatchHit();
+
+    if (stops != nullptr) {
+        impl_->stop_at.assign(0x10000, false);
+        for (auto addr : *stops) {
+            if (addr < 0x10000) {
+                impl_->stop_at[addr] = true;
+            }
+        }
+    }
+
+    auto start_cycles = impl_->emu_cycles;
+    unsigned long end_cycle = (cycles > ULONG_MAX - start_cycles)
+                            ? ULONG_MAX : start_cycles + cycles;
+    unsigned long done = 0;
+    StopReason reason;
+    try {
+        do {
+            unsigned long n;
+            reason = impl_->Advance(std::min(count - done, batch_size),
+                                    end_cycle, n);
+            done += n;
+            run_cycles.store(impl_->emu_cycles, std::memory_order_relaxed);
+            if (reason == stop_count && done < count
+            &&  pause_request.load(std::memory_order_relaxed)) {
+                reason = stop_pause;
+            }
+        } while (reason == stop_count && done < count);
+    }
+    catch (...) {
+        impl_->stop_at.clear();
+        throw;
+    }
+    impl_->stop_at.clear();
+
+    return RunResult(reason, done, impl_->emu_cycles - start_cycles);
+}
+
+bool
+CPU6502::SetJIT(bool enable)
+{
+    auto impl_ = reinterpret_cast<CPU6502Impl *>(impl);
+    return impl_->SetJIT(enable);
+}
+
+std::vector<CPU6502::OpcodeCost>
+CPU6502::GetOpcodeCosts(void) const
+{
+#ifdef CPU6502_INSTRUMENT
+    auto impl_ = reinterpret_cast<CPU6502Impl *>(impl);
+    return impl_->GetOpcodeCosts();
+#else
+    return {};
+#endif
+}
+
+void
+CPU6502::ClearOpcodeCosts(void)
+{
+#ifdef CPU6502_INSTRUMENT
+    auto impl_ = reinterpret_cast<CPU6502Impl *>(impl);
+    impl_->ClearOpcodeCosts();
+#endif
+}
+
+bool
+CPU6502::SetBreakStop(bool enable)
+{
+    auto impl_ = reinterpret_cast<CPU6502Impl *>(impl);
+    impl_->break_stop = enable;
+    return enable;
+}
+
+bool
+CPU6502::StartTrace(const std::string& path)
+{
+    auto impl_ = reinterpret_cast<CPU6502Impl *>(impl);
+    try {
+        impl_->StartTrace(path);
+    }
+    catch (const TraceExcept& e) {
+        throw CPUExcept(e.what());
+    }
+    return true;
+}
+
+void
+CPU6502::StopTrace(void)
+{
+    auto impl_ = reinterpret_cast<CPU6502Impl *>(impl);
+    try {
+        impl_->StopTrace();
+    }
+    catch (const TraceExcept& e) {
+        throw CPUExcept(e.what());
+    }
+}
+
+bool
+CPU6502::StartProfile(void)
+{
+    auto impl_ = reinterpret_cast<CPU6502Impl *>(impl);
+    impl_->profile.reset(new CallProfile(impl_->reg_pc, impl_->emu_cycles));
+    impl_->profiling = true;
+    return true;
+}
+
+void
+CPU6502::StopProfile(void)
+{
+    auto impl_ = reinterpret_cast<CPU6502Impl *>(impl);
+    if (impl_->profiling) {
+        impl_->profile->Update(impl_->emu_cycles);
+        impl_->profiling = false;
+    }
+}
+
+const CallProfile *
+CPU6502::GetProfile(void)
+{
+    auto impl_ = reinterpret_cast<CPU6502Impl *>(impl);
+    if (impl_->profiling) {
+        impl_->profile->Update(impl_->emu_cycles);
+    }
+    return impl_->profile.get();
+}
+
+bool
+CPU6502::SetHistory(std::size_t budget, unsigned long interval)
+{
+    auto impl_ = reinterpret_cast<CPU6502Impl *>(impl);
+    return impl_->SetHistory(budget, interval);
+}
+
+bool
+CPU6502::StepBack(void)
+{
+    auto impl_ = reinterpret_cast<CPU6502Impl *>(impl);
+    return impl_->StepBack();
+}
+
+CPU::StopReason
+CPU6502::ReverseContinue(void)
+{
+    auto impl_ = reinterpret_cast<CPU6502Impl *>(impl);
+    return impl_->ReverseContinue();
+}
+
+CPU6502::Variant
+CPU6502::GetVariant(void) const
+{
+    auto impl_ = reinterpret_cast<CPU6502Impl *>(impl);
+    return impl_->variant;
+}
+
 std::uint64_t
 CPU6502::GetPC(void) const
 {
@@ -357,289 +973,542 @@ void
 CPU6502::ClearEmuCycles(void)
 {
     auto impl_ = reinterpret_cast<CPU6502Impl *>(impl);
+    RebaseEvents(impl_->emu_cycles);
     impl_->emu_cycles = 0;
+    impl_->HistoryChanged(true);
+}
+
+void
+CPU6502::SetIRQ(bool asserted)
+{
+    auto impl_ = reinterpret_cast<CPU6502Impl *>(impl);
+    impl_->SetIRQ(asserted);
+}
+
+void
+CPU6502::NMI(void)
+{
+    auto impl_ = reinterpret_cast<CPU6502Impl *>(impl);
+    impl_->NMI();
+}
+
+void
+CPU6502::Reset(void)
+{
+    auto impl_ = reinterpret_cast<CPU6502Impl *>(impl);
+    impl_->Reset();
+}
+
+void
+CPU6502::EventScheduled(unsigned long cycle)
+{
+    auto impl_ = reinterpret_cast<CPU6502Impl *>(impl);
+    impl_->EventScheduled(cycle);
+}
+
+std::shared_ptr<const void>
+CPU6502::SaveState(void) const
+{
+    auto impl_ = reinterpret_cast<CPU6502Impl *>(impl);
+    return impl_->SaveState();
+}
+
+void
+CPU6502::RestoreState(const void *state)
+{
+    auto impl_ = reinterpret_cast<CPU6502Impl *>(impl);
+    impl_->RestoreState(state);
 }
 
 namespace {
 
-// TODO: Provide an enumeration at the constructor, to choose among variant
-// instruction sets
-const CPU6502Impl::Instruction CPU6502Impl::instructions[256] = {
-    { "BRK", am_implied,  &CPU6502Impl::do_BRK     }, /* 00 */
-    { "ORA", am_ind_x,    &CPU6502Impl::do_ORA     }, /* 01 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 02 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 03 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 04 */
-    { "ORA", am_zp,       &CPU6502Impl::do_ORA     }, /* 05 */
-    { "ASL", am_zp,       &CPU6502Impl::do_ASL     }, /* 06 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 07 */
-    { "PHP", am_implied,  &CPU6502Impl::do_PHP     }, /* 08 */
-    { "ORA", am_immediate,&CPU6502Impl::do_ORA     }, /* 09 */
-    { "ASL", am_acc,      &CPU6502Impl::do_ASL_A   }, /* 0A */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 0B */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 0C */
-    { "ORA", am_abs,      &CPU6502Impl::do_ORA     }, /* 0D */
-    { "ASL", am_abs,      &CPU6502Impl::do_ASL     }, /* 0E */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 0F */
-    { "BPL", am_rel,      &CPU6502Impl::do_branch  }, /* 10 */
-    { "ORA", am_ind_y,    &CPU6502Impl::do_ORA     }, /* 11 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 12 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 13 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 14 */
-    { "ORA", am_zp_x,     &CPU6502Impl::do_ORA     }, /* 15 */
-    { "ASL", am_zp_x,     &CPU6502Impl::do_ASL     }, /* 16 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 17 */
-    { "CLC", am_implied,  &CPU6502Impl::do_CLC     }, /* 18 */
-    { "ORA", am_abs_y,    &CPU6502Impl::do_ORA     }, /* 19 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 1A */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 1B */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 1C */
-    { "ORA", am_abs_x,    &CPU6502Impl::do_ORA     }, /* 1D */
-    { "ASL", am_abs_x,    &CPU6502Impl::do_ASL     }, /* 1E */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 1F */
-    { "JSR", am_abs,      &CPU6502Impl::do_JSR     }, /* 20 */
-    { "AND", am_ind_x,    &CPU6502Impl::do_AND     }, /* 21 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 22 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 23 */
-    { "BIT", am_zp,       &CPU6502Impl::do_BIT     }, /* 24 */
-    { "AND", am_zp,       &CPU6502Impl::do_AND     }, /* 25 */
-    { "ROL", am_zp,       &CPU6502Impl::do_ROL     }, /* 26 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 27 */
-    { "PLP", am_implied,  &CPU6502Impl::do_PLP     }, /* 28 */
-    { "AND", am_immediate,&CPU6502Impl::do_AND     }, /* 29 */
-    { "ROL", am_acc,      &CPU6502Impl::do_ROL_A   }, /* 2A */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 2B */
-    { "BIT", am_abs,      &CPU6502Impl::do_BIT     }, /* 2C */
-    { "AND", am_abs,      &CPU6502Impl::do_AND     }, /* 2D */
-    { "ROL", am_abs,      &CPU6502Impl::do_ROL     }, /* 2E */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 2F */
-    { "BMI", am_rel,      &CPU6502Impl::do_branch  }, /* 30 */
-    { "AND", am_ind_y,    &CPU6502Impl::do_AND     }, /* 31 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 32 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 33 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 34 */
-    { "AND", am_zp_x,     &CPU6502Impl::do_AND     }, /* 35 */
-    { "ROL", am_zp_x,     &CPU6502Impl::do_ROL     }, /* 36 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 37 */
-    { "SEC", am_implied,  &CPU6502Impl::do_SEC     }, /* 38 */
-    { "AND", am_abs_y,    &CPU6502Impl::do_AND     }, /* 39 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 3A */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 3B */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 3C */
-    { "AND", am_abs_x,    &CPU6502Impl::do_AND     }, /* 3D */
-    { "ROL", am_abs_x,    &CPU6502Impl::do_ROL     }, /* 3E */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 3F */
-    { "RTI", am_implied,  &CPU6502Impl::do_RTI     }, /* 40 */
-    { "EOR", am_ind_x,    &CPU6502Impl::do_EOR     }, /* 41 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 42 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 43 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 44 */
-    { "EOR", am_zp,       &CPU6502Impl::do_EOR     }, /* 45 */
-    { "LSR", am_zp,       &CPU6502Impl::do_LSR     }, /* 46 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 47 */
-    { "PHA", am_implied,  &CPU6502Impl::do_PHA     }, /* 48 */
-    { "EOR", am_immediate,&CPU6502Impl::do_EOR     }, /* 49 */
-    { "LSR", am_acc,      &CPU6502Impl::do_LSR_A   }, /* 4A */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 4B */
-    { "JMP", am_abs,      &CPU6502Impl::do_JMP_abs }, /* 4C */
-    { "EOR", am_abs,      &CPU6502Impl::do_EOR     }, /* 4D */
-    { "LSR", am_abs,      &CPU6502Impl::do_LSR     }, /* 4E */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 4F */
-    { "BVC", am_rel,      &CPU6502Impl::do_branch  }, /* 50 */
-    { "EOR", am_ind_y,    &CPU6502Impl::do_EOR     }, /* 51 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 52 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 53 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 54 */
-    { "EOR", am_zp_x,     &CPU6502Impl::do_EOR     }, /* 55 */
-    { "LSR", am_zp_x,     &CPU6502Impl::do_LSR     }, /* 56 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 57 */
-    { "CLI", am_implied,  &CPU6502Impl::do_CLI     }, /* 58 */
-    { "EOR", am_abs_y,    &CPU6502Impl::do_EOR     }, /* 59 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 5A */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 5B */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 5C */
-    { "EOR", am_abs_x,    &CPU6502Impl::do_EOR     }, /* 5D */
-    { "LSR", am_abs_x,    &CPU6502Impl::do_LSR     }, /* 5E */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 5F */
-    { "RTS", am_implied,  &CPU6502Impl::do_RTS     }, /* 60 */
-    { "ADC", am_ind_x,    &CPU6502Impl::do_ADC     }, /* 61 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 62 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 63 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 64 */
-    { "ADC", am_zp,       &CPU6502Impl::do_ADC     }, /* 65 */
-    { "ROR", am_zp,       &CPU6502Impl::do_ROR     }, /* 66 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 67 */
-    { "PLA", am_implied,  &CPU6502Impl::do_PLA     }, /* 68 */
-    { "ADC", am_immediate,&CPU6502Impl::do_ADC     }, /* 69 */
-    { "ROR", am_acc,      &CPU6502Impl::do_ROR_A   }, /* 6A */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 6B */
-    { "JMP", am_ind,      &CPU6502Impl::do_JMP_ind }, /* 6C */
-    { "ADC", am_abs,      &CPU6502Impl::do_ADC     }, /* 6D */
-    { "ROR", am_abs,      &CPU6502Impl::do_ROR     }, /* 6E */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 6F */
-    { "BVS", am_rel,      &CPU6502Impl::do_branch  }, /* 70 */
-    { "ADC", am_ind_y,    &CPU6502Impl::do_ADC     }, /* 71 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 72 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 73 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 74 */
-    { "ADC", am_zp_x,     &CPU6502Impl::do_ADC     }, /* 75 */
-    { "ROR", am_zp_x,     &CPU6502Impl::do_ROR     }, /* 76 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 77 */
-    { "SEI", am_implied,  &CPU6502Impl::do_SEI     }, /* 78 */
-    { "ADC", am_abs_y,    &CPU6502Impl::do_ADC     }, /* 79 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 7A */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 7B */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 7C */
-    { "ADC", am_abs_x,    &CPU6502Impl::do_ADC     }, /* 7D */
-    { "ROR", am_abs_x,    &CPU6502Impl::do_ROR     }, /* 7E */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 7F */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 80 */
-    { "STA", am_ind_x,    &CPU6502Impl::do_STA     }, /* 81 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 82 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 83 */
-    { "STY", am_zp,       &CPU6502Impl::do_STY     }, /* 84 */
-    { "STA", am_zp,       &CPU6502Impl::do_STA     }, /* 85 */
-    { "STX", am_zp,       &CPU6502Impl::do_STX     }, /* 86 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 87 */
-    { "DEY", am_implied,  &CPU6502Impl::do_DEY     }, /* 88 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 89 */
-    { "TXA", am_implied,  &CPU6502Impl::do_TXA     }, /* 8A */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 8B */
-    { "STY", am_abs,      &CPU6502Impl::do_STY     }, /* 8C */
-    { "STA", am_abs,      &CPU6502Impl::do_STA     }, /* 8D */
-    { "STX", am_abs,      &CPU6502Impl::do_STX     }, /* 8E */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 8F */
-    { "BCC", am_rel,      &CPU6502Impl::do_branch  }, /* 90 */
-    { "STA", am_ind_y,    &CPU6502Impl::do_STA     }, /* 91 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 92 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 93 */
-    { "STY", am_zp_x,     &CPU6502Impl::do_STY     }, /* 94 */
-    { "STA", am_zp_x,     &CPU6502Impl::do_STA     }, /* 95 */
-    { "STX", am_zp_y,     &CPU6502Impl::do_STX     }, /* 96 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 97 */
-    { "TYA", am_implied,  &CPU6502Impl::do_TYA     }, /* 98 */
-    { "STA", am_abs_y,    &CPU6502Impl::do_STA     }, /* 99 */
-    { "TXS", am_implied,  &CPU6502Impl::do_TXS     }, /* 9A */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 9B */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 9C */
-    { "STA", am_abs_x,    &CPU6502Impl::do_STA     }, /* 9D */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 9E */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* 9F */
-    { "LDY", am_immediate,&CPU6502Impl::do_LDY_imm }, /* A0 */
-    { "LDA", am_ind_x,    &CPU6502Impl::do_LDA     }, /* A1 */
-    { "LDX", am_immediate,&CPU6502Impl::do_LDX_imm }, /* A2 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* A3 */
-    { "LDY", am_zp,       &CPU6502Impl::do_LDY     }, /* A4 */
-    { "LDA", am_zp,       &CPU6502Impl::do_LDA     }, /* A5 */
-    { "LDX", am_zp,       &CPU6502Impl::do_LDX     }, /* A6 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* A7 */
-    { "TAY", am_implied,  &CPU6502Impl::do_TAY     }, /* A8 */
-    { "LDA", am_immediate,&CPU6502Impl::do_LDA     }, /* A9 */
-    { "TAX", am_implied,  &CPU6502Impl::do_TAX     }, /* AA */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* AB */
-    { "LDY", am_abs,      &CPU6502Impl::do_LDY     }, /* AC */
-    { "LDA", am_abs,      &CPU6502Impl::do_LDA     }, /* AD */
-    { "LDX", am_abs,      &CPU6502Impl::do_LDX     }, /* AE */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* AF */
-    { "BCS", am_rel,      &CPU6502Impl::do_branch  }, /* B0 */
-    { "LDA", am_ind_y,    &CPU6502Impl::do_LDA     }, /* B1 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* B2 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* B3 */
-    { "LDY", am_zp_x,     &CPU6502Impl::do_LDY     }, /* B4 */
-    { "LDA", am_zp_x,     &CPU6502Impl::do_LDA     }, /* B5 */
-    { "LDX", am_zp_y,     &CPU6502Impl::do_LDX     }, /* B6 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* B7 */
-    { "CLV", am_implied,  &CPU6502Impl::do_CLV     }, /* B8 */
-    { "LDA", am_abs_y,    &CPU6502Impl::do_LDA     }, /* B9 */
-    { "TSX", am_implied,  &CPU6502Impl::do_TSX     }, /* BA */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* BB */
-    { "LDY", am_abs_x,    &CPU6502Impl::do_LDY     }, /* BC */
-    { "LDA", am_abs_x,    &CPU6502Impl::do_LDA     }, /* BD */
-    { "LDX", am_abs_y,    &CPU6502Impl::do_LDX     }, /* BE */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* BF */
-    { "CPY", am_immediate,&CPU6502Impl::do_CPY_imm }, /* C0 */
-    { "CMP", am_ind_x,    &CPU6502Impl::do_CMP     }, /* C1 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* C2 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* C3 */
-    { "CPY", am_zp,       &CPU6502Impl::do_CPY     }, /* C4 */
-    { "CMP", am_zp,       &CPU6502Impl::do_CMP     }, /* C5 */
-    { "DEC", am_zp,       &CPU6502Impl::do_DEC     }, /* C6 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* C7 */
-    { "INY", am_implied,  &CPU6502Impl::do_INY     }, /* C8 */
-    { "CMP", am_immediate,&CPU6502Impl::do_CMP     }, /* C9 */
-    { "DEX", am_implied,  &CPU6502Impl::do_DEX     }, /* CA */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* CB */
-    { "CPY", am_abs,      &CPU6502Impl::do_CPY     }, /* CC */
-    { "CMP", am_abs,      &CPU6502Impl::do_CMP     }, /* CD */
-    { "DEC", am_abs,      &CPU6502Impl::do_DEC     }, /* CE */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* CF */
-    { "BNE", am_rel,      &CPU6502Impl::do_branch  }, /* D0 */
-    { "CMP", am_ind_y,    &CPU6502Impl::do_CMP     }, /* D1 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* D2 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* D3 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* D4 */
-    { "CMP", am_zp_x,     &CPU6502Impl::do_CMP     }, /* D5 */
-    { "DEC", am_zp_x,     &CPU6502Impl::do_DEC     }, /* D6 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* D7 */
-    { "CLD", am_implied,  &CPU6502Impl::do_CLD     }, /* D8 */
-    { "CMP", am_abs_y,    &CPU6502Impl::do_CMP     }, /* D9 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* DA */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* DB */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* DC */
-    { "CMP", am_abs_x,    &CPU6502Impl::do_CMP     }, /* DD */
-    { "DEC", am_abs_x,    &CPU6502Impl::do_DEC     }, /* DE */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* DF */
-    { "CPX", am_immediate,&CPU6502Impl::do_CPX_imm }, /* E0 */
-    { "SBC", am_ind_x,    &CPU6502Impl::do_SBC     }, /* E1 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* E2 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* E3 */
-    { "CPX", am_zp,       &CPU6502Impl::do_CPX     }, /* E4 */
-    { "SBC", am_zp,       &CPU6502Impl::do_SBC     }, /* E5 */
-    { "INC", am_zp,       &CPU6502Impl::do_INC     }, /* E6 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* E7 */
-    { "INX", am_implied,  &CPU6502Impl::do_INX     }, /* E8 */
-    { "SBC", am_immediate,&CPU6502Impl::do_SBC     }, /* E9 */
-    { "NOP", am_implied,  &CPU6502Impl::do_NOP     }, /* EA */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* EB */
-    { "CPX", am_abs,      &CPU6502Impl::do_CPX     }, /* EC */
-    { "SBC", am_abs,      &CPU6502Impl::do_SBC     }, /* ED */
-    { "INC", am_abs,      &CPU6502Impl::do_INC     }, /* EE */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* EF */
-    { "BEQ", am_rel,      &CPU6502Impl::do_branch  }, /* F0 */
-    { "SBC", am_ind_y,    &CPU6502Impl::do_SBC     }, /* F1 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* F2 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* F3 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* F4 */
-    { "SBC", am_zp_x,     &CPU6502Impl::do_SBC     }, /* F5 */
-    { "INC", am_zp_x,     &CPU6502Impl::do_INC     }, /* F6 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* F7 */
-    { "SED", am_implied,  &CPU6502Impl::do_SED     }, /* F8 */
-    { "SBC", am_abs_y,    &CPU6502Impl::do_SBC     }, /* F9 */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* FA */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* FB */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }, /* FC */
-    { "SBC", am_abs_x,    &CPU6502Impl::do_SBC     }, /* FD */
-    { "INC", am_abs_x,    &CPU6502Impl::do_INC     }, /* FE */
-    { "",    am_invalid,  &CPU6502Impl::do_invalid }  /* FF */
+const CPU6502Impl::Instruction CPU6502Impl::documented[256] = {
+    { "BRK", am_implied   }, /* 00 */
+    { "ORA", am_ind_x     }, /* 01 */
+    { "",    am_invalid   }, /* 02 */
+    { "",    am_invalid   }, /* 03 */
+    { "",    am_invalid   }, /* 04 */
+    { "ORA", am_zp        }, /* 05 */
+    { "ASL", am_zp        }, /* 06 */
+    { "",    am_invalid   }, /* 07 */
+    { "PHP", am_implied   }, /* 08 */
+    { "ORA", am_immediate }, /* 09 */
+    { "ASL", am_acc       }, /* 0A */
+    { "",    am_invalid   }, /* 0B */
+    { "",    am_invalid   }, /* 0C */
+    { "ORA", am_abs       }, /* 0D */
+    { "ASL", am_abs       }, /* 0E */
+    { "",    am_invalid   }, /* 0F */
+    { "BPL", am_rel       }, /* 10 */
+    { "ORA", am_ind_y     }, /* 11 */
+    { "",    am_invalid   }, /* 12 */
+    { "",    am_invalid   }, /* 13 */
+    { "",    am_invalid   }, /* 14 */
+    { "ORA", am_zp_x      }, /* 15 */
+    { "ASL", am_zp_x      }, /* 16 */
+    { "",    am_invalid   }, /* 17 */
+    { "CLC", am_implied   }, /* 18 */
+    { "ORA", am_abs_y     }, /* 19 */
+    { "",    am_invalid   }, /* 1A */
+    { "",    am_invalid   }, /* 1B */
+    { "",    am_invalid   }, /* 1C */
+    { "ORA", am_abs_x     }, /* 1D */
+    { "ASL", am_abs_x     }, /* 1E */
+    { "",    am_invalid   }, /* 1F */
+    { "JSR", am_abs       }, /* 20 */
+    { "AND", am_ind_x     }, /* 21 */
+    { "",    am_invalid   }, /* 22 */
+    { "",    am_invalid   }, /* 23 */
+    { "BIT", am_zp        }, /* 24 */
+    { "AND", am_zp        }, /* 25 */
+    { "ROL", am_zp        }, /* 26 */
+    { "",    am_invalid   }, /* 27 */
+    { "PLP", am_implied   }, /* 28 */
+    { "AND", am_immediate }, /* 29 */
+    { "ROL", am_acc       }, /* 2A */
+    { "",    am_invalid   }, /* 2B */
+    { "BIT", am_abs       }, /* 2C */
+    { "AND", am_abs       }, /* 2D */
+    { "ROL", am_abs       }, /* 2E */
+    { "",    am_invalid   }, /* 2F */
+    { "BMI", am_rel       }, /* 30 */
+    { "AND", am_ind_y     }, /* 31 */
+    { "",    am_invalid   }, /* 32 */
+    { "",    am_invalid   }, /* 33 */
+    { "",    am_invalid   }, /* 34 */
+    { "AND", am_zp_x      }, /* 35 */
+    { "ROL", am_zp_x      }, /* 36 */
+    { "",    am_invalid   }, /* 37 */
+    { "SEC", am_implied   }, /* 38 */
+    { "AND", am_abs_y     }, /* 39 */
+    { "",    am_invalid   }, /* 3A */
+    { "",    am_invalid   }, /* 3B */
+    { "",    am_invalid   }, /* 3C */
+    { "AND", am_abs_x     }, /* 3D */
+    { "ROL", am_abs_x     }, /* 3E */
+    { "",    am_invalid   }, /* 3F */
+    { "RTI", am_implied   }, /* 40 */
+    { "EOR", am_ind_x     }, /* 41 */
+    { "",    am_invalid   }, /* 42 */
+    { "",    am_invalid   }, /* 43 */
+    { "",    am_invalid   }, /* 44 */
+    { "EOR", am_zp        }, /* 45 */
+    { "LSR", am_zp        }, /* 46 */
+    { "",    am_invalid   }, /* 47 */
+    { "PHA", am_implied   }, /* 48 */
+    { "EOR", am_immediate }, /* 49 */
+    { "LSR", am_acc       }, /* 4A */
+    { "",    am_invalid   }, /* 4B */
+    { "JMP", am_abs       }, /* 4C */
+    { "EOR", am_abs       }, /* 4D */
+    { "LSR", am_abs       }, /* 4E */
+    { "",    am_invalid   }, /* 4F */
+    { "BVC", am_rel       }, /* 50 */
+    { "EOR", am_ind_y     }, /* 51 */
+    { "",    am_invalid   }, /* 52 */
+    { "",    am_invalid   }, /* 53 */
+    { "",    am_invalid   }, /* 54 */
+    { "EOR", am_zp_x      }, /* 55 */
+    { "LSR", am_zp_x      }, /* 56 */
+    { "",    am_invalid   }, /* 57 */
+    { "CLI", am_implied   }, /* 58 */
+    { "EOR", am_abs_y     }, /* 59 */
+    { "",    am_invalid   }, /* 5A */
+    { "",    am_invalid   }, /* 5B */
+    { "",    am_invalid   }, /* 5C */
+    { "EOR", am_abs_x     }, /* 5D */
+    { "LSR", am_abs_x     }, /* 5E */
+    { "",    am_invalid   }, /* 5F */
+    { "RTS", am_implied   }, /* 60 */
+    { "ADC", am_ind_x     }, /* 61 */
+    { "",    am_invalid   }, /* 62 */
+    { "",    am_invalid   }, /* 63 */
+    { "",    am_invalid   }, /* 64 */
+    { "ADC", am_zp        }, /* 65 */
+    { "ROR", am_zp        }, /* 66 */
+    { "",    am_invalid   }, /* 67 */
+    { "PLA", am_implied   }, /* 68 */
+    { "ADC", am_immediate }, /* 69 */
+    { "ROR", am_acc       }, /* 6A */
+    { "",    am_invalid   }, /* 6B */
+    { "JMP", am_ind       }, /* 6C */
+    { "ADC", am_abs       }, /* 6D */
+    { "ROR", am_abs       }, /* 6E */
+    { "",    am_invalid   }, /* 6F */
+    { "BVS", am_rel       }, /* 70 */
+    { "ADC", am_ind_y     }, /* 71 */
+    { "",    am_invalid   }, /* 72 */
+    { "",    am_invalid   }, /* 73 */
+    { "",    am_invalid   }, /* 74 */
+    { "ADC", am_zp_x      }, /* 75 */
+    { "ROR", am_zp_x      }, /* 76 */
+    { "",    am_invalid   }, /* 77 */
+    { "SEI", am_implied   }, /* 78 */
+    { "ADC", am_abs_y     }, /* 79 */
+    { "",    am_invalid   }, /* 7A */
+    { "",    am_invalid   }, /* 7B */
+    { "",    am_invalid   }, /* 7C */
+    { "ADC", am_abs_x     }, /* 7D */
+    { "ROR", am_abs_x     }, /* 7E */
+    { "",    am_invalid   }, /* 7F */
+    { "",    am_invalid   }, /* 80 */
+    { "STA", am_ind_x     }, /* 81 */
+    { "",    am_invalid   }, /* 82 */
+    { "",    am_invalid   }, /* 83 */
+    { "STY", am_zp        }, /* 84 */
+    { "STA", am_zp        }, /* 85 */
+    { "STX", am_zp        }, /* 86 */
+    { "",    am_invalid   }, /* 87 */
+    { "DEY", am_implied   }, /* 88 */
+    { "",    am_invalid   }, /* 89 */
+    { "TXA", am_implied   }, /* 8A */
+    { "",    am_invalid   }, /* 8B */
+    { "STY", am_abs       }, /* 8C */
+    { "STA", am_abs       }, /* 8D */
+    { "STX", am_abs       }, /* 8E */
+    { "",    am_invalid   }, /* 8F */
+    { "BCC", am_rel       }, /* 90 */
+    { "STA", am_ind_y     }, /* 91 */
+    { "",    am_invalid   }, /* 92 */
+    { "",    am_invalid   }, /* 93 */
+    { "STY", am_zp_x      }, /* 94 */
+    { "STA", am_zp_x      }, /* 95 */
+    { "STX", am_zp_y      }, /* 96 */
+    { "",    am_invalid   }, /* 97 */
+    { "TYA", am_implied   }, /* 98 */
+    { "STA", am_abs_y     }, /* 99 */
+    { "TXS", am_implied   }, /* 9A */
+    { "",    am_invalid   }, /* 9B */
+    { "",    am_invalid   }, /* 9C */
+    { "STA", am_abs_x     }, /* 9D */
+    { "",    am_invalid   }, /* 9E */
+    { "",    am_invalid   }, /* 9F */
+    { "LDY", am_immediate }, /* A0 */
+    { "LDA", am_ind_x     }, /* A1 */
+    { "LDX", am_immediate }, /* A2 */
+    { "",    am_invalid   }, /* A3 */
+    { "LDY", am_zp        }, /* A4 */
+    { "LDA", am_zp        }, /* A5 */
+    { "LDX", am_zp        }, /* A6 */
+    { "",    am_invalid   }, /* A7 */
+    { "TAY", am_implied   }, /* A8 */
+    { "LDA", am_immediate }, /* A9 */
+    { "TAX", am_implied   }, /* AA */
+    { "",    am_invalid   }, /* AB */
+    { "LDY", am_abs       }, /* AC */
+    { "LDA", am_abs       }, /* AD */
+    { "LDX", am_abs       }, /* AE */
+    { "",    am_invalid   }, /* AF */
+    { "BCS", am_rel       }, /* B0 */
+    { "LDA", am_ind_y     }, /* B1 */
+    { "",    am_invalid   }, /* B2 */
+    { "",    am_invalid   }, /* B3 */
+    { "LDY", am_zp_x      }, /* B4 */
+    { "LDA", am_zp_x      }, /* B5 */
+    { "LDX", am_zp_y      }, /* B6 */
+    { "",    am_invalid   }, /* B7 */
+    { "CLV", am_implied   }, /* B8 */
+    { "LDA", am_abs_y     }, /* B9 */
+    { "TSX", am_implied   }, /* BA */
+    { "",    am_invalid   }, /* BB */
+    { "LDY", am_abs_x     }, /* BC */
+    { "LDA", am_abs_x     }, /* BD */
+    { "LDX", am_abs_y     }, /* BE */
+    { "",    am_invalid   }, /* BF */
+    { "CPY", am_immediate }, /* C0 */
+    { "CMP", am_ind_x     }, /* C1 */
+    { "",    am_invalid   }, /* C2 */
+    { "",    am_invalid   }, /* C3 */
+    { "CPY", am_zp        }, /* C4 */
+    { "CMP", am_zp        }, /* C5 */
+    { "DEC", am_zp        }, /* C6 */
+    { "",    am_invalid   }, /* C7 */
+    { "INY", am_implied   }, /* C8 */
+    { "CMP", am_immediate }, /* C9 */
+    { "DEX", am_implied   }, /* CA */
+    { "",    am_invalid   }, /* CB */
+    { "CPY", am_abs       }, /* CC */
+    { "CMP", am_abs       }, /* CD */
+    { "DEC", am_abs       }, /* CE */
+    { "",    am_invalid   }, /* CF */
+    { "BNE", am_rel       }, /* D0 */
+    { "CMP", am_ind_y     }, /* D1 */
+    { "",    am_invalid   }, /* D2 */
+    { "",    am_invalid   }, /* D3 */
+    { "",    am_invalid   }, /* D4 */
+    { "CMP", am_zp_x      }, /* D5 */
+    { "DEC", am_zp_x      }, /* D6 */
+    { "",    am_invalid   }, /* D7 */
+    { "CLD", am_implied   }, /* D8 */
+    { "CMP", am_abs_y     }, /* D9 */
+    { "",    am_invalid   }, /* DA */
+    { "",    am_invalid   }, /* DB */
+    { "",    am_invalid   }, /* DC */
+    { "CMP", am_abs_x     }, /* DD */
+    { "DEC", am_abs_x     }, /* DE */
+    { "",    am_invalid   }, /* DF */
+    { "CPX", am_immediate }, /* E0 */
+    { "SBC", am_ind_x     }, /* E1 */
+    { "",    am_invalid   }, /* E2 */
+    { "",    am_invalid   }, /* E3 */
+    { "CPX", am_zp        }, /* E4 */
+    { "SBC", am_zp        }, /* E5 */
+    { "INC", am_zp        }, /* E6 */
+    { "",    am_invalid   }, /* E7 */
+    { "INX", am_implied   }, /* E8 */
+    { "SBC", am_immediate }, /* E9 */
+    { "NOP", am_implied   }, /* EA */
+    { "",    am_invalid   }, /* EB */
+    { "CPX", am_abs       }, /* EC */
+    { "SBC", am_abs       }, /* ED */
+    { "INC", am_abs       }, /* EE */
+    { "",    am_invalid   }, /* EF */
+    { "BEQ", am_rel       }, /* F0 */
+    { "SBC", am_ind_y     }, /* F1 */
+    { "",    am_invalid   }, /* F2 */
+    { "",    am_invalid   }, /* F3 */
+    { "",    am_invalid   }, /* F4 */
+    { "SBC", am_zp_x      }, /* F5 */
+    { "INC", am_zp_x      }, /* F6 */
+    { "",    am_invalid   }, /* F7 */
+    { "SED", am_implied   }, /* F8 */
+    { "SBC", am_abs_y     }, /* F9 */
+    { "",    am_invalid   }, /* FA */
+    { "",    am_invalid   }, /* FB */
+    { "",    am_invalid   }, /* FC */
+    { "SBC", am_abs_x     }, /* FD */
+    { "INC", am_abs_x     }, /* FE */
+    { "",    am_invalid   }  /* FF */
+};
+
+// Opcodes that the other variants add to the documented set
+struct ExtraInstruction {
+    std::uint8_t opcode;
+    char name[5];
+    AddrMode addr_mode;
+};
+
+static const ExtraInstruction undocumented_extra[] = {
+    { 0x02, "JAM", am_implied   }, { 0x12, "JAM", am_implied   },
+    { 0x22, "JAM", am_implied   }, { 0x32, "JAM", am_implied   },
+    { 0x42, "JAM", am_implied   }, { 0x52, "JAM", am_implied   },
+    { 0x62, "JAM", am_implied   }, { 0x72, "JAM", am_implied   },
+    { 0x92, "JAM", am_implied   }, { 0xB2, "JAM", am_implied   },
+    { 0xD2, "JAM", am_implied   }, { 0xF2, "JAM", am_implied   },
+    { 0x03, "SLO", am_ind_x     }, { 0x07, "SLO", am_zp        },
+    { 0x0F, "SLO", am_abs       }, { 0x13, "SLO", am_ind_y     },
+    { 0x17, "SLO", am_zp_x      }, { 0x1B, "SLO", am_abs_y     },
+    { 0x1F, "SLO", am_abs_x     },
+    { 0x23, "RLA", am_ind_x     }, { 0x27, "RLA", am_zp        },
+    { 0x2F, "RLA", am_abs       }, { 0x33, "RLA", am_ind_y     },
+    { 0x37, "RLA", am_zp_x      }, { 0x3B, "RLA", am_abs_y     },
+    { 0x3F, "RLA", am_abs_x     },
+    { 0x43, "SRE", am_ind_x     }, { 0x47, "SRE", am_zp        },
+    { 0x4F, "SRE", am_abs       }, { 0x53, "SRE", am_ind_y     },
+    { 0x57, "SRE", am_zp_x      }, { 0x5B, "SRE", am_abs_y     },
+    { 0x5F, "SRE", am_abs_x     },
+    { 0x63, "RRA", am_ind_x     }, { 0x67, "RRA", am_zp        },
+    { 0x6F, "RRA", am_abs       }, { 0x73, "RRA", am_ind_y     },
+    { 0x77, "RRA", am_zp_x      }, { 0x7B, "RRA", am_abs_y     },
+    { 0x7F, "RRA", am_abs_x     },
+    { 0x83, "SAX", am_ind_x     }, { 0x87, "SAX", am_zp        },
+    { 0x8F, "SAX", am_abs       }, { 0x97, "SAX", am_zp_y      },
+    { 0xA3, "LAX", am_ind_x     }, { 0xA7, "LAX", am_zp        },
+    { 0xAF, "LAX", am_abs       }, { 0xB3, "LAX", am_ind_y     },
+    { 0xB7, "LAX", am_zp_y      }, { 0xBF, "LAX", am_abs_y     },
+    { 0xC3, "DCP", am_ind_x     }, { 0xC7, "DCP", am_zp        },
+    { 0xCF, "DCP", am_abs       }, { 0xD3, "DCP", am_ind_y     },
+    { 0xD7, "DCP", am_zp_x      }, { 0xDB, "DCP", am_abs_y     },
+    { 0xDF, "DCP", am_abs_x     },
+    { 0xE3, "ISC", am_ind_x     }, { 0xE7, "ISC", am_zp        },
+    { 0xEF, "ISC", am_abs       }, { 0xF3, "ISC", am_ind_y     },
+    { 0xF7, "ISC", am_zp_x      }, { 0xFB, "ISC", am_abs_y     },
+    { 0xFF, "ISC", am_abs_x     },
+    { 0x0B, "ANC", am_immediate }, { 0x2B, "ANC", am_immediate },
+    { 0x4B, "ALR", am_immediate }, { 0x6B, "ARR", am_immediate },
+    { 0x8B, "ANE", am_immediate }, { 0xAB, "LXA", am_immediate },
+    { 0xCB, "SBX", am_immediate }, { 0xEB, "SBC", am_immediate },
+    { 0x93, "SHA", am_ind_y     }, { 0x9F, "SHA", am_abs_y     },
+    { 0x9B, "TAS", am_abs_y     }, { 0x9C, "SHY", am_abs_x     },
+    { 0x9E, "SHX", am_abs_y     }, { 0xBB, "LAS", am_abs_y     },
+    { 0x1A, "NOP", am_implied   }, { 0x3A, "NOP", am_implied   },
+    { 0x5A, "NOP", am_implied   }, { 0x7A, "NOP", am_implied   },
+    { 0xDA, "NOP", am_implied   }, { 0xFA, "NOP", am_implied   },
+    { 0x80, "NOP", am_immediate }, { 0x82, "NOP", am_immediate },
+    { 0x89, "NOP", am_immediate }, { 0xC2, "NOP", am_immediate },
+    { 0xE2, "NOP", am_immediate },
+    { 0x04, "NOP", am_zp        }, { 0x44, "NOP", am_zp        },
+    { 0x64, "NOP", am_zp        },
+    { 0x14, "NOP", am_zp_x      }, { 0x34, "NOP", am_zp_x      },
+    { 0x54, "NOP", am_zp_x      }, { 0x74, "NOP", am_zp_x      },
+    { 0xD4, "NOP", am_zp_x      }, { 0xF4, "NOP", am_zp_x      },
+    { 0x0C, "NOP", am_abs       },
+    { 0x1C, "NOP", am_abs_x     }, { 0x3C, "NOP", am_abs_x     },
+    { 0x5C, "NOP", am_abs_x     }, { 0x7C, "NOP", am_abs_x     },
+    { 0xDC, "NOP", am_abs_x     }, { 0xFC, "NOP", am_abs_x     }
+};
+
+// The 65C02 also turns every remaining opcode into a NOP; those are added
+// by InstructionTable()
+static const ExtraInstruction cmos_extra[] = {
+    { 0x80, "BRA", am_rel       },
+    { 0xDA, "PHX", am_implied   }, { 0xFA, "PLX", am_implied   },
+    { 0x5A, "PHY", am_implied   }, { 0x7A, "PLY", am_implied   },
+    { 0x64, "STZ", am_zp        }, { 0x74, "STZ", am_zp_x      },
+    { 0x9C, "STZ", am_abs       }, { 0x9E, "STZ", am_abs_x     },
+    { 0x04, "TSB", am_zp        }, { 0x0C, "TSB", am_abs       },
+    { 0x14, "TRB", am_zp        }, { 0x1C, "TRB", am_abs       },
+    { 0x1A, "INC", am_acc       }, { 0x3A, "DEC", am_acc       },
+    { 0x89, "BIT", am_immediate }, { 0x34, "BIT", am_zp_x      },
+    { 0x3C, "BIT", am_abs_x     },
+    { 0x12, "ORA", am_zp_ind    }, { 0x32, "AND", am_zp_ind    },
+    { 0x52, "EOR", am_zp_ind    }, { 0x72, "ADC", am_zp_ind    },
+    { 0x92, "STA", am_zp_ind    }, { 0xB2, "LDA", am_zp_ind    },
+    { 0xD2, "CMP", am_zp_ind    }, { 0xF2, "SBC", am_zp_ind    },
+    { 0x7C, "JMP", am_abs_ind_x },
+    { 0x02, "NOP", am_immediate }, { 0x22, "NOP", am_immediate },
+    { 0x42, "NOP", am_immediate }, { 0x62, "NOP", am_immediate },
+    { 0x82, "NOP", am_immediate }, { 0xC2, "NOP", am_immediate },
+    { 0xE2, "NOP", am_immediate }, { 0x44, "NOP", am_zp        },
+    { 0x54, "NOP", am_zp_x      }, { 0xD4, "NOP", am_zp_x      },
+    { 0xF4, "NOP", am_zp_x      }, { 0x5C, "NOP", am_abs       },
+    { 0xDC, "NOP", am_abs       }, { 0xFC, "NOP", am_abs       }
+};
+
+static const ExtraInstruction wdc_extra[] = {
+    { 0x07, "RMB0", am_zp       }, { 0x17, "RMB1", am_zp       },
+    { 0x27, "RMB2", am_zp       }, { 0x37, "RMB3", am_zp       },
+    { 0x47, "RMB4", am_zp       }, { 0x57, "RMB5", am_zp       },
+    { 0x67, "RMB6", am_zp       }, { 0x77, "RMB7", am_zp       },
+    { 0x87, "SMB0", am_zp       }, { 0x97, "SMB1", am_zp       },
+    { 0xA7, "SMB2", am_zp       }, { 0xB7, "SMB3", am_zp       },
+    { 0xC7, "SMB4", am_zp       }, { 0xD7, "SMB5", am_zp       },
+    { 0xE7, "SMB6", am_zp       }, { 0xF7, "SMB7", am_zp       },
+    { 0x0F, "BBR0", am_zp_rel   }, { 0x1F, "BBR1", am_zp_rel   },
+    { 0x2F, "BBR2", am_zp_rel   }, { 0x3F, "BBR3", am_zp_rel   },
+    { 0x4F, "BBR4", am_zp_rel   }, { 0x5F, "BBR5", am_zp_rel   },
+    { 0x6F, "BBR6", am_zp_rel   }, { 0x7F, "BBR7", am_zp_rel   },
+    { 0x8F, "BBS0", am_zp_rel   }, { 0x9F, "BBS1", am_zp_rel   },
+    { 0xAF, "BBS2", am_zp_rel   }, { 0xBF, "BBS3", am_zp_rel   },
+    { 0xCF, "BBS4", am_zp_rel   }, { 0xDF, "BBS5", am_zp_rel   },
+    { 0xEF, "BBS6", am_zp_rel   }, { 0xFF, "BBS7", am_zp_rel   },
+    { 0xCB, "WAI", am_implied   }, { 0xDB, "STP", am_implied   }
 };
 
-CPU6502Impl::CPU6502Impl(CPU *cpu_, Memory *mem) :
-    reg_a(0),
-    reg_x(0),
-    reg_y(0),
-    reg_s(0),
-    reg_flags(0x20),
-    reg_pc(0),
-    emu_cycles(0),
+// Return the instruction table for the variant; built on first use
+const CPU6502Impl::Instruction *
+CPU6502Impl::InstructionTable(CPU6502::Variant variant)
+{
+    struct Table {
+        Instruction entries[256];
+        Table(CPU6502::Variant variant)
+        {
+            std::copy(documented, documented + 256, entries);
+            if (variant == CPU6502::nmos_undocumented) {
+                add(undocumented_extra, sizeof(undocumented_extra));
+            }
+            if (variant == CPU6502::cmos || variant == CPU6502::wdc) {
+                add(cmos_extra, sizeof(cmos_extra));
+                if (variant == CPU6502::wdc) {
+                    add(wdc_extra, sizeof(wdc_extra));
+                }
+                for (auto &entry : entries) {
+                    if (entry.addr_mode == am_invalid) {
+                        entry = Instruction{ "NOP", am_implied };
+                    }
+                }
+            }
+        }
+        void add(const ExtraInstruction *extra, std::size_t size)
+        {
+            for (std::size_t i = 0; i < size / sizeof(extra[0]); ++i) {
+                auto &entry = entries[extra[i].opcode];
+                std::memcpy(entry.name, extra[i].name, sizeof(entry.name));
+                entry.addr_mode = extra[i].addr_mode;
+            }
+        }
+    };
+    static const Table nmos_table(CPU6502::nmos);
+    static const Table undocumented_table(CPU6502::nmos_undocumented);
+    static const Table cmos_table(CPU6502::cmos);
+    static const Table wdc_table(CPU6502::wdc);
+
+    switch (variant) {
+    case CPU6502::nmos:
+    default:
+        return nmos_table.entries;
+    case CPU6502::nmos_undocumented:
+        return undocumented_table.entries;
+    case CPU6502::cmos:
+        return cmos_table.entries;
+    case CPU6502::wdc:
+        return wdc_table.entries;
+    }
+}
+
+CPU6502Impl::CPU6502Impl(CPU *cpu_, Memory *mem, CPU6502::Variant variant_) :
     cpu(cpu_),
-    memory(mem)
+    memory(mem),
+    operand(0),
+    break_stop(false),
+    profiling(false),
+    variant(variant_),
+    blocks(0x10000),
+    page_blocks(0x100),
+    code_bytes(0x10000),
+    code_written(false),
+    load_generation(mem->GetLoadGeneration()),
+    jit_enabled(false),
+    jit_threshold(16),
+    irq_line(false),
+    nmi_pending(false),
+    waiting(false),
+    end_cycle(ULONG_MAX),
+    deadline(ULONG_MAX),
+    tracing(false),
+    trace_sync(true),
+    trace_write_count(0),
+    instructions(InstructionTable(variant_))
 {
+    SelectExecute(false);
+#ifdef CPU6502_INSTRUMENT
+    ClearOpcodeCosts();
+#endif
 }
 
 CPU6502Impl::~CPU6502Impl(void)
 {
 }
 
+void
+CPU6502Impl::SelectExecute(bool traced)
+{
+    tracing = traced;
+    switch (variant) {
+    case CPU6502::nmos:
+    default:
+        execute = traced
+                ? &CPU6502Impl::ExecuteVariant<CPU6502::nmos, true>
+                : &CPU6502Impl::ExecuteVariant<CPU6502::nmos, false>;
+        break;
+    case CPU6502::nmos_undocumented:
+        execute = traced
+                ? &CPU6502Impl::ExecuteVariant<CPU6502::nmos_undocumented, true>
+                : &CPU6502Impl::ExecuteVariant<CPU6502::nmos_undocumented, false>;
+        break;
+    case CPU6502::cmos:
+        execute = traced
+                ? &CPU6502Impl::ExecuteVariant<CPU6502::cmos, true>
+                : &CPU6502Impl::ExecuteVariant<CPU6502::cmos, false>;
+        break;
+    case CPU6502::wdc:
+        execute = traced
+                ? &CPU6502Impl::ExecuteVariant<CPU6502::wdc, true>
+                : &CPU6502Impl::ExecuteVariant<CPU6502::wdc, false>;
+        break;
+    }
+}
+
 CPU::Disasm
 CPU6502Impl::Disassemble(std::uint64_t address) const
 {
@@ -733,831 +1602,3680 @@ CPU6502Impl::Disassemble(std::uint64_t address) const
         }
         count = 2;
         break;
+
+    case am_zp_ind:
+        std::snprintf(buf, sizeof(buf), " ($%02X)", memory->Peek8(address+1));
+        count = 2;
+        break;
+
+    case am_abs_ind_x:
+        std::snprintf(buf, sizeof(buf), " ($%02X%02X,X)",
+                memory->Peek8(address+2),
+                memory->Peek8(address+1));
+        count = 3;
+        break;
+
+    case am_zp_rel:
+        {
+            std::uint16_t offset = memory->Peek8(address+2);
+            offset = (offset ^ 0x80) - 0x80;
+            std::snprintf(buf, sizeof(buf), " $%02X,$%04X",
+                    memory->Peek8(address+1),
+                    static_cast<std::uint16_t>(address + 3 + offset));
+        }
+        count = 3;
+        break;
     }
 
     return CPU::Disasm(mnemonic + buf, count);
 }
 
-// Step through one instruction. Return true if the instruction was JSR, and
-// Next() should continue until a return
+// Step through one instruction, setting reason to why execution stopped after
+// it. Return true if the instruction was JSR, and Next() should continue
+// until a return
 bool
-CPU6502Impl::DoStep(void)
+CPU6502Impl::DoStep(CPU::StopReason& reason)
 {
-    std::uint8_t opcode = memory->Read8(reg_pc++);
-    auto handler = instructions[opcode].handler;
-    (this->*handler)(opcode);
-
     // Indicate to Next() whether to continue to a return
-    return opcode == 0x20; // JSR
+    bool jsr = memory->Peek8(reg_pc) == 0x20;
+    unsigned long done;
+    reason = Advance(1, ULONG_MAX, done);
+    return jsr;
 }
 
-bool
-CPU6502Impl::HasBreakpoint(void)
+// Execute up to count instructions, and set done to the number executed.
+// Execution stops early at a breakpoint, at an address in stop_at, before
+// BRK with break_stop set, or once emu_cycles reaches end_cycle; the
+// return value says which, or is stop_count if all count instructions were
+// executed. Scheduled events and interrupts are handled along the way.
+// With observed_, each instruction writes a trace record while tracing, and
+// none then runs as native code, and marks coverage while memory keeps it.
+template <CPU6502::Variant variant_, bool observed_>
+CPU::StopReason
+CPU6502Impl::ExecuteVariant(unsigned long count, unsigned long end_cycle_,
+                            unsigned long& done)
 {
-    auto pc = cpu->GetPC();
-    auto opcode = memory->Peek8(pc);
-    unsigned count = 1;
-    switch (instructions[opcode].addr_mode) {
-    case am_invalid:
-    case am_implied:
-    case am_acc:
-    default:
-        count = 1;
-        break;
+    if (!observed_ && memory->CoverageEnabled()) {
+        return ExecuteVariant<variant_, true>(count, end_cycle_, done);
+    }
+    bool covering = observed_ && memory->CoverageEnabled();
 
-    case am_immediate:
-    case am_zp_x:
-    case am_zp_y:
-    case am_zp:
-    case am_ind_x:
-    case am_ind_y:
-    case am_rel:
-        count = 2;
-        break;
+    end_cycle = end_cycle_;
+    UpdateDeadline();
+    if (emu_cycles >= deadline) {
+        TakeEvents();
+    }
 
-    case am_abs_x:
-    case am_abs_y:
-    case am_abs:
-    case am_ind:
-        count = 3;
-        break;
+    // Memory loaded from outside the CPU may have replaced cached code
+    CheckLoads();
+
+    // An instruction that throws has not executed, and the count so far
+    // goes out with the exception
+    unsigned long i = 0;
+    try {
+        while (i < count) {
+            Block *block = blocks[reg_pc].get();
+            if (block == nullptr) {
+                block = DecodeBlock(reg_pc);
+            }
+
+            // If an instruction writes over any cached code, the block may
+            // be gone; go back and look up the PC again
+            code_written = false;
+            std::size_t first = 0;
+
+#ifdef CPU6502_JIT
+            // Run the translated part of the block, unless it would overrun
+            // the count or the cycle limit, or pass a place to stop.
+            // Watchpoints must stop right after the instruction that hits
+            // them, and only the interpreter checks for that. Neither does
+            // translated code see CLI or PLP unmask a waiting IRQ, nor
+            // report calls and returns to a profile. A block whose pages
+            // stopped being plain memory during the run is left to the
+            // interpreter until the cache is flushed. Code that a device
+            // loads when translated code reads it goes once the block
+            // exits.
+            if (jit_enabled && !(observed_ && tracing)
+            &&  memory->IsPlainPage(block->start)
+            &&  memory->IsPlainPage(
+                    static_cast<std::uint16_t>(block->start + block->length - 1))) {
+                if (!block->translated && ++block->runs >= jit_threshold) {
+                    TranslateBlock(block);
+                }
+                if (block->native != nullptr
+                &&  count - i >= block->native_ops
+                &&  emu_cycles + block->native_ops * max_op_cycles <= deadline
+                &&  !cpu->HasBreakpoint(block->start, block->native_length)
+                &&  !HasStop(block->start, block->native_length)
+                &&  !memory->AnyWatchpoints()
+                &&  !irq_line
+                &&  !profiling) {
+                    // Coverage is marked from a copy of the instructions,
+                    // as code that they write over may take the block away
+                    Decoded ran[max_block_ops];
+                    std::uint16_t ran_start = block->start;
+                    if (covering) {
+                        std::copy(block->ops.begin(),
+                                  block->ops.begin() + block->native_ops, ran);
+                    }
+                    unsigned n = block->native(this);
+                    i += n;
+                    for (unsigned k = 0; covering && k < n; ++k) {
+                        memory->MarkExecuted(ran_start, ran[k].length);
+                        ran_start += ran[k].length;
+                    }
+                    // A stop at the exit counts even if the block wrote
+                    // over code and has to be looked up again
+                    auto reason = CheckStop();
+                    if (reason != CPU::stop_count) {
+                        done = i;
+                        return reason;
+                    }
+                    if (code_written) {
+                        continue;
+                    }
+                    first = n;
+                }
+            }
+#endif
+
+            for (auto op_i = first; op_i < block->ops.size() && i < count;
+                 ++op_i) {
+                const Decoded op = block->ops[op_i];
+                std::uint16_t pc = reg_pc;
+                reg_pc += op.length;
+                operand = op.operand;
+#ifdef CPU6502_INSTRUMENT
+                InstrumentedDispatch<variant_>(op.opcode);
+#else
+                Dispatch<variant_>(op.opcode);
+#endif
+                ++i;
+                if (observed_ && tracing) {
+                    TraceOp(pc, op);
+                }
+                if (covering) {
+                    memory->MarkExecuted(pc, op.length);
+                }
+                auto reason = CheckStop();
+                if (reason != CPU::stop_count) {
+                    done = i;
+                    return reason;
+                }
+                if (code_written) {
+                    break;
+                }
+            }
+        }
+    }
+    catch (...) {
+        done = i;
+        throw;
     }
+    done = i;
+    return CPU::stop_count;
+}
 
-    return cpu->HasBreakpoint(pc, count);
+// Return why execution should stop before the next instruction, or
+// stop_count if it should go on
+CPU::StopReason
+CPU6502Impl::CheckStop(void)
+{
+    // The deadline is never later than end_cycle
+    bool at_deadline = emu_cycles >= deadline;
+    if (at_deadline) {
+        TakeEvents();
+    }
+    // An event, or a device that the instruction read, may have loaded
+    // memory over cached code
+    CheckLoads();
+    if (memory->WatchTriggered()) {
+        return CPU::stop_watchpoint;
+    }
+    if (BreakpointHit()) {
+        return CPU::stop_breakpoint;
+    }
+    if (!stop_at.empty() && stop_at[reg_pc]) {
+        return CPU::stop_address;
+    }
+    if (break_stop && memory->Peek8(reg_pc) == 0x00) {
+        return CPU::stop_break;
+    }
+    if (at_deadline && emu_cycles >= end_cycle) {
+        return CPU::stop_cycles;
+    }
+    return CPU::stop_count;
 }
 
 void
-CPU6502Impl::do_invalid(std::uint8_t opcode)
+CPU6502Impl::UpdateDeadline(void)
 {
-    // Undocumented opcodes come here
-    --reg_pc;
-    char err[40];
-    std::snprintf(err, sizeof(err), "Undocumented opcode %02X", opcode);
-    throw CPUExcept(err);
+    if (nmi_pending || (irq_line && (reg_flags & 0x04) == 0)) {
+        deadline = 0;
+    } else {
+        deadline = std::min(end_cycle, cpu->NextEventCycle());
+    }
 }
 
+// Run the events that are due, then take any waiting interrupt
 void
-CPU6502Impl::do_ORA(std::uint8_t opcode)
+CPU6502Impl::TakeEvents(void)
 {
-    auto addr = GetAddress(opcode);
-    auto byte = memory->Read8(addr);
-    reg_a |= byte;
-    SetNZ(reg_a);
-    emu_cycles += 2;
+    cpu->RunEvents(emu_cycles);
+    if (nmi_pending) {
+        nmi_pending = false;
+        Interrupt(0xFFFA);
+    } else if (irq_line && (reg_flags & 0x04) == 0) {
+        Interrupt(0xFFFE);
+    }
+    UpdateDeadline();
 }
 
+// Push the PC and the flags, and jump through the vector at the given address
 void
-CPU6502Impl::do_AND(std::uint8_t opcode)
+CPU6502Impl::Interrupt(std::uint16_t vector)
 {
-    auto addr = GetAddress(opcode);
-    auto byte = memory->Read8(addr);
+    auto byte1 = memory->FastRead8(vector);
+    auto byte2 = memory->FastRead8(vector + 1);
+
+    // Return past a WAI that was waiting for this
+    if (waiting && memory->Peek8(reg_pc) == 0xCB) {
+        ++reg_pc;
+    }
+    waiting = false;
+
+    PushByte(reg_pc >> 8);
+    PushByte(reg_pc & 0xFF);
+    PushByte((PackFlags() & 0xEF) | 0x20);
+    reg_flags |= 0x04;
+    if (variant >= CPU6502::cmos) {
+        reg_flags &= 0xF7;
+    }
+    reg_pc = byte2 * 0x100 + byte1;
+    emu_cycles += 7;
+    code_written = true;
+    if (profiling) {
+        ProfileCall(reg_s + 3);
+    }
+}
+
+void
+CPU6502Impl::SetIRQ(bool asserted)
+{
+    RecordInput(asserted ? input_irq_on : input_irq_off);
+    irq_line = asserted;
+    if (asserted) {
+        // Take it if it is not masked; TakeEvents() checks
+        deadline = 0;
+    }
+}
+
+void
+CPU6502Impl::NMI(void)
+{
+    RecordInput(input_nmi);
+    nmi_pending = true;
+    deadline = 0;
+}
+
+void
+CPU6502Impl::Reset(void)
+{
+    RecordInput(input_reset);
+    auto byte1 = memory->FastRead8(0xFFFC);
+    auto byte2 = memory->FastRead8(0xFFFD);
+
+    // The stack pointer moves as for an interrupt, but nothing is written
+    reg_s -= 3;
+    reg_flags |= 0x04;
+    if (variant >= CPU6502::cmos) {
+        reg_flags &= 0xF7;
+    }
+    nmi_pending = false;
+    waiting = false;
+    reg_pc = byte2 * 0x100 + byte1;
+    emu_cycles += 7;
+    code_written = true;
+    UpdateDeadline();
+}
+
+std::shared_ptr<const void>
+CPU6502Impl::SaveState(void) const
+{
+    auto state = std::make_shared<State>();
+    static_cast<CPU6502Regs&>(*state) = *this;
+    state->irq_line = irq_line;
+    state->nmi_pending = nmi_pending;
+    state->waiting = waiting;
+    return state;
+}
+
+void
+CPU6502Impl::RestoreState(const void *state_)
+{
+    auto state = static_cast<const State *>(state_);
+    static_cast<CPU6502Regs&>(*this) = *state;
+    irq_line = state->irq_line;
+    nmi_pending = state->nmi_pending;
+    waiting = state->waiting;
+    code_written = true;
+    UpdateDeadline();
+    HistoryChanged(true);
+}
+
+// An event may be scheduled by an action, or by a memory access during an
+// instruction, and may be due sooner than the current deadline
+void
+CPU6502Impl::EventScheduled(unsigned long cycle)
+{
+    deadline = std::min(deadline, cycle);
+}
+
+// Return true if any of count bytes from addr is in stop_at
+bool
+CPU6502Impl::HasStop(std::uint16_t addr, unsigned count) const
+{
+    if (stop_at.empty()) {
+        return false;
+    }
+    for (unsigned i = 0; i < count; ++i) {
+        if (stop_at[static_cast<std::uint16_t>(addr + i)]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//                                 Tracing                                  //
+//////////////////////////////////////////////////////////////////////////////
+
+// Trace records, after the header line "cpusim-trace 6502 1", give the
+// instructions executed in order. Each holds what changed since the last:
+//     byte      bits 0-1: number of instruction bytes, 1 to 3
+//               bit 2: the PC follows; if not, the PC is the last one
+//                      plus the length of the last instruction
+//               bits 3-7: A, X, Y, S and P follow, where they changed
+//     byte      bits 0-4: cycles since the last record, or 31 if the
+//                      count follows
+//               bits 5-7: number of writes, or 7 if a count byte follows
+//     the instruction bytes
+//     the PC, low byte first
+//     A, X, Y, S and P, as flagged, with their values after the instruction
+//     the count of cycles, 8 bytes, low byte first
+//     the count byte of writes
+//     each write: the address, low byte first, then the byte written
+// The first record gives everything. Writes by an interrupt taken before an
+// instruction are part of its record, whose PC is then the vector's.
+static const char trace_header[] = "cpusim-trace 6502 1";
+
+void
+CPU6502Impl::StartTrace(const std::string& path)
+{
+    StopTrace();
+    trace.reset(new TraceWriter(path, trace_header));
+    trace_sync = true;
+    trace_write_count = 0;
+    SelectExecute(true);
+}
+
+void
+CPU6502Impl::StopTrace(void)
+{
+    if (trace) {
+        SelectExecute(false);
+        std::unique_ptr<TraceWriter> ending(std::move(trace));
+        ending->Finish();
+    }
+}
+
+// Write the record of the instruction at pc, which has just executed
+void
+CPU6502Impl::TraceOp(std::uint16_t pc, const Decoded& op)
+{
+    static_assert(2 + 3 + 2 + 5 + 8 + 1 + 3 * max_trace_writes
+                  <= TraceWriter::max_record, "trace record too long");
+    std::uint8_t regs[5] = { reg_a, reg_x, reg_y, reg_s, PackFlags() };
+    auto start = trace->Reserve();
+    auto p = start + 2;
+
+    unsigned flags = op.length;
+    *p++ = op.opcode;
+    if (op.length > 1) {
+        *p++ = op.operand & 0xFF;
+    }
+    if (op.length > 2) {
+        *p++ = op.operand >> 8;
+    }
+    if (trace_sync || pc != trace_pc) {
+        flags |= 0x04;
+        *p++ = pc & 0xFF;
+        *p++ = pc >> 8;
+    }
+    for (unsigned r = 0; r < 5; ++r) {
+        if (trace_sync || regs[r] != trace_regs[r]) {
+            flags |= 0x08 << r;
+            *p++ = regs[r];
+            trace_regs[r] = regs[r];
+        }
+    }
+
+    unsigned counts;
+    auto cycles = emu_cycles - trace_cycles;
+    if (!trace_sync && emu_cycles >= trace_cycles && cycles < 31) {
+        counts = cycles;
+    } else {
+        counts = 31;
+        for (unsigned b = 0; b < 8; ++b) {
+            *p++ = static_cast<std::uint64_t>(emu_cycles) >> (b * 8);
+        }
+    }
+    if (trace_write_count < 7) {
+        counts |= trace_write_count << 5;
+    } else {
+        counts |= 7 << 5;
+        *p++ = trace_write_count;
+    }
+    for (unsigned w = 0; w < trace_write_count; ++w) {
+        *p++ = trace_writes[w].addr & 0xFF;
+        *p++ = trace_writes[w].addr >> 8;
+        *p++ = trace_writes[w].byte;
+    }
+
+    start[0] = flags;
+    start[1] = counts;
+    trace->Commit(p);
+
+    trace_pc = pc + op.length;
+    trace_cycles = emu_cycles;
+    trace_write_count = 0;
+    trace_sync = false;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//                                Profiling                                 //
+//////////////////////////////////////////////////////////////////////////////
+
+// JSR, BRK and interrupts call the routine at the new PC
+void
+CPU6502Impl::ProfileCall(std::uint8_t return_s)
+{
+    profile->Call(reg_pc, return_s, emu_cycles);
+}
+
+// RTS and RTI return from any calls that they pop the return address of
+void
+CPU6502Impl::ProfileReturn(void)
+{
+    profile->Return(reg_s, emu_cycles);
+}
+
+#ifdef CPU6502_INSTRUMENT
+
+//////////////////////////////////////////////////////////////////////////////
+//                             Instrumentation                              //
+//////////////////////////////////////////////////////////////////////////////
+
+static inline std::uint64_t
+HostTicks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    // The fence keeps earlier instructions from running into the count
+    _mm_lfence();
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+template <CPU6502::Variant variant_>
+void
+CPU6502Impl::InstrumentedDispatch(std::uint8_t opcode)
+{
+    auto &stats = op_stats[opcode];
+    if (--sample_gap != 0) {
+        Dispatch<variant_>(opcode);
+        ++stats.count;
+        return;
+    }
+
+    auto start = HostTicks();
+    Dispatch<variant_>(opcode);
+    auto ticks = HostTicks() - start;
+    ++stats.count;
+    ++stats.sampled;
+    stats.ticks += (ticks > tick_overhead) ? ticks - tick_overhead : 0;
+
+    // Gaps of 1 to 32, from a xorshift generator, so that samples do not
+    // fall in step with loops
+    sample_seed ^= sample_seed << 13;
+    sample_seed ^= sample_seed >> 17;
+    sample_seed ^= sample_seed << 5;
+    sample_gap = 1 + (sample_seed & 31);
+}
+
+void
+CPU6502Impl::ClearOpcodeCosts(void)
+{
+    std::fill(op_stats, op_stats + 256, OpcodeStats{ 0, 0, 0 });
+    sample_gap = 1;
+    sample_seed = 2463534242u;
+
+    // The least time seen for reading the ticks twice
+    tick_overhead = ~std::uint64_t(0);
+    for (unsigned i = 0; i < 64; ++i) {
+        auto start = HostTicks();
+        tick_overhead = std::min(tick_overhead, HostTicks() - start);
+    }
+
+    start_ticks = HostTicks();
+    start_time = std::chrono::steady_clock::now();
+}
+
+std::vector<CPU6502::OpcodeCost>
+CPU6502Impl::GetOpcodeCosts(void) const
+{
+    std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start_time;
+    double ticks_per_second = (elapsed.count() > 0)
+                            ? (HostTicks() - start_ticks) / elapsed.count()
+                            : 1e9;
+
+    std::vector<CPU6502::OpcodeCost> costs;
+    for (unsigned op = 0; op < 256; ++op) {
+        auto const &stats = op_stats[op];
+        if (stats.count == 0) {
+            continue;
+        }
+        double seconds = 0;
+        if (stats.sampled != 0) {
+            seconds = static_cast<double>(stats.ticks) / stats.sampled
+                    * stats.count / ticks_per_second;
+        }
+        costs.push_back({ static_cast<std::uint8_t>(op), stats.count,
+                          seconds });
+    }
+    std::sort(costs.begin(), costs.end(),
+              [](const CPU6502::OpcodeCost& a, const CPU6502::OpcodeCost& b) {
+                  return a.seconds != b.seconds ? a.seconds > b.seconds
+                                                : a.count > b.count;
+              });
+    return costs;
+}
+
+#endif // CPU6502_INSTRUMENT
+
+//////////////////////////////////////////////////////////////////////////////
+//                            Execution history                             //
+//////////////////////////////////////////////////////////////////////////////
+
+bool
+CPU6502Impl::SetHistory(std::size_t budget, unsigned long interval)
+{
+    if (budget == 0) {
+        if (history && history->input_event != ULONG_MAX) {
+            cpu->CancelEvent(history->input_event);
+        }
+        memory->SetReadJournal(nullptr);
+        history.reset();
+        return false;
+    }
+    if (!history) {
+        history.reset(new History());
+        memory->SetReadJournal(&history->reads);
+    }
+    history->budget = budget;
+    history->interval = std::max(interval, 1UL);
+    while (history->bytes > budget && history->checkpoints.size() > 1) {
+        DropOldest();
+    }
+    return true;
+}
+
+// Execute() while keeping history: take a checkpoint every interval. Where
+// history already goes further, an event brings in the inputs that it
+// recorded.
+CPU::StopReason
+CPU6502Impl::Advance(unsigned long count, unsigned long end_cycle_,
+                     unsigned long& done)
+{
+    if (!history) {
+        return Execute(count, end_cycle_, done);
+    }
+
+    auto &h = *history;
+    if (h.changed || memory->GetLoadGeneration() != h.load_generation) {
+        // Go on from the state as it is now
+        DropFuture();
+        if (!h.checkpoints.empty()
+        &&  h.checkpoints.back().position == h.position) {
+            h.bytes -= h.checkpoints.back().bytes;
+            h.checkpoints.pop_back();
+        }
+        AddCheckpoint();
+        h.changed = false;
+    }
+
+    auto reason = CPU::stop_count;
+    unsigned long n = 0;
+    done = 0;
+    h.running = true;
+    try {
+        while (done < count) {
+            if (h.checkpoints.empty()
+            ||  h.checkpoints.back().position + h.interval <= h.position) {
+                AddCheckpoint();
+            }
+
+            // Stop at the next checkpoint, whether it is to be taken or is
+            // already there
+            auto next = std::upper_bound(h.checkpoints.begin(),
+                    h.checkpoints.end(), h.position,
+                    [](unsigned long pos, const History::Checkpoint& c) {
+                        return pos < c.position;
+                    });
+            auto next_position = (next != h.checkpoints.end())
+                               ? next->position
+                               : h.checkpoints.back().position + h.interval;
+            reason = Execute(std::min(count - done, next_position - h.position),
+                             end_cycle_, n);
+            done += n;
+            h.position += n;
+            n = 0;
+            if (reason != CPU::stop_count) {
+                break;
+            }
+        }
+        if (h.checkpoints.back().position + h.interval <= h.position) {
+            AddCheckpoint();
+        }
+    }
+    catch (...) {
+        done += n;
+        h.position += n;
+        h.running = false;
+        h.load_generation = memory->GetLoadGeneration();
+        throw;
+    }
+    h.running = false;
+    h.load_generation = memory->GetLoadGeneration();
+    return reason;
+}
+
+bool
+CPU6502Impl::StepBack(void)
+{
+    if (!history || history->position == 0) {
+        return false;
+    }
+
+    // The last checkpoint at or before the instruction to go back to
+    auto &h = *history;
+    auto target = h.position - 1;
+    auto p = std::upper_bound(h.checkpoints.begin(), h.checkpoints.end(),
+            target, [](unsigned long pos, const History::Checkpoint& c) {
+                return pos < c.position;
+            });
+    if (p == h.checkpoints.begin()) {
+        return false;
+    }
+    RestoreCheckpoint(p - 1 - h.checkpoints.begin());
+    Replay(target, nullptr);
+    return true;
+}
+
+// Look back through the checkpoints, newest first, for the last place
+// before this one where a breakpoint matches
+CPU::StopReason
+CPU6502Impl::ReverseContinue(void)
+{
+    if (!history || history->checkpoints.empty()) {
+        return CPU::stop_count;
+    }
+
+    // Stop at each instruction that a breakpoint may be on
+    stop_at.assign(0x10000, false);
+    for (unsigned addr = 0; addr < 0x10000; ++addr) {
+        if (cpu->HasBreakpoint(addr, 1)) {
+            for (unsigned k = 0; k < 3; ++k) {
+                stop_at[(addr - k) & 0xFFFF] = true;
+            }
+        }
+    }
+
+    auto &h = *history;
+    auto limit = h.position;
+    auto index = std::lower_bound(h.checkpoints.begin(), h.checkpoints.end(),
+            limit, [](const History::Checkpoint& c, unsigned long pos) {
+                return c.position < pos;
+            }) - h.checkpoints.begin();
+    unsigned long found = ULONG_MAX;
+    try {
+        while (index > 0 && found == ULONG_MAX) {
+            --index;
+            RestoreCheckpoint(index);
+            Replay(limit - 1, &found);
+            limit = h.checkpoints[index].position;
+        }
+    }
+    catch (...) {
+        stop_at.clear();
+        throw;
+    }
+    stop_at.clear();
+
+    if (found == ULONG_MAX) {
+        RestoreCheckpoint(0);
+        return CPU::stop_count;
+    }
+    RestoreCheckpoint(index);
+    Replay(found, nullptr);
+    return CPU::stop_breakpoint;
+}
+
+// The CPU or memory was changed from outside. The next run goes on from
+// the new state; if it moved the cycle count, as restoring a snapshot or
+// clearing the count does, history before it no longer fits, and is dropped.
+void
+CPU6502Impl::HistoryChanged(bool restart)
+{
+    if (!history || history->replaying) {
+        return;
+    }
+    auto &h = *history;
+    h.changed = true;
+    if (restart) {
+        h.checkpoints.clear();
+        h.inputs.clear();
+        h.inputs_dropped = 0;
+        h.reads.bytes.clear();
+        h.reads.next = 0;
+        h.reads_dropped = 0;
+        h.reads_counted = 0;
+        h.bytes = 0;
+        h.position = 0;
+        h.next_input = 0;
+        ScheduleInput();
+    }
+}
+
+// Take a checkpoint here, and drop the oldest ones beyond the budget. The
+// newest checkpoint is always kept.
+void
+CPU6502Impl::AddCheckpoint(void)
+{
+    auto &h = *history;
+    History::Checkpoint checkpoint;
+    checkpoint.position = h.position;
+    checkpoint.bytes = sizeof(checkpoint) + sizeof(State)
+                     + memory->GetSnapshotCost();
+    checkpoint.snapshot = cpu->TakeSnapshot();
+    checkpoint.first_input = h.inputs_dropped + h.inputs.size();
+    checkpoint.first_read = h.reads_dropped + h.reads.next;
+    h.checkpoints.push_back(checkpoint);
+    h.bytes += checkpoint.bytes;
+    h.bytes += h.reads.bytes.size() - h.reads_counted;
+    h.reads_counted = h.reads.bytes.size();
+    while (h.bytes > h.budget && h.checkpoints.size() > 1) {
+        DropOldest();
+    }
+}
+
+// The oldest checkpoint goes, with the inputs that only it needed. Its
+// pages that the next one shares stay, so this is an estimate; the error
+// is at most one copy of memory.
+void
+CPU6502Impl::DropOldest(void)
+{
+    auto &h = *history;
+    h.bytes -= h.checkpoints.front().bytes;
+    h.checkpoints.pop_front();
+    while (h.inputs_dropped < h.checkpoints.front().first_input) {
+        h.inputs.pop_front();
+        ++h.inputs_dropped;
+        h.bytes -= sizeof(History::Input);
+        if (h.next_input > 0) {
+            --h.next_input;
+        }
+    }
+    while (h.reads_dropped < h.checkpoints.front().first_read) {
+        h.reads.bytes.pop_front();
+        ++h.reads_dropped;
+        if (h.reads_counted > 0) {
+            --h.reads_counted;
+            --h.bytes;
+        }
+        if (h.reads.next > 0) {
+            --h.reads.next;
+        }
+    }
+}
+
+// Forget history after the current instruction, as what happens next
+// will differ from it
+void
+CPU6502Impl::DropFuture(void)
+{
+    auto &h = *history;
+    while (!h.checkpoints.empty()
+    &&     h.checkpoints.back().position > h.position) {
+        h.bytes -= h.checkpoints.back().bytes;
+        h.checkpoints.pop_back();
+    }
+    while (h.inputs.size() > h.next_input) {
+        h.inputs.pop_back();
+        h.bytes -= sizeof(History::Input);
+    }
+    h.reads.bytes.resize(h.reads.next);
+    if (h.reads_counted > h.reads.next) {
+        h.bytes -= h.reads_counted - h.reads.next;
+        h.reads_counted = h.reads.next;
+    }
+    ScheduleInput();
+}
+
+void
+CPU6502Impl::RestoreCheckpoint(std::size_t index)
+{
+    auto &h = *history;
+    auto const &checkpoint = h.checkpoints[index];
+    h.replaying = true;
+    cpu->RestoreSnapshot(*checkpoint.snapshot);
+    h.replaying = false;
+    h.position = checkpoint.position;
+    h.next_input = checkpoint.first_input - h.inputs_dropped;
+    h.reads.next = checkpoint.first_read - h.reads_dropped;
+    h.load_generation = memory->GetLoadGeneration();
+    h.changed = false;
+    ScheduleInput();
+}
+
+// Execute forward again to target, as history recorded it, without
+// stopping at breakpoints or watchpoints. If found is not null, set it to
+// the last position on the way, from where this starts, at which a
+// breakpoint matches; stop_at then holds the places to look.
+void
+CPU6502Impl::Replay(unsigned long target, unsigned long *found)
+{
+    auto &h = *history;
+    h.replaying = true;
+    cpu->HideBreakpoints(true);
+    SelectExecute(false);
+    bool was_profiling = profiling;
+    profiling = false;
+    try {
+        while (true) {
+            if (found != nullptr && !stop_at.empty() && stop_at[reg_pc]) {
+                auto opcode = memory->Peek8(reg_pc);
+                if (cpu->BreakpointMatches(reg_pc,
+                        Length(instructions[opcode].addr_mode))) {
+                    *found = h.position;
+                }
+            }
+            if (h.position >= target) {
+                break;
+            }
+            unsigned long n;
+            Execute(target - h.position, ULONG_MAX, n);
+            h.position += n;
+            memory->ResetWatchHit();
+        }
+    }
+    catch (...) {
+        profiling = was_profiling;
+        SelectExecute(trace != nullptr);
+        cpu->HideBreakpoints(false);
+        h.replaying = false;
+        throw;
+    }
+    profiling = was_profiling;
+    SelectExecute(trace != nullptr);
+    cpu->HideBreakpoints(false);
+    h.replaying = false;
+    h.load_generation = memory->GetLoadGeneration();
+}
+
+// Schedule an event for the next input in the journal, if any, so that
+// it comes in as it did: with the other events of its cycle, before any
+// interrupt is taken
+void
+CPU6502Impl::ScheduleInput(void)
+{
+    auto &h = *history;
+    if (h.input_event != ULONG_MAX) {
+        cpu->CancelEvent(h.input_event);
+        h.input_event = ULONG_MAX;
+    }
+    if (h.next_input < h.inputs.size()) {
+        h.input_event = cpu->ScheduleEvent(h.inputs[h.next_input].cycle,
+                [this](CPU *) {
+                    history->input_event = ULONG_MAX;
+                    ApplyInputs();
+                    ScheduleInput();
+                });
+    }
+}
+
+// Bring in the inputs of the journal that are due
+void
+CPU6502Impl::ApplyInputs(void)
+{
+    auto &h = *history;
+    bool replaying = h.replaying;
+    h.replaying = true;
+    while (h.next_input < h.inputs.size()
+    &&     h.inputs[h.next_input].cycle <= emu_cycles) {
+        switch (h.inputs[h.next_input++].kind) {
+        case input_irq_off:
+            SetIRQ(false);
+            break;
+        case input_irq_on:
+            SetIRQ(true);
+            break;
+        case input_nmi:
+            NMI();
+            break;
+        case input_reset:
+            Reset();
+            break;
+        }
+    }
+    h.replaying = replaying;
+}
+
+// An interrupt input has come. During a run it goes in the journal, and any
+// history recorded beyond here no longer holds; at other times, it changes
+// the CPU from outside.
+void
+CPU6502Impl::RecordInput(InputKind kind)
+{
+    if (!history || history->replaying) {
+        return;
+    }
+    auto &h = *history;
+    if (!h.running) {
+        h.changed = true;
+        return;
+    }
+    DropFuture();
+    h.inputs.push_back({ emu_cycles, kind });
+    h.next_input = h.inputs.size();
+    h.bytes += sizeof(History::Input);
+}
+
+// Execute one decoded instruction; the PC has already advanced past it.
+//
+// Each case calls a handler instantiated for its addressing mode, so that the
+// operand address is computed without consulting the instruction table.
+// Likewise each variant has its own instantiation, in which the differences
+// between variants are settled at compile time.
+template <CPU6502::Variant variant_>
+void
+CPU6502Impl::Dispatch(std::uint8_t opcode)
+{
+    constexpr bool cmos = variant_ >= CPU6502::cmos;
+    // The 65C02 takes the extra cycle for abs,X shifts only on a page
+    // crossing
+    constexpr Access shift_x = cmos ? acc_read : acc_write;
+
+    switch (opcode) {
+    case 0x00: do_BRK<cmos>(); break;
+    case 0x01: do_ORA<am_ind_x>(); break;
+    case 0x05: do_ORA<am_zp>(); break;
+    case 0x06: do_ASL<am_zp>(); break;
+    case 0x08: do_PHP(); break;
+    case 0x09: do_ORA<am_immediate>(); break;
+    case 0x0A: do_ASL_A(); break;
+    case 0x0D: do_ORA<am_abs>(); break;
+    case 0x0E: do_ASL<am_abs>(); break;
+    case 0x10: do_branch<0x80, false>(); break;
+    case 0x11: do_ORA<am_ind_y>(); break;
+    case 0x15: do_ORA<am_zp_x>(); break;
+    case 0x16: do_ASL<am_zp_x>(); break;
+    case 0x18: do_CLC(); break;
+    case 0x19: do_ORA<am_abs_y>(); break;
+    case 0x1D: do_ORA<am_abs_x>(); break;
+    case 0x1E: do_ASL<am_abs_x, shift_x>(); break;
+    case 0x20: do_JSR(); break;
+    case 0x21: do_AND<am_ind_x>(); break;
+    case 0x24: do_BIT<am_zp>(); break;
+    case 0x25: do_AND<am_zp>(); break;
+    case 0x26: do_ROL<am_zp>(); break;
+    case 0x28: do_PLP(); break;
+    case 0x29: do_AND<am_immediate>(); break;
+    case 0x2A: do_ROL_A(); break;
+    case 0x2C: do_BIT<am_abs>(); break;
+    case 0x2D: do_AND<am_abs>(); break;
+    case 0x2E: do_ROL<am_abs>(); break;
+    case 0x30: do_branch<0x80, true>(); break;
+    case 0x31: do_AND<am_ind_y>(); break;
+    case 0x35: do_AND<am_zp_x>(); break;
+    case 0x36: do_ROL<am_zp_x>(); break;
+    case 0x38: do_SEC(); break;
+    case 0x39: do_AND<am_abs_y>(); break;
+    case 0x3D: do_AND<am_abs_x>(); break;
+    case 0x3E: do_ROL<am_abs_x, shift_x>(); break;
+    case 0x40: do_RTI(); break;
+    case 0x41: do_EOR<am_ind_x>(); break;
+    case 0x45: do_EOR<am_zp>(); break;
+    case 0x46: do_LSR<am_zp>(); break;
+    case 0x48: do_PHA(); break;
+    case 0x49: do_EOR<am_immediate>(); break;
+    case 0x4A: do_LSR_A(); break;
+    case 0x4C: do_JMP_abs(); break;
+    case 0x4D: do_EOR<am_abs>(); break;
+    case 0x4E: do_LSR<am_abs>(); break;
+    case 0x50: do_branch<0x40, false>(); break;
+    case 0x51: do_EOR<am_ind_y>(); break;
+    case 0x55: do_EOR<am_zp_x>(); break;
+    case 0x56: do_LSR<am_zp_x>(); break;
+    case 0x58: do_CLI(); break;
+    case 0x59: do_EOR<am_abs_y>(); break;
+    case 0x5D: do_EOR<am_abs_x>(); break;
+    case 0x5E: do_LSR<am_abs_x, shift_x>(); break;
+    case 0x60: do_RTS(); break;
+    case 0x61: do_ADC<am_ind_x, cmos>(); break;
+    case 0x65: do_ADC<am_zp, cmos>(); break;
+    case 0x66: do_ROR<am_zp>(); break;
+    case 0x68: do_PLA(); break;
+    case 0x69: do_ADC<am_immediate, cmos>(); break;
+    case 0x6A: do_ROR_A(); break;
+    case 0x6C: do_JMP_ind<cmos>(); break;
+    case 0x6D: do_ADC<am_abs, cmos>(); break;
+    case 0x6E: do_ROR<am_abs>(); break;
+    case 0x70: do_branch<0x40, true>(); break;
+    case 0x71: do_ADC<am_ind_y, cmos>(); break;
+    case 0x75: do_ADC<am_zp_x, cmos>(); break;
+    case 0x76: do_ROR<am_zp_x>(); break;
+    case 0x78: do_SEI(); break;
+    case 0x79: do_ADC<am_abs_y, cmos>(); break;
+    case 0x7D: do_ADC<am_abs_x, cmos>(); break;
+    case 0x7E: do_ROR<am_abs_x, shift_x>(); break;
+    case 0x81: do_STA<am_ind_x>(); break;
+    case 0x84: do_STY<am_zp>(); break;
+    case 0x85: do_STA<am_zp>(); break;
+    case 0x86: do_STX<am_zp>(); break;
+    case 0x88: do_DEY(); break;
+    case 0x8A: do_TXA(); break;
+    case 0x8C: do_STY<am_abs>(); break;
+    case 0x8D: do_STA<am_abs>(); break;
+    case 0x8E: do_STX<am_abs>(); break;
+    case 0x90: do_branch<0x01, false>(); break;
+    case 0x91: do_STA<am_ind_y>(); break;
+    case 0x94: do_STY<am_zp_x>(); break;
+    case 0x95: do_STA<am_zp_x>(); break;
+    case 0x96: do_STX<am_zp_y>(); break;
+    case 0x98: do_TYA(); break;
+    case 0x99: do_STA<am_abs_y>(); break;
+    case 0x9A: do_TXS(); break;
+    case 0x9D: do_STA<am_abs_x>(); break;
+    case 0xA0: do_LDY<am_immediate>(); break;
+    case 0xA1: do_LDA<am_ind_x>(); break;
+    case 0xA2: do_LDX<am_immediate>(); break;
+    case 0xA4: do_LDY<am_zp>(); break;
+    case 0xA5: do_LDA<am_zp>(); break;
+    case 0xA6: do_LDX<am_zp>(); break;
+    case 0xA8: do_TAY(); break;
+    case 0xA9: do_LDA<am_immediate>(); break;
+    case 0xAA: do_TAX(); break;
+    case 0xAC: do_LDY<am_abs>(); break;
+    case 0xAD: do_LDA<am_abs>(); break;
+    case 0xAE: do_LDX<am_abs>(); break;
+    case 0xB0: do_branch<0x01, true>(); break;
+    case 0xB1: do_LDA<am_ind_y>(); break;
+    case 0xB4: do_LDY<am_zp_x>(); break;
+    case 0xB5: do_LDA<am_zp_x>(); break;
+    case 0xB6: do_LDX<am_zp_y>(); break;
+    case 0xB8: do_CLV(); break;
+    case 0xB9: do_LDA<am_abs_y>(); break;
+    case 0xBA: do_TSX(); break;
+    case 0xBC: do_LDY<am_abs_x>(); break;
+    case 0xBD: do_LDA<am_abs_x>(); break;
+    case 0xBE: do_LDX<am_abs_y>(); break;
+    case 0xC0: do_CPY<am_immediate>(); break;
+    case 0xC1: do_CMP<am_ind_x>(); break;
+    case 0xC4: do_CPY<am_zp>(); break;
+    case 0xC5: do_CMP<am_zp>(); break;
+    case 0xC6: do_DEC<am_zp>(); break;
+    case 0xC8: do_INY(); break;
+    case 0xC9: do_CMP<am_immediate>(); break;
+    case 0xCA: do_DEX(); break;
+    case 0xCC: do_CPY<am_abs>(); break;
+    case 0xCD: do_CMP<am_abs>(); break;
+    case 0xCE: do_DEC<am_abs>(); break;
+    case 0xD0: do_branch<0x02, false>(); break;
+    case 0xD1: do_CMP<am_ind_y>(); break;
+    case 0xD5: do_CMP<am_zp_x>(); break;
+    case 0xD6: do_DEC<am_zp_x>(); break;
+    case 0xD8: do_CLD(); break;
+    case 0xD9: do_CMP<am_abs_y>(); break;
+    case 0xDD: do_CMP<am_abs_x>(); break;
+    case 0xDE: do_DEC<am_abs_x>(); break;
+    case 0xE0: do_CPX<am_immediate>(); break;
+    case 0xE1: do_SBC<am_ind_x, cmos>(); break;
+    case 0xE4: do_CPX<am_zp>(); break;
+    case 0xE5: do_SBC<am_zp, cmos>(); break;
+    case 0xE6: do_INC<am_zp>(); break;
+    case 0xE8: do_INX(); break;
+    case 0xE9: do_SBC<am_immediate, cmos>(); break;
+    case 0xEA: do_NOP(); break;
+    case 0xEC: do_CPX<am_abs>(); break;
+    case 0xED: do_SBC<am_abs, cmos>(); break;
+    case 0xEE: do_INC<am_abs>(); break;
+    case 0xF0: do_branch<0x02, true>(); break;
+    case 0xF1: do_SBC<am_ind_y, cmos>(); break;
+    case 0xF5: do_SBC<am_zp_x, cmos>(); break;
+    case 0xF6: do_INC<am_zp_x>(); break;
+    case 0xF8: do_SED(); break;
+    case 0xF9: do_SBC<am_abs_y, cmos>(); break;
+    case 0xFD: do_SBC<am_abs_x, cmos>(); break;
+    case 0xFE: do_INC<am_abs_x>(); break;
+    default:
+        if constexpr (variant_ == CPU6502::nmos_undocumented) {
+            DispatchUndocumented(opcode);
+        } else if constexpr (cmos) {
+            DispatchCMOS<variant_>(opcode);
+        } else {
+            do_invalid(opcode);
+        }
+        break;
+    }
+}
+
+// Opcodes that the NMOS 6502 does not document
+void
+CPU6502Impl::DispatchUndocumented(std::uint8_t opcode)
+{
+    switch (opcode) {
+    case 0x03: do_SLO<am_ind_x>(); break;
+    case 0x07: do_SLO<am_zp>(); break;
+    case 0x0F: do_SLO<am_abs>(); break;
+    case 0x13: do_SLO<am_ind_y>(); break;
+    case 0x17: do_SLO<am_zp_x>(); break;
+    case 0x1B: do_SLO<am_abs_y>(); break;
+    case 0x1F: do_SLO<am_abs_x>(); break;
+    case 0x23: do_RLA<am_ind_x>(); break;
+    case 0x27: do_RLA<am_zp>(); break;
+    case 0x2F: do_RLA<am_abs>(); break;
+    case 0x33: do_RLA<am_ind_y>(); break;
+    case 0x37: do_RLA<am_zp_x>(); break;
+    case 0x3B: do_RLA<am_abs_y>(); break;
+    case 0x3F: do_RLA<am_abs_x>(); break;
+    case 0x43: do_SRE<am_ind_x>(); break;
+    case 0x47: do_SRE<am_zp>(); break;
+    case 0x4F: do_SRE<am_abs>(); break;
+    case 0x53: do_SRE<am_ind_y>(); break;
+    case 0x57: do_SRE<am_zp_x>(); break;
+    case 0x5B: do_SRE<am_abs_y>(); break;
+    case 0x5F: do_SRE<am_abs_x>(); break;
+    case 0x63: do_RRA<am_ind_x>(); break;
+    case 0x67: do_RRA<am_zp>(); break;
+    case 0x6F: do_RRA<am_abs>(); break;
+    case 0x73: do_RRA<am_ind_y>(); break;
+    case 0x77: do_RRA<am_zp_x>(); break;
+    case 0x7B: do_RRA<am_abs_y>(); break;
+    case 0x7F: do_RRA<am_abs_x>(); break;
+    case 0x83: do_SAX<am_ind_x>(); break;
+    case 0x87: do_SAX<am_zp>(); break;
+    case 0x8F: do_SAX<am_abs>(); break;
+    case 0x97: do_SAX<am_zp_y>(); break;
+    case 0xA3: do_LAX<am_ind_x>(); break;
+    case 0xA7: do_LAX<am_zp>(); break;
+    case 0xAF: do_LAX<am_abs>(); break;
+    case 0xB3: do_LAX<am_ind_y>(); break;
+    case 0xB7: do_LAX<am_zp_y>(); break;
+    case 0xBF: do_LAX<am_abs_y>(); break;
+    case 0xC3: do_DCP<am_ind_x>(); break;
+    case 0xC7: do_DCP<am_zp>(); break;
+    case 0xCF: do_DCP<am_abs>(); break;
+    case 0xD3: do_DCP<am_ind_y>(); break;
+    case 0xD7: do_DCP<am_zp_x>(); break;
+    case 0xDB: do_DCP<am_abs_y>(); break;
+    case 0xDF: do_DCP<am_abs_x>(); break;
+    case 0xE3: do_ISC<am_ind_x>(); break;
+    case 0xE7: do_ISC<am_zp>(); break;
+    case 0xEF: do_ISC<am_abs>(); break;
+    case 0xF3: do_ISC<am_ind_y>(); break;
+    case 0xF7: do_ISC<am_zp_x>(); break;
+    case 0xFB: do_ISC<am_abs_y>(); break;
+    case 0xFF: do_ISC<am_abs_x>(); break;
+    case 0x0B: case 0x2B: do_ANC(); break;
+    case 0x4B: do_ALR(); break;
+    case 0x6B: do_ARR(); break;
+    case 0x8B: do_ANE(); break;
+    case 0xAB: do_LXA(); break;
+    case 0xCB: do_SBX(); break;
+    case 0xEB: do_SBC<am_immediate>(); break;
+    case 0x93: do_SHA<am_ind_y>(); break;
+    case 0x9F: do_SHA<am_abs_y>(); break;
+    case 0x9B: do_TAS(); break;
+    case 0x9C: do_SHY(); break;
+    case 0x9E: do_SHX(); break;
+    case 0xBB: do_LAS(); break;
+    case 0x1A: case 0x3A: case 0x5A: case 0x7A: case 0xDA: case 0xFA:
+        do_NOP();
+        break;
+    case 0x80: case 0x82: case 0x89: case 0xC2: case 0xE2:
+        do_NOP_operand<am_immediate>();
+        break;
+    case 0x04: case 0x44: case 0x64:
+        do_NOP_operand<am_zp>();
+        break;
+    case 0x14: case 0x34: case 0x54: case 0x74: case 0xD4: case 0xF4:
+        do_NOP_operand<am_zp_x>();
+        break;
+    case 0x0C:
+        do_NOP_operand<am_abs>();
+        break;
+    case 0x1C: case 0x3C: case 0x5C: case 0x7C: case 0xDC: case 0xFC:
+        do_NOP_operand<am_abs_x>();
+        break;
+    default: do_JAM(opcode); break;
+    }
+}
+
+// Opcodes that the 65C02 adds
+template <CPU6502::Variant variant_>
+void
+CPU6502Impl::DispatchCMOS(std::uint8_t opcode)
+{
+    if constexpr (variant_ == CPU6502::wdc) {
+        switch (opcode) {
+        case 0x07: do_RMB<0>(); return;
+        case 0x17: do_RMB<1>(); return;
+        case 0x27: do_RMB<2>(); return;
+        case 0x37: do_RMB<3>(); return;
+        case 0x47: do_RMB<4>(); return;
+        case 0x57: do_RMB<5>(); return;
+        case 0x67: do_RMB<6>(); return;
+        case 0x77: do_RMB<7>(); return;
+        case 0x87: do_SMB<0>(); return;
+        case 0x97: do_SMB<1>(); return;
+        case 0xA7: do_SMB<2>(); return;
+        case 0xB7: do_SMB<3>(); return;
+        case 0xC7: do_SMB<4>(); return;
+        case 0xD7: do_SMB<5>(); return;
+        case 0xE7: do_SMB<6>(); return;
+        case 0xF7: do_SMB<7>(); return;
+        case 0x0F: do_BBR<0>(); return;
+        case 0x1F: do_BBR<1>(); return;
+        case 0x2F: do_BBR<2>(); return;
+        case 0x3F: do_BBR<3>(); return;
+        case 0x4F: do_BBR<4>(); return;
+        case 0x5F: do_BBR<5>(); return;
+        case 0x6F: do_BBR<6>(); return;
+        case 0x7F: do_BBR<7>(); return;
+        case 0x8F: do_BBS<0>(); return;
+        case 0x9F: do_BBS<1>(); return;
+        case 0xAF: do_BBS<2>(); return;
+        case 0xBF: do_BBS<3>(); return;
+        case 0xCF: do_BBS<4>(); return;
+        case 0xDF: do_BBS<5>(); return;
+        case 0xEF: do_BBS<6>(); return;
+        case 0xFF: do_BBS<7>(); return;
+        case 0xCB: do_WAI(); return;
+        case 0xDB: do_STP(); return;
+        default: break;
+        }
+    }
+
+    switch (opcode) {
+    case 0x80: do_branch<0x00, false>(); break;
+    case 0xDA: do_PHX(); break;
+    case 0xFA: do_PLX(); break;
+    case 0x5A: do_PHY(); break;
+    case 0x7A: do_PLY(); break;
+    case 0x64: do_STZ<am_zp>(); break;
+    case 0x74: do_STZ<am_zp_x>(); break;
+    case 0x9C: do_STZ<am_abs>(); break;
+    case 0x9E: do_STZ<am_abs_x>(); break;
+    case 0x04: do_TSB<am_zp>(); break;
+    case 0x0C: do_TSB<am_abs>(); break;
+    case 0x14: do_TRB<am_zp>(); break;
+    case 0x1C: do_TRB<am_abs>(); break;
+    case 0x1A: do_INC_A(); break;
+    case 0x3A: do_DEC_A(); break;
+    case 0x89: do_BIT_imm(); break;
+    case 0x34: do_BIT<am_zp_x>(); break;
+    case 0x3C: do_BIT<am_abs_x>(); break;
+    case 0x12: do_ORA<am_zp_ind>(); break;
+    case 0x32: do_AND<am_zp_ind>(); break;
+    case 0x52: do_EOR<am_zp_ind>(); break;
+    case 0x72: do_ADC<am_zp_ind, true>(); break;
+    case 0x92: do_STA<am_zp_ind>(); break;
+    case 0xB2: do_LDA<am_zp_ind>(); break;
+    case 0xD2: do_CMP<am_zp_ind>(); break;
+    case 0xF2: do_SBC<am_zp_ind, true>(); break;
+    case 0x7C: do_JMP_abs_x(); break;
+    case 0x02: case 0x22: case 0x42: case 0x62: case 0x82: case 0xC2: case 0xE2:
+        do_NOP_operand<am_immediate>();
+        break;
+    case 0x44:
+        do_NOP_operand<am_zp>();
+        break;
+    case 0x54: case 0xD4: case 0xF4:
+        do_NOP_operand<am_zp_x>();
+        break;
+    case 0x5C:
+        // Reads a word from an odd place, over eight cycles
+        do_NOP_operand<am_abs>();
+        emu_cycles += 4;
+        break;
+    case 0xDC: case 0xFC:
+        do_NOP_operand<am_abs>();
+        break;
+    default:
+        // The rest are one byte long and take one cycle
+        do_NOP1();
+        break;
+    }
+}
+
+// Decode instructions from start until one that can change the flow of
+// control, and add the block to the cache
+CPU6502Impl::Block *
+CPU6502Impl::DecodeBlock(std::uint16_t start)
+{
+    if (!PlainCode(start)) {
+        return DecodeUncached(start);
+    }
+
+    std::unique_ptr<Block> block(new Block);
+    block->start = start;
+    block->length = 0;
+    block->native = nullptr;
+    block->native_ops = 0;
+    block->native_length = 0;
+    block->runs = 0;
+    block->translated = false;
+
+    std::uint16_t addr = start;
+    while (block->ops.size() < max_block_ops) {
+        // Stop short of an instruction that reaches off plain memory
+        if (!PlainCode(addr)) {
+            break;
+        }
+        Decoded op;
+        op.opcode = memory->Peek8(addr);
+        auto mode = instructions[op.opcode].addr_mode;
+        op.length = Length(mode);
+        op.operand = 0;
+        if (op.length >= 2) {
+            op.operand = memory->Peek8(static_cast<std::uint16_t>(addr + 1));
+        }
+        if (op.length >= 3) {
+            op.operand |= memory->Peek8(static_cast<std::uint16_t>(addr + 2)) << 8;
+        }
+        block->ops.push_back(op);
+        block->length += op.length;
+        addr += op.length;
+
+        bool ends_block;
+        switch (op.opcode) {
+        case 0x00: // BRK
+        case 0x20: // JSR
+        case 0x40: // RTI
+        case 0x4C: // JMP abs
+        case 0x60: // RTS
+        case 0x6C: // JMP ind
+            ends_block = true;
+            break;
+
+        case 0xCB: // WAI, which repeats until an interrupt
+            ends_block = variant == CPU6502::wdc;
+            break;
+
+        default:
+            ends_block = mode == am_rel || mode == am_invalid
+                      || mode == am_abs_ind_x || mode == am_zp_rel;
+            break;
+        }
+        if (ends_block) {
+            break;
+        }
+    }
+
+    // Mark the bytes and pages that the block covers
+    unsigned last_page = 0x100;
+    for (unsigned i = 0; i < block->length; ++i) {
+        std::uint16_t a = start + i;
+        if (code_bytes[a] < 0xFF) {
+            ++code_bytes[a];
+        }
+        if ((a >> 8) != last_page) {
+            last_page = a >> 8;
+            page_blocks[last_page].push_back(start);
+            memory->MarkCodePage(a);
+        }
+    }
+
+    blocks[start] = std::move(block);
+    return blocks[start].get();
+}
+
+// Reading a device may have effects, and give something different each
+// time; so may a page that a subclass of Memory handles. An instruction
+// with any byte on such a page, or on an unmapped one, is read through
+// FastRead8 each time that it runs, as a block of its own that is not
+// cached.
+CPU6502Impl::Block *
+CPU6502Impl::DecodeUncached(std::uint16_t start)
+{
+    Decoded op;
+    op.opcode = memory->FastRead8(start);
+    op.length = Length(instructions[op.opcode].addr_mode);
+    op.operand = 0;
+    if (op.length >= 2) {
+        op.operand = memory->FastRead8(static_cast<std::uint16_t>(start + 1));
+    }
+    if (op.length >= 3) {
+        op.operand |= memory->FastRead8(static_cast<std::uint16_t>(start + 2)) << 8;
+    }
+
+    uncached.start = start;
+    uncached.length = op.length;
+    uncached.ops.assign(1, op);
+    uncached.native = nullptr;
+    uncached.native_ops = 0;
+    uncached.native_length = 0;
+    uncached.runs = 0;
+    uncached.translated = true;     // Never to be translated
+    return &uncached;
+}
+
+// Whether every byte of the instruction at addr is on plain memory
+bool
+CPU6502Impl::PlainCode(std::uint16_t addr) const
+{
+    if (!memory->IsPlainPage(addr)) {
+        return false;
+    }
+    auto length = Length(instructions[memory->Peek8(addr)].addr_mode);
+    return memory->IsPlainPage(static_cast<std::uint16_t>(addr + length - 1));
+}
+
+// Remove any blocks that contain the given address
+void
+CPU6502Impl::InvalidateCode(std::uint16_t addr)
+{
+    auto &starts = page_blocks[addr >> 8];
+    std::size_t j = 0;
+    for (std::size_t i = 0; i < starts.size(); ++i) {
+        auto start = starts[i];
+        Block *block = blocks[start].get();
+        if (block == nullptr) {
+            continue; // already removed; drop the stale entry
+        }
+        if (static_cast<std::uint16_t>(addr - start) >= block->length) {
+            starts[j++] = start;
+            continue;
+        }
+        DropBlock(start, addr >> 8);
+    }
+    starts.resize(j);
+}
+
+// Remove the blocks on pages loaded since load_generation, and bring it up
+// to date
+void
+CPU6502Impl::FlushLoadedPages(void)
+{
+    for (unsigned page = 0; page < page_blocks.size(); ++page) {
+        if (memory->GetPageLoadGeneration(page) <= load_generation) {
+            continue;
+        }
+        for (auto start : page_blocks[page]) {
+            if (blocks[start] != nullptr) {
+                DropBlock(start, page);
+            }
+        }
+        page_blocks[page].clear();
+    }
+    load_generation = memory->GetLoadGeneration();
+}
+
+// Remove the block at start, and its entries in page_blocks, but for those
+// of skip_page, which the caller is going through. A block that ends on
+// the next page is listed on both, and an entry left on either would
+// stay there as the block was decoded again and again.
+void
+CPU6502Impl::DropBlock(std::uint16_t start, unsigned skip_page)
+{
+    unsigned last_page = 0x100;
+    for (unsigned k = 0; k < blocks[start]->length; ++k) {
+        std::uint16_t a = start + k;
+        if (code_bytes[a] < 0xFF) {
+            --code_bytes[a];
+        }
+        if ((a >> 8) != last_page) {
+            last_page = a >> 8;
+            if (last_page != skip_page) {
+                auto &starts = page_blocks[last_page];
+                starts.erase(std::remove(starts.begin(), starts.end(), start),
+                             starts.end());
+            }
+        }
+    }
+    blocks[start].reset();
+    code_written = true;
+}
+
+// All writes by the CPU come here, so that cached code stays current
+void
+CPU6502Impl::Write8(std::uint16_t addr, std::uint8_t byte)
+{
+    memory->FastWrite8(addr, byte);
+    if (code_bytes[addr] != 0) {
+        InvalidateCode(addr);
+    }
+    // A device written to may load memory in turn
+    CheckLoads();
+    if (tracing && trace_write_count < max_trace_writes) {
+        trace_writes[trace_write_count++] = { addr, byte };
+    }
+}
+
+// Number of bytes in an instruction with the given addressing mode
+unsigned
+CPU6502Impl::Length(AddrMode mode)
+{
+    switch (mode) {
+    case am_invalid:
+    case am_implied:
+    case am_acc:
+    default:
+        return 1;
+
+    case am_immediate:
+    case am_zp_x:
+    case am_zp_y:
+    case am_zp:
+    case am_ind_x:
+    case am_ind_y:
+    case am_rel:
+    case am_zp_ind:
+        return 2;
+
+    case am_abs_x:
+    case am_abs_y:
+    case am_abs:
+    case am_ind:
+    case am_abs_ind_x:
+    case am_zp_rel:
+        return 3;
+    }
+}
+
+// Return true if execution should stop at a breakpoint on the instruction at
+// the PC
+bool
+CPU6502Impl::BreakpointHit(void)
+{
+    if (!cpu->AnyBreakpoints()) {
+        return false;
+    }
+    auto opcode = memory->Peek8(reg_pc);
+    return cpu->BreakpointHit(reg_pc, Length(instructions[opcode].addr_mode));
+}
+
+void
+CPU6502Impl::do_invalid(std::uint8_t opcode)
+{
+    // Undocumented opcodes come here
+    --reg_pc;
+    char err[40];
+    std::snprintf(err, sizeof(err), "Undocumented opcode %02X", opcode);
+    throw CPUExcept(err);
+}
+
+template <AddrMode mode>
+void
+CPU6502Impl::do_ORA(void)
+{
+    auto byte = ReadOperand<mode>();
+    reg_a |= byte;
+    SetNZ(reg_a);
+    emu_cycles += 2;
+}
+
+template <AddrMode mode>
+void
+CPU6502Impl::do_AND(void)
+{
+    auto byte = ReadOperand<mode>();
     reg_a &= byte;
     SetNZ(reg_a);
     emu_cycles += 2;
 }
 
+template <AddrMode mode>
+void
+CPU6502Impl::do_EOR(void)
+{
+    auto byte = ReadOperand<mode>();
+    reg_a ^= byte;
+    SetNZ(reg_a);
+    emu_cycles += 2;
+}
+
+template <AddrMode mode, bool cmos>
+void
+CPU6502Impl::do_ADC(void)
+{
+    auto byte = ReadOperand<mode>();
+    emu_cycles += 2;
+    DoAdd<cmos>(byte);
+}
+
+template <AddrMode mode>
+void
+CPU6502Impl::do_STA(void)
+{
+    auto addr = Address<mode, acc_write>();
+    Write8(addr, reg_a);
+    emu_cycles += 2;
+}
+
+template <AddrMode mode>
+void
+CPU6502Impl::do_LDA(void)
+{
+    auto byte = ReadOperand<mode>();
+    reg_a = byte;
+    SetNZ(reg_a);
+    emu_cycles += 2;
+}
+
+template <AddrMode mode>
+void
+CPU6502Impl::do_CMP(void)
+{
+    auto byte = ReadOperand<mode>();
+    Compare(reg_a, byte);
+    emu_cycles += 2;
+}
+
+template <AddrMode mode, bool cmos>
+void
+CPU6502Impl::do_SBC(void)
+{
+    auto byte = ReadOperand<mode>();
+    DoSubtract<cmos>(byte);
+    emu_cycles += 2;
+}
+
+// In decimal mode, the NMOS 6502 sets N, V and Z from the binary
+// subtraction; the 65C02 sets N and Z from the decimal result, and takes a
+// cycle more
+template <bool cmos>
+void
+CPU6502Impl::DoSubtract(std::uint8_t byte)
+{
+    if ((reg_flags & 0x08) == 0) {
+        DoAdd<cmos>(byte ^ 0xFF);
+        return;
+    }
+
+    int borrow = 1 - flag_c;
+    int binary = reg_a - byte - borrow;
+    int low = (reg_a & 0x0F) - (byte & 0x0F) - borrow;
+    int result;
+    if constexpr (cmos) {
+        emu_cycles += 1;
+        result = binary;
+        if (result < 0) {
+            result -= 0x60;
+        }
+        if (low < 0) {
+            result -= 0x06;
+        }
+    } else {
+        if (low < 0) {
+            low = ((low - 0x06) & 0x0F) - 0x10;
+        }
+        result = (reg_a & 0xF0) - (byte & 0xF0) + low;
+        if (result < 0) {
+            result -= 0x60;
+        }
+    }
+    flag_v = (reg_a ^ byte) & (reg_a ^ binary);
+    SetC(binary >= 0);
+    reg_a = static_cast<std::uint8_t>(result);
+    SetNZ(cmos ? reg_a : binary);
+}
+
+// Common to ADC and SBC in binary mode. In decimal mode, the NMOS 6502 sets
+// N and V from the sum after the low digit is adjusted but not the high
+// one, and Z from the binary sum; the 65C02 sets N and Z from the decimal
+// result, and takes a cycle more.
+template <bool cmos>
+void
+CPU6502Impl::DoAdd(std::uint8_t byte)
+{
+    int result;
+    if (reg_flags & 0x08) {
+        // Decimal mode
+        int binary = reg_a + byte + flag_c;
+        int low = (reg_a & 0x0F) + (byte & 0x0F) + flag_c;
+        if (low > 0x09) {
+            low = ((low + 0x06) & 0x0F) + 0x10;
+        }
+        result = (reg_a & 0xF0) + (byte & 0xF0) + low;
+        flag_v = (reg_a ^ result) & (byte ^ result);
+        std::uint8_t nmos_n = result;
+        if (result > 0x9F) {
+            result += 0x60;
+        }
+        if constexpr (cmos) {
+            emu_cycles += 1;
+            SetNZ(result);
+        } else {
+            flag_n = nmos_n;
+            flag_z = binary;
+        }
+    } else {
+        // Binary mode
+        result = reg_a + byte + flag_c;
+        // Overflow if the operands have the same sign and the result does not
+        flag_v = (reg_a ^ result) & (byte ^ result);
+        SetNZ(result);
+    }
+    reg_a = static_cast<std::uint8_t>(result);
+    SetC(result > 0xFF);
+}
+
+template <AddrMode mode, CPU6502Impl::Access access>
+void
+CPU6502Impl::do_ASL(void)
+{
+    auto addr = Address<mode, access>();
+    auto byte = memory->FastRead8(addr);
+    std::uint8_t result = byte << 1;
+    Write8(addr, result);
+    SetNZ(result);
+    SetC((byte & 0x80) != 0);
+    emu_cycles += 4;
+}
+
+template <AddrMode mode, CPU6502Impl::Access access>
+void
+CPU6502Impl::do_LSR(void)
+{
+    auto addr = Address<mode, access>();
+    auto byte = memory->FastRead8(addr);
+    std::uint8_t result = byte >> 1;
+    Write8(addr, result);
+    SetNZ(result);
+    SetC((byte & 0x01) != 0);
+    emu_cycles += 4;
+}
+
+template <AddrMode mode, CPU6502Impl::Access access>
+void
+CPU6502Impl::do_ROL(void)
+{
+    auto addr = Address<mode, access>();
+    auto byte = memory->FastRead8(addr);
+    std::uint8_t result = (byte << 1) | flag_c;
+    Write8(addr, result);
+    SetNZ(result);
+    SetC((byte & 0x80) != 0);
+    emu_cycles += 4;
+}
+
+template <AddrMode mode, CPU6502Impl::Access access>
+void
+CPU6502Impl::do_ROR(void)
+{
+    auto addr = Address<mode, access>();
+    auto byte = memory->FastRead8(addr);
+    std::uint8_t result = (byte >> 1) | (flag_c << 7);
+    Write8(addr, result);
+    SetNZ(result);
+    SetC((byte & 0x01) != 0);
+    emu_cycles += 4;
+}
+
+void
+CPU6502Impl::do_ASL_A(void)
+{
+    std::uint8_t byte = reg_a;
+    std::uint8_t result = byte << 1;
+    reg_a = result;
+    SetNZ(result);
+    SetC((byte & 0x80) != 0);
+    emu_cycles += 2;
+}
+
+void
+CPU6502Impl::do_LSR_A(void)
+{
+    std::uint8_t byte = reg_a;
+    std::uint8_t result = byte >> 1;
+    reg_a = result;
+    SetNZ(result);
+    SetC((byte & 0x01) != 0);
+    emu_cycles += 2;
+}
+
+void
+CPU6502Impl::do_ROL_A(void)
+{
+    std::uint8_t byte = reg_a;
+    std::uint8_t result = (byte << 1) | flag_c;
+    reg_a = result;
+    SetNZ(result);
+    SetC((byte & 0x80) != 0);
+    emu_cycles += 2;
+}
+
+void
+CPU6502Impl::do_ROR_A(void)
+{
+    auto byte = reg_a;
+    std::uint8_t result = (byte >> 1) | (flag_c << 7);
+    reg_a = result;
+    SetNZ(result);
+    SetC((byte & 0x01) != 0);
+    emu_cycles += 2;
+}
+
+template <AddrMode mode>
+void
+CPU6502Impl::do_BIT(void)
+{
+    auto byte = ReadOperand<mode>();
+    flag_n = byte;
+    flag_v = byte << 1;
+    SetZ(byte & reg_a);
+    emu_cycles += 2;
+}
+
+// Branch if the flag bit is set, or if it is clear; with no flag, as for
+// BRA, always branch
+template <std::uint8_t flag, bool set>
+void
+CPU6502Impl::do_branch(void)
+{
+    std::uint8_t offset = operand;
+    std::uint16_t address = reg_pc + (offset ^ 0x80) - 0x80;
+    emu_cycles += 2;
+
+    bool flag_set;
+    if constexpr (flag == 0x80) {
+        flag_set = (flag_n & 0x80) != 0;
+    } else if constexpr (flag == 0x40) {
+        flag_set = (flag_v & 0x80) != 0;
+    } else if constexpr (flag == 0x02) {
+        flag_set = flag_z == 0;
+    } else if constexpr (flag == 0x01) {
+        flag_set = flag_c != 0;
+    } else if constexpr (flag == 0x00) {
+        flag_set = set;
+    } else {
+        flag_set = (reg_flags & flag) != 0;
+    }
+
+    if (flag_set == set) {
+        emu_cycles += 1;
+        if ((address >> 8) != (reg_pc >> 8)) {
+            emu_cycles += 1;
+        }
+        reg_pc = address;
+    }
+}
+
+template <bool cmos>
+void
+CPU6502Impl::do_BRK(void)
+{
+    auto byte1 = memory->FastRead8(0xFFFE);
+    auto byte2 = memory->FastRead8(0xFFFF);
+
+    reg_pc++; // skip byte after BRK
+    PushByte(reg_pc >> 8);
+    PushByte(reg_pc & 0xFF);
+    // The pushed status has B set, so that a handler can tell BRK from IRQ
+    PushByte(PackFlags() | 0x30);
+    reg_flags |= 0x14;
+    if constexpr (cmos) {
+        reg_flags &= 0xF7;
+    }
+    reg_pc = byte2 * 0x100 + byte1;
+    emu_cycles += 7;
+    if (profiling) {
+        ProfileCall(reg_s + 3);
+    }
+}
+
+void
+CPU6502Impl::do_CLC(void)
+{
+    flag_c = 0;
+    emu_cycles += 2;
+}
+
+void
+CPU6502Impl::do_CLD(void)
+{
+    reg_flags &= 0xF7;
+    emu_cycles += 2;
+}
+
+void
+CPU6502Impl::do_CLI(void)
+{
+    reg_flags &= 0xFB;
+    emu_cycles += 2;
+    if (irq_line) {
+        deadline = 0;
+    }
+}
+
+void
+CPU6502Impl::do_CLV(void)
+{
+    flag_v = 0;
+    emu_cycles += 2;
+}
+
+template <AddrMode mode>
+void
+CPU6502Impl::do_CPX(void)
+{
+    auto byte = ReadOperand<mode>();
+    Compare(reg_x, byte);
+    emu_cycles += 2;
+}
+
+template <AddrMode mode>
+void
+CPU6502Impl::do_CPY(void)
+{
+    auto byte = ReadOperand<mode>();
+    Compare(reg_y, byte);
+    emu_cycles += 2;
+}
+
+template <AddrMode mode>
+void
+CPU6502Impl::do_DEC(void)
+{
+    auto addr = Address<mode, acc_write>();
+    auto byte = memory->FastRead8(addr);
+    std::uint8_t result = byte - 1;
+    Write8(addr, result);
+    SetNZ(result);
+    emu_cycles += 4;
+}
+
+void
+CPU6502Impl::do_DEX(void)
+{
+    SetNZ(--reg_x);
+    emu_cycles += 2;
+}
+
+void
+CPU6502Impl::do_DEY(void)
+{
+    SetNZ(--reg_y);
+    emu_cycles += 2;
+}
+
+template <AddrMode mode>
+void
+CPU6502Impl::do_INC(void)
+{
+    auto addr = Address<mode, acc_write>();
+    auto byte = memory->FastRead8(addr);
+    std::uint8_t result = byte + 1;
+    Write8(addr, result);
+    SetNZ(result);
+    emu_cycles += 4;
+}
+
+void
+CPU6502Impl::do_INX(void)
+{
+    SetNZ(++reg_x);
+    emu_cycles += 2;
+}
+
+void
+CPU6502Impl::do_INY(void)
+{
+    SetNZ(++reg_y);
+    emu_cycles += 2;
+}
+
+void
+CPU6502Impl::do_JMP_abs(void)
+{
+    reg_pc = operand;
+    emu_cycles += 3;
+}
+
+template <bool cmos>
+void
+CPU6502Impl::do_JMP_ind(void)
+{
+    std::uint8_t byte1 = operand;
+    std::uint8_t byte2 = operand >> 8;
+    std::uint16_t addr = operand;
+    auto byte3 = memory->FastRead8(addr);
+
+    // The original 6502 has a bug in this instruction, where a vector at an
+    // address ending in FF will wrap around to the start of the 256 byte page
+    // instead of advancing to the next page. This bug is emulated here.
+    // The 65C02 fixes it, at the cost of a cycle.
+    if constexpr (cmos) {
+        ++addr;
+        emu_cycles += 1;
+    } else {
+        ++byte1;
+        addr = byte2 * 0x100 + byte1;
+    }
+    auto byte4 = memory->FastRead8(addr);
+    reg_pc = byte4 * 0x100 + byte3;
+    emu_cycles += 5;
+}
+
+void
+CPU6502Impl::do_JSR(void)
+{
+    // JSR pushes the PC address of the last byte of the instruction, not the
+    // first byte of the next instruction.
+    std::uint16_t last = reg_pc - 1;
+    PushByte(last >> 8);
+    PushByte(last & 0xFF);
+    reg_pc = operand;
+    emu_cycles += 6;
+    if (profiling) {
+        ProfileCall(reg_s + 2);
+    }
+}
+
+template <AddrMode mode>
+void
+CPU6502Impl::do_LDX(void)
+{
+    auto byte = ReadOperand<mode>();
+    reg_x = byte;
+    SetNZ(reg_x);
+    emu_cycles += 2;
+}
+
+template <AddrMode mode>
+void
+CPU6502Impl::do_LDY(void)
+{
+    auto byte = ReadOperand<mode>();
+    reg_y = byte;
+    SetNZ(reg_y);
+    emu_cycles += 2;
+}
+
+void
+CPU6502Impl::do_NOP(void)
+{
+    emu_cycles += 2;
+}
+
+void
+CPU6502Impl::do_PHA(void)
+{
+    PushByte(reg_a);
+    emu_cycles += 3;
+}
+
+void
+CPU6502Impl::do_PHP(void)
+{
+    PushByte(PackFlags() | 0x30);
+    emu_cycles += 3;
+}
+
+void
+CPU6502Impl::do_PLA(void)
+{
+    auto byte = PopByte();
+    reg_a = byte;
+    SetNZ(reg_a);
+    emu_cycles += 4;
+}
+
+void
+CPU6502Impl::do_PLP(void)
+{
+    auto byte = PopByte();
+    UnpackFlags(byte | 0x20);
+    emu_cycles += 4;
+    if (irq_line) {
+        deadline = 0;
+    }
+}
+
+void
+CPU6502Impl::do_RTI(void)
+{
+    auto byte1 = PopByte();
+    UnpackFlags(byte1 | 0x20);
+    auto byte2 = PopByte();
+    auto byte3 = PopByte();
+    reg_pc = byte3 * 0x100 + byte2;
+    emu_cycles += 6;
+    if (irq_line) {
+        deadline = 0;
+    }
+    if (profiling) {
+        ProfileReturn();
+    }
+}
+
+void
+CPU6502Impl::do_RTS(void)
+{
+    auto byte1 = PopByte();
+    auto byte2 = PopByte();
+    reg_pc = byte2 * 0x100 + byte1 + 1;
+    emu_cycles += 6;
+    if (profiling) {
+        ProfileReturn();
+    }
+}
+
+void
+CPU6502Impl::do_SEC(void)
+{
+    flag_c = 1;
+    emu_cycles += 2;
+}
+
+void
+CPU6502Impl::do_SED(void)
+{
+    reg_flags |= 0x08;
+    emu_cycles += 2;
+}
+
+void
+CPU6502Impl::do_SEI(void)
+{
+    reg_flags |= 0x04;
+    emu_cycles += 2;
+}
+
+template <AddrMode mode>
+void
+CPU6502Impl::do_STX(void)
+{
+    auto addr = Address<mode, acc_write>();
+    Write8(addr, reg_x);
+    emu_cycles += 2;
+}
+
+template <AddrMode mode>
+void
+CPU6502Impl::do_STY(void)
+{
+    auto addr = Address<mode, acc_write>();
+    Write8(addr, reg_y);
+    emu_cycles += 2;
+}
+
 void
-CPU6502Impl::do_EOR(std::uint8_t opcode)
+CPU6502Impl::do_TAX(void)
 {
-    auto addr = GetAddress(opcode);
-    auto byte = memory->Read8(addr);
-    reg_a ^= byte;
-    SetNZ(reg_a);
+    reg_x = reg_a;
+    SetNZ(reg_x);
     emu_cycles += 2;
 }
 
 void
-CPU6502Impl::do_ADC(std::uint8_t opcode)
+CPU6502Impl::do_TAY(void)
 {
-    auto addr = GetAddress(opcode);
-    auto byte = memory->Read8(addr);
+    reg_y = reg_a;
+    SetNZ(reg_y);
     emu_cycles += 2;
-    DoAdd(byte);
 }
 
 void
-CPU6502Impl::do_STA(std::uint8_t opcode)
+CPU6502Impl::do_TSX(void)
 {
-    auto addr = GetAddress(opcode);
-    memory->Write8(addr, reg_a);
+    reg_x = reg_s;
+    SetNZ(reg_x);
     emu_cycles += 2;
 }
 
 void
-CPU6502Impl::do_LDA(std::uint8_t opcode)
+CPU6502Impl::do_TXA(void)
 {
-    auto addr = GetAddress(opcode);
-    auto byte = memory->Read8(addr);
-    reg_a = byte;
+    reg_a = reg_x;
     SetNZ(reg_a);
     emu_cycles += 2;
 }
 
 void
-CPU6502Impl::do_CMP(std::uint8_t opcode)
+CPU6502Impl::do_TXS(void)
 {
-    auto addr = GetAddress(opcode);
-    auto byte = memory->Read8(addr);
-    Compare(reg_a, byte);
+    reg_s = reg_x;
     emu_cycles += 2;
 }
 
 void
-CPU6502Impl::do_SBC(std::uint8_t opcode)
+CPU6502Impl::do_TYA(void)
 {
-    auto addr = GetAddress(opcode);
-    auto byte = memory->Read8(addr);
-    if (reg_flags & 0x08) {
-        byte = 0x99 - byte;
-    } else {
-        byte = byte ^ 0xFF;
-    }
-    DoAdd(byte);
+    reg_a = reg_y;
+    SetNZ(reg_a);
     emu_cycles += 2;
 }
 
-// Common to ADC and SBC
+//////////////////////////////////////////////////////////////////////////////
+//                    Undocumented NMOS instructions                        //
+//////////////////////////////////////////////////////////////////////////////
+
+// ASL, then ORA
+template <AddrMode mode>
 void
-CPU6502Impl::DoAdd(std::uint8_t byte)
+CPU6502Impl::do_SLO(void)
 {
-    int result;
-    if (reg_flags & 0x08) {
-        // Decimal mode
-        int r1 = (reg_a & 0x0F) + (byte & 0xF0) + (reg_flags & 0x01);
-        if (r1 > 0x09) {
-            r1 += 0x06;
-        }
-        int r2 = (reg_a & 0xF0) + (byte & 0xF0);
-        if (r2 > 0x90) {
-            r2 += 0x60;
-        }
-        result = r1 + r2;
-    } else {
-        // Binary mode
-        result = reg_a + byte + (reg_flags & 0x01);
-        int r7 = (reg_a & 0x7F) + (byte & 0x7F) + (reg_flags & 0x01);
-        int overflow = ((r7 << 1) ^ result) & 0x100;
-        SetV(overflow);
-    }
-    reg_a = static_cast<std::uint8_t>(result);
-    SetNZ(result);
-    SetC(result > 0xFF);
+    auto addr = Address<mode, acc_write>();
+    auto byte = memory->FastRead8(addr);
+    std::uint8_t result = byte << 1;
+    Write8(addr, result);
+    SetC((byte & 0x80) != 0);
+    reg_a |= result;
+    SetNZ(reg_a);
+    emu_cycles += 4;
 }
 
+// ROL, then AND
+template <AddrMode mode>
 void
-CPU6502Impl::do_ASL(std::uint8_t opcode)
+CPU6502Impl::do_RLA(void)
 {
-    auto addr = GetAddress(opcode);
-    auto byte = memory->Read8(addr);
-    std::uint8_t result = byte << 1;
-    memory->Write8(addr, result);
-    SetNZ(result);
+    auto addr = Address<mode, acc_write>();
+    auto byte = memory->FastRead8(addr);
+    std::uint8_t result = (byte << 1) | flag_c;
+    Write8(addr, result);
     SetC((byte & 0x80) != 0);
+    reg_a &= result;
+    SetNZ(reg_a);
     emu_cycles += 4;
 }
 
+// LSR, then EOR
+template <AddrMode mode>
 void
-CPU6502Impl::do_LSR(std::uint8_t opcode)
+CPU6502Impl::do_SRE(void)
 {
-    auto addr = GetAddress(opcode);
-    auto byte = memory->Read8(addr);
+    auto addr = Address<mode, acc_write>();
+    auto byte = memory->FastRead8(addr);
     std::uint8_t result = byte >> 1;
-    memory->Write8(addr, result);
-    SetNZ(result);
+    Write8(addr, result);
     SetC((byte & 0x01) != 0);
+    reg_a ^= result;
+    SetNZ(reg_a);
     emu_cycles += 4;
 }
 
+// ROR, then ADC
+template <AddrMode mode>
 void
-CPU6502Impl::do_ROL(std::uint8_t opcode)
+CPU6502Impl::do_RRA(void)
 {
-    auto addr = GetAddress(opcode);
-    auto byte = memory->Read8(addr);
-    std::uint8_t result = (byte << 1) | (reg_flags & 0x01);
-    memory->Write8(addr, result);
-    SetNZ(result);
-    SetC((byte & 0x80) != 0);
+    auto addr = Address<mode, acc_write>();
+    auto byte = memory->FastRead8(addr);
+    std::uint8_t result = (byte >> 1) | (flag_c << 7);
+    Write8(addr, result);
+    SetC((byte & 0x01) != 0);
+    DoAdd<false>(result);
     emu_cycles += 4;
 }
 
+// Store A AND X
+template <AddrMode mode>
 void
-CPU6502Impl::do_ROR(std::uint8_t opcode)
+CPU6502Impl::do_SAX(void)
 {
-    auto addr = GetAddress(opcode);
-    auto byte = memory->Read8(addr);
-    std::uint8_t result = (byte >> 1) | ((reg_flags & 0x01) << 7);
-    memory->Write8(addr, result);
-    SetNZ(result);
-    SetC((byte & 0x01) != 0);
-    emu_cycles += 4;
+    auto addr = Address<mode, acc_write>();
+    Write8(addr, reg_a & reg_x);
+    emu_cycles += 2;
 }
 
+// LDA and LDX together
+template <AddrMode mode>
 void
-CPU6502Impl::do_ASL_A(std::uint8_t /*opcode*/)
+CPU6502Impl::do_LAX(void)
 {
-    std::uint8_t byte = reg_a;
-    std::uint8_t result = byte << 1;
-    reg_a = result;
-    SetNZ(result);
-    SetC((byte & 0x80) != 0);
+    auto byte = ReadOperand<mode>();
+    reg_a = reg_x = byte;
+    SetNZ(byte);
     emu_cycles += 2;
 }
 
+// DEC, then CMP
+template <AddrMode mode>
 void
-CPU6502Impl::do_LSR_A(std::uint8_t /*opcode*/)
+CPU6502Impl::do_DCP(void)
 {
-    std::uint8_t byte = reg_a;
-    std::uint8_t result = byte >> 1;
-    reg_a = result;
-    SetNZ(result);
-    SetC((byte & 0x01) != 0);
-    emu_cycles += 2;
+    auto addr = Address<mode, acc_write>();
+    std::uint8_t result = memory->FastRead8(addr) - 1;
+    Write8(addr, result);
+    Compare(reg_a, result);
+    emu_cycles += 4;
 }
 
+// INC, then SBC
+template <AddrMode mode>
 void
-CPU6502Impl::do_ROL_A(std::uint8_t /*opcode*/)
+CPU6502Impl::do_ISC(void)
 {
-    std::uint8_t byte = reg_a;
-    std::uint8_t result = (byte << 1) | (reg_flags & 0x01);
-    reg_a = result;
-    SetNZ(result);
-    SetC((byte & 0x80) != 0);
-    emu_cycles += 2;
+    auto addr = Address<mode, acc_write>();
+    std::uint8_t result = memory->FastRead8(addr) + 1;
+    Write8(addr, result);
+    DoSubtract<false>(result);
+    emu_cycles += 4;
 }
 
+// AND immediate, copying N to C
 void
-CPU6502Impl::do_ROR_A(std::uint8_t /*opcode*/)
+CPU6502Impl::do_ANC(void)
 {
-    auto byte = reg_a;
-    std::uint8_t result = (byte >> 1) | ((reg_flags & 0x01) << 7);
-    reg_a = result;
-    SetNZ(result);
-    SetC((byte & 0x01) != 0);
+    reg_a &= operand;
+    SetNZ(reg_a);
+    SetC((reg_a & 0x80) != 0);
     emu_cycles += 2;
 }
 
+// AND immediate, then LSR A
 void
-CPU6502Impl::do_BIT(std::uint8_t opcode)
+CPU6502Impl::do_ALR(void)
 {
-    auto addr = GetAddress(opcode);
-    auto byte = memory->Read8(addr);
-    SetZ(byte & reg_a);
-    reg_flags = (reg_flags & 0x3F) | (byte & 0xC0);
+    std::uint8_t byte = reg_a & operand;
+    reg_a = byte >> 1;
+    SetNZ(reg_a);
+    SetC((byte & 0x01) != 0);
     emu_cycles += 2;
 }
 
+// AND immediate, then ROR A, with C taken from bit 6 and V from bit 6 XOR
+// bit 5. In decimal mode, N, V and Z are as in binary, but each digit is
+// then adjusted as if by an addition of the AND to itself, and C comes
+// from the high digit.
 void
-CPU6502Impl::do_branch(std::uint8_t opcode)
+CPU6502Impl::do_ARR(void)
 {
-    static const std::uint8_t flag_bits[] = {
-        0x80, // BPL, BMI
-        0x40, // BVC, BVS
-        0x01, // BCC, BCS
-        0x02  // BNE, BEQ
-    };
-
-    auto offset = memory->Read8(reg_pc++);
-    std::uint16_t address = reg_pc + (offset ^ 0x80) - 0x80;
-    bool which = (opcode & 0x20) != 0;
-    bool flag = (reg_flags & flag_bits[opcode >> 6]) != 0;
-    emu_cycles += 2;
-    if (flag == which) {
-        emu_cycles += 1;
-        if ((address >> 8) != (reg_pc >> 8)) {
-            emu_cycles += 1;
+    std::uint8_t byte = reg_a & operand;
+    reg_a = (byte >> 1) | (flag_c << 7);
+    SetNZ(reg_a);
+    flag_v = ((reg_a << 1) ^ (reg_a << 2)) & 0x80;
+    if ((reg_flags & 0x08) == 0) {
+        SetC((reg_a & 0x40) != 0);
+    } else {
+        flag_v = ((byte ^ reg_a) << 1) & 0x80;
+        if ((byte & 0x0F) + (byte & 0x01) > 0x05) {
+            reg_a = (reg_a & 0xF0) | ((reg_a + 0x06) & 0x0F);
         }
-        reg_pc = address;
+        bool carry = (byte & 0xF0) + (byte & 0x10) > 0x50;
+        if (carry) {
+            reg_a += 0x60;
+        }
+        SetC(carry);
     }
+    emu_cycles += 2;
 }
 
+// X = (A AND X) - immediate, setting the flags as CMP does
 void
-CPU6502Impl::do_BRK(std::uint8_t /*opcode*/)
+CPU6502Impl::do_SBX(void)
 {
-    auto byte1 = memory->Read8(0xFFFE);
-    auto byte2 = memory->Read8(0xFFFF);
-
-    reg_pc++; // skip byte after BRK
-    PushByte(reg_pc >> 8);
-    PushByte(reg_pc & 0xFF);
-    PushByte(reg_flags);
-    reg_flags |= 0x14;
-    reg_pc = byte2 * 0x100 + byte1;
-    emu_cycles += 7;
+    std::uint8_t byte = reg_a & reg_x;
+    Compare(byte, operand);
+    reg_x = byte - operand;
+    emu_cycles += 2;
 }
 
+// The next two depend on the chip; these use the common value $EE for the
+// bits of A that leak into the result
 void
-CPU6502Impl::do_CLC(std::uint8_t /*opcode*/)
+CPU6502Impl::do_LXA(void)
 {
-    reg_flags &= 0xFE;
+    reg_a = reg_x = (reg_a | 0xEE) & operand;
+    SetNZ(reg_a);
     emu_cycles += 2;
 }
 
 void
-CPU6502Impl::do_CLD(std::uint8_t /*opcode*/)
+CPU6502Impl::do_ANE(void)
 {
-    reg_flags &= 0xF7;
+    reg_a = (reg_a | 0xEE) & reg_x & operand;
+    SetNZ(reg_a);
     emu_cycles += 2;
 }
 
+template <AddrMode mode>
 void
-CPU6502Impl::do_CLI(std::uint8_t /*opcode*/)
+CPU6502Impl::do_SHA(void)
 {
-    reg_flags &= 0xFB;
+    auto addr = Address<mode, acc_write>();
+    StoreHigh(addr, reg_y, reg_a & reg_x);
     emu_cycles += 2;
 }
 
 void
-CPU6502Impl::do_CLV(std::uint8_t /*opcode*/)
+CPU6502Impl::do_SHX(void)
 {
-    reg_flags &= 0xBF;
+    auto addr = Address<am_abs_y, acc_write>();
+    StoreHigh(addr, reg_y, reg_x);
     emu_cycles += 2;
 }
 
 void
-CPU6502Impl::do_CPX(std::uint8_t opcode)
+CPU6502Impl::do_SHY(void)
 {
-    auto addr = GetAddress(opcode);
-    auto byte = memory->Read8(addr);
-    Compare(reg_x, byte);
+    auto addr = Address<am_abs_x, acc_write>();
+    StoreHigh(addr, reg_x, reg_y);
     emu_cycles += 2;
 }
 
 void
-CPU6502Impl::do_CPX_imm(std::uint8_t /*opcode*/)
+CPU6502Impl::do_TAS(void)
 {
-    auto byte = memory->Read8(reg_pc++);
-    Compare(reg_x, byte);
+    auto addr = Address<am_abs_y, acc_write>();
+    reg_s = reg_a & reg_x;
+    StoreHigh(addr, reg_y, reg_s);
     emu_cycles += 2;
 }
 
 void
-CPU6502Impl::do_CPY(std::uint8_t opcode)
+CPU6502Impl::do_LAS(void)
 {
-    auto addr = GetAddress(opcode);
-    auto byte = memory->Read8(addr);
-    Compare(reg_y, byte);
+    auto byte = ReadOperand<am_abs_y>();
+    reg_a = reg_x = reg_s = byte & reg_s;
+    SetNZ(reg_a);
     emu_cycles += 2;
 }
 
+// NOP that reads its operand
+template <AddrMode mode>
 void
-CPU6502Impl::do_CPY_imm(std::uint8_t /*opcode*/)
+CPU6502Impl::do_NOP_operand(void)
 {
-    int byte = memory->Read8(reg_pc++);
-    Compare(reg_y, byte);
+    ReadOperand<mode>();
     emu_cycles += 2;
 }
 
 void
-CPU6502Impl::do_DEC(std::uint8_t opcode)
+CPU6502Impl::do_JAM(std::uint8_t opcode)
 {
-    auto addr = GetAddress(opcode);
-    auto byte = memory->Read8(addr);
-    std::uint8_t result = byte - 1;
-    memory->Write8(addr, result);
-    SetNZ(result);
-    emu_cycles += 4;
+    // The processor locks up until reset
+    --reg_pc;
+    char err[40];
+    std::snprintf(err, sizeof(err), "Opcode %02X halted the processor", opcode);
+    throw CPUExcept(err);
 }
 
+//////////////////////////////////////////////////////////////////////////////
+//                          65C02 instructions                              //
+//////////////////////////////////////////////////////////////////////////////
+
 void
-CPU6502Impl::do_DEX(std::uint8_t /*opcode*/)
+CPU6502Impl::do_PHX(void)
 {
-    SetNZ(--reg_x);
-    emu_cycles += 2;
+    PushByte(reg_x);
+    emu_cycles += 3;
 }
 
 void
-CPU6502Impl::do_DEY(std::uint8_t /*opcode*/)
+CPU6502Impl::do_PHY(void)
 {
-    SetNZ(--reg_y);
-    emu_cycles += 2;
+    PushByte(reg_y);
+    emu_cycles += 3;
 }
 
 void
-CPU6502Impl::do_INC(std::uint8_t opcode)
+CPU6502Impl::do_PLX(void)
 {
-    auto addr = GetAddress(opcode);
-    auto byte = memory->Read8(addr);
-    std::uint8_t result = byte + 1;
-    memory->Write8(addr, result);
-    SetNZ(result);
+    reg_x = PopByte();
+    SetNZ(reg_x);
     emu_cycles += 4;
 }
 
 void
-CPU6502Impl::do_INX(std::uint8_t /*opcode*/)
+CPU6502Impl::do_PLY(void)
 {
-    SetNZ(++reg_x);
-    emu_cycles += 2;
+    reg_y = PopByte();
+    SetNZ(reg_y);
+    emu_cycles += 4;
 }
 
+template <AddrMode mode>
 void
-CPU6502Impl::do_INY(std::uint8_t /*opcode*/)
+CPU6502Impl::do_STZ(void)
 {
-    SetNZ(++reg_y);
+    auto addr = Address<mode, acc_write>();
+    Write8(addr, 0);
     emu_cycles += 2;
 }
 
+// Set the bits of A in memory; Z is set as BIT sets it
+template <AddrMode mode>
 void
-CPU6502Impl::do_JMP_abs(std::uint8_t /*opcode*/)
+CPU6502Impl::do_TSB(void)
 {
-    auto byte1 = memory->Read8(reg_pc++);
-    auto byte2 = memory->Read8(reg_pc++);
-    std::uint16_t addr = byte2 * 0x100 + byte1;
-    reg_pc = addr;
-    emu_cycles += 3;
+    auto addr = Address<mode, acc_write>();
+    auto byte = memory->FastRead8(addr);
+    SetZ(byte & reg_a);
+    Write8(addr, byte | reg_a);
+    emu_cycles += 4;
 }
 
+// Clear the bits of A in memory
+template <AddrMode mode>
 void
-CPU6502Impl::do_JMP_ind(std::uint8_t /*opcode*/)
+CPU6502Impl::do_TRB(void)
 {
-    auto byte1 = memory->Read8(reg_pc++);
-    auto byte2 = memory->Read8(reg_pc++);
-    std::uint16_t addr = byte2 * 0x100 + byte1;
-    auto byte3 = memory->Read8(addr);
-
-    // The original 6502 has a bug in this instruction, where a vector at an
-    // address ending in FF will wrap around to the start of the 256 byte page
-    // instead of advancing to the next page. This bug is emulated here.
-    // TODO: Bypass this if emulating a 65C02.
+    auto addr = Address<mode, acc_write>();
+    auto byte = memory->FastRead8(addr);
+    SetZ(byte & reg_a);
+    Write8(addr, byte & ~reg_a);
+    emu_cycles += 4;
+}
 
-    ++byte1;
-    addr = byte2 * 0x100 + byte1;
-    auto byte4 = memory->Read8(addr);
-    reg_pc = byte4 * 0x100 + byte3;
-    emu_cycles += 5;
+void
+CPU6502Impl::do_INC_A(void)
+{
+    SetNZ(++reg_a);
+    emu_cycles += 2;
 }
 
 void
-CPU6502Impl::do_JSR(std::uint8_t /*opcode*/)
+CPU6502Impl::do_DEC_A(void)
 {
-    auto byte1 = memory->Read8(reg_pc++);
+    SetNZ(--reg_a);
+    emu_cycles += 2;
+}
 
-    // reg_pc is not incremented, because JSR pushes the PC address of the
-    // last byte of the instruction, not the first byte of the next
-    // instruction.
+// BIT immediate sets only Z
+void
+CPU6502Impl::do_BIT_imm(void)
+{
+    SetZ(operand & reg_a);
+    emu_cycles += 2;
+}
 
-    auto byte2 = memory->Read8(reg_pc);
-    std::uint16_t addr = byte2 * 0x100 + byte1;
-    PushByte(reg_pc >> 8);
-    PushByte(reg_pc & 0xFF); 
-    reg_pc = addr;
+void
+CPU6502Impl::do_JMP_abs_x(void)
+{
+    std::uint16_t addr = operand + reg_x;
+    auto byte1 = memory->FastRead8(addr);
+    auto byte2 = memory->FastRead8(static_cast<std::uint16_t>(addr + 1));
+    reg_pc = byte2 * 0x100 + byte1;
     emu_cycles += 6;
 }
 
 void
-CPU6502Impl::do_LDX(std::uint8_t opcode)
+CPU6502Impl::do_NOP1(void)
 {
-    auto addr = GetAddress(opcode);
-    auto byte = memory->Read8(addr);
-    reg_x = byte;
-    SetNZ(reg_x);
-    emu_cycles += 2;
+    emu_cycles += 1;
 }
 
+//////////////////////////////////////////////////////////////////////////////
+//                    Rockwell and WDC instructions                         //
+//////////////////////////////////////////////////////////////////////////////
+
+template <unsigned bit>
 void
-CPU6502Impl::do_LDX_imm(std::uint8_t /*opcode*/)
+CPU6502Impl::do_RMB(void)
 {
-    auto byte = memory->Read8(reg_pc++);
-    reg_x = byte;
-    SetNZ(reg_x);
-    emu_cycles += 2;
+    auto addr = Address<am_zp, acc_write>();
+    Write8(addr, memory->FastRead8(addr) & ~(1 << bit));
+    emu_cycles += 4;
 }
 
+template <unsigned bit>
 void
-CPU6502Impl::do_LDY(std::uint8_t opcode)
+CPU6502Impl::do_SMB(void)
 {
-    auto addr = GetAddress(opcode);
-    auto byte = memory->Read8(addr);
-    reg_y = byte;
-    SetNZ(reg_y);
-    emu_cycles += 2;
+    auto addr = Address<am_zp, acc_write>();
+    Write8(addr, memory->FastRead8(addr) | (1 << bit));
+    emu_cycles += 4;
 }
 
+// The operand is the zero page address, then the branch offset
+template <unsigned bit>
 void
-CPU6502Impl::do_LDY_imm(std::uint8_t /*opcode*/)
+CPU6502Impl::do_BBR(void)
 {
-    auto byte = memory->Read8(reg_pc++);
-    reg_y = byte;
-    SetNZ(reg_y);
-    emu_cycles += 2;
+    auto byte = memory->FastRead8(operand & 0xFF);
+    emu_cycles += 5;
+    if ((byte & (1 << bit)) == 0) {
+        std::uint8_t offset = operand >> 8;
+        std::uint16_t address = reg_pc + (offset ^ 0x80) - 0x80;
+        emu_cycles += ((address >> 8) != (reg_pc >> 8)) ? 2 : 1;
+        reg_pc = address;
+    }
 }
 
+template <unsigned bit>
 void
-CPU6502Impl::do_NOP(std::uint8_t /*opcode*/)
+CPU6502Impl::do_BBS(void)
 {
-    emu_cycles += 2;
+    auto byte = memory->FastRead8(operand & 0xFF);
+    emu_cycles += 5;
+    if ((byte & (1 << bit)) != 0) {
+        std::uint8_t offset = operand >> 8;
+        std::uint16_t address = reg_pc + (offset ^ 0x80) - 0x80;
+        emu_cycles += ((address >> 8) != (reg_pc >> 8)) ? 2 : 1;
+        reg_pc = address;
+    }
 }
 
+// Wait for an interrupt. Until one arrives, WAI runs again, and the clock
+// skips ahead to the next event; Interrupt() returns past it. An IRQ that
+// is masked ends the wait without being taken.
 void
-CPU6502Impl::do_PHA(std::uint8_t /*opcode*/)
+CPU6502Impl::do_WAI(void)
 {
-    PushByte(reg_a);
     emu_cycles += 3;
+    waiting = !nmi_pending && !irq_line;
+    if (!waiting) {
+        return;
+    }
+    --reg_pc;
+    if (deadline != ULONG_MAX && deadline > emu_cycles) {
+        emu_cycles = deadline;
+    }
 }
 
 void
-CPU6502Impl::do_PHP(std::uint8_t /*opcode*/)
+CPU6502Impl::do_STP(void)
 {
-    PushByte(reg_flags | 0x20);
-    emu_cycles += 3;
+    // The processor stops until reset
+    --reg_pc;
+    throw CPUExcept("STP stopped the processor");
+}
+
+// Return the address of the operand, and count the cycles for the addressing
+// mode. Each instantiation handles one mode, so nothing here is decided at
+// run time except the page crossing test for indexed reads.
+template <AddrMode mode, CPU6502Impl::Access access>
+std::uint16_t
+CPU6502Impl::Address(void)
+{
+    if constexpr (mode == am_zp || mode == am_zp_x || mode == am_zp_y) {
+        // ABC zp
+        // ABC zp, X
+        // ABC zp, Y
+        std::uint8_t byte1 = operand;
+        // Indexing takes a cycle more
+        emu_cycles += (mode == am_zp) ? 1 : 2;
+        // Overflow past zero page wraps to zero
+        if constexpr (mode == am_zp_x) {
+            byte1 += reg_x;
+        } else if constexpr (mode == am_zp_y) {
+            byte1 += reg_y;
+        }
+        return byte1;
+    } else if constexpr (mode == am_abs || mode == am_abs_x || mode == am_abs_y) {
+        // ABC abs
+        // ABC abs, X
+        // ABC abs, Y
+        std::uint16_t addr1 = operand;
+        emu_cycles += 2;
+        if constexpr (mode == am_abs) {
+            return addr1;
+        } else {
+            std::uint16_t addr2 = addr1 + (mode == am_abs_x ? reg_x : reg_y);
+            IndexCycles<access>(addr1, addr2);
+            return addr2;
+        }
+    } else if constexpr (mode == am_ind_x) {
+        // ABC (zp, X)
+        std::uint8_t zp_addr = operand + reg_x;
+        //zp_addr++, not zp_addr + 1, because read from 0xFF wraps to 0x00
+        auto byte2 = memory->FastRead8(zp_addr++);
+        auto byte3 = memory->FastRead8(zp_addr);
+        emu_cycles += 4;
+        return byte3 * 0x100 + byte2;
+    } else if constexpr (mode == am_zp_ind) {
+        // ABC (zp)
+        std::uint8_t zp_addr = operand;
+        //zp_addr++, not zp_addr + 1, because read from 0xFF wraps to 0x00
+        auto byte2 = memory->FastRead8(zp_addr++);
+        auto byte3 = memory->FastRead8(zp_addr);
+        emu_cycles += 3;
+        return byte3 * 0x100 + byte2;
+    } else if constexpr (mode == am_ind_y) {
+        // ABC (zp), Y
+        std::uint8_t zp_addr = operand;
+        //zp_addr++, not zp_addr + 1, because read from 0xFF wraps to 0x00
+        auto byte2 = memory->FastRead8(zp_addr++);
+        auto byte3 = memory->FastRead8(zp_addr);
+        std::uint16_t addr1 = byte3 * 0x100 + byte2;
+        std::uint16_t addr2 = addr1 + reg_y;
+        emu_cycles += 3;
+        IndexCycles<access>(addr1, addr2);
+        return addr2;
+    } else {
+        static_assert(mode == am_zp, "Addressing mode has no operand address");
+        return 0;
+    }
+}
+
+// Return the byte that an instruction reads; an immediate operand is part of
+// the decoded instruction
+template <AddrMode mode>
+std::uint8_t
+CPU6502Impl::ReadOperand(void)
+{
+    if constexpr (mode == am_immediate) {
+        return static_cast<std::uint8_t>(operand);
+    } else {
+        return memory->FastRead8(Address<mode>());
+    }
 }
 
+// Indexed reads take an extra cycle if the index crosses a page; writes and
+// read-modify-write instructions always take it
+template <CPU6502Impl::Access access>
 void
-CPU6502Impl::do_PLA(std::uint8_t /*opcode*/)
+CPU6502Impl::IndexCycles(std::uint16_t base, std::uint16_t addr)
 {
-    auto byte = PopByte();
-    reg_a = byte;
-    SetNZ(reg_a);
-    emu_cycles += 4;
+    if (access == acc_write || (addr >> 8) != (base >> 8)) {
+        emu_cycles += 1;
+    }
 }
 
 void
-CPU6502Impl::do_PLP(std::uint8_t /*opcode*/)
+CPU6502Impl::Compare(std::uint8_t reg, std::uint8_t byte)
 {
-    auto byte = PopByte();
-    reg_flags = byte | 0x20;
-    emu_cycles += 4;
+    int result = reg + (byte ^ 0xFF) + 1;
+    SetNZ(result);
+    SetC(result > 0xFF);
 }
 
+// SHA, SHX, SHY and TAS store the byte ANDed with one more than the high
+// byte of the unindexed address
 void
-CPU6502Impl::do_RTI(std::uint8_t /*opcode*/)
+CPU6502Impl::StoreHigh(std::uint16_t addr, std::uint8_t index,
+                       std::uint8_t byte)
 {
-    auto byte1 = PopByte();
-    reg_flags = byte1 | 0x20;
-    auto byte2 = PopByte();
-    auto byte3 = PopByte();
-    reg_pc = byte3 * 0x100 + byte2;
-    emu_cycles += 6;
+    std::uint16_t base = addr - index;
+    Write8(addr, byte & ((base >> 8) + 1));
 }
 
+// S points at the next free byte of the stack, which grows downward
 void
-CPU6502Impl::do_RTS(std::uint8_t /*opcode*/)
+CPU6502Impl::PushByte(std::uint8_t byte)
 {
-    auto byte1 = PopByte();
-    auto byte2 = PopByte();
-    reg_pc = byte2 * 0x100 + byte1 + 1;
-    emu_cycles += 6;
+    std::uint16_t address = 0x0100 + reg_s--;
+    Write8(address, byte);
+}
+
+std::uint8_t
+CPU6502Impl::PopByte(void)
+{
+    std::uint16_t address = 0x0100 + ++reg_s;
+    return memory->FastRead8(address);
+}
+
+// These only record the result; the status byte is assembled by PackFlags()
+void
+CPU6502Impl::SetNZ(std::uint8_t result)
+{
+    flag_n = result;
+    flag_z = result;
+}
+
+void
+CPU6502Impl::SetZ(std::uint8_t result)
+{
+    flag_z = result;
+}
+
+void
+CPU6502Impl::SetC(bool carry)
+{
+    flag_c = carry;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//                      Begin x86-64 translator code                        //
+//////////////////////////////////////////////////////////////////////////////
+
+// The instrumented build does not translate, so that every instruction
+// goes through its handler
+bool
+CPU6502Impl::SetJIT(bool enable)
+{
+#if defined(CPU6502_JIT) && !defined(CPU6502_INSTRUMENT)
+    if (enable && jit == nullptr) {
+        // Translated code is discarded when this fills up
+        jit.reset(new JITBuffer(16 * 1024 * 1024));
+    }
+    jit_enabled = enable && jit->Valid();
+#else
+    jit_enabled = false;
+#endif
+    return jit_enabled;
+}
+
+unsigned
+CPU6502Impl::JitRead8(CPU6502Regs *regs, unsigned addr)
+{
+    auto impl = static_cast<CPU6502Impl *>(regs);
+    return impl->memory->FastRead8(addr);
+}
+
+// Read a vector from zero page, wrapping from $FF to $00
+unsigned
+CPU6502Impl::JitRead16ZP(CPU6502Regs *regs, unsigned zp_addr)
+{
+    auto impl = static_cast<CPU6502Impl *>(regs);
+    auto byte1 = impl->memory->FastRead8(zp_addr & 0xFF);
+    auto byte2 = impl->memory->FastRead8((zp_addr + 1) & 0xFF);
+    return byte2 * 0x100 + byte1;
 }
 
-void
-CPU6502Impl::do_SEC(std::uint8_t /*opcode*/)
+// Returns nonzero if the write removed cached code
+unsigned
+CPU6502Impl::JitWrite8(CPU6502Regs *regs, unsigned addr, unsigned byte)
 {
-    reg_flags |= 0x01;
-    emu_cycles += 2;
+    auto impl = static_cast<CPU6502Impl *>(regs);
+    impl->Write8(addr, byte);
+    return impl->code_written;
 }
 
-void
-CPU6502Impl::do_SED(std::uint8_t /*opcode*/)
+unsigned
+CPU6502Impl::JitPush(CPU6502Regs *regs, unsigned byte)
 {
-    reg_flags |= 0x08;
-    emu_cycles += 2;
+    auto impl = static_cast<CPU6502Impl *>(regs);
+    impl->PushByte(byte);
+    return impl->code_written;
 }
 
-void
-CPU6502Impl::do_SEI(std::uint8_t /*opcode*/)
+unsigned
+CPU6502Impl::JitPop(CPU6502Regs *regs)
 {
-    reg_flags |= 0x04;
-    emu_cycles += 2;
+    auto impl = static_cast<CPU6502Impl *>(regs);
+    return impl->PopByte();
 }
 
-void
-CPU6502Impl::do_STX(std::uint8_t opcode)
+// PHP; returns nonzero if the push removed cached code
+unsigned
+CPU6502Impl::JitPushFlags(CPU6502Regs *regs)
 {
-    auto addr = GetAddress(opcode);
-    memory->Write8(addr, reg_x);
-    emu_cycles += 2;
+    auto impl = static_cast<CPU6502Impl *>(regs);
+    impl->PushByte(impl->PackFlags() | 0x30);
+    return impl->code_written;
 }
 
 void
-CPU6502Impl::do_STY(std::uint8_t opcode)
+CPU6502Impl::JitPullFlags(CPU6502Regs *regs)
 {
-    auto addr = GetAddress(opcode);
-    memory->Write8(addr, reg_y);
-    emu_cycles += 2;
+    auto impl = static_cast<CPU6502Impl *>(regs);
+    impl->UnpackFlags(impl->PopByte() | 0x20);
 }
 
 void
-CPU6502Impl::do_TAX(std::uint8_t /*opcode*/)
+CPU6502Impl::JitRTS(CPU6502Regs *regs)
 {
-    reg_x = reg_a;
-    SetNZ(reg_x);
-    emu_cycles += 2;
+    auto impl = static_cast<CPU6502Impl *>(regs);
+    auto byte1 = impl->PopByte();
+    auto byte2 = impl->PopByte();
+    impl->reg_pc = byte2 * 0x100 + byte1 + 1;
 }
 
+template <bool cmos>
 void
-CPU6502Impl::do_TAY(std::uint8_t /*opcode*/)
+CPU6502Impl::JitADC(CPU6502Regs *regs, unsigned byte)
 {
-    reg_y = reg_a;
-    SetNZ(reg_y);
-    emu_cycles += 2;
+    auto impl = static_cast<CPU6502Impl *>(regs);
+    impl->DoAdd<cmos>(byte);
 }
 
+template <bool cmos>
 void
-CPU6502Impl::do_TSX(std::uint8_t /*opcode*/)
+CPU6502Impl::JitSBC(CPU6502Regs *regs, unsigned byte)
 {
-    reg_x = reg_s;
-    SetNZ(reg_x);
-    emu_cycles += 2;
+    auto impl = static_cast<CPU6502Impl *>(regs);
+    impl->DoSubtract<cmos>(byte);
 }
 
-void
-CPU6502Impl::do_TXA(std::uint8_t /*opcode*/)
+#ifdef CPU6502_JIT
+
+// Operations that the translator knows
+enum JitOp {
+    jop_none,
+    jop_LDA, jop_LDX, jop_LDY, jop_STA, jop_STX, jop_STY,
+    jop_ORA, jop_AND, jop_EOR, jop_ADC, jop_SBC,
+    jop_CMP, jop_CPX, jop_CPY, jop_BIT,
+    jop_ASL, jop_LSR, jop_ROL, jop_ROR, jop_INC, jop_DEC,
+    jop_INX, jop_INY, jop_DEX, jop_DEY,
+    jop_TAX, jop_TAY, jop_TXA, jop_TYA, jop_TSX, jop_TXS,
+    jop_CLC, jop_SEC, jop_CLI, jop_SEI, jop_CLD, jop_SED, jop_CLV,
+    jop_NOP, jop_PHA, jop_PHP, jop_PLA, jop_PLP,
+    jop_JSR, jop_RTS, jop_JMP, jop_branch
+};
+
+static JitOp
+jitOperation(const char *name, AddrMode mode)
 {
-    reg_a = reg_x;
-    SetNZ(reg_a);
-    emu_cycles += 2;
+    static const struct {
+        char name[4];
+        JitOp op;
+    } ops[] = {
+        { "LDA", jop_LDA }, { "LDX", jop_LDX }, { "LDY", jop_LDY },
+        { "STA", jop_STA }, { "STX", jop_STX }, { "STY", jop_STY },
+        { "ORA", jop_ORA }, { "AND", jop_AND }, { "EOR", jop_EOR },
+        { "ADC", jop_ADC }, { "SBC", jop_SBC }, { "CMP", jop_CMP },
+        { "CPX", jop_CPX }, { "CPY", jop_CPY }, { "BIT", jop_BIT },
+        { "ASL", jop_ASL }, { "LSR", jop_LSR }, { "ROL", jop_ROL },
+        { "ROR", jop_ROR }, { "INC", jop_INC }, { "DEC", jop_DEC },
+        { "INX", jop_INX }, { "INY", jop_INY }, { "DEX", jop_DEX },
+        { "DEY", jop_DEY }, { "TAX", jop_TAX }, { "TAY", jop_TAY },
+        { "TXA", jop_TXA }, { "TYA", jop_TYA }, { "TSX", jop_TSX },
+        { "TXS", jop_TXS }, { "CLC", jop_CLC }, { "SEC", jop_SEC },
+        { "CLI", jop_CLI }, { "SEI", jop_SEI }, { "CLD", jop_CLD },
+        { "SED", jop_SED }, { "CLV", jop_CLV }, { "NOP", jop_NOP },
+        { "PHA", jop_PHA }, { "PHP", jop_PHP }, { "PLA", jop_PLA },
+        { "PLP", jop_PLP }, { "JSR", jop_JSR }, { "RTS", jop_RTS },
+        { "JMP", jop_JMP }
+    };
+
+    if (mode == am_rel) {
+        return jop_branch;
+    }
+    if (mode == am_ind) {
+        return jop_none; // JMP (ind) is left to the interpreter
+    }
+    for (auto const &op : ops) {
+        if (std::strcmp(name, op.name) == 0) {
+            return op.op;
+        }
+    }
+    return jop_none; // BRK, RTI and invalid opcodes
 }
 
-void
-CPU6502Impl::do_TXS(std::uint8_t /*opcode*/)
+// True for instructions that store through their operand address
+static bool
+jitWrites(JitOp op)
 {
-    reg_s = reg_x;
-    emu_cycles += 2;
+    switch (op) {
+    case jop_STA: case jop_STX: case jop_STY:
+    case jop_ASL: case jop_LSR: case jop_ROL: case jop_ROR:
+    case jop_INC: case jop_DEC:
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+// Cycles that do not depend on run-time values; these match the counts in
+// the interpreter's handlers and Address()
+static unsigned
+jitCycles(JitOp op, AddrMode mode)
+{
+    // JSR and JMP take their target directly from the operand
+    if (op == jop_JSR || op == jop_JMP) {
+        return op == jop_JSR ? 6 : 3;
+    }
+
+    unsigned cycles;
+    switch (mode) {
+    case am_zp:
+        cycles = 1;
+        break;
+    case am_zp_x: case am_zp_y:
+    case am_abs: case am_abs_x: case am_abs_y:
+        cycles = 2;
+        break;
+    case am_ind_x:
+        cycles = 4;
+        break;
+    case am_ind_y:
+        cycles = 3;
+        break;
+    default:
+        cycles = 0;
+        break;
+    }
+    if (jitWrites(op)
+    &&  (mode == am_abs_x || mode == am_abs_y || mode == am_ind_y)) {
+        cycles += 1;
+    }
+
+    switch (op) {
+    case jop_ASL: case jop_LSR: case jop_ROL: case jop_ROR:
+        cycles += (mode == am_acc) ? 2 : 4;
+        break;
+    case jop_INC: case jop_DEC:
+        cycles += 4;
+        break;
+    case jop_PHA: case jop_PHP:
+        cycles += 3;
+        break;
+    case jop_PLA: case jop_PLP:
+        cycles += 4;
+        break;
+    case jop_RTS:
+        cycles += 6;
+        break;
+    default:
+        cycles += 2;
+        break;
+    }
+    return cycles;
 }
 
+// Emits x86-64 code for translated blocks. Throughout, RBX points to the
+// CPU6502Regs, and R12 holds an address across a call.
+class X86Emitter {
+public:
+    X86Emitter(JITBuffer &buf_) : buf(buf_) {}
+
+    void Code(std::initializer_list<std::uint8_t> bytes)
+    {
+        for (auto b : bytes) {
+            buf.Emit8(b);
+        }
+    }
+
+    void Prologue(void)
+    {
+        // Three pushes keep the stack aligned for calls
+        Code({ 0x53 });               // push rbx
+        Code({ 0x41, 0x54 });         // push r12
+        Code({ 0x41, 0x55 });         // push r13
+        Code({ 0x48, 0x89, 0xFB });   // mov rbx, rdi
+    }
+
+    // Return count to the caller; pc < 0 if reg_pc is already set
+    void Exit(long pc, unsigned count)
+    {
+        if (pc >= 0) {
+            Code({ 0x66, 0xC7, 0x43, Reg(&CPU6502Regs::reg_pc) });
+            buf.Emit16(pc);           // mov word [rbx+reg_pc], pc
+        }
+        buf.Emit8(0xB8);              // mov eax, count
+        buf.Emit32(count);
+        Code({ 0x41, 0x5D });         // pop r13
+        Code({ 0x41, 0x5C });         // pop r12
+        Code({ 0x5B });               // pop rbx
+        Code({ 0xC3 });               // ret
+    }
+
+    // Leave if EAX is nonzero, as returned by a write that removed code
+    void ExitIfWritten(long pc, unsigned count)
+    {
+        Code({ 0x85, 0xC0 });         // test eax, eax
+        Code({ 0x74, 0x00 });         // jz over exit
+        auto pos = buf.Position();
+        Exit(pc, count);
+        buf.Patch8(pos - 1, buf.Position() - pos);
+    }
+
+    // Call a helper with RDI = registers; other arguments are already in
+    // ESI and EDX
+    void Call(const void *func)
+    {
+        Code({ 0x48, 0x89, 0xDF });   // mov rdi, rbx
+        Code({ 0x48, 0xB8 });         // mov rax, func
+        buf.Emit64(reinterpret_cast<std::uintptr_t>(func));
+        Code({ 0xFF, 0xD0 });         // call rax
+    }
+
+    void AddCycles(unsigned cycles)
+    {
+        // add qword [rbx+emu_cycles], cycles
+        Code({ 0x48, 0x83, 0x43, Reg(&CPU6502Regs::emu_cycles),
+               static_cast<std::uint8_t>(cycles) });
+    }
+
+    // Add one cycle if bits 8-15 of ECX are nonzero
+    void AddPageCycle(void)
+    {
+        Code({ 0xC1, 0xE9, 0x08 });   // shr ecx, 8
+        Code({ 0x0F, 0x95, 0xC1 });   // setne cl
+        Code({ 0x0F, 0xB6, 0xC9 });   // movzx ecx, cl
+        // add [rbx+emu_cycles], rcx
+        Code({ 0x48, 0x01, 0x4B, Reg(&CPU6502Regs::emu_cycles) });
+    }
+
+    // Read the byte at ESI into EAX: straight from a page of RAM that
+    // pages, from Memory::GetReadPages(), points to, and otherwise through
+    // the helper
+    void ReadByte(std::uint8_t *const *pages, std::uint32_t page_mask,
+                  const void *helper)
+    {
+        LoadPage(pages, page_mask);
+        Code({ 0x74, 0x00 });         // jz slow
+        auto slow = buf.Position();
+        Code({ 0x40, 0x0F, 0xB6, 0xC6 }); // movzx eax, sil
+        Code({ 0x0F, 0xB6, 0x04, 0x01 }); // movzx eax, byte [rcx+rax]
+        Code({ 0xEB, 0x00 });         // jmp done
+        auto done = buf.Position();
+        buf.Patch8(slow - 1, done - slow);
+        Call(helper);
+        buf.Patch8(done - 1, buf.Position() - done);
+    }
+
+    // Write DL to the byte at ESI, and leave EAX nonzero if that removed
+    // cached code: straight to a page of RAM, where code_bytes shows no
+    // code at the address, and otherwise through the helper
+    void WriteByte(std::uint8_t *const *pages, std::uint32_t page_mask,
+                   const std::uint8_t *code_bytes, const void *helper)
+    {
+        LoadPage(pages, page_mask);
+        Code({ 0x74, 0x00 });         // jz slow
+        auto no_page = buf.Position();
+        Code({ 0x48, 0xB8 });         // mov rax, code_bytes
+        buf.Emit64(reinterpret_cast<std::uintptr_t>(code_bytes));
+        Code({ 0x80, 0x3C, 0x30, 0x00 }); // cmp byte [rax+rsi], 0
+        Code({ 0x75, 0x00 });         // jnz slow
+        auto code = buf.Position();
+        Code({ 0x40, 0x0F, 0xB6, 0xC6 }); // movzx eax, sil
+        Code({ 0x88, 0x14, 0x01 });   // mov [rcx+rax], dl
+        Code({ 0x31, 0xC0 });         // xor eax, eax
+        Code({ 0xEB, 0x00 });         // jmp done
+        auto done = buf.Position();
+        buf.Patch8(no_page - 1, done - no_page);
+        buf.Patch8(code - 1, done - code);
+        Call(helper);
+        buf.Patch8(done - 1, buf.Position() - done);
+    }
+
+    // Set N and Z from AL, and C from DL if carry is true
+    void SetFlags(bool carry)
+    {
+        Code({ 0x88, 0x43, Reg(&CPU6502Regs::flag_n) });  // mov [rbx+flag_n], al
+        Code({ 0x88, 0x43, Reg(&CPU6502Regs::flag_z) });  // mov [rbx+flag_z], al
+        if (carry) {
+            Code({ 0x88, 0x53, Reg(&CPU6502Regs::flag_c) });  // mov [rbx+flag_c], dl
+        }
+    }
+
+    template <class T>
+    static std::uint8_t Reg(T CPU6502Regs::*member)
+    {
+        // Offset of a register within CPU6502Regs
+        static const CPU6502Regs regs;
+        return reinterpret_cast<const char *>(&(regs.*member))
+             - reinterpret_cast<const char *>(&regs);
+    }
+
+    JITBuffer &buf;
+
+private:
+    // Load RCX from the entry of pages for the address in ESI, and set ZF
+    // if it is null
+    void LoadPage(std::uint8_t *const *pages, std::uint32_t page_mask)
+    {
+        Code({ 0x89, 0xF0 });         // mov eax, esi
+        Code({ 0xC1, 0xE8, 0x08 });   // shr eax, 8
+        Code({ 0x25 });               // and eax, page_mask
+        buf.Emit32(page_mask);
+        Code({ 0x48, 0xB9 });         // mov rcx, pages
+        buf.Emit64(reinterpret_cast<std::uintptr_t>(pages));
+        Code({ 0x48, 0x8B, 0x0C, 0xC1 }); // mov rcx, [rcx+rax*8]
+        Code({ 0x48, 0x85, 0xC9 });   // test rcx, rcx
+    }
+};
+
+#endif // CPU6502_JIT
+
+// Discard all native code; the blocks may be translated again
 void
-CPU6502Impl::do_TYA(std::uint8_t /*opcode*/)
+CPU6502Impl::DropTranslations(void)
 {
-    reg_a = reg_y;
-    SetNZ(reg_a);
-    emu_cycles += 2;
+    for (auto &block : blocks) {
+        if (block != nullptr) {
+            block->native = nullptr;
+            block->native_ops = 0;
+            block->native_length = 0;
+            block->runs = 0;
+            block->translated = false;
+        }
+    }
+    if (jit != nullptr) {
+        jit->Reset();
+    }
 }
 
-// Return the address of the operand
-std::uint16_t
-CPU6502Impl::GetAddress(std::uint8_t opcode)
+// Translate the leading instructions of the block that the translator
+// knows; the rest of the block is left to the interpreter
+void
+CPU6502Impl::TranslateBlock(Block *block)
 {
-    auto mode = instructions[opcode].addr_mode;
-    switch (mode) {
-    case am_ind_x:
-        // ABC (zp, X)
-        {
-            int byte1 = memory->Read8(reg_pc++);
-            if (byte1 < 0) {
-                return -1;
+#ifdef CPU6502_JIT
+    block->translated = true;
+
+    std::size_t count = 0;
+    unsigned length = 0;
+    // Only documented NMOS opcodes are translated. Of those, the 65C02 times
+    // abs,X shifts differently.
+    bool cmos = variant >= CPU6502::cmos;
+    while (count < block->ops.size()) {
+        auto opcode = block->ops[count].opcode;
+        auto &instr = documented[opcode];
+        if (jitOperation(instr.name, instr.addr_mode) == jop_none) {
+            break;
+        }
+        if (cmos && (opcode & 0x9F) == 0x1E) {
+            break;
+        }
+        length += block->ops[count].length;
+        ++count;
+    }
+    if (count == 0) {
+        return;
+    }
+
+    // Generous bound on the size of the code for one instruction
+    std::size_t max_size = 64 + 160 * count;
+    if (!jit->Begin(max_size)) {
+        DropTranslations();
+        block->translated = true;
+        if (!jit->Begin(max_size)) {
+            // Not for want of room; the host refuses to change the
+            // protection of the buffer
+            jit_enabled = false;
+            return;
+        }
+    }
+
+    X86Emitter x(*jit);
+    const auto a_reg = X86Emitter::Reg(&CPU6502Regs::reg_a);
+    const auto x_reg = X86Emitter::Reg(&CPU6502Regs::reg_x);
+    const auto y_reg = X86Emitter::Reg(&CPU6502Regs::reg_y);
+    const auto s_reg = X86Emitter::Reg(&CPU6502Regs::reg_s);
+    const auto p_reg = X86Emitter::Reg(&CPU6502Regs::reg_flags);
+    const auto n_flag = X86Emitter::Reg(&CPU6502Regs::flag_n);
+    const auto v_flag = X86Emitter::Reg(&CPU6502Regs::flag_v);
+    const auto z_flag = X86Emitter::Reg(&CPU6502Regs::flag_z);
+    const auto c_flag = X86Emitter::Reg(&CPU6502Regs::flag_c);
+
+    // Loads and stores reach plain RAM through the page tables of memory,
+    // as FastRead8() and FastWrite8() do, and call out for anything else
+    auto read_pages = memory->GetReadPages();
+    auto write_pages = memory->GetWritePages();
+    std::uint32_t page_mask = (memory->GetSize() - 1) >> 8;
+
+    x.Prologue();
+
+    std::uint16_t pc = block->start;
+    bool exited = false;
+    for (std::size_t k = 0; k < count; ++k) {
+        auto const &op = block->ops[k];
+        auto mode = documented[op.opcode].addr_mode;
+        auto jop = jitOperation(documented[op.opcode].name, mode);
+        bool writes = jitWrites(jop);
+        std::uint16_t next = pc + op.length;
+        std::uint8_t lo = op.operand & 0xFF;
+
+        x.AddCycles(jitCycles(jop, mode));
+
+        // Leave the operand address in ESI
+        switch (mode) {
+        case am_zp:
+            x.Code({ 0xBE }); x.buf.Emit32(lo);          // mov esi, zp
+            break;
+
+        case am_zp_x:
+        case am_zp_y:
+            // movzx esi, byte [rbx+index]
+            x.Code({ 0x0F, 0xB6, 0x73, mode == am_zp_x ? x_reg : y_reg });
+            x.Code({ 0x81, 0xC6 }); x.buf.Emit32(lo);    // add esi, zp
+            x.Code({ 0x81, 0xE6 }); x.buf.Emit32(0xFF);  // and esi, 0xFF
+            break;
+
+        case am_abs:
+            if (jop == jop_JSR || jop == jop_JMP) {
+                break;
             }
-            std::uint8_t zp_addr = byte1 + reg_x;
-            //zp_addr++, not zp_addr + 1, because read from 0xFF wraps to 0x00
-            int byte2 = memory->Read8(zp_addr++);
-            if (byte2 < 0) {
-                return -1;
+            x.Code({ 0xBE }); x.buf.Emit32(op.operand);  // mov esi, abs
+            break;
+
+        case am_abs_x:
+        case am_abs_y:
+            // movzx esi, byte [rbx+index]
+            x.Code({ 0x0F, 0xB6, 0x73, mode == am_abs_x ? x_reg : y_reg });
+            x.Code({ 0x81, 0xC6 }); x.buf.Emit32(op.operand); // add esi, abs
+            x.Code({ 0x81, 0xE6 }); x.buf.Emit32(0xFFFF);     // and esi, 0xFFFF
+            if (!writes) {
+                x.Code({ 0x89, 0xF1 });                  // mov ecx, esi
+                x.Code({ 0x81, 0xF1 });                  // xor ecx, abs
+                x.buf.Emit32(op.operand);
+                x.AddPageCycle();
             }
-            int byte3 = memory->Read8(zp_addr);
-            if (byte3 < 0) {
-                return -1;
+            break;
+
+        case am_ind_x:
+            // movzx esi, byte [rbx+reg_x]
+            x.Code({ 0x0F, 0xB6, 0x73, x_reg });
+            x.Code({ 0x81, 0xC6 }); x.buf.Emit32(lo);    // add esi, zp
+            x.Call(reinterpret_cast<const void *>(&JitRead16ZP));
+            x.Code({ 0x89, 0xC6 });                      // mov esi, eax
+            break;
+
+        case am_ind_y:
+            x.Code({ 0xBE }); x.buf.Emit32(lo);          // mov esi, zp
+            x.Call(reinterpret_cast<const void *>(&JitRead16ZP));
+            x.Code({ 0x0F, 0xB6, 0x4B, y_reg });         // movzx ecx, byte [rbx+reg_y]
+            x.Code({ 0x8D, 0x34, 0x08 });                // lea esi, [rax+rcx]
+            x.Code({ 0x81, 0xE6 }); x.buf.Emit32(0xFFFF);// and esi, 0xFFFF
+            if (!writes) {
+                x.Code({ 0x89, 0xC1 });                  // mov ecx, eax
+                x.Code({ 0x31, 0xF1 });                  // xor ecx, esi
+                x.AddPageCycle();
             }
-            emu_cycles += 4;
-            return byte3 * 0x100 + byte2;
+            break;
+
+        default:
+            break;
         }
 
-    case am_immediate:
-        // ABC #imm
-        return reg_pc++;
+        // Instructions that read an operand get it in AL
+        bool reads;
+        switch (jop) {
+        case jop_LDA: case jop_LDX: case jop_LDY:
+        case jop_ORA: case jop_AND: case jop_EOR:
+        case jop_ADC: case jop_SBC:
+        case jop_CMP: case jop_CPX: case jop_CPY: case jop_BIT:
+            reads = true;
+            break;
+        case jop_ASL: case jop_LSR: case jop_ROL: case jop_ROR:
+        case jop_INC: case jop_DEC:
+            reads = mode != am_acc;
+            break;
+        default:
+            reads = false;
+            break;
+        }
+        if (reads) {
+            if (mode == am_immediate) {
+                x.Code({ 0xB8 }); x.buf.Emit32(lo);      // mov eax, imm
+            } else {
+                if (writes) {
+                    x.Code({ 0x41, 0x89, 0xF4 });        // mov r12d, esi
+                }
+                x.ReadByte(read_pages, page_mask,
+                           reinterpret_cast<const void *>(&JitRead8));
+            }
+        }
 
-    case am_ind_y:
-        // ABC (zp), Y
-        {
-            int byte1 = memory->Read8(reg_pc++);
-            if (byte1 < 0) {
-                return -1;
+        switch (jop) {
+        case jop_LDA:
+        case jop_LDX:
+        case jop_LDY:
+            {
+                auto r = jop == jop_LDA ? a_reg : jop == jop_LDX ? x_reg : y_reg;
+                x.Code({ 0x88, 0x43, r });               // mov [rbx+r], al
+                x.SetFlags(false);
             }
-            std::uint8_t zp_addr = byte1;
-            //zp_addr++, not zp_addr + 1, because read from 0xFF wraps to 0x00
-            int byte2 = memory->Read8(zp_addr++);
-            if (byte2 < 0) {
-                return -1;
+            break;
+
+        case jop_STA:
+        case jop_STX:
+        case jop_STY:
+            {
+                auto r = jop == jop_STA ? a_reg : jop == jop_STX ? x_reg : y_reg;
+                x.Code({ 0x0F, 0xB6, 0x53, r });         // movzx edx, byte [rbx+r]
+                x.WriteByte(write_pages, page_mask, code_bytes.data(),
+                            reinterpret_cast<const void *>(&JitWrite8));
+                x.ExitIfWritten(next, k + 1);
             }
-            int byte3 = memory->Read8(zp_addr);
-            if (byte3 < 0) {
-                return -1;
+            break;
+
+        case jop_ORA:
+            x.Code({ 0x0A, 0x43, a_reg });               // or al, [rbx+reg_a]
+            x.Code({ 0x88, 0x43, a_reg });               // mov [rbx+reg_a], al
+            x.SetFlags(false);
+            break;
+
+        case jop_AND:
+            x.Code({ 0x22, 0x43, a_reg });               // and al, [rbx+reg_a]
+            x.Code({ 0x88, 0x43, a_reg });               // mov [rbx+reg_a], al
+            x.SetFlags(false);
+            break;
+
+        case jop_EOR:
+            x.Code({ 0x32, 0x43, a_reg });               // xor al, [rbx+reg_a]
+            x.Code({ 0x88, 0x43, a_reg });               // mov [rbx+reg_a], al
+            x.SetFlags(false);
+            break;
+
+        case jop_ADC:
+        case jop_SBC:
+            // Decimal mode and overflow are left to the interpreter's code
+            x.Code({ 0x0F, 0xB6, 0xF0 });                // movzx esi, al
+            if (jop == jop_ADC) {
+                x.Call(cmos ? reinterpret_cast<const void *>(&JitADC<true>)
+                            : reinterpret_cast<const void *>(&JitADC<false>));
+            } else {
+                x.Call(cmos ? reinterpret_cast<const void *>(&JitSBC<true>)
+                            : reinterpret_cast<const void *>(&JitSBC<false>));
             }
-            std::uint16_t addr1 = byte3 * 0x100 + byte2;
-            std::uint16_t addr2 = addr1 + reg_y;
-            emu_cycles += 3;
-            if ((addr2 >> 8) != (addr1 >> 8)) {
-                emu_cycles += 1;
+            break;
+
+        case jop_CMP:
+        case jop_CPX:
+        case jop_CPY:
+            {
+                auto r = jop == jop_CMP ? a_reg : jop == jop_CPX ? x_reg : y_reg;
+                x.Code({ 0x88, 0xC1 });                  // mov cl, al
+                x.Code({ 0x8A, 0x43, r });               // mov al, [rbx+r]
+                x.Code({ 0x28, 0xC8 });                  // sub al, cl
+                x.Code({ 0x0F, 0x93, 0xC2 });            // setae dl
+                x.SetFlags(true);
             }
-            return addr2;
-        }
+            break;
 
-    case am_zp: // ABC zp
-    case am_zp_x: // ABC zp, X
-    case am_zp_y: // ABC zp, Y
-        {
-            int byte1 = memory->Read8(reg_pc++);
-            if (byte1 < 0) {
-                return -1;
+        case jop_BIT:
+            x.Code({ 0x88, 0x43, n_flag });              // mov [rbx+flag_n], al
+            x.Code({ 0x88, 0xC1 });                      // mov cl, al
+            x.Code({ 0xD0, 0xE1 });                      // shl cl, 1
+            x.Code({ 0x88, 0x4B, v_flag });              // mov [rbx+flag_v], cl
+            x.Code({ 0x22, 0x43, a_reg });               // and al, [rbx+reg_a]
+            x.Code({ 0x88, 0x43, z_flag });              // mov [rbx+flag_z], al
+            break;
+
+        case jop_ASL:
+        case jop_LSR:
+        case jop_ROL:
+        case jop_ROR:
+        case jop_INC:
+        case jop_DEC:
+            if (mode == am_acc) {
+                x.Code({ 0x8A, 0x43, a_reg });           // mov al, [rbx+reg_a]
             }
-            emu_cycles += 2;
-            if (mode == am_zp_x) {
-                byte1 += reg_x;
-            } else if (mode == am_zp_y) {
-                byte1 += reg_y;
+            switch (jop) {
+            case jop_ASL:
+                x.Code({ 0xD0, 0xE0 });                  // shl al, 1
+                break;
+            case jop_LSR:
+                x.Code({ 0xD0, 0xE8 });                  // shr al, 1
+                break;
+            case jop_ROL:
+                x.Code({ 0x8A, 0x4B, c_flag });          // mov cl, [rbx+flag_c]
+                x.Code({ 0xD0, 0xE9 });                  // shr cl, 1
+                x.Code({ 0xD0, 0xD0 });                  // rcl al, 1
+                break;
+            case jop_ROR:
+                x.Code({ 0x8A, 0x4B, c_flag });          // mov cl, [rbx+flag_c]
+                x.Code({ 0xD0, 0xE9 });                  // shr cl, 1
+                x.Code({ 0xD0, 0xD8 });                  // rcr al, 1
+                break;
+            case jop_INC:
+                x.Code({ 0xFE, 0xC0 });                  // inc al
+                break;
+            default:
+                x.Code({ 0xFE, 0xC8 });                  // dec al
+                break;
             }
-            // Overflow past zero page wraps to zero
-            return byte1 & 0xFF;
-        }
+            if (jop == jop_INC || jop == jop_DEC) {
+                x.SetFlags(false);
+            } else {
+                x.Code({ 0x0F, 0x92, 0xC2 });            // setc dl
+                x.SetFlags(true);
+            }
+            if (mode == am_acc) {
+                x.Code({ 0x88, 0x43, a_reg });           // mov [rbx+reg_a], al
+            } else {
+                x.Code({ 0x0F, 0xB6, 0xD0 });            // movzx edx, al
+                x.Code({ 0x44, 0x89, 0xE6 });            // mov esi, r12d
+                x.WriteByte(write_pages, page_mask, code_bytes.data(),
+                            reinterpret_cast<const void *>(&JitWrite8));
+                x.ExitIfWritten(next, k + 1);
+            }
+            break;
 
-    case am_abs: // ABC abs
-    case am_abs_x: // ABC abs, X
-    case am_abs_y: // ABC abs, Y
-        {
-            int byte1 = memory->Read8(reg_pc++);
-            if (byte1 < 0) {
-                return -1;
+        case jop_INX:
+        case jop_INY:
+        case jop_DEX:
+        case jop_DEY:
+            {
+                auto r = (jop == jop_INX || jop == jop_DEX) ? x_reg : y_reg;
+                x.Code({ 0x8A, 0x43, r });               // mov al, [rbx+r]
+                if (jop == jop_INX || jop == jop_INY) {
+                    x.Code({ 0xFE, 0xC0 });              // inc al
+                } else {
+                    x.Code({ 0xFE, 0xC8 });              // dec al
+                }
+                x.Code({ 0x88, 0x43, r });               // mov [rbx+r], al
+                x.SetFlags(false);
             }
-            int byte2 = memory->Read8(reg_pc++);
-            if (byte2 < 0) {
-                return -1;
+            break;
+
+        case jop_TAX:
+        case jop_TAY:
+        case jop_TXA:
+        case jop_TYA:
+        case jop_TSX:
+        case jop_TXS:
+            {
+                std::uint8_t from, to;
+                switch (jop) {
+                case jop_TAX: from = a_reg; to = x_reg; break;
+                case jop_TAY: from = a_reg; to = y_reg; break;
+                case jop_TXA: from = x_reg; to = a_reg; break;
+                case jop_TYA: from = y_reg; to = a_reg; break;
+                case jop_TSX: from = s_reg; to = x_reg; break;
+                default:      from = x_reg; to = s_reg; break;
+                }
+                x.Code({ 0x8A, 0x43, from });            // mov al, [rbx+from]
+                x.Code({ 0x88, 0x43, to });              // mov [rbx+to], al
+                if (jop != jop_TXS) {
+                    x.SetFlags(false);
+                }
             }
-            std::uint16_t addr1 = byte2 * 0x100 + byte1;
-            std::uint16_t addr2 = addr1;
-            if (mode == am_abs_x) {
-                addr2 += reg_x;
-            } else if (mode == am_abs_y) {
-                addr2 += reg_y;
+            break;
+
+        case jop_CLC:
+            x.Code({ 0xC6, 0x43, c_flag, 0x00 });        // mov byte [rbx+flag_c], 0
+            break;
+
+        case jop_SEC:
+            x.Code({ 0xC6, 0x43, c_flag, 0x01 });        // mov byte [rbx+flag_c], 1
+            break;
+
+        case jop_CLV:
+            x.Code({ 0xC6, 0x43, v_flag, 0x00 });        // mov byte [rbx+flag_v], 0
+            break;
+
+        case jop_CLI:
+        case jop_CLD:
+            {
+                std::uint8_t mask = jop == jop_CLI ? 0xFB : 0xF7;
+                x.Code({ 0x80, 0x63, p_reg, mask });     // and byte [rbx+reg_flags], mask
             }
-            emu_cycles += 2;
-            if ((addr2 >> 8) != (addr1 >> 8)) {
-                emu_cycles += 1;
+            break;
+
+        case jop_SEI:
+        case jop_SED:
+            {
+                std::uint8_t bit = jop == jop_SEI ? 0x04 : 0x08;
+                x.Code({ 0x80, 0x4B, p_reg, bit });      // or byte [rbx+reg_flags], bit
             }
-            return addr2;
-        }
+            break;
 
-    default: // shouldn't happen
-    //am_invalid = -1,
-    //am_implied = 0,
-    //am_acc,
-    //am_ind,
-    //am_rel
-        return -1;
-    }
-}
+        case jop_NOP:
+            break;
 
-void
-CPU6502Impl::Compare(std::uint8_t reg, std::uint8_t byte)
-{
-    int result = reg + (byte ^ 0xFF) + 1;
-    SetNZ(result);
-    SetC(result > 0xFF);
-}
+        case jop_PHA:
+            x.Code({ 0x0F, 0xB6, 0x73, a_reg });         // movzx esi, byte [rbx+reg_a]
+            x.Call(reinterpret_cast<const void *>(&JitPush));
+            x.ExitIfWritten(next, k + 1);
+            break;
 
-void
-CPU6502Impl::PushByte(std::uint8_t byte)
-{
-    std::uint16_t address = 0x0100 + --reg_s;
-    memory->Write8(address, byte);
-}
+        case jop_PHP:
+            x.Call(reinterpret_cast<const void *>(&JitPushFlags));
+            x.ExitIfWritten(next, k + 1);
+            break;
 
-std::uint8_t
-CPU6502Impl::PopByte(void)
-{
-    std::uint16_t address = 0x0100 + reg_s++;
-    return memory->Read8(address);
-}
+        case jop_PLA:
+            x.Call(reinterpret_cast<const void *>(&JitPop));
+            x.Code({ 0x88, 0x43, a_reg });               // mov [rbx+reg_a], al
+            x.SetFlags(false);
+            break;
 
-void
-CPU6502Impl::SetNZ(std::uint8_t result)
-{
-    reg_flags = (reg_flags & 0x7F) | (result & 0x80);
-    SetZ(result);
-}
+        case jop_PLP:
+            x.Call(reinterpret_cast<const void *>(&JitPullFlags));
+            break;
 
-void
-CPU6502Impl::SetZ(std::uint8_t result)
-{
-    if (result == 0) {
-        reg_flags |= 0x02;
-    } else {
-        reg_flags &= 0xFD;
+        case jop_JSR:
+            {
+                // Push the address of the last byte of the instruction
+                std::uint16_t last = next - 1;
+                x.Code({ 0xBE }); x.buf.Emit32(last >> 8);   // mov esi, high
+                x.Call(reinterpret_cast<const void *>(&JitPush));
+                x.Code({ 0xBE }); x.buf.Emit32(last & 0xFF); // mov esi, low
+                x.Call(reinterpret_cast<const void *>(&JitPush));
+                x.Exit(op.operand, k + 1);
+                exited = true;
+            }
+            break;
+
+        case jop_RTS:
+            x.Call(reinterpret_cast<const void *>(&JitRTS));
+            x.Exit(-1, k + 1);
+            exited = true;
+            break;
+
+        case jop_JMP:
+            x.Exit(op.operand, k + 1);
+            exited = true;
+            break;
+
+        case jop_branch:
+            {
+                bool set = (op.opcode & 0x20) != 0;
+                std::uint16_t target = next + (lo ^ 0x80) - 0x80;
+
+                // Leave ZF set if the flag is clear, or for Z, if it is set
+                switch (op.opcode >> 6) {
+                case 0: // BPL, BMI
+                    x.Code({ 0xF6, 0x43, n_flag, 0x80 }); // test byte [rbx+flag_n], 0x80
+                    break;
+                case 1: // BVC, BVS
+                    x.Code({ 0xF6, 0x43, v_flag, 0x80 }); // test byte [rbx+flag_v], 0x80
+                    break;
+                case 2: // BCC, BCS
+                    x.Code({ 0xF6, 0x43, c_flag, 0x01 }); // test byte [rbx+flag_c], 1
+                    break;
+                default: // BNE, BEQ; Z is set when flag_z is zero
+                    x.Code({ 0x80, 0x7B, z_flag, 0x00 }); // cmp byte [rbx+flag_z], 0
+                    set = !set;
+                    break;
+                }
+                // Jump to the untaken path
+                x.Code({ static_cast<std::uint8_t>(set ? 0x74 : 0x75), 0x00 });
+                auto pos = x.buf.Position();
+                x.AddCycles((target >> 8) != (next >> 8) ? 2 : 1);
+                x.Exit(target, k + 1);
+                x.buf.Patch8(pos - 1, x.buf.Position() - pos);
+                x.Exit(next, k + 1);
+                exited = true;
+            }
+            break;
+
+        default:
+            break;
+        }
+
+        pc = next;
     }
-}
 
-void
-CPU6502Impl::SetV(bool overflow)
-{
-    if (overflow) {
-        reg_flags |= 0x40;
-    } else {
-        reg_flags &= 0xBF;
+    if (!exited) {
+        x.Exit(pc, count);
     }
-}
 
-void
-CPU6502Impl::SetC(bool carry)
-{
-    if (carry) {
-        reg_flags |= 0x01;
-    } else {
-        reg_flags &= 0xFE;
+    block->native = reinterpret_cast<NativeBlock>(jit->End());
+    if (block->native == nullptr) {
+        // None of the buffer can run now
+        DropTranslations();
+        block->translated = true;
+        jit_enabled = false;
+        return;
     }
+    block->native_ops = count;
+    block->native_length = length;
+#else
+    block->translated = true;
+#endif
 }
 
 //////////////////////////////////////////////////////////////////////////////
 //                           Begin assembler code                           //
 //////////////////////////////////////////////////////////////////////////////
 
-static AddrMode parseOperand(std::string const &operand, std::string &address);
+static AddrMode parseOperand(std::string const &operand, std::string &address,
+                             std::string &target);
 static AddrMode checkAddress(AddrMode mode, const std::string& address);
 
 CPU::Assem
@@ -1585,8 +5303,8 @@ CPU6502Impl::Assemble(std::uint64_t pc, const std::string& code) const
     auto operand = code.substr(start+len);
 
     // Parse the operand
-    std::string address;
-    auto mode = parseOperand(operand, address);
+    std::string address, target;
+    auto mode = parseOperand(operand, address, target);
     // Handle cases where an instruction does not support both zero page and
     // absolute
     AddrMode alt_mode = am_invalid;
@@ -1619,6 +5337,15 @@ CPU6502Impl::Assemble(std::uint64_t pc, const std::string& code) const
         }
         break;
 
+    // The 65C02 adds (zp) and JMP (abs,X)
+    case am_zp_ind:
+        alt_mode = am_ind;
+        break;
+
+    case am_ind_x:
+        alt_mode = am_abs_ind_x;
+        break;
+
     default:
         break;
     }
@@ -1663,6 +5390,7 @@ CPU6502Impl::Assemble(std::uint64_t pc, const std::string& code) const
     case am_zp:
     case am_ind_x:
     case am_ind_y:
+    case am_zp_ind:
         assem.bytes.push_back(addr_num);
         break;
 
@@ -1671,10 +5399,23 @@ CPU6502Impl::Assemble(std::uint64_t pc, const std::string& code) const
     case am_abs_y:
     case am_abs:
     case am_ind:
+    case am_abs_ind_x:
         assem.bytes.push_back(addr_num & 0xFF);
         assem.bytes.push_back(addr_num >> 8);
         break;
 
+    // Zero page address, then relative branch
+    case am_zp_rel:
+        {
+            int offset = std::strtoul(target.c_str(), NULL, 16) - (pc + 3);
+            if (offset < -128 || offset > +127) {
+                return error;
+            }
+            assem.bytes.push_back(addr_num);
+            assem.bytes.push_back(offset & 0xFF);
+        }
+        break;
+
     // Relative branch
     case am_rel:
         {
@@ -1692,8 +5433,15 @@ CPU6502Impl::Assemble(std::uint64_t pc, const std::string& code) const
 
 // Scan the instructions table for the instruction and mode
 int
-CPU6502Impl::FindOpcode(std::string const &instr, AddrMode mode)
+CPU6502Impl::FindOpcode(std::string const &instr, AddrMode mode) const
 {
+    // Prefer the documented opcode, where a variant adds another with the
+    // same meaning, such as NOP
+    for (int i = 0; i < 256; ++i) {
+        if (instr == documented[i].name && mode == documented[i].addr_mode) {
+            return i;
+        }
+    }
     for (int i = 0; i < 256; ++i) {
         if (instr == instructions[i].name && mode == instructions[i].addr_mode) {
             return i;
@@ -1705,7 +5453,8 @@ CPU6502Impl::FindOpcode(std::string const &instr, AddrMode mode)
 //////////////////////////////////////////////////////////////////////////////
 
 static AddrMode
-parseOperand(std::string const &operand, std::string &address)
+parseOperand(std::string const &operand, std::string &address,
+             std::string &target)
 {
     // Delete whitespace and convert to uppercase
     std::vector<char> buf(operand.size()+1);
@@ -1755,6 +5504,18 @@ parseOperand(std::string const &operand, std::string &address)
         return checkAddress(am_abs_y, address);
     }
 
+    // Zero page and branch target, for BBR and BBS
+    std::regex zp_rel_regex(R"-(^\$?([0-9A-F]+),\$?([0-9A-F]+)$)-",
+        std::regex_constants::ECMAScript | std::regex_constants::icase);
+    if (std::regex_match(op2, match, zp_rel_regex)) {
+        address = match[1];
+        target = match[2];
+        if (std::strtoul(target.c_str(), NULL, 16) > 0xFFFF) {
+            return am_invalid;
+        }
+        return checkAddress(am_zp_rel, address);
+    }
+
     // Absolute and zero-page mode
     std::regex abs_regex(R"-(^\$?([0-9A-F]+))-",
         std::regex_constants::ECMAScript | std::regex_constants::icase);
@@ -1768,7 +5529,9 @@ parseOperand(std::string const &operand, std::string &address)
         std::regex_constants::ECMAScript | std::regex_constants::icase);
     if (std::regex_match(op2, match, ind_x_regex)) {
         address = match[1];
-        return checkAddress(am_ind_x, address);
+        // Or JMP (abs,X) on the 65C02
+        return checkAddress(address.size() <= 2 ? am_ind_x : am_abs_ind_x,
+                            address);
     }
 
     // Indirect-Y mode
@@ -1784,7 +5547,8 @@ parseOperand(std::string const &operand, std::string &address)
         std::regex_constants::ECMAScript | std::regex_constants::icase);
     if (std::regex_match(op2, match, ind_regex)) {
         address = match[1];
-        return checkAddress(am_ind, address);
+        // Or (zp) on the 65C02
+        return checkAddress(address.size() <= 2 ? am_zp_ind : am_ind, address);
     }
 
     address = "";
@@ -1801,6 +5565,7 @@ checkAddress(AddrMode mode, const std::string& address)
     case am_abs:
     case am_ind:
     case am_rel:
+    case am_abs_ind_x:
         {
             auto a = std::strtoul(address.c_str(), NULL, 16);
             return a > 0xFFFF ? am_invalid : mode;
@@ -1812,6 +5577,8 @@ checkAddress(AddrMode mode, const std::string& address)
     case am_zp:
     case am_ind_x:
     case am_ind_y:
+    case am_zp_ind:
+    case am_zp_rel:
         {
             auto a = std::strtoul(address.c_str(), NULL, 16);
             return a > 0xFF ? am_invalid : mode;
@@ -3,7 +3,10 @@
 #ifndef CPU6502_H
 #define CPU6502_H
 
+#include <climits>
 #include <cstdint>
+#include <memory>
+#include <set>
 #include <string>
 #include <vector>
 #include "cpu.h"
@@ -12,16 +15,58 @@ class Memory;
 
 class CPU6502 : public CPU {
 public:
-    CPU6502(Memory *mem);
+    // Instruction sets. The variant is fixed when the CPU is built; each has
+    // its own dispatch code, so nothing checks it per instruction.
+    enum Variant {
+        nmos,               // NMOS 6502, documented opcodes only
+        nmos_undocumented,  // NMOS 6502 with its undocumented opcodes
+        cmos,               // 65C02
+        wdc                 // Rockwell and WDC 65C02: 65C02 with RMB, SMB,
+                            // BBR and BBS, and WDC's WAI and STP
+    };
+
+    CPU6502(Memory *mem, Variant variant = nmos);
     virtual ~CPU6502(void);
 
+    Variant GetVariant(void) const;
+
+    // Host cost of each opcode, in the instrumented build, which is made
+    // with CPU6502_INSTRUMENT defined; other builds return nothing. That
+    // build interprets all code, counts every instruction, and times a
+    // random sample of about one in sixteen on the host, from which the
+    // time for all of them is estimated. The opcodes that have run come
+    // most expensive first.
+    struct OpcodeCost {
+        std::uint8_t opcode;
+        unsigned long long count;
+        double seconds;
+    };
+    std::vector<OpcodeCost> GetOpcodeCosts(void) const;
+    void ClearOpcodeCosts(void);
+
     virtual std::vector<std::string> GetRegisterList(void) const override;
     virtual std::vector<Flag> GetFlags(void) const override;
     virtual std::string GetRegister(const std::string& reg_name) const override;
     virtual bool SetRegister(const std::string& reg_name, const std::string& value) override;
+    virtual std::uint64_t GetRegisterValue(int index) const override;
     virtual void Step(void) override;
     virtual void Next(void) override;
     virtual void ToReturn(void) override;
+    virtual StopReason Run(void) override;
+    virtual RunResult RunCycles(unsigned long budget) override;
+    virtual RunResult RunInstructions(unsigned long count) override;
+    virtual RunResult RunUntil(const std::set<std::uint64_t>& stops,
+                               unsigned long max_count = ULONG_MAX) override;
+    virtual bool SetJIT(bool enable) override;
+    virtual bool SetBreakStop(bool enable) override;
+    virtual bool StartTrace(const std::string& path) override;
+    virtual void StopTrace(void) override;
+    virtual bool StartProfile(void) override;
+    virtual void StopProfile(void) override;
+    virtual const CallProfile *GetProfile(void) override;
+    virtual bool SetHistory(std::size_t budget, unsigned long interval) override;
+    virtual bool StepBack(void) override;
+    virtual StopReason ReverseContinue(void) override;
     virtual std::vector<MemZone> GetMemZones(void) const override;
 
     virtual std::uint64_t GetPC(void) const override;
@@ -32,7 +77,19 @@ public:
     virtual unsigned long GetEmuCycles(void) const override;
     virtual void ClearEmuCycles(void) override;
 
+    virtual void SetIRQ(bool asserted) override;
+    virtual void NMI(void) override;
+    virtual void Reset(void) override;
+
+protected:
+    virtual void EventScheduled(unsigned long cycle) override;
+    virtual std::shared_ptr<const void> SaveState(void) const override;
+    virtual void RestoreState(const void *state) override;
+
 private:
+    RunResult RunLimited(unsigned long count, unsigned long cycles,
+                         const std::set<std::uint64_t> *stops);
+
     void *impl;
 };
 
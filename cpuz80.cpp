@@ -0,0 +1,3256 @@
+// cpuz80.cpp
+
+#include <algorithm>
+#include <array>
+#include <map>
+#include <memory>
+#include <utility>
+#include <cctype>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "cpuz80.h"
+#include "memory.h"
+
+namespace {
+
+// Bits of the F register
+const std::uint8_t flag_c  = 0x01;
+const std::uint8_t flag_n  = 0x02;
+const std::uint8_t flag_pv = 0x04;
+const std::uint8_t flag_x  = 0x08;   // Undocumented; bit 3 of some result
+const std::uint8_t flag_h  = 0x10;
+const std::uint8_t flag_y  = 0x20;   // Undocumented; bit 5 of some result
+const std::uint8_t flag_z  = 0x40;
+const std::uint8_t flag_s  = 0x80;
+
+// S, Z, Y and X as a byte value sets them, and the same with parity in P
+struct FlagTables {
+    std::uint8_t sz53[256];
+    std::uint8_t sz53p[256];
+
+    FlagTables(void)
+    {
+        for (unsigned i = 0; i < 256; ++i) {
+            sz53[i] = (i & (flag_s | flag_y | flag_x)) | (i == 0 ? flag_z : 0);
+            unsigned bits = 0;
+            for (unsigned b = i; b != 0; b >>= 1) {
+                bits += b & 1;
+            }
+            sz53p[i] = sz53[i] | ((bits & 1) == 0 ? flag_pv : 0);
+        }
+    }
+};
+const FlagTables flag_tables;
+
+// T-states for each unprefixed opcode. Conditional jumps, calls and returns
+// are given for the case where the condition fails, and the handlers add the
+// difference. The prefixes are zero here; their own tables count them.
+const std::uint8_t base_cycles[256] = {
+/*        0   1   2   3   4   5   6   7   8   9   A   B   C   D   E   F */
+/* 00 */  4, 10,  7,  6,  4,  4,  7,  4,  4, 11,  7,  6,  4,  4,  7,  4,
+/* 10 */  8, 10,  7,  6,  4,  4,  7,  4, 12, 11,  7,  6,  4,  4,  7,  4,
+/* 20 */  7, 10, 16,  6,  4,  4,  7,  4,  7, 11, 16,  6,  4,  4,  7,  4,
+/* 30 */  7, 10, 13,  6, 11, 11, 10,  4,  7, 11, 13,  6,  4,  4,  7,  4,
+/* 40 */  4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,
+/* 50 */  4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,
+/* 60 */  4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,
+/* 70 */  7,  7,  7,  7,  7,  7,  4,  7,  4,  4,  4,  4,  4,  4,  7,  4,
+/* 80 */  4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,
+/* 90 */  4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,
+/* A0 */  4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,
+/* B0 */  4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,
+/* C0 */  5, 10, 10, 10, 10, 11,  7, 11,  5, 10, 10,  0, 10, 17,  7, 11,
+/* D0 */  5, 10, 10, 11, 10, 11,  7, 11,  5,  4, 10, 11, 10,  0,  7, 11,
+/* E0 */  5, 10, 10, 19, 10, 11,  7, 11,  5,  4, 10,  4, 10,  0,  7, 11,
+/* F0 */  5, 10, 10,  4, 10, 11,  7, 11,  5,  6, 10,  4, 10,  0,  7, 11
+};
+
+// T-states for the prefixed opcodes, each including its prefixes. The index
+// tables count the DD or FD prefix; index_cb counts only what follows the DD
+// CB, as index[0xCB] has counted that.
+struct CycleTables {
+    std::uint8_t cb[256];
+    std::uint8_t ed[256];
+    std::uint8_t index[256];
+    std::uint8_t index_cb[256];
+
+    CycleTables(void)
+    {
+        for (unsigned op = 0; op < 256; ++op) {
+            unsigned x = op >> 6;
+            unsigned y = (op >> 3) & 7;
+            unsigned z = op & 7;
+
+            // CB: 8 for a register, more for (HL)
+            cb[op] = (z != 6) ? 8 : (x == 1) ? 12 : 15;
+
+            // ED: anything not listed acts as two NOPs
+            ed[op] = 8;
+            if (x == 1) {
+                static const std::uint8_t ed1[8] = { 12, 12, 15, 20, 8, 14, 8, 0 };
+                ed[op] = (z != 7) ? ed1[z] : (y < 4) ? 9 : (y < 6) ? 18 : 8;
+            } else if (x == 2 && z <= 3 && y >= 4) {
+                ed[op] = 16;
+            }
+
+            // DD and FD: four for the prefix, and eight to add the offset
+            // to an (IX+d) operand; LD (IX+d),n fetches n meanwhile
+            unsigned extra = 0;
+            if ((x == 1 && (y == 6) != (z == 6))
+            ||  (x == 2 && z == 6)
+            ||  (x == 0 && y == 6 && (z == 4 || z == 5))) {
+                extra = 8;
+            } else if (op == 0x36) {
+                extra = 5;
+            }
+            index[op] = 4 + base_cycles[op] + extra;
+
+            // DD CB d op: 23, or 20 for BIT
+            index_cb[op] = (x == 1) ? 16 : 19;
+        }
+        // A DD, ED or FD after DD or FD cancels it
+        index[0xDD] = index[0xED] = index[0xFD] = 4;
+    }
+};
+const CycleTables cycle_tables;
+
+// Which register stands for HL: unprefixed, DD or FD
+enum Index {
+    idx_hl,
+    idx_ix,
+    idx_iy
+};
+
+// Tables of mnemonics, for disassembly and assembly
+enum Table {
+    tab_base,
+    tab_cb,
+    tab_ed,
+    tab_ix,
+    tab_iy,
+    tab_ix_cb,
+    tab_iy_cb,
+    num_tables
+};
+
+// The registers, kept apart so that a snapshot can copy them
+struct CPUZ80Regs {
+    std::uint8_t reg_a;
+    std::uint8_t reg_f;
+    std::uint16_t reg_bc;
+    std::uint16_t reg_de;
+    std::uint16_t reg_hl;
+    std::uint16_t reg_ix;
+    std::uint16_t reg_iy;
+    std::uint16_t reg_sp;
+    std::uint16_t reg_pc;
+    // The alternate set, for EX AF,AF' and EXX
+    std::uint16_t alt_af;
+    std::uint16_t alt_bc;
+    std::uint16_t alt_de;
+    std::uint16_t alt_hl;
+    std::uint8_t reg_i;
+    std::uint8_t reg_r;
+    // An internal address latch, which shows in the X and Y flags after
+    // BIT n,(HL)
+    std::uint16_t memptr;
+    bool iff1;
+    bool iff2;
+    std::uint8_t int_mode;
+    unsigned long emu_cycles;
+
+    CPUZ80Regs(void) :
+        reg_a(0xFF),
+        reg_f(0xFF),
+        reg_bc(0),
+        reg_de(0),
+        reg_hl(0),
+        reg_ix(0),
+        reg_iy(0),
+        reg_sp(0xFFFF),
+        reg_pc(0),
+        alt_af(0),
+        alt_bc(0),
+        alt_de(0),
+        alt_hl(0),
+        reg_i(0),
+        reg_r(0),
+        memptr(0),
+        iff1(false),
+        iff2(false),
+        int_mode(0),
+        emu_cycles(0)
+    {
+    }
+};
+
+struct CPUZ80Impl : CPUZ80Regs {
+    CPU *cpu;
+    Memory *memory;
+
+    // Address of (IX+d), computed before a DD CB or FD CB opcode is fetched
+    std::uint16_t index_addr;
+
+    CPUZ80Impl(CPU *cpu, Memory *mem);
+    ~CPUZ80Impl(void);
+    bool DoStep(CPU::StopReason& reason);
+    CPU::StopReason Execute(unsigned long count, unsigned long end_cycle,
+                            unsigned long& done);
+    bool BreakpointHit(void);
+
+    // Addresses for RunUntil(); empty at other times
+    std::vector<bool> stop_at;
+    // Set to stop before HALT
+    bool break_stop;
+
+    CPUZ80::PortIn port_in;
+    CPUZ80::PortOut port_out;
+    std::uint8_t int_data;
+
+    void SetIRQ(bool asserted);
+    void NMI(void);
+    void Reset(void);
+    void EventScheduled(unsigned long cycle);
+
+    // What a snapshot keeps of the CPU
+    struct State : CPUZ80Regs {
+        bool irq_line;
+        bool nmi_pending;
+        bool ei_delay;
+        bool halted;
+    };
+    std::shared_ptr<const void> SaveState(void) const;
+    void RestoreState(const void *state);
+
+    CPU::Disasm Disassemble(std::uint64_t address) const;
+    CPU::Assem Assemble(std::uint64_t pc, const std::string& code) const;
+    unsigned Length(std::uint16_t address) const;
+
+    std::uint16_t GetAF(void) const { return reg_a << 8 | reg_f; }
+    void SetAF(std::uint16_t af) { reg_a = af >> 8; reg_f = af & 0xFF; }
+
+private:
+    // Interrupt inputs; an NMI waits in nmi_pending until it is taken
+    bool irq_line;
+    bool nmi_pending;
+    // Set by EI, which holds off interrupts until the next instruction is
+    // done
+    bool ei_delay;
+    // Set while HALT repeats, waiting for an interrupt
+    bool halted;
+
+    // Execution checks the cycle count against a single deadline: the end
+    // of the run, the next scheduled event, or zero if an interrupt may be
+    // waiting. Reaching it calls TakeEvents().
+    unsigned long end_cycle;
+    unsigned long deadline;
+
+    void UpdateDeadline(void);
+    void TakeEvents(void);
+    void Interrupt(std::uint16_t address, unsigned cycles);
+
+    CPU::StopReason CheckStop(void);
+
+    // Each opcode of each table has its own handler, chosen when the
+    // program is compiled by decoding the opcode's bits. Execution looks
+    // the handler up, and nothing is decoded at run time.
+    typedef void (CPUZ80Impl::*OpFunc)(void);
+    typedef std::array<OpFunc, 256> OpTable;
+    static const OpTable base_ops;
+    static const OpTable ix_ops;
+    static const OpTable iy_ops;
+    static const OpTable cb_ops;
+    static const OpTable ed_ops;
+    static const OpTable index_cb_ops;
+
+    template <Index idx, unsigned op> static constexpr OpFunc BaseOp(void);
+    template <unsigned op> static constexpr OpFunc CBOp(void);
+    template <unsigned op> static constexpr OpFunc EDOp(void);
+    template <unsigned op> static constexpr OpFunc IndexCBOp(void);
+    template <Index idx, std::size_t... op>
+    static constexpr OpTable BaseTable(std::index_sequence<op...>);
+    template <std::size_t... op>
+    static constexpr OpTable CBTable(std::index_sequence<op...>);
+    template <std::size_t... op>
+    static constexpr OpTable EDTable(std::index_sequence<op...>);
+    template <std::size_t... op>
+    static constexpr OpTable IndexCBTable(std::index_sequence<op...>);
+
+    // Bytes of the current instruction, counted for coverage
+    unsigned fetched;
+    std::uint8_t Fetch8(void)
+        { ++fetched; return memory->FastRead8(reg_pc++); }
+    std::uint16_t Fetch16(void);
+    std::uint8_t Read8(std::uint16_t addr) { return memory->FastRead8(addr); }
+    void Write8(std::uint16_t addr, std::uint8_t byte)
+        { memory->FastWrite8(addr, byte); }
+    std::uint16_t Read16(std::uint16_t addr);
+    void Write16(std::uint16_t addr, std::uint16_t word);
+    void Push16(std::uint16_t word);
+    std::uint16_t Pop16(void);
+    std::uint8_t In(std::uint16_t port);
+    void Out(std::uint16_t port, std::uint8_t byte);
+    // R counts opcode fetches in its low seven bits
+    void IncR(void) { reg_r = (reg_r & 0x80) | ((reg_r + 1) & 0x7F); }
+
+    // Registers as numbered in opcodes: B C D E H L (HL) A for r, and
+    // BC DE HL SP for p. With a DD or FD prefix, H, L and HL become the
+    // halves of IX or IY, or all of it.
+    template <Index idx> std::uint16_t& HL(void);
+    template <unsigned r, Index idx> std::uint8_t GetReg(void);
+    template <unsigned r, Index idx> void SetReg(std::uint8_t byte);
+    template <unsigned p, Index idx> std::uint16_t GetPair(void);
+    template <unsigned p, Index idx> void SetPair(std::uint16_t word);
+    template <unsigned cc> bool Condition(void) const;
+    template <Index idx> std::uint16_t IndexAddress(void);
+
+    template <unsigned op> void ALU(std::uint8_t byte);
+    template <unsigned op> std::uint8_t Rotate(std::uint8_t byte);
+    std::uint8_t Inc8(std::uint8_t byte);
+    std::uint8_t Dec8(std::uint8_t byte);
+    void Bit(unsigned bit, std::uint8_t byte, std::uint8_t xy);
+    void BlockIOFlags(std::uint8_t byte, unsigned k);
+
+    // Unprefixed instructions, and their DD and FD forms
+    void do_NOP(void);
+    void do_EX_AF_AF(void);
+    void do_DJNZ(void);
+    void do_JR(void);
+    template <unsigned cc> void do_JR_cc(void);
+    template <unsigned p, Index idx> void do_LD_rp_nn(void);
+    template <unsigned p, Index idx> void do_ADD_HL_rp(void);
+    template <unsigned p> void do_LD_rpind_A(void);
+    template <unsigned p> void do_LD_A_rpind(void);
+    template <Index idx> void do_LD_nnind_HL(void);
+    template <Index idx> void do_LD_HL_nnind(void);
+    void do_LD_nnind_A(void);
+    void do_LD_A_nnind(void);
+    template <unsigned p, Index idx> void do_INC_rp(void);
+    template <unsigned p, Index idx> void do_DEC_rp(void);
+    template <unsigned r, Index idx> void do_INC_r(void);
+    template <Index idx> void do_INC_mem(void);
+    template <unsigned r, Index idx> void do_DEC_r(void);
+    template <Index idx> void do_DEC_mem(void);
+    template <unsigned r, Index idx> void do_LD_r_n(void);
+    template <Index idx> void do_LD_mem_n(void);
+    void do_RLCA(void);
+    void do_RRCA(void);
+    void do_RLA(void);
+    void do_RRA(void);
+    void do_DAA(void);
+    void do_CPL(void);
+    void do_SCF(void);
+    void do_CCF(void);
+    template <unsigned r1, unsigned r2, Index idx> void do_LD_r_r(void);
+    template <unsigned r, Index idx> void do_LD_r_mem(void);
+    template <unsigned r, Index idx> void do_LD_mem_r(void);
+    void do_HALT(void);
+    template <unsigned op, unsigned r, Index idx> void do_ALU_r(void);
+    template <unsigned op, Index idx> void do_ALU_mem(void);
+    template <unsigned op> void do_ALU_n(void);
+    template <unsigned cc> void do_RET_cc(void);
+    template <unsigned p, Index idx> void do_POP(void);
+    void do_RET(void);
+    void do_EXX(void);
+    template <Index idx> void do_JP_HL(void);
+    template <Index idx> void do_LD_SP_HL(void);
+    template <unsigned cc> void do_JP_cc(void);
+    void do_JP(void);
+    void do_OUT_n_A(void);
+    void do_IN_A_n(void);
+    template <Index idx> void do_EX_SP_HL(void);
+    void do_EX_DE_HL(void);
+    void do_DI(void);
+    void do_EI(void);
+    template <unsigned cc> void do_CALL_cc(void);
+    template <unsigned p, Index idx> void do_PUSH(void);
+    void do_CALL(void);
+    template <unsigned n> void do_RST(void);
+
+    // Prefixes
+    void do_prefix_CB(void);
+    void do_prefix_ED(void);
+    template <Index idx> void do_prefix_index(void);
+    template <Index idx> void do_prefix_index_CB(void);
+    void do_prefix_only(void);
+
+    // CB instructions, on a register or (HL)
+    template <unsigned op, unsigned r> void do_rot_r(void);
+    template <unsigned op> void do_rot_mem(void);
+    template <unsigned bit, unsigned r> void do_BIT_r(void);
+    template <unsigned bit> void do_BIT_mem(void);
+    template <unsigned bit, unsigned r> void do_RES_r(void);
+    template <unsigned bit> void do_RES_mem(void);
+    template <unsigned bit, unsigned r> void do_SET_r(void);
+    template <unsigned bit> void do_SET_mem(void);
+
+    // DD CB and FD CB instructions, on (IX+d); all but BIT also copy the
+    // result to register r, unless r is 6
+    template <unsigned op, unsigned r> void do_rot_index(void);
+    template <unsigned bit> void do_BIT_index(void);
+    template <unsigned bit, unsigned r> void do_RES_index(void);
+    template <unsigned bit, unsigned r> void do_SET_index(void);
+
+    // ED instructions
+    template <unsigned r> void do_IN_r_C(void);
+    template <unsigned r> void do_OUT_C_r(void);
+    template <unsigned p> void do_SBC_HL_rp(void);
+    template <unsigned p> void do_ADC_HL_rp(void);
+    template <unsigned p> void do_LD_nnind_rp(void);
+    template <unsigned p> void do_LD_rp_nnind(void);
+    void do_NEG(void);
+    void do_RETN(void);
+    template <unsigned mode> void do_IM(void);
+    void do_LD_I_A(void);
+    void do_LD_R_A(void);
+    void do_LD_A_I(void);
+    void do_LD_A_R(void);
+    void do_RRD(void);
+    void do_RLD(void);
+    template <int step, bool repeat> void do_LDI(void);
+    template <int step, bool repeat> void do_CPI(void);
+    template <int step, bool repeat> void do_INI(void);
+    template <int step, bool repeat> void do_OUTI(void);
+    void do_ED_NOP(void);
+
+    // Used for disassembly and assembly
+    static const std::vector<std::string> *MnemonicTables(void);
+    static std::string BaseText(unsigned op, Index idx);
+    static std::string CBText(unsigned op, Index idx);
+    static std::string EDText(unsigned op);
+};
+
+}
+
+CPUZ80::CPUZ80(Memory *mem) :
+    CPU(mem),
+    impl(new CPUZ80Impl(this, mem))
+{
+    max_len = 4;
+}
+
+CPUZ80::~CPUZ80(void)
+{
+    delete reinterpret_cast<CPUZ80Impl *>(impl);
+    impl = nullptr;
+}
+
+static const char z80_reg_list[][8] = {
+    "A", "FLAGS", "BC", "DE", "HL", "IX", "IY", "SP", "PC", "I", "R", "IM",
+    "IFF1", "IFF2", "AF'", "BC'", "DE'", "HL'", ""
+};
+
+// Registers that breakpoint conditions can use, but that the register window
+// does not list; they follow z80_reg_list in numbering
+static const char z80_extra_regs[][8] = {
+    "B", "C", "D", "E", "H", "L", "F", "IXH", "IXL", "IYH", "IYL", ""
+};
+
+std::vector<std::string>
+CPUZ80::GetRegisterList(void) const
+{
+    std::vector<std::string> regs;
+    for (unsigned i = 0; z80_reg_list[i][0] != '\0'; ++i) {
+        regs.push_back(std::string(z80_reg_list[i]));
+    }
+    return regs;
+}
+
+std::vector<CPU::Flag>
+CPUZ80::GetFlags(void) const
+{
+    static const Flag flag_list[] = {
+        { "&Sign",             'S' },
+        { "&Zero",             'Z' },
+        { "Bit &5",            'Y' },
+        { "&Half carry",       'H' },
+        { "Bit &3",            'X' },
+        { "&Parity/overflow",  'P' },
+        { "&Subtract",         'N' },
+        { "&Carry",            'C' },
+        { nullptr,             0   }
+    };
+
+    std::vector<Flag> flags;
+    for (unsigned i = 0; flag_list[i].name != nullptr; ++i) {
+        flags.push_back(flag_list[i]);
+    }
+    return flags;
+}
+
+int
+CPUZ80::GetRegisterIndex(const std::string& reg_name) const
+{
+    int index = 0;
+    for (unsigned i = 0; z80_reg_list[i][0] != '\0'; ++i, ++index) {
+        if (reg_name == z80_reg_list[i]) {
+            return index;
+        }
+    }
+    for (unsigned i = 0; z80_extra_regs[i][0] != '\0'; ++i, ++index) {
+        if (reg_name == z80_extra_regs[i]) {
+            return index;
+        }
+    }
+    return -1;
+}
+
+// Index is as in GetRegisterIndex()
+std::uint64_t
+CPUZ80::GetRegisterValue(int index) const
+{
+    auto impl_ = reinterpret_cast<CPUZ80Impl *>(impl);
+    switch (index) {
+    case 0:  return impl_->reg_a;
+    case 1:  return impl_->reg_f;
+    case 2:  return impl_->reg_bc;
+    case 3:  return impl_->reg_de;
+    case 4:  return impl_->reg_hl;
+    case 5:  return impl_->reg_ix;
+    case 6:  return impl_->reg_iy;
+    case 7:  return impl_->reg_sp;
+    case 8:  return impl_->reg_pc;
+    case 9:  return impl_->reg_i;
+    case 10: return impl_->reg_r;
+    case 11: return impl_->int_mode;
+    case 12: return impl_->iff1;
+    case 13: return impl_->iff2;
+    case 14: return impl_->alt_af;
+    case 15: return impl_->alt_bc;
+    case 16: return impl_->alt_de;
+    case 17: return impl_->alt_hl;
+    case 18: return impl_->reg_bc >> 8;
+    case 19: return impl_->reg_bc & 0xFF;
+    case 20: return impl_->reg_de >> 8;
+    case 21: return impl_->reg_de & 0xFF;
+    case 22: return impl_->reg_hl >> 8;
+    case 23: return impl_->reg_hl & 0xFF;
+    case 24: return impl_->reg_f;
+    case 25: return impl_->reg_ix >> 8;
+    case 26: return impl_->reg_ix & 0xFF;
+    case 27: return impl_->reg_iy >> 8;
+    case 28: return impl_->reg_iy & 0xFF;
+    default: return 0;
+    }
+}
+
+std::string
+CPUZ80::GetRegister(const std::string& reg_name) const
+{
+    auto impl_ = reinterpret_cast<CPUZ80Impl *>(impl);
+    char str[10];
+
+    if (reg_name == "FLAGS") {
+        static const char letters[] = "SZYHXPNC";
+        for (unsigned i = 0; i < 8; ++i) {
+            str[i] = (impl_->reg_f & (0x80 >> i)) ? letters[i] : '-';
+        }
+        str[8] = '\0';
+        return str;
+    }
+
+    int index = GetRegisterIndex(reg_name);
+    if (index < 0) {
+        return "";
+    }
+
+    // 16-bit registers are those from BC to PC, and the alternate set
+    int width;
+    if ((index >= 2 && index <= 8) || (index >= 14 && index <= 17)) {
+        width = 4;
+    } else if (index >= 11 && index <= 13) {
+        width = 1;
+    } else {
+        width = 2;
+    }
+    std::snprintf(str, sizeof(str), "%0*X", width,
+                  static_cast<unsigned>(GetRegisterValue(index)));
+    return str;
+}
+
+bool
+CPUZ80::SetRegister(const std::string& reg_name, const std::string& value)
+{
+    unsigned long num;
+    auto impl_ = reinterpret_cast<CPUZ80Impl *>(impl);
+
+    if (reg_name == "FLAGS") {
+        // Parse flags as individual letters
+        static const char flags[] = "SZYHXPNC";
+
+        num = 0;
+        for (std::size_t i = 0; i < value.size(); ++i) {
+            char ch = value.at(i);
+            if (ch == '-') {
+                continue;
+            }
+            const char *p = std::strchr(flags, std::toupper(ch));
+            if (p == nullptr) {
+                return false;
+            }
+            num |= 0x80 >> (p - flags);
+        }
+        impl_->reg_f = num;
+        return true;
+    }
+
+    char *ptr;
+
+    num = std::strtoul(value.c_str(), &ptr, 16);
+    while (*ptr != '\0') {
+        if (!std::isspace(*ptr)) {
+            return false;
+        }
+        ++ptr;
+    }
+
+    auto set_high = [num](std::uint16_t& pair) {
+        pair = (pair & 0x00FF) | ((num & 0xFF) << 8);
+    };
+    auto set_low = [num](std::uint16_t& pair) {
+        pair = (pair & 0xFF00) | (num & 0xFF);
+    };
+
+    if (reg_name == "A") {
+        impl_->reg_a = num;
+    } else if (reg_name == "F") {
+        impl_->reg_f = num;
+    } else if (reg_name == "BC") {
+        impl_->reg_bc = num;
+    } else if (reg_name == "DE") {
+        impl_->reg_de = num;
+    } else if (reg_name == "HL") {
+        impl_->reg_hl = num;
+    } else if (reg_name == "IX") {
+        impl_->reg_ix = num;
+    } else if (reg_name == "IY") {
+        impl_->reg_iy = num;
+    } else if (reg_name == "SP") {
+        impl_->reg_sp = num;
+    } else if (reg_name == "PC") {
+        impl_->reg_pc = num;
+    } else if (reg_name == "I") {
+        impl_->reg_i = num;
+    } else if (reg_name == "R") {
+        impl_->reg_r = num;
+    } else if (reg_name == "IM") {
+        if (num > 2) {
+            return false;
+        }
+        impl_->int_mode = num;
+    } else if (reg_name == "IFF1") {
+        impl_->iff1 = num != 0;
+    } else if (reg_name == "IFF2") {
+        impl_->iff2 = num != 0;
+    } else if (reg_name == "AF'") {
+        impl_->alt_af = num;
+    } else if (reg_name == "BC'") {
+        impl_->alt_bc = num;
+    } else if (reg_name == "DE'") {
+        impl_->alt_de = num;
+    } else if (reg_name == "HL'") {
+        impl_->alt_hl = num;
+    } else if (reg_name == "B") {
+        set_high(impl_->reg_bc);
+    } else if (reg_name == "C") {
+        set_low(impl_->reg_bc);
+    } else if (reg_name == "D") {
+        set_high(impl_->reg_de);
+    } else if (reg_name == "E") {
+        set_low(impl_->reg_de);
+    } else if (reg_name == "H") {
+        set_high(impl_->reg_hl);
+    } else if (reg_name == "L") {
+        set_low(impl_->reg_hl);
+    } else if (reg_name == "IXH") {
+        set_high(impl_->reg_ix);
+    } else if (reg_name == "IXL") {
+        set_low(impl_->reg_ix);
+    } else if (reg_name == "IYH") {
+        set_high(impl_->reg_iy);
+    } else if (reg_name == "IYL") {
+        set_low(impl_->reg_iy);
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+void
+CPUZ80::Step(void)
+{
+    auto impl_ = reinterpret_cast<CPUZ80Impl *>(impl);
+    CPU::StopReason reason;
+    impl_->DoStep(reason);
+}
+
+void
+CPUZ80::Next(void)
+{
+    auto impl_ = reinterpret_cast<CPUZ80Impl *>(impl);
+    CPU::StopReason reason;
+    if (impl_->DoStep(reason) && reason != CPU::stop_breakpoint) {
+        ToReturn();
+    }
+}
+
+void
+CPUZ80::ToReturn(void)
+{
+    auto impl_ = reinterpret_cast<CPUZ80Impl *>(impl);
+    std::uint16_t saved_sp = impl_->reg_sp;
+    std::uint16_t delta_sp;
+
+    do {
+        CPU::StopReason reason;
+        impl_->DoStep(reason);
+        if (reason == CPU::stop_breakpoint) {
+            break;
+        }
+        // As for the 6502, a return pops two bytes above the saved SP;
+        // this still works if SP wraps
+        delta_sp = impl_->reg_sp - saved_sp;
+    } while (delta_sp == 0 || delta_sp > 2);
+}
+
+CPU::StopReason
+CPUZ80::Run(void)
+{
+    return RunLimited(ULONG_MAX, ULONG_MAX, nullptr).reason;
+}
+
+CPU::RunResult
+CPUZ80::RunCycles(unsigned long budget)
+{
+    return RunLimited(ULONG_MAX, budget, nullptr);
+}
+
+CPU::RunResult
+CPUZ80::RunInstructions(unsigned long count)
+{
+    return RunLimited(count, ULONG_MAX, nullptr);
+}
+
+CPU::RunResult
+CPUZ80::RunUntil(const std::set<std::uint64_t>& stops, unsigned long max_count)
+{
+    return RunLimited(max_count, ULONG_MAX, &stops);
+}
+
+// Common to the run functions
+CPU::RunResult
+CPUZ80::RunLimited(unsigned long count, unsigned long cycles,
+                   const std::set<std::uint64_t> *stops)
+{
+    // Number of instructions between checks for a pause request
+    static const unsigned long batch_size = 65536;
+
+    auto impl_ = reinterpret_cast<CPUZ80Impl *>(impl);
+    pause_request.store(false, std::memory_order_relaxed);
+    impl_->memory->ResetWatchHit();
+
+    if (stops != nullptr) {
+        impl_->stop_at.assign(0x10000, false);
+        for (auto addr : *stops) {
+            if (addr < 0x10000) {
+                impl_->stop_at[addr] = true;
+            }
+        }
+    }
+
+    auto start_cycles = impl_->emu_cycles;
+    unsigned long end_cycle = (cycles > ULONG_MAX - start_cycles)
+                            ? ULONG_MAX : start_cycles + cycles;
+    unsigned long done = 0;
+    StopReason reason;
+    try {
+        do {
+            unsigned long n;
+            reason = impl_->Execute(std::min(count - done, batch_size),
+                                    end_cycle, n);
+            done += n;
+            run_cycles.store(impl_->emu_cycles, std::memory_order_relaxed);
+            if (reason == stop_count && done < count
+            &&  pause_request.load(std::memory_order_relaxed)) {
+                reason = stop_pause;
+            }
+        } while (reason == stop_count && done < count);
+    }
+    catch (...) {
+        impl_->stop_at.clear();
+        throw;
+    }
+    impl_->stop_at.clear();
+
+    return RunResult(reason, done, impl_->emu_cycles - start_cycles);
+}
+
+std::uint64_t
+CPUZ80::GetPC(void) const
+{
+    auto impl_ = reinterpret_cast<CPUZ80Impl *>(impl);
+    return impl_->reg_pc;
+}
+
+CPU::Disasm
+CPUZ80::Disassemble(std::uint64_t address) const
+{
+    auto impl_ = reinterpret_cast<CPUZ80Impl *>(impl);
+    return impl_->Disassemble(address);
+}
+
+CPU::Assem
+CPUZ80::Assemble(std::uint64_t pc, const std::string& code) const
+{
+    auto impl_ = reinterpret_cast<CPUZ80Impl *>(impl);
+    return impl_->Assemble(pc, code);
+}
+
+unsigned long
+CPUZ80::GetEmuCycles(void) const
+{
+    auto impl_ = reinterpret_cast<CPUZ80Impl *>(impl);
+    return impl_->emu_cycles;
+}
+
+void
+CPUZ80::ClearEmuCycles(void)
+{
+    auto impl_ = reinterpret_cast<CPUZ80Impl *>(impl);
+    RebaseEvents(impl_->emu_cycles);
+    impl_->emu_cycles = 0;
+}
+
+bool
+CPUZ80::SetBreakStop(bool enable)
+{
+    auto impl_ = reinterpret_cast<CPUZ80Impl *>(impl);
+    impl_->break_stop = enable;
+    return enable;
+}
+
+void
+CPUZ80::SetIRQ(bool asserted)
+{
+    auto impl_ = reinterpret_cast<CPUZ80Impl *>(impl);
+    impl_->SetIRQ(asserted);
+}
+
+void
+CPUZ80::NMI(void)
+{
+    auto impl_ = reinterpret_cast<CPUZ80Impl *>(impl);
+    impl_->NMI();
+}
+
+void
+CPUZ80::Reset(void)
+{
+    auto impl_ = reinterpret_cast<CPUZ80Impl *>(impl);
+    impl_->Reset();
+}
+
+void
+CPUZ80::SetPortHandlers(PortIn in, PortOut out)
+{
+    auto impl_ = reinterpret_cast<CPUZ80Impl *>(impl);
+    impl_->port_in = std::move(in);
+    impl_->port_out = std::move(out);
+}
+
+void
+CPUZ80::SetInterruptData(std::uint8_t data)
+{
+    auto impl_ = reinterpret_cast<CPUZ80Impl *>(impl);
+    impl_->int_data = data;
+}
+
+void
+CPUZ80::EventScheduled(unsigned long cycle)
+{
+    auto impl_ = reinterpret_cast<CPUZ80Impl *>(impl);
+    impl_->EventScheduled(cycle);
+}
+
+std::shared_ptr<const void>
+CPUZ80::SaveState(void) const
+{
+    auto impl_ = reinterpret_cast<CPUZ80Impl *>(impl);
+    return impl_->SaveState();
+}
+
+void
+CPUZ80::RestoreState(const void *state)
+{
+    auto impl_ = reinterpret_cast<CPUZ80Impl *>(impl);
+    impl_->RestoreState(state);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//                              Implementation                              //
+//////////////////////////////////////////////////////////////////////////////
+
+CPUZ80Impl::CPUZ80Impl(CPU *cpu_, Memory *mem) :
+    cpu(cpu_),
+    memory(mem),
+    index_addr(0),
+    break_stop(false),
+    int_data(0xFF),
+    irq_line(false),
+    nmi_pending(false),
+    ei_delay(false),
+    halted(false),
+    end_cycle(ULONG_MAX),
+    deadline(ULONG_MAX)
+{
+}
+
+CPUZ80Impl::~CPUZ80Impl(void)
+{
+}
+
+// Step through one instruction, setting reason to why execution stopped after
+// it. Return true if the instruction was a CALL or RST that was taken, and
+// Next() should continue until a return
+bool
+CPUZ80Impl::DoStep(CPU::StopReason& reason)
+{
+    auto opcode = memory->Peek8(reg_pc);
+    bool call = opcode == 0xCD || (opcode & 0xC7) == 0xC4
+             || (opcode & 0xC7) == 0xC7;
+    std::uint16_t saved_sp = reg_sp;
+    unsigned long done;
+    reason = Execute(1, ULONG_MAX, done);
+    return call && reg_sp == static_cast<std::uint16_t>(saved_sp - 2);
+}
+
+// Execute up to count instructions, and set done to the number executed.
+// Execution stops early at a breakpoint, at an address in stop_at, before
+// HALT with break_stop set, or once emu_cycles reaches end_cycle; the
+// return value says which, or is stop_count if all count instructions were
+// executed. Scheduled events and interrupts are handled along the way.
+CPU::StopReason
+CPUZ80Impl::Execute(unsigned long count, unsigned long end_cycle_,
+                    unsigned long& done)
+{
+    end_cycle = end_cycle_;
+    UpdateDeadline();
+    if (emu_cycles >= deadline) {
+        TakeEvents();
+    }
+
+    bool covering = memory->CoverageEnabled();
+    unsigned long i = 0;
+    while (i < count) {
+        std::uint16_t pc = reg_pc;
+        fetched = 0;
+        auto opcode = Fetch8();
+        IncR();
+        emu_cycles += base_cycles[opcode];
+        (this->*base_ops[opcode])();
+        ++i;
+        if (covering) {
+            memory->MarkExecuted(pc, fetched);
+        }
+        auto reason = CheckStop();
+        if (reason != CPU::stop_count) {
+            done = i;
+            return reason;
+        }
+    }
+    done = i;
+    return CPU::stop_count;
+}
+
+// Return why execution should stop before the next instruction, or
+// stop_count if it should go on
+CPU::StopReason
+CPUZ80Impl::CheckStop(void)
+{
+    // The deadline is never later than end_cycle
+    bool at_deadline = emu_cycles >= deadline;
+    if (at_deadline) {
+        TakeEvents();
+    }
+    if (memory->WatchTriggered()) {
+        return CPU::stop_watchpoint;
+    }
+    if (BreakpointHit()) {
+        return CPU::stop_breakpoint;
+    }
+    if (!stop_at.empty() && stop_at[reg_pc]) {
+        return CPU::stop_address;
+    }
+    if (break_stop && memory->Peek8(reg_pc) == 0x76) {
+        return CPU::stop_break;
+    }
+    if (at_deadline && emu_cycles >= end_cycle) {
+        return CPU::stop_cycles;
+    }
+    return CPU::stop_count;
+}
+
+void
+CPUZ80Impl::UpdateDeadline(void)
+{
+    if (nmi_pending || (irq_line && iff1)) {
+        deadline = 0;
+    } else {
+        deadline = std::min(end_cycle, cpu->NextEventCycle());
+    }
+}
+
+// Run the events that are due, then take any waiting interrupt
+void
+CPUZ80Impl::TakeEvents(void)
+{
+    cpu->RunEvents(emu_cycles);
+    if (nmi_pending) {
+        nmi_pending = false;
+        iff1 = false;
+        Interrupt(0x0066, 11);
+    } else if (irq_line && iff1 && !ei_delay) {
+        iff1 = iff2 = false;
+        switch (int_mode) {
+        case 0:
+        default:
+            // Only RST is supported on the bus
+            Interrupt(int_data & 0x38, 13);
+            break;
+
+        case 1:
+            Interrupt(0x0038, 13);
+            break;
+
+        case 2:
+            Interrupt(Read16(reg_i << 8 | int_data), 19);
+            break;
+        }
+    }
+    ei_delay = false;
+    UpdateDeadline();
+}
+
+// Push the PC and jump to the given address
+void
+CPUZ80Impl::Interrupt(std::uint16_t address, unsigned cycles)
+{
+    // Return past a HALT that was waiting for this
+    if (halted) {
+        ++reg_pc;
+        halted = false;
+    }
+    IncR();
+    Push16(reg_pc);
+    reg_pc = address;
+    memptr = address;
+    emu_cycles += cycles;
+}
+
+void
+CPUZ80Impl::SetIRQ(bool asserted)
+{
+    irq_line = asserted;
+    if (asserted) {
+        // Take it if it is not masked; TakeEvents() checks
+        deadline = 0;
+    }
+}
+
+void
+CPUZ80Impl::NMI(void)
+{
+    nmi_pending = true;
+    deadline = 0;
+}
+
+void
+CPUZ80Impl::Reset(void)
+{
+    reg_pc = 0;
+    reg_i = 0;
+    reg_r = 0;
+    iff1 = iff2 = false;
+    int_mode = 0;
+    nmi_pending = false;
+    ei_delay = false;
+    halted = false;
+    emu_cycles += 3;
+    UpdateDeadline();
+}
+
+// An event may be scheduled by an action, or by a memory access during an
+// instruction, and may be due sooner than the current deadline
+void
+CPUZ80Impl::EventScheduled(unsigned long cycle)
+{
+    deadline = std::min(deadline, cycle);
+}
+
+std::shared_ptr<const void>
+CPUZ80Impl::SaveState(void) const
+{
+    auto state = std::make_shared<State>();
+    static_cast<CPUZ80Regs&>(*state) = *this;
+    state->irq_line = irq_line;
+    state->nmi_pending = nmi_pending;
+    state->ei_delay = ei_delay;
+    state->halted = halted;
+    return state;
+}
+
+void
+CPUZ80Impl::RestoreState(const void *state_)
+{
+    auto state = static_cast<const State *>(state_);
+    static_cast<CPUZ80Regs&>(*this) = *state;
+    irq_line = state->irq_line;
+    nmi_pending = state->nmi_pending;
+    ei_delay = state->ei_delay;
+    halted = state->halted;
+    UpdateDeadline();
+}
+
+// Return true if execution should stop at a breakpoint on the instruction at
+// the PC
+bool
+CPUZ80Impl::BreakpointHit(void)
+{
+    if (!cpu->AnyBreakpoints()) {
+        return false;
+    }
+    return cpu->BreakpointHit(reg_pc, Length(reg_pc));
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//                             Dispatch tables                              //
+//////////////////////////////////////////////////////////////////////////////
+
+// Handler for an unprefixed opcode, or with idx, a DD or FD opcode. The
+// opcode is taken apart as
+//     x = bits 7-6, y = bits 5-3, z = bits 2-0, p = bits 5-4, q = bit 3
+// which is how the Z80 groups its instructions.
+template <Index idx, unsigned op>
+constexpr CPUZ80Impl::OpFunc
+CPUZ80Impl::BaseOp(void)
+{
+    constexpr unsigned x = op >> 6;
+    constexpr unsigned y = (op >> 3) & 7;
+    constexpr unsigned z = op & 7;
+    constexpr unsigned p = y >> 1;
+    constexpr unsigned q = y & 1;
+
+    if constexpr (x == 0) {
+        if constexpr (z == 0) {
+            if constexpr (y == 0) {
+                return &CPUZ80Impl::do_NOP;
+            } else if constexpr (y == 1) {
+                return &CPUZ80Impl::do_EX_AF_AF;
+            } else if constexpr (y == 2) {
+                return &CPUZ80Impl::do_DJNZ;
+            } else if constexpr (y == 3) {
+                return &CPUZ80Impl::do_JR;
+            } else {
+                return &CPUZ80Impl::do_JR_cc<y - 4>;
+            }
+        } else if constexpr (z == 1) {
+            if constexpr (q == 0) {
+                return &CPUZ80Impl::do_LD_rp_nn<p, idx>;
+            } else {
+                return &CPUZ80Impl::do_ADD_HL_rp<p, idx>;
+            }
+        } else if constexpr (z == 2) {
+            if constexpr (p < 2) {
+                if constexpr (q == 0) {
+                    return &CPUZ80Impl::do_LD_rpind_A<p>;
+                } else {
+                    return &CPUZ80Impl::do_LD_A_rpind<p>;
+                }
+            } else if constexpr (p == 2) {
+                if constexpr (q == 0) {
+                    return &CPUZ80Impl::do_LD_nnind_HL<idx>;
+                } else {
+                    return &CPUZ80Impl::do_LD_HL_nnind<idx>;
+                }
+            } else {
+                if constexpr (q == 0) {
+                    return &CPUZ80Impl::do_LD_nnind_A;
+                } else {
+                    return &CPUZ80Impl::do_LD_A_nnind;
+                }
+            }
+        } else if constexpr (z == 3) {
+            if constexpr (q == 0) {
+                return &CPUZ80Impl::do_INC_rp<p, idx>;
+            } else {
+                return &CPUZ80Impl::do_DEC_rp<p, idx>;
+            }
+        } else if constexpr (z == 4) {
+            if constexpr (y == 6) {
+                return &CPUZ80Impl::do_INC_mem<idx>;
+            } else {
+                return &CPUZ80Impl::do_INC_r<y, idx>;
+            }
+        } else if constexpr (z == 5) {
+            if constexpr (y == 6) {
+                return &CPUZ80Impl::do_DEC_mem<idx>;
+            } else {
+                return &CPUZ80Impl::do_DEC_r<y, idx>;
+            }
+        } else if constexpr (z == 6) {
+            if constexpr (y == 6) {
+                return &CPUZ80Impl::do_LD_mem_n<idx>;
+            } else {
+                return &CPUZ80Impl::do_LD_r_n<y, idx>;
+            }
+        } else {
+            constexpr OpFunc ops[8] = {
+                &CPUZ80Impl::do_RLCA, &CPUZ80Impl::do_RRCA,
+                &CPUZ80Impl::do_RLA,  &CPUZ80Impl::do_RRA,
+                &CPUZ80Impl::do_DAA,  &CPUZ80Impl::do_CPL,
+                &CPUZ80Impl::do_SCF,  &CPUZ80Impl::do_CCF
+            };
+            return ops[y];
+        }
+    } else if constexpr (x == 1) {
+        // The other operand of (IX+d) is H or L, not half of IX
+        if constexpr (y == 6 && z == 6) {
+            return &CPUZ80Impl::do_HALT;
+        } else if constexpr (z == 6) {
+            return &CPUZ80Impl::do_LD_r_mem<y, idx>;
+        } else if constexpr (y == 6) {
+            return &CPUZ80Impl::do_LD_mem_r<z, idx>;
+        } else {
+            return &CPUZ80Impl::do_LD_r_r<y, z, idx>;
+        }
+    } else if constexpr (x == 2) {
+        if constexpr (z == 6) {
+            return &CPUZ80Impl::do_ALU_mem<y, idx>;
+        } else {
+            return &CPUZ80Impl::do_ALU_r<y, z, idx>;
+        }
+    } else {
+        if constexpr (z == 0) {
+            return &CPUZ80Impl::do_RET_cc<y>;
+        } else if constexpr (z == 1) {
+            if constexpr (q == 0) {
+                return &CPUZ80Impl::do_POP<p, idx>;
+            } else if constexpr (p == 0) {
+                return &CPUZ80Impl::do_RET;
+            } else if constexpr (p == 1) {
+                return &CPUZ80Impl::do_EXX;
+            } else if constexpr (p == 2) {
+                return &CPUZ80Impl::do_JP_HL<idx>;
+            } else {
+                return &CPUZ80Impl::do_LD_SP_HL<idx>;
+            }
+        } else if constexpr (z == 2) {
+            return &CPUZ80Impl::do_JP_cc<y>;
+        } else if constexpr (z == 3) {
+            if constexpr (y == 0) {
+                return &CPUZ80Impl::do_JP;
+            } else if constexpr (y == 1) {
+                if constexpr (idx == idx_hl) {
+                    return &CPUZ80Impl::do_prefix_CB;
+                } else {
+                    return &CPUZ80Impl::do_prefix_index_CB<idx>;
+                }
+            } else if constexpr (y == 2) {
+                return &CPUZ80Impl::do_OUT_n_A;
+            } else if constexpr (y == 3) {
+                return &CPUZ80Impl::do_IN_A_n;
+            } else if constexpr (y == 4) {
+                return &CPUZ80Impl::do_EX_SP_HL<idx>;
+            } else if constexpr (y == 5) {
+                // Never affected by a prefix
+                return &CPUZ80Impl::do_EX_DE_HL;
+            } else if constexpr (y == 6) {
+                return &CPUZ80Impl::do_DI;
+            } else {
+                return &CPUZ80Impl::do_EI;
+            }
+        } else if constexpr (z == 4) {
+            return &CPUZ80Impl::do_CALL_cc<y>;
+        } else if constexpr (z == 5) {
+            if constexpr (q == 0) {
+                return &CPUZ80Impl::do_PUSH<p, idx>;
+            } else if constexpr (idx != idx_hl && p != 0) {
+                return &CPUZ80Impl::do_prefix_only;
+            } else if constexpr (p == 0) {
+                return &CPUZ80Impl::do_CALL;
+            } else if constexpr (p == 1) {
+                return &CPUZ80Impl::do_prefix_index<idx_ix>;
+            } else if constexpr (p == 2) {
+                return &CPUZ80Impl::do_prefix_ED;
+            } else {
+                return &CPUZ80Impl::do_prefix_index<idx_iy>;
+            }
+        } else if constexpr (z == 6) {
+            return &CPUZ80Impl::do_ALU_n<y>;
+        } else {
+            return &CPUZ80Impl::do_RST<y * 8>;
+        }
+    }
+}
+
+template <unsigned op>
+constexpr CPUZ80Impl::OpFunc
+CPUZ80Impl::CBOp(void)
+{
+    constexpr unsigned x = op >> 6;
+    constexpr unsigned y = (op >> 3) & 7;
+    constexpr unsigned z = op & 7;
+
+    if constexpr (x == 0) {
+        if constexpr (z == 6) {
+            return &CPUZ80Impl::do_rot_mem<y>;
+        } else {
+            return &CPUZ80Impl::do_rot_r<y, z>;
+        }
+    } else if constexpr (x == 1) {
+        if constexpr (z == 6) {
+            return &CPUZ80Impl::do_BIT_mem<y>;
+        } else {
+            return &CPUZ80Impl::do_BIT_r<y, z>;
+        }
+    } else if constexpr (x == 2) {
+        if constexpr (z == 6) {
+            return &CPUZ80Impl::do_RES_mem<y>;
+        } else {
+            return &CPUZ80Impl::do_RES_r<y, z>;
+        }
+    } else {
+        if constexpr (z == 6) {
+            return &CPUZ80Impl::do_SET_mem<y>;
+        } else {
+            return &CPUZ80Impl::do_SET_r<y, z>;
+        }
+    }
+}
+
+template <unsigned op>
+constexpr CPUZ80Impl::OpFunc
+CPUZ80Impl::IndexCBOp(void)
+{
+    constexpr unsigned x = op >> 6;
+    constexpr unsigned y = (op >> 3) & 7;
+    constexpr unsigned z = op & 7;
+
+    if constexpr (x == 0) {
+        return &CPUZ80Impl::do_rot_index<y, z>;
+    } else if constexpr (x == 1) {
+        return &CPUZ80Impl::do_BIT_index<y>;
+    } else if constexpr (x == 2) {
+        return &CPUZ80Impl::do_RES_index<y, z>;
+    } else {
+        return &CPUZ80Impl::do_SET_index<y, z>;
+    }
+}
+
+template <unsigned op>
+constexpr CPUZ80Impl::OpFunc
+CPUZ80Impl::EDOp(void)
+{
+    constexpr unsigned x = op >> 6;
+    constexpr unsigned y = (op >> 3) & 7;
+    constexpr unsigned z = op & 7;
+    constexpr unsigned p = y >> 1;
+    constexpr unsigned q = y & 1;
+
+    if constexpr (x == 1) {
+        if constexpr (z == 0) {
+            return &CPUZ80Impl::do_IN_r_C<y>;
+        } else if constexpr (z == 1) {
+            return &CPUZ80Impl::do_OUT_C_r<y>;
+        } else if constexpr (z == 2) {
+            if constexpr (q == 0) {
+                return &CPUZ80Impl::do_SBC_HL_rp<p>;
+            } else {
+                return &CPUZ80Impl::do_ADC_HL_rp<p>;
+            }
+        } else if constexpr (z == 3) {
+            if constexpr (q == 0) {
+                return &CPUZ80Impl::do_LD_nnind_rp<p>;
+            } else {
+                return &CPUZ80Impl::do_LD_rp_nnind<p>;
+            }
+        } else if constexpr (z == 4) {
+            return &CPUZ80Impl::do_NEG;
+        } else if constexpr (z == 5) {
+            // RETI differs only in what devices see on the bus
+            return &CPUZ80Impl::do_RETN;
+        } else if constexpr (z == 6) {
+            constexpr unsigned modes[8] = { 0, 0, 1, 2, 0, 0, 1, 2 };
+            return &CPUZ80Impl::do_IM<modes[y]>;
+        } else {
+            constexpr OpFunc ops[8] = {
+                &CPUZ80Impl::do_LD_I_A, &CPUZ80Impl::do_LD_R_A,
+                &CPUZ80Impl::do_LD_A_I, &CPUZ80Impl::do_LD_A_R,
+                &CPUZ80Impl::do_RRD,    &CPUZ80Impl::do_RLD,
+                &CPUZ80Impl::do_ED_NOP, &CPUZ80Impl::do_ED_NOP
+            };
+            return ops[y];
+        }
+    } else if constexpr (x == 2 && z <= 3 && y >= 4) {
+        // y selects increment or decrement, and whether to repeat
+        constexpr int step = (y & 1) ? -1 : +1;
+        constexpr bool repeat = y >= 6;
+        if constexpr (z == 0) {
+            return &CPUZ80Impl::do_LDI<step, repeat>;
+        } else if constexpr (z == 1) {
+            return &CPUZ80Impl::do_CPI<step, repeat>;
+        } else if constexpr (z == 2) {
+            return &CPUZ80Impl::do_INI<step, repeat>;
+        } else {
+            return &CPUZ80Impl::do_OUTI<step, repeat>;
+        }
+    } else {
+        return &CPUZ80Impl::do_ED_NOP;
+    }
+}
+
+template <Index idx, std::size_t... op>
+constexpr CPUZ80Impl::OpTable
+CPUZ80Impl::BaseTable(std::index_sequence<op...>)
+{
+    return {{ BaseOp<idx, op>()... }};
+}
+
+template <std::size_t... op>
+constexpr CPUZ80Impl::OpTable
+CPUZ80Impl::CBTable(std::index_sequence<op...>)
+{
+    return {{ CBOp<op>()... }};
+}
+
+template <std::size_t... op>
+constexpr CPUZ80Impl::OpTable
+CPUZ80Impl::EDTable(std::index_sequence<op...>)
+{
+    return {{ EDOp<op>()... }};
+}
+
+template <std::size_t... op>
+constexpr CPUZ80Impl::OpTable
+CPUZ80Impl::IndexCBTable(std::index_sequence<op...>)
+{
+    return {{ IndexCBOp<op>()... }};
+}
+
+const CPUZ80Impl::OpTable CPUZ80Impl::base_ops =
+        CPUZ80Impl::BaseTable<idx_hl>(std::make_index_sequence<256>());
+const CPUZ80Impl::OpTable CPUZ80Impl::ix_ops =
+        CPUZ80Impl::BaseTable<idx_ix>(std::make_index_sequence<256>());
+const CPUZ80Impl::OpTable CPUZ80Impl::iy_ops =
+        CPUZ80Impl::BaseTable<idx_iy>(std::make_index_sequence<256>());
+const CPUZ80Impl::OpTable CPUZ80Impl::cb_ops =
+        CPUZ80Impl::CBTable(std::make_index_sequence<256>());
+const CPUZ80Impl::OpTable CPUZ80Impl::ed_ops =
+        CPUZ80Impl::EDTable(std::make_index_sequence<256>());
+const CPUZ80Impl::OpTable CPUZ80Impl::index_cb_ops =
+        CPUZ80Impl::IndexCBTable(std::make_index_sequence<256>());
+
+//////////////////////////////////////////////////////////////////////////////
+//                                 Helpers                                  //
+//////////////////////////////////////////////////////////////////////////////
+
+std::uint16_t
+CPUZ80Impl::Fetch16(void)
+{
+    std::uint16_t lo = Fetch8();
+    std::uint16_t hi = Fetch8();
+    return hi << 8 | lo;
+}
+
+std::uint16_t
+CPUZ80Impl::Read16(std::uint16_t addr)
+{
+    std::uint16_t lo = Read8(addr);
+    std::uint16_t hi = Read8(addr + 1);
+    return hi << 8 | lo;
+}
+
+void
+CPUZ80Impl::Write16(std::uint16_t addr, std::uint16_t word)
+{
+    Write8(addr, word & 0xFF);
+    Write8(addr + 1, word >> 8);
+}
+
+void
+CPUZ80Impl::Push16(std::uint16_t word)
+{
+    Write8(--reg_sp, word >> 8);
+    Write8(--reg_sp, word & 0xFF);
+}
+
+std::uint16_t
+CPUZ80Impl::Pop16(void)
+{
+    std::uint16_t lo = Read8(reg_sp++);
+    std::uint16_t hi = Read8(reg_sp++);
+    return hi << 8 | lo;
+}
+
+std::uint8_t
+CPUZ80Impl::In(std::uint16_t port)
+{
+    return port_in ? port_in(port) : 0xFF;
+}
+
+void
+CPUZ80Impl::Out(std::uint16_t port, std::uint8_t byte)
+{
+    if (port_out) {
+        port_out(port, byte);
+    }
+}
+
+template <Index idx>
+std::uint16_t&
+CPUZ80Impl::HL(void)
+{
+    if constexpr (idx == idx_ix) {
+        return reg_ix;
+    } else if constexpr (idx == idx_iy) {
+        return reg_iy;
+    } else {
+        return reg_hl;
+    }
+}
+
+template <unsigned r, Index idx>
+std::uint8_t
+CPUZ80Impl::GetReg(void)
+{
+    static_assert(r != 6, "(HL) is not a register");
+    if constexpr (r == 0) {
+        return reg_bc >> 8;
+    } else if constexpr (r == 1) {
+        return reg_bc & 0xFF;
+    } else if constexpr (r == 2) {
+        return reg_de >> 8;
+    } else if constexpr (r == 3) {
+        return reg_de & 0xFF;
+    } else if constexpr (r == 4) {
+        return HL<idx>() >> 8;
+    } else if constexpr (r == 5) {
+        return HL<idx>() & 0xFF;
+    } else {
+        return reg_a;
+    }
+}
+
+template <unsigned r, Index idx>
+void
+CPUZ80Impl::SetReg(std::uint8_t byte)
+{
+    static_assert(r != 6, "(HL) is not a register");
+    if constexpr (r == 0) {
+        reg_bc = (reg_bc & 0x00FF) | (byte << 8);
+    } else if constexpr (r == 1) {
+        reg_bc = (reg_bc & 0xFF00) | byte;
+    } else if constexpr (r == 2) {
+        reg_de = (reg_de & 0x00FF) | (byte << 8);
+    } else if constexpr (r == 3) {
+        reg_de = (reg_de & 0xFF00) | byte;
+    } else if constexpr (r == 4) {
+        HL<idx>() = (HL<idx>() & 0x00FF) | (byte << 8);
+    } else if constexpr (r == 5) {
+        HL<idx>() = (HL<idx>() & 0xFF00) | byte;
+    } else {
+        reg_a = byte;
+    }
+}
+
+template <unsigned p, Index idx>
+std::uint16_t
+CPUZ80Impl::GetPair(void)
+{
+    if constexpr (p == 0) {
+        return reg_bc;
+    } else if constexpr (p == 1) {
+        return reg_de;
+    } else if constexpr (p == 2) {
+        return HL<idx>();
+    } else {
+        return reg_sp;
+    }
+}
+
+template <unsigned p, Index idx>
+void
+CPUZ80Impl::SetPair(std::uint16_t word)
+{
+    if constexpr (p == 0) {
+        reg_bc = word;
+    } else if constexpr (p == 1) {
+        reg_de = word;
+    } else if constexpr (p == 2) {
+        HL<idx>() = word;
+    } else {
+        reg_sp = word;
+    }
+}
+
+// NZ Z NC C PO PE P M
+template <unsigned cc>
+bool
+CPUZ80Impl::Condition(void) const
+{
+    constexpr std::uint8_t flags[4] = { flag_z, flag_c, flag_pv, flag_s };
+    bool set = (reg_f & flags[cc >> 1]) != 0;
+    return (cc & 1) ? set : !set;
+}
+
+// Address of (HL), or fetch d and return that of (IX+d) or (IY+d)
+template <Index idx>
+std::uint16_t
+CPUZ80Impl::IndexAddress(void)
+{
+    if constexpr (idx == idx_hl) {
+        return reg_hl;
+    } else {
+        auto d = static_cast<std::int8_t>(Fetch8());
+        memptr = HL<idx>() + d;
+        return memptr;
+    }
+}
+
+// ADD ADC SUB SBC AND XOR OR CP
+template <unsigned op>
+void
+CPUZ80Impl::ALU(std::uint8_t byte)
+{
+    unsigned a = reg_a;
+    if constexpr (op == 0 || op == 1) {
+        unsigned result = a + byte;
+        if constexpr (op == 1) {
+            result += reg_f & flag_c;
+        }
+        reg_a = result;
+        reg_f = flag_tables.sz53[reg_a]
+              | ((a ^ byte ^ result) & flag_h)
+              | (((a ^ ~byte) & (a ^ result) & 0x80) >> 5)
+              | ((result >> 8) & flag_c);
+    } else if constexpr (op == 2 || op == 3 || op == 7) {
+        unsigned result = a - byte;
+        if constexpr (op == 3) {
+            result -= reg_f & flag_c;
+        }
+        std::uint8_t flags = ((a ^ byte ^ result) & flag_h)
+                           | (((a ^ byte) & (a ^ result) & 0x80) >> 5)
+                           | ((result >> 8) & flag_c)
+                           | flag_n;
+        if constexpr (op == 7) {
+            // CP takes X and Y from the operand
+            reg_f = flags | (flag_tables.sz53[result & 0xFF] & (flag_s | flag_z))
+                  | (byte & (flag_x | flag_y));
+        } else {
+            reg_a = result;
+            reg_f = flags | flag_tables.sz53[reg_a];
+        }
+    } else if constexpr (op == 4) {
+        reg_a &= byte;
+        reg_f = flag_tables.sz53p[reg_a] | flag_h;
+    } else if constexpr (op == 5) {
+        reg_a ^= byte;
+        reg_f = flag_tables.sz53p[reg_a];
+    } else {
+        reg_a |= byte;
+        reg_f = flag_tables.sz53p[reg_a];
+    }
+}
+
+// RLC RRC RL RR SLA SRA SLL SRL, as the CB instructions do them
+template <unsigned op>
+std::uint8_t
+CPUZ80Impl::Rotate(std::uint8_t byte)
+{
+    std::uint8_t result;
+    std::uint8_t carry;
+    if constexpr (op == 0) {
+        carry = byte >> 7;
+        result = (byte << 1) | carry;
+    } else if constexpr (op == 1) {
+        carry = byte & 1;
+        result = (byte >> 1) | (carry << 7);
+    } else if constexpr (op == 2) {
+        carry = byte >> 7;
+        result = (byte << 1) | (reg_f & flag_c);
+    } else if constexpr (op == 3) {
+        carry = byte & 1;
+        result = (byte >> 1) | ((reg_f & flag_c) << 7);
+    } else if constexpr (op == 4) {
+        carry = byte >> 7;
+        result = byte << 1;
+    } else if constexpr (op == 5) {
+        carry = byte & 1;
+        result = (byte >> 1) | (byte & 0x80);
+    } else if constexpr (op == 6) {
+        // Undocumented; shifts in a one
+        carry = byte >> 7;
+        result = (byte << 1) | 1;
+    } else {
+        carry = byte & 1;
+        result = byte >> 1;
+    }
+    reg_f = flag_tables.sz53p[result] | carry;
+    return result;
+}
+
+std::uint8_t
+CPUZ80Impl::Inc8(std::uint8_t byte)
+{
+    std::uint8_t result = byte + 1;
+    reg_f = (reg_f & flag_c) | flag_tables.sz53[result]
+          | ((result & 0x0F) == 0 ? flag_h : 0)
+          | (result == 0x80 ? flag_pv : 0);
+    return result;
+}
+
+std::uint8_t
+CPUZ80Impl::Dec8(std::uint8_t byte)
+{
+    std::uint8_t result = byte - 1;
+    reg_f = (reg_f & flag_c) | flag_tables.sz53[result] | flag_n
+          | ((result & 0x0F) == 0x0F ? flag_h : 0)
+          | (result == 0x7F ? flag_pv : 0);
+    return result;
+}
+
+// BIT takes X and Y from the byte for a register, and otherwise from the
+// high byte of an internal address
+void
+CPUZ80Impl::Bit(unsigned bit, std::uint8_t byte, std::uint8_t xy)
+{
+    reg_f = (reg_f & flag_c) | flag_h | (xy & (flag_x | flag_y));
+    if ((byte & (1 << bit)) == 0) {
+        reg_f |= flag_z | flag_pv;
+    } else if (bit == 7) {
+        reg_f |= flag_s;
+    }
+}
+
+// Flags after INI, IND, OUTI and OUTD, once B has been decremented
+void
+CPUZ80Impl::BlockIOFlags(std::uint8_t byte, unsigned k)
+{
+    std::uint8_t b = reg_bc >> 8;
+    reg_f = flag_tables.sz53[b]
+          | ((byte & 0x80) ? flag_n : 0)
+          | (k > 0xFF ? flag_h | flag_c : 0)
+          | (flag_tables.sz53p[((k & 7) ^ b) & 0xFF] & flag_pv);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//                          Unprefixed instructions                         //
+//////////////////////////////////////////////////////////////////////////////
+
+void
+CPUZ80Impl::do_NOP(void)
+{
+}
+
+void
+CPUZ80Impl::do_EX_AF_AF(void)
+{
+    std::uint16_t af = GetAF();
+    SetAF(alt_af);
+    alt_af = af;
+}
+
+void
+CPUZ80Impl::do_DJNZ(void)
+{
+    auto d = static_cast<std::int8_t>(Fetch8());
+    reg_bc -= 0x100;
+    if ((reg_bc >> 8) != 0) {
+        reg_pc += d;
+        memptr = reg_pc;
+        emu_cycles += 5;
+    }
+}
+
+void
+CPUZ80Impl::do_JR(void)
+{
+    auto d = static_cast<std::int8_t>(Fetch8());
+    reg_pc += d;
+    memptr = reg_pc;
+}
+
+template <unsigned cc>
+void
+CPUZ80Impl::do_JR_cc(void)
+{
+    auto d = static_cast<std::int8_t>(Fetch8());
+    if (Condition<cc>()) {
+        reg_pc += d;
+        memptr = reg_pc;
+        emu_cycles += 5;
+    }
+}
+
+template <unsigned p, Index idx>
+void
+CPUZ80Impl::do_LD_rp_nn(void)
+{
+    SetPair<p, idx>(Fetch16());
+}
+
+template <unsigned p, Index idx>
+void
+CPUZ80Impl::do_ADD_HL_rp(void)
+{
+    unsigned hl = HL<idx>();
+    unsigned word = GetPair<p, idx>();
+    unsigned result = hl + word;
+    memptr = hl + 1;
+    HL<idx>() = result;
+    reg_f = (reg_f & (flag_s | flag_z | flag_pv))
+          | (((hl ^ word ^ result) >> 8) & flag_h)
+          | ((result >> 8) & (flag_x | flag_y))
+          | (result >> 16);
+}
+
+template <unsigned p>
+void
+CPUZ80Impl::do_LD_rpind_A(void)
+{
+    std::uint16_t addr = GetPair<p, idx_hl>();
+    Write8(addr, reg_a);
+    memptr = (reg_a << 8) | ((addr + 1) & 0xFF);
+}
+
+template <unsigned p>
+void
+CPUZ80Impl::do_LD_A_rpind(void)
+{
+    std::uint16_t addr = GetPair<p, idx_hl>();
+    reg_a = Read8(addr);
+    memptr = addr + 1;
+}
+
+template <Index idx>
+void
+CPUZ80Impl::do_LD_nnind_HL(void)
+{
+    auto addr = Fetch16();
+    Write16(addr, HL<idx>());
+    memptr = addr + 1;
+}
+
+template <Index idx>
+void
+CPUZ80Impl::do_LD_HL_nnind(void)
+{
+    auto addr = Fetch16();
+    HL<idx>() = Read16(addr);
+    memptr = addr + 1;
+}
+
+void
+CPUZ80Impl::do_LD_nnind_A(void)
+{
+    auto addr = Fetch16();
+    Write8(addr, reg_a);
+    memptr = (reg_a << 8) | ((addr + 1) & 0xFF);
+}
+
+void
+CPUZ80Impl::do_LD_A_nnind(void)
+{
+    auto addr = Fetch16();
+    reg_a = Read8(addr);
+    memptr = addr + 1;
+}
+
+template <unsigned p, Index idx>
+void
+CPUZ80Impl::do_INC_rp(void)
+{
+    SetPair<p, idx>(GetPair<p, idx>() + 1);
+}
+
+template <unsigned p, Index idx>
+void
+CPUZ80Impl::do_DEC_rp(void)
+{
+    SetPair<p, idx>(GetPair<p, idx>() - 1);
+}
+
+template <unsigned r, Index idx>
+void
+CPUZ80Impl::do_INC_r(void)
+{
+    SetReg<r, idx>(Inc8(GetReg<r, idx>()));
+}
+
+template <Index idx>
+void
+CPUZ80Impl::do_INC_mem(void)
+{
+    auto addr = IndexAddress<idx>();
+    Write8(addr, Inc8(Read8(addr)));
+}
+
+template <unsigned r, Index idx>
+void
+CPUZ80Impl::do_DEC_r(void)
+{
+    SetReg<r, idx>(Dec8(GetReg<r, idx>()));
+}
+
+template <Index idx>
+void
+CPUZ80Impl::do_DEC_mem(void)
+{
+    auto addr = IndexAddress<idx>();
+    Write8(addr, Dec8(Read8(addr)));
+}
+
+template <unsigned r, Index idx>
+void
+CPUZ80Impl::do_LD_r_n(void)
+{
+    SetReg<r, idx>(Fetch8());
+}
+
+template <Index idx>
+void
+CPUZ80Impl::do_LD_mem_n(void)
+{
+    // The offset comes before the byte to store
+    auto addr = IndexAddress<idx>();
+    Write8(addr, Fetch8());
+}
+
+void
+CPUZ80Impl::do_RLCA(void)
+{
+    reg_a = (reg_a << 1) | (reg_a >> 7);
+    reg_f = (reg_f & (flag_s | flag_z | flag_pv))
+          | (reg_a & (flag_x | flag_y | flag_c));
+}
+
+void
+CPUZ80Impl::do_RRCA(void)
+{
+    std::uint8_t carry = reg_a & 1;
+    reg_a = (reg_a >> 1) | (carry << 7);
+    reg_f = (reg_f & (flag_s | flag_z | flag_pv))
+          | (reg_a & (flag_x | flag_y)) | carry;
+}
+
+void
+CPUZ80Impl::do_RLA(void)
+{
+    std::uint8_t carry = reg_a >> 7;
+    reg_a = (reg_a << 1) | (reg_f & flag_c);
+    reg_f = (reg_f & (flag_s | flag_z | flag_pv))
+          | (reg_a & (flag_x | flag_y)) | carry;
+}
+
+void
+CPUZ80Impl::do_RRA(void)
+{
+    std::uint8_t carry = reg_a & 1;
+    reg_a = (reg_a >> 1) | ((reg_f & flag_c) << 7);
+    reg_f = (reg_f & (flag_s | flag_z | flag_pv))
+          | (reg_a & (flag_x | flag_y)) | carry;
+}
+
+void
+CPUZ80Impl::do_DAA(void)
+{
+    std::uint8_t a = reg_a;
+    std::uint8_t correction = 0;
+    std::uint8_t carry = reg_f & flag_c;
+    if ((reg_f & flag_h) != 0 || (a & 0x0F) > 9) {
+        correction |= 0x06;
+    }
+    if (carry != 0 || a > 0x99) {
+        correction |= 0x60;
+        carry = flag_c;
+    }
+
+    std::uint8_t half;
+    if ((reg_f & flag_n) != 0) {
+        half = ((reg_f & flag_h) != 0 && (a & 0x0F) < 6) ? flag_h : 0;
+        reg_a = a - correction;
+    } else {
+        half = ((a & 0x0F) > 9) ? flag_h : 0;
+        reg_a = a + correction;
+    }
+    reg_f = flag_tables.sz53p[reg_a] | (reg_f & flag_n) | half | carry;
+}
+
+void
+CPUZ80Impl::do_CPL(void)
+{
+    reg_a = ~reg_a;
+    reg_f = (reg_f & (flag_s | flag_z | flag_pv | flag_c))
+          | flag_h | flag_n | (reg_a & (flag_x | flag_y));
+}
+
+void
+CPUZ80Impl::do_SCF(void)
+{
+    reg_f = (reg_f & (flag_s | flag_z | flag_pv))
+          | (reg_a & (flag_x | flag_y)) | flag_c;
+}
+
+void
+CPUZ80Impl::do_CCF(void)
+{
+    // H gets the old carry
+    reg_f = (reg_f & (flag_s | flag_z | flag_pv))
+          | ((reg_f & flag_c) ? flag_h : flag_c)
+          | (reg_a & (flag_x | flag_y));
+}
+
+template <unsigned r1, unsigned r2, Index idx>
+void
+CPUZ80Impl::do_LD_r_r(void)
+{
+    SetReg<r1, idx>(GetReg<r2, idx>());
+}
+
+template <unsigned r, Index idx>
+void
+CPUZ80Impl::do_LD_r_mem(void)
+{
+    auto addr = IndexAddress<idx>();
+    SetReg<r, idx_hl>(Read8(addr));
+}
+
+template <unsigned r, Index idx>
+void
+CPUZ80Impl::do_LD_mem_r(void)
+{
+    auto addr = IndexAddress<idx>();
+    Write8(addr, GetReg<r, idx_hl>());
+}
+
+void
+CPUZ80Impl::do_HALT(void)
+{
+    // Repeat until an interrupt; the time until the next event passes at
+    // once, as nothing else can happen until then
+    halted = true;
+    --reg_pc;
+    if (nmi_pending || (irq_line && iff1)) {
+        return;
+    }
+    if (deadline != ULONG_MAX && deadline > emu_cycles) {
+        emu_cycles = deadline;
+    }
+}
+
+template <unsigned op, unsigned r, Index idx>
+void
+CPUZ80Impl::do_ALU_r(void)
+{
+    ALU<op>(GetReg<r, idx>());
+}
+
+template <unsigned op, Index idx>
+void
+CPUZ80Impl::do_ALU_mem(void)
+{
+    ALU<op>(Read8(IndexAddress<idx>()));
+}
+
+template <unsigned op>
+void
+CPUZ80Impl::do_ALU_n(void)
+{
+    ALU<op>(Fetch8());
+}
+
+template <unsigned cc>
+void
+CPUZ80Impl::do_RET_cc(void)
+{
+    if (Condition<cc>()) {
+        reg_pc = Pop16();
+        memptr = reg_pc;
+        emu_cycles += 6;
+    }
+}
+
+template <unsigned p, Index idx>
+void
+CPUZ80Impl::do_POP(void)
+{
+    if constexpr (p == 3) {
+        SetAF(Pop16());
+    } else {
+        SetPair<p, idx>(Pop16());
+    }
+}
+
+void
+CPUZ80Impl::do_RET(void)
+{
+    reg_pc = Pop16();
+    memptr = reg_pc;
+}
+
+void
+CPUZ80Impl::do_EXX(void)
+{
+    std::swap(reg_bc, alt_bc);
+    std::swap(reg_de, alt_de);
+    std::swap(reg_hl, alt_hl);
+}
+
+template <Index idx>
+void
+CPUZ80Impl::do_JP_HL(void)
+{
+    reg_pc = HL<idx>();
+}
+
+template <Index idx>
+void
+CPUZ80Impl::do_LD_SP_HL(void)
+{
+    reg_sp = HL<idx>();
+}
+
+template <unsigned cc>
+void
+CPUZ80Impl::do_JP_cc(void)
+{
+    auto addr = Fetch16();
+    memptr = addr;
+    if (Condition<cc>()) {
+        reg_pc = addr;
+    }
+}
+
+void
+CPUZ80Impl::do_JP(void)
+{
+    reg_pc = Fetch16();
+    memptr = reg_pc;
+}
+
+void
+CPUZ80Impl::do_OUT_n_A(void)
+{
+    std::uint8_t n = Fetch8();
+    Out((reg_a << 8) | n, reg_a);
+    memptr = (reg_a << 8) | ((n + 1) & 0xFF);
+}
+
+void
+CPUZ80Impl::do_IN_A_n(void)
+{
+    std::uint16_t port = (reg_a << 8) | Fetch8();
+    reg_a = In(port);
+    memptr = port + 1;
+}
+
+template <Index idx>
+void
+CPUZ80Impl::do_EX_SP_HL(void)
+{
+    auto word = Read16(reg_sp);
+    Write16(reg_sp, HL<idx>());
+    HL<idx>() = word;
+    memptr = word;
+}
+
+void
+CPUZ80Impl::do_EX_DE_HL(void)
+{
+    std::swap(reg_de, reg_hl);
+}
+
+void
+CPUZ80Impl::do_DI(void)
+{
+    iff1 = iff2 = false;
+}
+
+void
+CPUZ80Impl::do_EI(void)
+{
+    // TakeEvents() lets the next instruction run before any interrupt
+    iff1 = iff2 = true;
+    ei_delay = true;
+    deadline = 0;
+}
+
+template <unsigned cc>
+void
+CPUZ80Impl::do_CALL_cc(void)
+{
+    auto addr = Fetch16();
+    memptr = addr;
+    if (Condition<cc>()) {
+        Push16(reg_pc);
+        reg_pc = addr;
+        emu_cycles += 7;
+    }
+}
+
+template <unsigned p, Index idx>
+void
+CPUZ80Impl::do_PUSH(void)
+{
+    if constexpr (p == 3) {
+        Push16(GetAF());
+    } else {
+        Push16(GetPair<p, idx>());
+    }
+}
+
+void
+CPUZ80Impl::do_CALL(void)
+{
+    auto addr = Fetch16();
+    Push16(reg_pc);
+    reg_pc = addr;
+    memptr = addr;
+}
+
+template <unsigned n>
+void
+CPUZ80Impl::do_RST(void)
+{
+    Push16(reg_pc);
+    reg_pc = n;
+    memptr = n;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//                                 Prefixes                                 //
+//////////////////////////////////////////////////////////////////////////////
+
+void
+CPUZ80Impl::do_prefix_CB(void)
+{
+    auto opcode = Fetch8();
+    IncR();
+    emu_cycles += cycle_tables.cb[opcode];
+    (this->*cb_ops[opcode])();
+}
+
+void
+CPUZ80Impl::do_prefix_ED(void)
+{
+    auto opcode = Fetch8();
+    IncR();
+    emu_cycles += cycle_tables.ed[opcode];
+    (this->*ed_ops[opcode])();
+}
+
+template <Index idx>
+void
+CPUZ80Impl::do_prefix_index(void)
+{
+    auto opcode = Fetch8();
+    IncR();
+    emu_cycles += cycle_tables.index[opcode];
+    if constexpr (idx == idx_ix) {
+        (this->*ix_ops[opcode])();
+    } else {
+        (this->*iy_ops[opcode])();
+    }
+}
+
+// DD CB d op: the offset comes before the opcode, which is not counted in R
+template <Index idx>
+void
+CPUZ80Impl::do_prefix_index_CB(void)
+{
+    index_addr = IndexAddress<idx>();
+    auto opcode = Fetch8();
+    emu_cycles += cycle_tables.index_cb[opcode];
+    (this->*index_cb_ops[opcode])();
+}
+
+// DD or FD followed by another prefix acts alone, as a NOP; the next prefix
+// starts the next instruction
+void
+CPUZ80Impl::do_prefix_only(void)
+{
+    --reg_pc;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//                             CB instructions                              //
+//////////////////////////////////////////////////////////////////////////////
+
+template <unsigned op, unsigned r>
+void
+CPUZ80Impl::do_rot_r(void)
+{
+    SetReg<r, idx_hl>(Rotate<op>(GetReg<r, idx_hl>()));
+}
+
+template <unsigned op>
+void
+CPUZ80Impl::do_rot_mem(void)
+{
+    Write8(reg_hl, Rotate<op>(Read8(reg_hl)));
+}
+
+template <unsigned bit, unsigned r>
+void
+CPUZ80Impl::do_BIT_r(void)
+{
+    auto byte = GetReg<r, idx_hl>();
+    Bit(bit, byte, byte);
+}
+
+template <unsigned bit>
+void
+CPUZ80Impl::do_BIT_mem(void)
+{
+    Bit(bit, Read8(reg_hl), memptr >> 8);
+}
+
+template <unsigned bit, unsigned r>
+void
+CPUZ80Impl::do_RES_r(void)
+{
+    SetReg<r, idx_hl>(GetReg<r, idx_hl>() & ~(1 << bit));
+}
+
+template <unsigned bit>
+void
+CPUZ80Impl::do_RES_mem(void)
+{
+    Write8(reg_hl, Read8(reg_hl) & ~(1 << bit));
+}
+
+template <unsigned bit, unsigned r>
+void
+CPUZ80Impl::do_SET_r(void)
+{
+    SetReg<r, idx_hl>(GetReg<r, idx_hl>() | (1 << bit));
+}
+
+template <unsigned bit>
+void
+CPUZ80Impl::do_SET_mem(void)
+{
+    Write8(reg_hl, Read8(reg_hl) | (1 << bit));
+}
+
+template <unsigned op, unsigned r>
+void
+CPUZ80Impl::do_rot_index(void)
+{
+    auto result = Rotate<op>(Read8(index_addr));
+    Write8(index_addr, result);
+    if constexpr (r != 6) {
+        SetReg<r, idx_hl>(result);
+    }
+}
+
+template <unsigned bit>
+void
+CPUZ80Impl::do_BIT_index(void)
+{
+    Bit(bit, Read8(index_addr), index_addr >> 8);
+}
+
+template <unsigned bit, unsigned r>
+void
+CPUZ80Impl::do_RES_index(void)
+{
+    std::uint8_t result = Read8(index_addr) & ~(1 << bit);
+    Write8(index_addr, result);
+    if constexpr (r != 6) {
+        SetReg<r, idx_hl>(result);
+    }
+}
+
+template <unsigned bit, unsigned r>
+void
+CPUZ80Impl::do_SET_index(void)
+{
+    std::uint8_t result = Read8(index_addr) | (1 << bit);
+    Write8(index_addr, result);
+    if constexpr (r != 6) {
+        SetReg<r, idx_hl>(result);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//                             ED instructions                              //
+//////////////////////////////////////////////////////////////////////////////
+
+// IN (C) with r = 6 sets the flags only
+template <unsigned r>
+void
+CPUZ80Impl::do_IN_r_C(void)
+{
+    auto byte = In(reg_bc);
+    reg_f = (reg_f & flag_c) | flag_tables.sz53p[byte];
+    if constexpr (r != 6) {
+        SetReg<r, idx_hl>(byte);
+    }
+    memptr = reg_bc + 1;
+}
+
+// OUT (C),0 with r = 6
+template <unsigned r>
+void
+CPUZ80Impl::do_OUT_C_r(void)
+{
+    if constexpr (r != 6) {
+        Out(reg_bc, GetReg<r, idx_hl>());
+    } else {
+        Out(reg_bc, 0);
+    }
+    memptr = reg_bc + 1;
+}
+
+template <unsigned p>
+void
+CPUZ80Impl::do_SBC_HL_rp(void)
+{
+    unsigned hl = reg_hl;
+    unsigned word = GetPair<p, idx_hl>();
+    unsigned result = hl - word - (reg_f & flag_c);
+    memptr = hl + 1;
+    reg_hl = result;
+    reg_f = ((result >> 8) & (flag_s | flag_x | flag_y))
+          | (reg_hl == 0 ? flag_z : 0)
+          | (((hl ^ word ^ result) >> 8) & flag_h)
+          | (((hl ^ word) & (hl ^ result) & 0x8000) >> 13)
+          | flag_n
+          | ((result >> 16) & flag_c);
+}
+
+template <unsigned p>
+void
+CPUZ80Impl::do_ADC_HL_rp(void)
+{
+    unsigned hl = reg_hl;
+    unsigned word = GetPair<p, idx_hl>();
+    unsigned result = hl + word + (reg_f & flag_c);
+    memptr = hl + 1;
+    reg_hl = result;
+    reg_f = ((result >> 8) & (flag_s | flag_x | flag_y))
+          | (reg_hl == 0 ? flag_z : 0)
+          | (((hl ^ word ^ result) >> 8) & flag_h)
+          | (((hl ^ ~word) & (hl ^ result) & 0x8000) >> 13)
+          | ((result >> 16) & flag_c);
+}
+
+template <unsigned p>
+void
+CPUZ80Impl::do_LD_nnind_rp(void)
+{
+    auto addr = Fetch16();
+    Write16(addr, GetPair<p, idx_hl>());
+    memptr = addr + 1;
+}
+
+template <unsigned p>
+void
+CPUZ80Impl::do_LD_rp_nnind(void)
+{
+    auto addr = Fetch16();
+    SetPair<p, idx_hl>(Read16(addr));
+    memptr = addr + 1;
+}
+
+void
+CPUZ80Impl::do_NEG(void)
+{
+    std::uint8_t byte = reg_a;
+    reg_a = 0;
+    ALU<2>(byte);
+}
+
+void
+CPUZ80Impl::do_RETN(void)
+{
+    iff1 = iff2;
+    reg_pc = Pop16();
+    memptr = reg_pc;
+    if (irq_line && iff1) {
+        deadline = 0;
+    }
+}
+
+template <unsigned mode>
+void
+CPUZ80Impl::do_IM(void)
+{
+    int_mode = mode;
+}
+
+void
+CPUZ80Impl::do_LD_I_A(void)
+{
+    reg_i = reg_a;
+}
+
+void
+CPUZ80Impl::do_LD_R_A(void)
+{
+    reg_r = reg_a;
+}
+
+void
+CPUZ80Impl::do_LD_A_I(void)
+{
+    reg_a = reg_i;
+    reg_f = (reg_f & flag_c) | flag_tables.sz53[reg_a] | (iff2 ? flag_pv : 0);
+}
+
+void
+CPUZ80Impl::do_LD_A_R(void)
+{
+    reg_a = reg_r;
+    reg_f = (reg_f & flag_c) | flag_tables.sz53[reg_a] | (iff2 ? flag_pv : 0);
+}
+
+void
+CPUZ80Impl::do_RRD(void)
+{
+    auto byte = Read8(reg_hl);
+    Write8(reg_hl, (reg_a << 4) | (byte >> 4));
+    reg_a = (reg_a & 0xF0) | (byte & 0x0F);
+    reg_f = (reg_f & flag_c) | flag_tables.sz53p[reg_a];
+    memptr = reg_hl + 1;
+}
+
+void
+CPUZ80Impl::do_RLD(void)
+{
+    auto byte = Read8(reg_hl);
+    Write8(reg_hl, (byte << 4) | (reg_a & 0x0F));
+    reg_a = (reg_a & 0xF0) | (byte >> 4);
+    reg_f = (reg_f & flag_c) | flag_tables.sz53p[reg_a];
+    memptr = reg_hl + 1;
+}
+
+// LDI, LDD, LDIR and LDDR. The repeating forms run one step each time and
+// go back to the start while BC is not zero, so that interrupts and
+// breakpoints can come between steps.
+template <int step, bool repeat>
+void
+CPUZ80Impl::do_LDI(void)
+{
+    auto byte = Read8(reg_hl);
+    Write8(reg_de, byte);
+    reg_hl += step;
+    reg_de += step;
+    --reg_bc;
+    std::uint8_t n = byte + reg_a;
+    reg_f = (reg_f & (flag_s | flag_z | flag_c))
+          | (reg_bc != 0 ? flag_pv : 0)
+          | (n & flag_x) | ((n << 4) & flag_y);
+    if (repeat && reg_bc != 0) {
+        reg_pc -= 2;
+        memptr = reg_pc + 1;
+        emu_cycles += 5;
+    }
+}
+
+template <int step, bool repeat>
+void
+CPUZ80Impl::do_CPI(void)
+{
+    auto byte = Read8(reg_hl);
+    std::uint8_t result = reg_a - byte;
+    std::uint8_t half = (reg_a ^ byte ^ result) & flag_h;
+    reg_hl += step;
+    --reg_bc;
+    memptr += step;
+    std::uint8_t n = result - (half ? 1 : 0);
+    reg_f = (reg_f & flag_c) | flag_n | half
+          | (flag_tables.sz53[result] & (flag_s | flag_z))
+          | (reg_bc != 0 ? flag_pv : 0)
+          | (n & flag_x) | ((n << 4) & flag_y);
+    if (repeat && reg_bc != 0 && result != 0) {
+        reg_pc -= 2;
+        memptr = reg_pc + 1;
+        emu_cycles += 5;
+    }
+}
+
+template <int step, bool repeat>
+void
+CPUZ80Impl::do_INI(void)
+{
+    auto byte = In(reg_bc);
+    memptr = reg_bc + step;
+    Write8(reg_hl, byte);
+    reg_hl += step;
+    reg_bc -= 0x100;
+    BlockIOFlags(byte, byte + ((reg_bc + step) & 0xFF));
+    if (repeat && (reg_bc >> 8) != 0) {
+        reg_pc -= 2;
+        emu_cycles += 5;
+    }
+}
+
+template <int step, bool repeat>
+void
+CPUZ80Impl::do_OUTI(void)
+{
+    auto byte = Read8(reg_hl);
+    reg_bc -= 0x100;
+    Out(reg_bc, byte);
+    memptr = reg_bc + step;
+    reg_hl += step;
+    BlockIOFlags(byte, byte + (reg_hl & 0xFF));
+    if (repeat && (reg_bc >> 8) != 0) {
+        reg_pc -= 2;
+        emu_cycles += 5;
+    }
+}
+
+void
+CPUZ80Impl::do_ED_NOP(void)
+{
+    // Opcodes that ED does not define do nothing
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//                       Disassembly and assembly                           //
+//////////////////////////////////////////////////////////////////////////////
+
+// In the mnemonic tables, lowercase marks what follows the opcode:
+//     n    a byte
+//     nn   a little-endian word
+//     e    a relative jump target
+//     d    the signed offset of (IX+d) or (IY+d)
+
+static const char *const r_names[] = {
+    "B", "C", "D", "E", "H", "L", "(HL)", "A"
+};
+static const char *const rp_names[] = { "BC", "DE", "HL", "SP" };
+static const char *const rp2_names[] = { "BC", "DE", "HL", "AF" };
+static const char *const cc_names[] = {
+    "NZ", "Z", "NC", "C", "PO", "PE", "P", "M"
+};
+static const char *const alu_names[] = {
+    "ADD A,", "ADC A,", "SUB ", "SBC A,", "AND ", "XOR ", "OR ", "CP "
+};
+static const char *const rot_names[] = {
+    "RLC", "RRC", "RL", "RR", "SLA", "SRA", "SLL", "SRL"
+};
+
+// The text of an unprefixed opcode, or of a DD or FD opcode with idx
+std::string
+CPUZ80Impl::BaseText(unsigned op, Index idx)
+{
+    static const char *const hl_names[] = { "HL", "IX", "IY" };
+    static const char *const h_names[] = { "H", "IXH", "IYH" };
+    static const char *const l_names[] = { "L", "IXL", "IYL" };
+    static const char *const mem_names[] = { "(HL)", "(IX+d)", "(IY+d)" };
+
+    unsigned x = op >> 6;
+    unsigned y = (op >> 3) & 7;
+    unsigned z = op & 7;
+    unsigned p = y >> 1;
+    unsigned q = y & 1;
+    std::string hl = hl_names[idx];
+
+    // Register r; with plain, H and L stay themselves, as they do beside
+    // (IX+d)
+    auto reg = [idx](unsigned r, bool plain) -> std::string {
+        if (r == 6) {
+            return mem_names[idx];
+        }
+        if (!plain && r == 4) {
+            return h_names[idx];
+        }
+        if (!plain && r == 5) {
+            return l_names[idx];
+        }
+        return r_names[r];
+    };
+    auto rp = [&hl](unsigned p_) -> std::string {
+        return p_ == 2 ? hl : rp_names[p_];
+    };
+    char buf[16];
+
+    switch (x) {
+    case 0:
+        switch (z) {
+        case 0:
+            switch (y) {
+            case 0: return "NOP";
+            case 1: return "EX AF,AF'";
+            case 2: return "DJNZ e";
+            case 3: return "JR e";
+            default: return std::string("JR ") + cc_names[y - 4] + ",e";
+            }
+        case 1:
+            if (q == 0) {
+                return "LD " + rp(p) + ",nn";
+            }
+            return "ADD " + hl + "," + rp(p);
+        case 2:
+            switch (y) {
+            case 0: return "LD (BC),A";
+            case 1: return "LD A,(BC)";
+            case 2: return "LD (DE),A";
+            case 3: return "LD A,(DE)";
+            case 4: return "LD (nn)," + hl;
+            case 5: return "LD " + hl + ",(nn)";
+            case 6: return "LD (nn),A";
+            default: return "LD A,(nn)";
+            }
+        case 3:
+            return (q == 0 ? "INC " : "DEC ") + rp(p);
+        case 4:
+            return "INC " + reg(y, false);
+        case 5:
+            return "DEC " + reg(y, false);
+        case 6:
+            return "LD " + reg(y, false) + ",n";
+        default:
+            {
+                static const char *const names[] = {
+                    "RLCA", "RRCA", "RLA", "RRA", "DAA", "CPL", "SCF", "CCF"
+                };
+                return names[y];
+            }
+        }
+
+    case 1:
+        if (y == 6 && z == 6) {
+            return "HALT";
+        }
+        {
+            bool plain = (y == 6 || z == 6);
+            return "LD " + reg(y, plain) + "," + reg(z, plain);
+        }
+
+    case 2:
+        return alu_names[y] + reg(z, false);
+
+    default:
+        switch (z) {
+        case 0:
+            return std::string("RET ") + cc_names[y];
+        case 1:
+            if (q == 0) {
+                return "POP " + (p == 2 ? hl : std::string(rp2_names[p]));
+            }
+            switch (p) {
+            case 0: return "RET";
+            case 1: return "EXX";
+            case 2: return "JP (" + hl + ")";
+            default: return "LD SP," + hl;
+            }
+        case 2:
+            return std::string("JP ") + cc_names[y] + ",nn";
+        case 3:
+            switch (y) {
+            case 0: return "JP nn";
+            case 1: return "";      // CB prefix
+            case 2: return "OUT (n),A";
+            case 3: return "IN A,(n)";
+            case 4: return "EX (SP)," + hl;
+            case 5: return "EX DE,HL";
+            case 6: return "DI";
+            default: return "EI";
+            }
+        case 4:
+            return std::string("CALL ") + cc_names[y] + ",nn";
+        case 5:
+            if (q == 0) {
+                return "PUSH " + (p == 2 ? hl : std::string(rp2_names[p]));
+            }
+            // The others are prefixes
+            return p == 0 ? "CALL nn" : "";
+        case 6:
+            return alu_names[y] + std::string("n");
+        default:
+            std::snprintf(buf, sizeof(buf), "RST $%02X", y * 8);
+            return buf;
+        }
+    }
+}
+
+// The text of a CB opcode, or with idx, of a DD CB or FD CB opcode
+std::string
+CPUZ80Impl::CBText(unsigned op, Index idx)
+{
+    static const char *const mem_names[] = { "(HL)", "(IX+d)", "(IY+d)" };
+
+    unsigned x = op >> 6;
+    unsigned y = (op >> 3) & 7;
+    unsigned z = op & 7;
+    char buf[8];
+
+    // Indexed forms operate on memory; the undocumented ones also copy the
+    // result to a register
+    std::string operand;
+    if (idx == idx_hl) {
+        operand = r_names[z];
+    } else {
+        operand = mem_names[idx];
+        if (z != 6 && x != 1) {
+            operand = operand + "," + r_names[z];
+        }
+    }
+
+    if (x == 0) {
+        return rot_names[y] + std::string(" ") + operand;
+    }
+    static const char *const names[] = { "", "BIT", "RES", "SET" };
+    std::snprintf(buf, sizeof(buf), " %u,", y);
+    return names[x] + std::string(buf) + operand;
+}
+
+std::string
+CPUZ80Impl::EDText(unsigned op)
+{
+    unsigned x = op >> 6;
+    unsigned y = (op >> 3) & 7;
+    unsigned z = op & 7;
+    unsigned p = y >> 1;
+    unsigned q = y & 1;
+
+    if (x == 1) {
+        switch (z) {
+        case 0:
+            return y == 6 ? "IN (C)" : std::string("IN ") + r_names[y] + ",(C)";
+        case 1:
+            return y == 6 ? "OUT (C),0" : std::string("OUT (C),") + r_names[y];
+        case 2:
+            return (q == 0 ? "SBC HL," : "ADC HL,") + std::string(rp_names[p]);
+        case 3:
+            if (q == 0) {
+                return "LD (nn)," + std::string(rp_names[p]);
+            }
+            return "LD " + std::string(rp_names[p]) + ",(nn)";
+        case 4:
+            return "NEG";
+        case 5:
+            return y == 1 ? "RETI" : "RETN";
+        case 6:
+            {
+                static const char *const modes[] = {
+                    "IM 0", "IM 0", "IM 1", "IM 2", "IM 0", "IM 0", "IM 1", "IM 2"
+                };
+                return modes[y];
+            }
+        default:
+            {
+                static const char *const names[] = {
+                    "LD I,A", "LD R,A", "LD A,I", "LD A,R", "RRD", "RLD",
+                    "NOP", "NOP"
+                };
+                return names[y];
+            }
+        }
+    }
+    if (x == 2 && z <= 3 && y >= 4) {
+        static const char *const names[4][4] = {
+            { "LDI",  "CPI",  "INI",  "OUTI" },
+            { "LDD",  "CPD",  "IND",  "OUTD" },
+            { "LDIR", "CPIR", "INIR", "OTIR" },
+            { "LDDR", "CPDR", "INDR", "OTDR" }
+        };
+        return names[y - 4][z];
+    }
+    return "NOP";
+}
+
+// Mnemonics for each opcode of each table, built on first use
+const std::vector<std::string> *
+CPUZ80Impl::MnemonicTables(void)
+{
+    static std::vector<std::string> tables[num_tables];
+    if (tables[tab_base].empty()) {
+        for (unsigned op = 0; op < 256; ++op) {
+            tables[tab_base].push_back(BaseText(op, idx_hl));
+            tables[tab_cb].push_back(CBText(op, idx_hl));
+            tables[tab_ed].push_back(EDText(op));
+            tables[tab_ix].push_back(BaseText(op, idx_ix));
+            tables[tab_iy].push_back(BaseText(op, idx_iy));
+            tables[tab_ix_cb].push_back(CBText(op, idx_ix));
+            tables[tab_iy_cb].push_back(CBText(op, idx_iy));
+        }
+    }
+    return tables;
+}
+
+// Find the table and opcode of the instruction at address, and the number
+// of bytes of prefix and opcode
+static void
+findOpcode(const Memory *memory, std::uint16_t address, Table& table,
+           std::uint8_t& opcode, unsigned& count)
+{
+    opcode = memory->Peek8(address);
+    table = tab_base;
+    count = 1;
+    switch (opcode) {
+    case 0xCB:
+        table = tab_cb;
+        break;
+    case 0xED:
+        table = tab_ed;
+        break;
+    case 0xDD:
+    case 0xFD:
+        {
+            auto next = memory->Peek8(static_cast<std::uint16_t>(address + 1));
+            if (next == 0xDD || next == 0xED || next == 0xFD) {
+                // Acts alone, as a NOP
+                table = tab_base;
+                opcode = 0x00;
+                return;
+            }
+            if (next == 0xCB) {
+                // The offset comes before the opcode
+                table = (opcode == 0xDD) ? tab_ix_cb : tab_iy_cb;
+                opcode = memory->Peek8(static_cast<std::uint16_t>(address + 3));
+                count = 4;
+                return;
+            }
+            table = (opcode == 0xDD) ? tab_ix : tab_iy;
+        }
+        break;
+    default:
+        return;
+    }
+    opcode = memory->Peek8(static_cast<std::uint16_t>(address + 1));
+    count = 2;
+}
+
+CPU::Disasm
+CPUZ80Impl::Disassemble(std::uint64_t address) const
+{
+    Table table;
+    std::uint8_t opcode;
+    unsigned count;
+    std::uint16_t addr = address;
+    findOpcode(memory, addr, table, opcode, count);
+
+    auto const &text = MnemonicTables()[table][opcode];
+    auto byte = [this, addr](unsigned offset) -> unsigned {
+        return memory->Peek8(static_cast<std::uint16_t>(addr + offset));
+    };
+
+    // The offset of DD CB d op is already counted
+    unsigned offset_pos = 2;
+    std::string disasm;
+    char buf[20];
+    for (std::size_t i = 0; i < text.size(); ) {
+        if (!std::islower(static_cast<unsigned char>(text[i]))) {
+            disasm += text[i++];
+            continue;
+        }
+        if (text.compare(i, 2, "nn") == 0) {
+            std::snprintf(buf, sizeof(buf), "$%02X%02X",
+                          byte(count + 1), byte(count));
+            count += 2;
+            i += 2;
+        } else if (text[i] == 'n') {
+            std::snprintf(buf, sizeof(buf), "$%02X", byte(count));
+            count += 1;
+            i += 1;
+        } else if (text[i] == 'e') {
+            auto d = static_cast<std::int8_t>(byte(count));
+            count += 1;
+            std::snprintf(buf, sizeof(buf), "$%04X",
+                          static_cast<std::uint16_t>(addr + count + d));
+            i += 1;
+        } else {
+            auto d = static_cast<std::int8_t>(byte(offset_pos));
+            if (table == tab_ix || table == tab_iy) {
+                count += 1;
+            }
+            if (d < 0 && !disasm.empty() && disasm.back() == '+') {
+                disasm.back() = '-';
+                d = -d;
+            }
+            std::snprintf(buf, sizeof(buf), "$%02X",
+                          static_cast<unsigned>(static_cast<std::uint8_t>(d)));
+            i += 1;
+        }
+        disasm += buf;
+    }
+
+    return CPU::Disasm(disasm, count);
+}
+
+// Number of bytes in the instruction at address
+unsigned
+CPUZ80Impl::Length(std::uint16_t address) const
+{
+    Table table;
+    std::uint8_t opcode;
+    unsigned count;
+    findOpcode(memory, address, table, opcode, count);
+
+    auto const &text = MnemonicTables()[table][opcode];
+    for (auto ch : text) {
+        if (std::islower(static_cast<unsigned char>(ch))) {
+            ++count;
+        }
+    }
+    // d in DD CB d op was counted with the opcode
+    if (table == tab_ix_cb || table == tab_iy_cb) {
+        --count;
+    }
+    return count;
+}
+
+// An operand, as parsed from a mnemonic table or from assembler input
+struct AsmOperand {
+    char kind;          // 'n', 'w' for nn, 'e', 'd', or '#' for a number
+    long value;
+};
+
+// Registers and conditions; anything else is a number
+static bool
+isName(const std::string& word)
+{
+    static const char *const names[] = {
+        "A", "B", "C", "D", "E", "H", "L", "I", "R", "F",
+        "AF", "AF'", "BC", "DE", "HL", "SP", "IX", "IY",
+        "IXH", "IXL", "IYH", "IYL",
+        "NZ", "Z", "NC", "PO", "PE", "P", "M",
+        nullptr
+    };
+    for (unsigned i = 0; names[i] != nullptr; ++i) {
+        if (word == names[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Parse a number in hexadecimal, with an optional $
+static bool
+parseNumber(const std::string& str, long& value)
+{
+    std::size_t start = (!str.empty() && str[0] == '$') ? 1 : 0;
+    if (start >= str.size()) {
+        return false;
+    }
+    char *end;
+    value = std::strtol(str.c_str() + start, &end, 16);
+    return *end == '\0'
+        && std::isxdigit(static_cast<unsigned char>(str[start]));
+}
+
+// Reduce an operand to its shape, in which every number is #, and (IX+d) is
+// (IX+#); return an empty string if it cannot be parsed. Lowercase
+// placeholders are recognized, as in the mnemonic tables.
+static std::string
+operandShape(const std::string& operand, AsmOperand& value)
+{
+    value.kind = 0;
+    value.value = 0;
+
+    auto number = [&value](const std::string& str) -> bool {
+        if (str == "n" || str == "nn" || str == "e") {
+            value.kind = (str == "nn") ? 'w' : str[0];
+            return true;
+        }
+        value.kind = '#';
+        return parseNumber(str, value.value);
+    };
+
+    if (operand.size() >= 2 && operand.front() == '('
+    &&  operand.back() == ')') {
+        std::string inner = operand.substr(1, operand.size() - 2);
+        if (isName(inner)) {
+            return operand;
+        }
+        if (inner.compare(0, 2, "IX") == 0 || inner.compare(0, 2, "IY") == 0) {
+            std::string rest = inner.substr(2);
+            std::string shape = "(" + inner.substr(0, 2) + "+#)";
+            if (rest == "+d") {
+                value.kind = 'd';
+                return shape;
+            }
+            value.kind = '#';
+            if (rest.empty()) {
+                return shape;
+            }
+            if ((rest[0] == '+' || rest[0] == '-')
+            &&  parseNumber(rest.substr(1), value.value)) {
+                if (rest[0] == '-') {
+                    value.value = -value.value;
+                }
+                return shape;
+            }
+            return "";
+        }
+        return number(inner) ? "(#)" : "";
+    }
+    if (isName(operand)) {
+        return operand;
+    }
+    return number(operand) ? "#" : "";
+}
+
+// Reduce an instruction to its shape, and list its operands
+static std::string
+instructionShape(const std::string& code, std::vector<AsmOperand>& operands)
+{
+    // Separate the mnemonic, and remove all other spaces
+    std::size_t start = code.find_first_not_of(" \t");
+    if (start == std::string::npos) {
+        return "";
+    }
+    std::size_t end = code.find_first_of(" \t", start);
+    std::string shape = code.substr(start, end - start);
+    std::string rest;
+    if (end != std::string::npos) {
+        for (std::size_t i = end; i < code.size(); ++i) {
+            if (code[i] != ' ' && code[i] != '\t') {
+                rest += code[i];
+            }
+        }
+    }
+
+    operands.clear();
+    if (rest.empty()) {
+        return shape;
+    }
+    shape += ' ';
+    std::size_t pos = 0;
+    while (true) {
+        auto comma = rest.find(',', pos);
+        AsmOperand op;
+        auto op_shape = operandShape(rest.substr(pos, comma - pos), op);
+        if (op_shape.empty()) {
+            return "";
+        }
+        shape += op_shape;
+        if (op.kind != 0) {
+            operands.push_back(op);
+        }
+        if (comma == std::string::npos) {
+            break;
+        }
+        shape += ',';
+        pos = comma + 1;
+    }
+    return shape;
+}
+
+CPU::Assem
+CPUZ80Impl::Assemble(std::uint64_t pc, const std::string& code) const
+{
+    CPU::Assem error(false);
+
+    // Each shape of instruction, with its opcode bytes and operands. The
+    // tables are searched in order, so the documented form of an
+    // instruction comes first.
+    struct Encoding {
+        std::vector<std::uint8_t> opcode;
+        std::vector<AsmOperand> operands;
+    };
+    static std::map<std::string, std::vector<Encoding>> encodings;
+    if (encodings.empty()) {
+        static const std::uint8_t prefixes[num_tables][2] = {
+            { 0x00, 0x00 }, { 0xCB, 0x00 }, { 0xED, 0x00 },
+            { 0xDD, 0x00 }, { 0xFD, 0x00 }, { 0xDD, 0xCB }, { 0xFD, 0xCB }
+        };
+        auto tables = MnemonicTables();
+        for (unsigned t = 0; t < num_tables; ++t) {
+            for (unsigned op = 0; op < 256; ++op) {
+                auto const &text = tables[t][op];
+                if (text.empty()) {
+                    continue;
+                }
+                // Skip forms of the index tables that the prefix does not
+                // change, and undocumented copies of BIT n,(IX+d)
+                if ((t == tab_ix || t == tab_iy)
+                &&  text == tables[tab_base][op]) {
+                    continue;
+                }
+                if ((t == tab_ix_cb || t == tab_iy_cb)
+                &&  (op >> 6) == 1 && (op & 7) != 6) {
+                    continue;
+                }
+                Encoding enc;
+                for (unsigned i = 0; i < 2 && prefixes[t][i] != 0; ++i) {
+                    enc.opcode.push_back(prefixes[t][i]);
+                }
+                enc.opcode.push_back(op);
+                auto shape = instructionShape(text, enc.operands);
+                encodings[shape].push_back(enc);
+            }
+        }
+    }
+
+    // Parse the instruction
+    std::string upper;
+    for (auto ch : code) {
+        upper += std::toupper(static_cast<unsigned char>(ch));
+    }
+    std::vector<AsmOperand> operands;
+    auto shape = instructionShape(upper, operands);
+    auto p = encodings.find(shape);
+    if (p == encodings.end()) {
+        return error;   // Instruction not recognized
+    }
+
+    for (auto const &enc : p->second) {
+        if (enc.operands.size() != operands.size()) {
+            continue;
+        }
+        CPU::Assem assem(true, enc.opcode);
+        bool ok = true;
+        for (std::size_t i = 0; ok && i < operands.size(); ++i) {
+            long value = operands[i].value;
+            switch (enc.operands[i].kind) {
+            case '#':
+                // A number that is part of the instruction, as in RST $38
+                ok = value == enc.operands[i].value;
+                break;
+
+            case 'n':
+                ok = value >= -0x80 && value <= 0xFF;
+                assem.bytes.push_back(value & 0xFF);
+                break;
+
+            case 'w':
+                ok = value >= 0 && value <= 0xFFFF;
+                assem.bytes.push_back(value & 0xFF);
+                assem.bytes.push_back((value >> 8) & 0xFF);
+                break;
+
+            case 'e':
+                {
+                    // A relative jump always ends the instruction
+                    long offset = value - static_cast<long>(
+                            pc + assem.bytes.size() + 1);
+                    ok = value >= 0 && value <= 0xFFFF
+                      && offset >= -128 && offset <= +127;
+                    assem.bytes.push_back(offset & 0xFF);
+                }
+                break;
+
+            case 'd':
+                // The offset follows the first two bytes
+                ok = value >= -128 && value <= +127;
+                assem.bytes.insert(assem.bytes.begin() + 2, value & 0xFF);
+                break;
+            }
+        }
+        if (ok) {
+            return assem;
+        }
+    }
+
+    return error;
+}
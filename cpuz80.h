@@ -0,0 +1,76 @@
+// cpuz80.h
+
+#ifndef CPUZ80_H
+#define CPUZ80_H
+
+#include <climits>
+#include <cstdint>
+#include <memory>
+#include <functional>
+#include <set>
+#include <string>
+#include <vector>
+#include "cpu.h"
+
+class Memory;
+
+class CPUZ80 : public CPU {
+public:
+    CPUZ80(Memory *mem);
+    virtual ~CPUZ80(void);
+
+    virtual std::vector<std::string> GetRegisterList(void) const override;
+    virtual std::vector<Flag> GetFlags(void) const override;
+    virtual std::string GetRegister(const std::string& reg_name) const override;
+    virtual bool SetRegister(const std::string& reg_name, const std::string& value) override;
+    virtual int GetRegisterIndex(const std::string& reg_name) const override;
+    virtual std::uint64_t GetRegisterValue(int index) const override;
+    virtual void Step(void) override;
+    virtual void Next(void) override;
+    virtual void ToReturn(void) override;
+    virtual StopReason Run(void) override;
+    virtual RunResult RunCycles(unsigned long budget) override;
+    virtual RunResult RunInstructions(unsigned long count) override;
+    virtual RunResult RunUntil(const std::set<std::uint64_t>& stops,
+                               unsigned long max_count = ULONG_MAX) override;
+
+    virtual bool SetBreakStop(bool enable) override;
+
+    virtual std::uint64_t GetPC(void) const override;
+
+    virtual Disasm Disassemble(std::uint64_t address) const override;
+    virtual Assem Assemble(std::uint64_t pc, const std::string& code) const override;
+
+    // Counted in T-states
+    virtual unsigned long GetEmuCycles(void) const override;
+    virtual void ClearEmuCycles(void) override;
+
+    virtual void SetIRQ(bool asserted) override;
+    virtual void NMI(void) override;
+    virtual void Reset(void) override;
+
+    // I/O ports. IN and OUT pass the full 16-bit port address, as the Z80
+    // puts it on the bus. Without handlers, IN reads $FF and OUT does
+    // nothing.
+    typedef std::function<std::uint8_t(std::uint16_t port)> PortIn;
+    typedef std::function<void(std::uint16_t port, std::uint8_t data)> PortOut;
+    void SetPortHandlers(PortIn in, PortOut out);
+
+    // The byte that an interrupting device puts on the bus: the low byte of
+    // the vector address in mode 2, or an RST instruction in mode 0. The
+    // default is $FF, which is RST $38.
+    void SetInterruptData(std::uint8_t data);
+
+protected:
+    virtual void EventScheduled(unsigned long cycle) override;
+    virtual std::shared_ptr<const void> SaveState(void) const override;
+    virtual void RestoreState(const void *state) override;
+
+private:
+    RunResult RunLimited(unsigned long count, unsigned long cycles,
+                         const std::set<std::uint64_t> *stops);
+
+    void *impl;
+};
+
+#endif
@@ -3,6 +3,7 @@
 #include <wx/wx.h>
 #include <vector>
 #include <cstdio>
+#include <cstdlib>
 #include "cpu.h"
 #include "disasm.h"
 #include "events.h"
@@ -143,11 +144,53 @@ DisassemblyWindow::OnChar(wxKeyEvent& event)
         }
         break;
 
+    case 'c':
+    case 'C':
+        {
+            auto n = GetSelection();
+            if (n >= 0) {
+                SetConditionalBreakpoint(text[n].addr);
+                Refresh();
+            }
+        }
+        break;
+
     default:
         break;
     }
 }
 
+// Ask for a condition and a hit count, and set a breakpoint with them
+void
+DisassemblyWindow::SetConditionalBreakpoint(std::uint16_t addr)
+{
+    char addr_str[10];
+    std::snprintf(addr_str, sizeof(addr_str), "%04X", (unsigned)addr);
+
+    wxTextEntryDialog cond_dlg(this,
+            "Stop at $" + std::string(addr_str) + " when this holds,\n"
+            "for example: X == $10 && [$FB] > 3",
+            "Conditional breakpoint", cpu->GetBreakpointCondition(addr));
+    if (cond_dlg.ShowModal() == wxID_CANCEL) {
+        return;
+    }
+
+    wxTextEntryDialog hit_dlg(this,
+            "Stop on this hit and later ones", "Conditional breakpoint", "1");
+    if (hit_dlg.ShowModal() == wxID_CANCEL) {
+        return;
+    }
+    auto hits = std::strtoul(hit_dlg.GetValue(), NULL, 10);
+
+    try {
+        cpu->SetBreakpoint(addr, cond_dlg.GetValue().ToStdString(),
+                           hits != 0 ? hits : 1);
+    }
+    catch (CPUExcept const &err) {
+        wxMessageBox(err.what(), "Error", wxOK | wxICON_ERROR);
+    }
+}
+
 void
 DisassemblyWindow::OnDoubleClick(wxCommandEvent& event)
 {
@@ -190,7 +233,17 @@ DisassemblyWindow::OnDrawItem(wxDC & dc, const wxRect & rect, size_t n) const
     auto square = rect.GetHeight();
 
     auto line = text[n];
+
+    // Shade lines never executed, once there is coverage to tell
+    auto const &coverage = cpu->GetMemory()->GetCoverage();
+    bool unexecuted = line.addr < coverage.size()
+                   && (coverage[line.addr] & Memory::cover_opcode) == 0;
+    auto foreground = dc.GetTextForeground();
+    if (unexecuted) {
+        dc.SetTextForeground(*wxLIGHT_GREY);
+    }
     dc.DrawText(line.text, rect.GetLeft() + square, rect.GetTop() + 3);
+    dc.SetTextForeground(foreground);
     if (cpu->HasBreakpoint(line.addr, line.count)) {
         // Draw the breakpoint marker
         auto pen = dc.GetPen();
@@ -31,6 +31,7 @@ private:
     };
     std::vector<DisasmLine> text;
 
+    void SetConditionalBreakpoint(std::uint16_t addr);
     void OnDoubleClick(wxCommandEvent& event);
     void OnChar(wxKeyEvent& event);
 
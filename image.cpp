@@ -0,0 +1,47 @@
+// image.cpp
+
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include <cerrno>
+#include <cstring>
+#include "image.h"
+#include "memory.h"
+
+ImageLoad
+LoadImage(Memory *memory, const std::string& path, std::uint64_t address,
+          bool from_file)
+{
+    std::ifstream fp(path, std::ios::binary);
+    if (!fp) {
+        throw ImageExcept(path + ": " + std::strerror(errno));
+    }
+    std::vector<char> bytes((std::istreambuf_iterator<char>(fp)),
+                            std::istreambuf_iterator<char>());
+    if (fp.bad()) {
+        throw ImageExcept(path + ": " + std::strerror(errno));
+    }
+
+    // Use address at start of file if requested
+    std::size_t pos = 0;
+    if (from_file) {
+        if (bytes.size() < 2) {
+            return { address, 0 };
+        }
+        address = static_cast<std::uint8_t>(bytes[0])
+                | static_cast<std::uint8_t>(bytes[1]) << 8;
+        pos = 2;
+    }
+
+    ImageLoad image = { address, 0 };
+    if (address < 0x10000) {
+        image.length = std::min<std::uint64_t>(bytes.size() - pos,
+                                               0x10000 - address);
+        memory->LoadBlock(address,
+                reinterpret_cast<const std::uint8_t *>(bytes.data() + pos),
+                image.length);
+    }
+    return image;
+}
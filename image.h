@@ -0,0 +1,31 @@
+// image.h
+
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdexcept>
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+class Memory;
+
+class ImageExcept : public std::runtime_error {
+public:
+    ImageExcept(const std::string& msg) : std::runtime_error(msg) {}
+    ImageExcept(const char *msg) : std::runtime_error(msg) {}
+};
+
+struct ImageLoad {
+    std::uint64_t start;    // Address of the first byte loaded
+    std::size_t length;     // Number of bytes loaded
+};
+
+// Load the binary file at path into memory at address or, if from_file is
+// set, at the address in its first two bytes, low byte first. Loading stops
+// at the end of the 64K address space. Throws ImageExcept if the file
+// cannot be read.
+ImageLoad LoadImage(Memory *memory, const std::string& path,
+                    std::uint64_t address, bool from_file);
+
+#endif
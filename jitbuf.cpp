@@ -0,0 +1,95 @@
+// jitbuf.cpp
+
+#include "jitbuf.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#define JITBUF_MMAP 1
+#endif
+
+JITBuffer::JITBuffer(std::size_t size_) :
+    base(nullptr),
+    size(size_),
+    used(0),
+    start(0)
+{
+#ifdef JITBUF_MMAP
+    void *p = mmap(nullptr, size, PROT_READ | PROT_EXEC,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p != MAP_FAILED) {
+        base = static_cast<std::uint8_t *>(p);
+    }
+#endif
+}
+
+JITBuffer::~JITBuffer(void)
+{
+#ifdef JITBUF_MMAP
+    if (base != nullptr) {
+        munmap(base, size);
+    }
+#endif
+}
+
+bool
+JITBuffer::Begin(std::size_t max_size)
+{
+    if (base == nullptr || size - used < max_size || !Protect(true)) {
+        return false;
+    }
+    start = used;
+    return true;
+}
+
+void
+JITBuffer::Emit16(std::uint16_t word)
+{
+    Emit8(static_cast<std::uint8_t>(word >> 0));
+    Emit8(static_cast<std::uint8_t>(word >> 8));
+}
+
+void
+JITBuffer::Emit32(std::uint32_t word)
+{
+    Emit16(static_cast<std::uint16_t>(word >>  0));
+    Emit16(static_cast<std::uint16_t>(word >> 16));
+}
+
+void
+JITBuffer::Emit64(std::uint64_t word)
+{
+    Emit32(static_cast<std::uint32_t>(word >>  0));
+    Emit32(static_cast<std::uint32_t>(word >> 32));
+}
+
+void *
+JITBuffer::End(void)
+{
+    bool executable = Protect(false);
+    void *func = base + start;
+    // Keep functions aligned for the instruction fetcher
+    used = (used + 15) & ~static_cast<std::size_t>(15);
+    if (used > size) {
+        used = size;
+    }
+    start = used;
+    return executable ? func : nullptr;
+}
+
+void
+JITBuffer::Reset(void)
+{
+    used = 0;
+    start = 0;
+}
+
+bool
+JITBuffer::Protect(bool writable)
+{
+#ifdef JITBUF_MMAP
+    return mprotect(base, size, writable ? (PROT_READ | PROT_WRITE)
+                                         : (PROT_READ | PROT_EXEC)) == 0;
+#else
+    return false;
+#endif
+}
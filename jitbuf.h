@@ -0,0 +1,50 @@
+// jitbuf.h
+
+#ifndef JITBUF_H
+#define JITBUF_H
+
+#include <cstddef>
+#include <cstdint>
+
+// A region of executable memory, filled with one function at a time. The
+// region is writable only between Begin() and End().
+class JITBuffer {
+public:
+    JITBuffer(std::size_t size);
+    ~JITBuffer(void);
+
+    // False if executable memory is not available on this host
+    bool Valid(void) const { return base != nullptr; }
+
+    // Start a new function of at most max_size bytes. Returns false if there
+    // is not enough room left, where Reset() makes room by discarding
+    // everything, or if the region cannot be made writable.
+    bool Begin(std::size_t max_size);
+
+    void Emit8(std::uint8_t byte) { base[used++] = byte; }
+    void Emit16(std::uint16_t word);
+    void Emit32(std::uint32_t word);
+    void Emit64(std::uint64_t word);
+
+    // Offset from the start of the current function
+    std::size_t Position(void) const { return used - start; }
+    void Patch8(std::size_t pos, std::uint8_t byte) { base[start + pos] = byte; }
+
+    // Finish the current function and return its address, or null if the
+    // region cannot be made executable again, when no function in it can
+    // run
+    void *End(void);
+
+    // Discard all functions
+    void Reset(void);
+
+private:
+    std::uint8_t *base;
+    std::size_t size;
+    std::size_t used;
+    std::size_t start;
+
+    bool Protect(bool writable);
+};
+
+#endif // JITBUF_H
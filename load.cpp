@@ -3,14 +3,9 @@
 #include <wx/wx.h>
 #include <wx/filedlg.h>
 #include <wx/filedlgcustomize.h>
-#include <fstream>
-#include <string>
-#include <cerrno>
-#include <cstdint>
 #include <cstdlib>
-#include <cstring>
+#include "image.h"
 #include "load.h"
-#include "memory.h"
 
 // We need additional controls to specify the load address
 class LoadDialogHook : public wxFileDialogCustomizeHook {
@@ -67,40 +62,13 @@ Load(wxWindow *parent, Memory *memory)
         return -1;
     }
 
-    unsigned start = loadDlgHook.Address();
-
-    auto name = loadDlg.GetPath();
-
-    unsigned addr = start;
-    std::ifstream fp(name, std::ios::binary);
     try {
-        fp.exceptions(std::ifstream::failbit);
-        // Use address at start of file if requested
-        if (fp.good() && loadDlgHook.FromFile()) {
-            char ch1 = 0, ch2 = 0;
-            fp.get(ch1);
-            fp.get(ch2);
-            start = (std::uint8_t)ch1 | ((std::uint8_t)ch2 << 8);
-            addr = start;
-        }
-
-        while (fp.good() && addr < 0x10000) {
-            char ch;
-            fp.get(ch);
-            if (!fp.good()) {
-                break;
-            }
-            memory->Load8(addr, (std::uint8_t)ch);
-            ++addr;
-        }
+        auto image = LoadImage(memory, loadDlg.GetPath().ToStdString(),
+                               loadDlgHook.Address(), loadDlgHook.FromFile());
+        return (image.length != 0) ? static_cast<int>(image.start) : -1;
     }
-    catch (const std::ios_base::failure& fail) {
-        if (!fp.eof()) {
-            wxMessageBox(
-                    name + std::string(": ") + std::strerror(errno), 
-                    "Load failed");
-        }
+    catch (const ImageExcept& e) {
+        wxMessageBox(e.what(), "Load failed");
+        return -1;
     }
-
-    return (addr > start) ? start : -1;
 }
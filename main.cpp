@@ -2,17 +2,24 @@
 
 #include <wx/wx.h>
 #include <algorithm>
+#include <fstream>
+#include <string>
+#include <thread>
 #include <vector>
+#include <cctype>
 #include <cinttypes>
 #include <cstdio>
 #include <cstdlib>
 #include "cpu.h"
 #include "cpu6502.h"
+#include "coverage.h"
+#include "cpuz80.h"
 #include "disasm.h"
 #include "events.h"
 #include "load.h"
 #include "memdump.h"
 #include "memory.h"
+#include "profile.h"
 #include "registers.h"
 
 #include "open.xpm"
@@ -21,6 +28,8 @@
 #include "return.xpm"
 #include "goto.xpm"
 #include "mgoto.xpm"
+#include "run.xpm"
+#include "pause.xpm"
  
 class CPUSimApp : public wxApp
 {
@@ -33,7 +42,7 @@ wxIMPLEMENT_APP(CPUSimApp);
 class CPUSimFrame : public wxFrame
 {
 public:
-    CPUSimFrame();
+    explicit CPUSimFrame(const wxString& cpu_option);
  
 private:
     void OnLoad(wxCommandEvent& event);
@@ -42,12 +51,36 @@ private:
     void OnStepInto(wxCommandEvent& event);
     void OnStepOver(wxCommandEvent& event);
     void OnReturn(wxCommandEvent& event);
+    void OnRun(wxCommandEvent& event);
+    void OnPause(wxCommandEvent& event);
+    void OnJIT(wxCommandEvent& event);
+    void OnWatch(wxCommandEvent& event);
+    void OnClearWatch(wxCommandEvent& event);
+    void OnReset(wxCommandEvent& event);
+    void OnSnapshot(wxCommandEvent& event);
+    void OnRestore(wxCommandEvent& event);
+    void OnHistory(wxCommandEvent& event);
+    void OnStepBack(wxCommandEvent& event);
+    void OnReverseContinue(wxCommandEvent& event);
+    void OnTrace(wxCommandEvent& event);
+    void OnProfile(wxCommandEvent& event);
+    void OnCoverage(wxCommandEvent& event);
+    void OnSaveCoverage(wxCommandEvent& event);
+    void OnMergeCoverage(wxCommandEvent& event);
+    void OnClearCoverage(wxCommandEvent& event);
+    void OnNMI(wxCommandEvent& event);
+    void OnIRQ(wxCommandEvent& event);
+    void OnSample(wxTimerEvent& event);
+    void OnClose(wxCloseEvent& event);
     void OnExit(wxCommandEvent& event);
     void OnClearCycles(wxCommandEvent& event);
     void OnAbout(wxCommandEvent& event);
     void OnUpdateAll(wxEvent& event);
 
     void UpdateAll(void);
+    void SetRunning(bool running);
+    void RunThread(void);
+    void RunStopped(CPU::StopReason reason, const std::string& error);
 
     Memory *memory;
     CPU *cpu;
@@ -57,6 +90,19 @@ private:
     MemDumpWindow *memoryWin;
     wxBoxSizer *m_cycles_sizer;
     wxStaticText *m_cycles;
+    wxButton *m_clear;
+
+    // Free-running execution happens on m_run_thread; while m_running is
+    // set, the GUI only samples the cycle count
+    std::thread m_run_thread;
+    bool m_running;
+    wxTimer m_sample_timer;
+
+    // Taken by Run > Take snapshot; nullptr until then
+    std::shared_ptr<const CPU::Snapshot> m_snapshot;
+
+    // Set while the CPU keeps history, for Step back and Reverse continue
+    bool m_history;
 
     wxDECLARE_EVENT_TABLE();
 };
@@ -69,34 +115,108 @@ enum
     ID_Return = 4,
     ID_CodeGoto = 5,
     ID_MemGoto = 6,
-    ID_ClearCycles = 7
+    ID_ClearCycles = 7,
+    ID_Run = 8,
+    ID_Pause = 9,
+    ID_Sample = 10,
+    ID_JIT = 11,
+    ID_Watch = 12,
+    ID_ClearWatch = 13,
+    ID_Reset = 14,
+    ID_NMI = 15,
+    ID_IRQ = 16,
+    ID_Snapshot = 17,
+    ID_Restore = 18,
+    ID_History = 19,
+    ID_StepBack = 20,
+    ID_ReverseContinue = 21,
+    ID_Trace = 22,
+    ID_Profile = 23,
+    ID_Coverage = 24,
+    ID_SaveCoverage = 25,
+    ID_MergeCoverage = 26,
+    ID_ClearCoverage = 27
 };
 
+// History that Run > Keep history asks for: a checkpoint every million
+// instructions, so that going back executes for some milliseconds at most,
+// in up to 256 MB
+static const std::size_t history_budget = 256 << 20;
+static const unsigned long history_interval = 1000000;
+
 static void setBold(wxWindow *window);
+static bool parseWatch(const std::string& spec, Memory::Watchpoint& watch);
  
 wxDEFINE_EVENT(wxEVT_UPDATE_ALL, wxEvent);
 
 wxBEGIN_EVENT_TABLE(CPUSimFrame, wxFrame)
     EVT_BUTTON(ID_ClearCycles, CPUSimFrame::OnClearCycles)
     EVT_CUSTOM(wxEVT_UPDATE_ALL, wxID_ANY, CPUSimFrame::OnUpdateAll)
+    EVT_TIMER(ID_Sample, CPUSimFrame::OnSample)
+    EVT_CLOSE(CPUSimFrame::OnClose)
 wxEND_EVENT_TABLE()
 
+// Options that choose the CPU
+static const char *const cpu_options[] = {
+    "--6502", "--6502-undocumented", "--65c02", "--w65c02", "--z80", nullptr
+};
+
+// Create the CPU named by an option from cpu_options
+static CPU *
+newCPU(Memory *memory, const wxString& option)
+{
+    if (option == "--z80") {
+        return new CPUZ80(memory);
+    }
+
+    CPU6502::Variant variant = CPU6502::nmos;
+    if (option == "--6502-undocumented") {
+        variant = CPU6502::nmos_undocumented;
+    } else if (option == "--65c02") {
+        variant = CPU6502::cmos;
+    } else if (option == "--w65c02") {
+        variant = CPU6502::wdc;
+    }
+    return new CPU6502(memory, variant);
+}
+
 bool CPUSimApp::OnInit()
 {
-    CPUSimFrame *frame = new CPUSimFrame();
+    // The CPU is chosen on the command line, as one of cpu_options; the
+    // default is --6502
+    wxString cpu_option = "--6502";
+    for (int i = 1; i < argc; ++i) {
+        wxString arg = argv[i];
+        bool known = false;
+        for (unsigned j = 0; cpu_options[j] != nullptr; ++j) {
+            known = known || arg == cpu_options[j];
+        }
+        if (!known) {
+            wxMessageBox("Unknown option " + arg, "CPU Simulator",
+                         wxOK | wxICON_ERROR);
+            return false;
+        }
+        cpu_option = arg;
+    }
+
+    CPUSimFrame *frame = new CPUSimFrame(cpu_option);
     frame->Show(true);
     return true;
 }
  
-CPUSimFrame::CPUSimFrame() :
+CPUSimFrame::CPUSimFrame(const wxString& cpu_option) :
     wxFrame(nullptr, wxID_ANY, "CPU Simulator"),
     memory(new LittleEndianMemory(65536)),
-    cpu(new CPU6502(memory)),
+    cpu(newCPU(memory, cpu_option)),
     registers(nullptr),
     disassembly(nullptr),
     memoryWin(nullptr),
     m_cycles_sizer(nullptr),
-    m_cycles(nullptr)
+    m_cycles(nullptr),
+    m_clear(nullptr),
+    m_running(false),
+    m_sample_timer(this, ID_Sample),
+    m_history(false)
 {
     wxMenu *menuFile = new wxMenu;
     menuFile->Append(ID_Load, "&Load...\tCtrl-L",
@@ -112,6 +232,45 @@ CPUSimFrame::CPUSimFrame() :
     menuRun->Append(ID_StepInto, "Step &into subroutine");
     menuRun->Append(ID_StepOver, "Step &over subroutine");
     menuRun->Append(ID_Return, "&Return from subroutine");
+    menuRun->AppendSeparator();
+    menuRun->Append(ID_Run, "&Continue\tF5");
+    menuRun->Append(ID_Pause, "&Pause\tF6");
+    menuRun->AppendSeparator();
+    menuRun->Append(ID_StepBack, "Step &back\tShift-F7",
+                    "Go back one instruction");
+    menuRun->Append(ID_ReverseContinue, "Reverse con&tinue\tShift-F5",
+                    "Go back to the last breakpoint reached");
+    menuRun->AppendCheckItem(ID_History, "Keep &history",
+                             "Record execution, to be able to go back");
+    menuRun->AppendSeparator();
+    menuRun->Append(ID_Watch, "Add &watchpoint...",
+                    "Stop when a memory range is read or written");
+    menuRun->Append(ID_ClearWatch, "Clear all watc&hpoints");
+    menuRun->AppendSeparator();
+    menuRun->Append(ID_Reset, "R&eset",
+                    "Reset the CPU, loading the PC from the reset vector");
+    menuRun->Append(ID_NMI, "Signal &NMI");
+    menuRun->AppendCheckItem(ID_IRQ, "Assert I&RQ");
+    menuRun->AppendSeparator();
+    menuRun->Append(ID_Snapshot, "Take &snapshot\tCtrl-S",
+                    "Save the registers and memory, to restore later");
+    menuRun->Append(ID_Restore, "Restore snapshot\tCtrl-R",
+                    "Go back to the registers and memory of the snapshot");
+    menuRun->AppendSeparator();
+    menuRun->AppendCheckItem(ID_JIT, "&Native translation",
+                             "Translate frequently run code to native code");
+    menuRun->AppendCheckItem(ID_Trace, "Record &trace...",
+                             "Write every instruction executed to a file");
+    menuRun->AppendCheckItem(ID_Profile, "Pro&file subroutines",
+                             "Count the cycles spent in each subroutine");
+    menuRun->AppendSeparator();
+    menuRun->AppendCheckItem(ID_Coverage, "Keep co&verage",
+                             "Mark the bytes executed, read and written");
+    menuRun->Append(ID_SaveCoverage, "Save coverage...",
+                    "Write the coverage marks to a file");
+    menuRun->Append(ID_MergeCoverage, "Merge coverage...",
+                    "Add the coverage marks of an earlier run");
+    menuRun->Append(ID_ClearCoverage, "Clear coverage");
  
     wxMenu *menuHelp = new wxMenu;
     menuHelp->Append(wxID_ABOUT);
@@ -146,6 +305,13 @@ CPUSimFrame::CPUSimFrame() :
     toolbar->AddTool(ID_Return, "Return",
                      wxBitmapBundle(return_xpm),
                      "Return from subroutine");
+    toolbar->AddSeparator();
+    toolbar->AddTool(ID_Run, "Continue",
+                     wxBitmapBundle(run_xpm),
+                     "Run until breakpoint or pause");
+    toolbar->AddTool(ID_Pause, "Pause",
+                     wxBitmapBundle(pause_xpm),
+                     "Pause execution");
     toolbar->Realize();
 
     auto *sizer0 = new wxBoxSizer(wxHORIZONTAL);
@@ -159,8 +325,8 @@ CPUSimFrame::CPUSimFrame() :
             wxDefaultPosition, wxDefaultSize, wxALIGN_RIGHT);
     m_cycles_sizer->Add(m_cycles, 1, wxALIGN_CENTER_VERTICAL);
     m_cycles_sizer->AddSpacer(5);
-    auto clear = new wxButton(this, ID_ClearCycles, "Clear");
-    m_cycles_sizer->Add(clear, 0);
+    m_clear = new wxButton(this, ID_ClearCycles, "Clear");
+    m_cycles_sizer->Add(m_clear, 0);
     sizer1->Add(m_cycles_sizer, 0, wxEXPAND);
     label = new wxStaticText(this, wxID_ANY, "Registers");
     setBold(label);
@@ -198,6 +364,7 @@ CPUSimFrame::CPUSimFrame() :
     SetStatusText("");
 
     SetSizerAndFit(sizer0);
+    SetRunning(false);
  
     Bind(wxEVT_MENU, &CPUSimFrame::OnLoad, this, ID_Load);
     Bind(wxEVT_MENU, &CPUSimFrame::OnCodeGoto, this, ID_CodeGoto);
@@ -205,6 +372,26 @@ CPUSimFrame::CPUSimFrame() :
     Bind(wxEVT_MENU, &CPUSimFrame::OnStepInto, this, ID_StepInto);
     Bind(wxEVT_MENU, &CPUSimFrame::OnStepOver, this, ID_StepOver);
     Bind(wxEVT_MENU, &CPUSimFrame::OnReturn, this, ID_Return);
+    Bind(wxEVT_MENU, &CPUSimFrame::OnRun, this, ID_Run);
+    Bind(wxEVT_MENU, &CPUSimFrame::OnPause, this, ID_Pause);
+    Bind(wxEVT_MENU, &CPUSimFrame::OnJIT, this, ID_JIT);
+    Bind(wxEVT_MENU, &CPUSimFrame::OnWatch, this, ID_Watch);
+    Bind(wxEVT_MENU, &CPUSimFrame::OnClearWatch, this, ID_ClearWatch);
+    Bind(wxEVT_MENU, &CPUSimFrame::OnReset, this, ID_Reset);
+    Bind(wxEVT_MENU, &CPUSimFrame::OnNMI, this, ID_NMI);
+    Bind(wxEVT_MENU, &CPUSimFrame::OnIRQ, this, ID_IRQ);
+    Bind(wxEVT_MENU, &CPUSimFrame::OnSnapshot, this, ID_Snapshot);
+    Bind(wxEVT_MENU, &CPUSimFrame::OnRestore, this, ID_Restore);
+    Bind(wxEVT_MENU, &CPUSimFrame::OnHistory, this, ID_History);
+    Bind(wxEVT_MENU, &CPUSimFrame::OnStepBack, this, ID_StepBack);
+    Bind(wxEVT_MENU, &CPUSimFrame::OnReverseContinue, this,
+         ID_ReverseContinue);
+    Bind(wxEVT_MENU, &CPUSimFrame::OnTrace, this, ID_Trace);
+    Bind(wxEVT_MENU, &CPUSimFrame::OnProfile, this, ID_Profile);
+    Bind(wxEVT_MENU, &CPUSimFrame::OnCoverage, this, ID_Coverage);
+    Bind(wxEVT_MENU, &CPUSimFrame::OnSaveCoverage, this, ID_SaveCoverage);
+    Bind(wxEVT_MENU, &CPUSimFrame::OnMergeCoverage, this, ID_MergeCoverage);
+    Bind(wxEVT_MENU, &CPUSimFrame::OnClearCoverage, this, ID_ClearCoverage);
     Bind(wxEVT_MENU, &CPUSimFrame::OnAbout, this, wxID_ABOUT);
     Bind(wxEVT_MENU, &CPUSimFrame::OnExit, this, wxID_EXIT);
 }
@@ -302,6 +489,403 @@ CPUSimFrame::OnReturn(wxCommandEvent& event)
     disassembly->SetAddress(cpu->GetPC());
 }
 
+void
+CPUSimFrame::OnRun(wxCommandEvent& event)
+{
+    if (m_running) {
+        return;
+    }
+    SetRunning(true);
+    SetStatusText("Running");
+    m_run_thread = std::thread(&CPUSimFrame::RunThread, this);
+}
+
+void
+CPUSimFrame::OnPause(wxCommandEvent& event)
+{
+    if (m_running) {
+        cpu->Pause();
+    }
+}
+
+void
+CPUSimFrame::OnJIT(wxCommandEvent& event)
+{
+    bool enabled = cpu->SetJIT(event.IsChecked());
+    GetMenuBar()->Check(ID_JIT, enabled);
+    if (event.IsChecked() && !enabled) {
+        wxMessageBox("Native translation is not available for this CPU",
+                     "Error", wxOK | wxICON_ERROR);
+    }
+}
+
+void
+CPUSimFrame::OnWatch(wxCommandEvent& event)
+{
+    wxTextEntryDialog dlg(this,
+            "Address or range, such as 0400-07FF; then r, w or rw;\n"
+            "then optionally = and a byte to match",
+            "Add watchpoint");
+    if (dlg.ShowModal() == wxID_OK) {
+        std::string spec = dlg.GetValue().ToStdString();
+        Memory::Watchpoint watch;
+        if (parseWatch(spec, watch)) {
+            cpu->GetMemory()->AddWatchpoint(watch);
+        } else {
+            wxMessageBox("Cannot read watchpoint \"" + spec + "\"", "Error",
+                         wxOK | wxICON_ERROR);
+        }
+    }
+}
+
+void
+CPUSimFrame::OnClearWatch(wxCommandEvent& event)
+{
+    cpu->GetMemory()->ClearWatchpoints();
+}
+
+void
+CPUSimFrame::OnReset(wxCommandEvent& event)
+{
+    cpu->Reset();
+    UpdateAll();
+    disassembly->SetAddress(cpu->GetPC());
+}
+
+void
+CPUSimFrame::OnSnapshot(wxCommandEvent& event)
+{
+    m_snapshot = cpu->TakeSnapshot();
+    GetMenuBar()->Enable(ID_Restore, true);
+}
+
+void
+CPUSimFrame::OnRestore(wxCommandEvent& event)
+{
+    if (m_snapshot) {
+        cpu->RestoreSnapshot(*m_snapshot);
+        UpdateAll();
+        disassembly->SetAddress(cpu->GetPC());
+    }
+}
+
+void
+CPUSimFrame::OnHistory(wxCommandEvent& event)
+{
+    m_history = cpu->SetHistory(event.IsChecked() ? history_budget : 0,
+                                history_interval);
+    auto menuBar = GetMenuBar();
+    menuBar->Check(ID_History, m_history);
+    menuBar->Enable(ID_StepBack, m_history);
+    menuBar->Enable(ID_ReverseContinue, m_history);
+    if (event.IsChecked() && !m_history) {
+        wxMessageBox("Execution history is not available for this CPU",
+                     "Error", wxOK | wxICON_ERROR);
+    }
+}
+
+void
+CPUSimFrame::OnStepBack(wxCommandEvent& event)
+{
+    try {
+        if (!cpu->StepBack()) {
+            SetStatusText("At the start of the history");
+        }
+    }
+    catch (CPUExcept const &err) {
+        wxMessageBox(err.what(), "Error", wxOK | wxICON_ERROR);
+    }
+    UpdateAll();
+    disassembly->SetAddress(cpu->GetPC());
+}
+
+void
+CPUSimFrame::OnReverseContinue(wxCommandEvent& event)
+{
+    try {
+        char status[40];
+        if (cpu->ReverseContinue() == CPU::stop_breakpoint) {
+            std::snprintf(status, sizeof(status), "Breakpoint at $%04" PRIX64,
+                          cpu->GetPC());
+            SetStatusText(status);
+        } else {
+            SetStatusText("At the start of the history");
+        }
+    }
+    catch (CPUExcept const &err) {
+        wxMessageBox(err.what(), "Error", wxOK | wxICON_ERROR);
+    }
+    UpdateAll();
+    disassembly->SetAddress(cpu->GetPC());
+}
+
+// Start a trace in a file chosen here, or finish the one being written
+void
+CPUSimFrame::OnTrace(wxCommandEvent& event)
+{
+    auto menuBar = GetMenuBar();
+    if (!event.IsChecked()) {
+        try {
+            cpu->StopTrace();
+        }
+        catch (CPUExcept const &err) {
+            wxMessageBox(err.what(), "Error", wxOK | wxICON_ERROR);
+        }
+        return;
+    }
+
+    wxFileDialog traceDlg(this, "Record trace", "", "trace.gz",
+                          "Trace files (*.gz)|*.gz",
+                          wxFD_SAVE | wxFD_OVERWRITE_PROMPT);
+    bool tracing = false;
+    if (traceDlg.ShowModal() == wxID_OK) {
+        try {
+            tracing = cpu->StartTrace(traceDlg.GetPath().ToStdString());
+            if (!tracing) {
+                wxMessageBox("Tracing is not available for this CPU",
+                             "Error", wxOK | wxICON_ERROR);
+            }
+        }
+        catch (CPUExcept const &err) {
+            wxMessageBox(err.what(), "Error", wxOK | wxICON_ERROR);
+        }
+    }
+    menuBar->Check(ID_Trace, tracing);
+}
+
+// Start a profile, or finish it and save its stacks for a flame graph
+void
+CPUSimFrame::OnProfile(wxCommandEvent& event)
+{
+    auto menuBar = GetMenuBar();
+    if (event.IsChecked()) {
+        if (!cpu->StartProfile()) {
+            menuBar->Check(ID_Profile, false);
+            wxMessageBox("Profiling is not available for this CPU",
+                         "Error", wxOK | wxICON_ERROR);
+        }
+        return;
+    }
+
+    cpu->StopProfile();
+    auto profile = cpu->GetProfile();
+    if (profile == nullptr) {
+        return;
+    }
+    auto routines = profile->GetRoutines();
+    if (!routines.empty()) {
+        char status[80];
+        std::snprintf(status, sizeof(status),
+                "Most cycles in $%04" PRIX64 ": %llu, %llu in itself",
+                routines[0].addr, routines[0].inclusive,
+                routines[0].exclusive);
+        SetStatusText(status);
+    }
+
+    wxFileDialog profileDlg(this, "Save profile stacks", "", "profile.folded",
+                            "Collapsed stacks (*.folded)|*.folded",
+                            wxFD_SAVE | wxFD_OVERWRITE_PROMPT);
+    if (profileDlg.ShowModal() == wxID_OK) {
+        std::ofstream out(profileDlg.GetPath().ToStdString());
+        profile->WriteCollapsed(out);
+        if (!out) {
+            wxMessageBox("Cannot write the profile", "Error",
+                         wxOK | wxICON_ERROR);
+        }
+    }
+}
+
+void
+CPUSimFrame::OnCoverage(wxCommandEvent& event)
+{
+    cpu->GetMemory()->SetCoverage(event.IsChecked());
+    UpdateAll();
+}
+
+void
+CPUSimFrame::OnSaveCoverage(wxCommandEvent& event)
+{
+    wxFileDialog coverageDlg(this, "Save coverage", "", "coverage.cov",
+                             "Coverage files (*.cov)|*.cov",
+                             wxFD_SAVE | wxFD_OVERWRITE_PROMPT);
+    if (coverageDlg.ShowModal() == wxID_OK) {
+        try {
+            SaveCoverage(*cpu->GetMemory(),
+                         coverageDlg.GetPath().ToStdString());
+        }
+        catch (CoverageExcept const &err) {
+            wxMessageBox(err.what(), "Error", wxOK | wxICON_ERROR);
+        }
+    }
+}
+
+void
+CPUSimFrame::OnMergeCoverage(wxCommandEvent& event)
+{
+    wxFileDialog coverageDlg(this, "Merge coverage", "", "",
+                             "Coverage files (*.cov)|*.cov",
+                             wxFD_OPEN | wxFD_FILE_MUST_EXIST);
+    if (coverageDlg.ShowModal() == wxID_OK) {
+        try {
+            MergeCoverage(cpu->GetMemory(),
+                          coverageDlg.GetPath().ToStdString());
+        }
+        catch (CoverageExcept const &err) {
+            wxMessageBox(err.what(), "Error", wxOK | wxICON_ERROR);
+        }
+        UpdateAll();
+    }
+}
+
+void
+CPUSimFrame::OnClearCoverage(wxCommandEvent& event)
+{
+    cpu->GetMemory()->ClearCoverage();
+    UpdateAll();
+}
+
+// The interrupt is taken by the next Step or Continue
+void
+CPUSimFrame::OnNMI(wxCommandEvent& event)
+{
+    cpu->NMI();
+}
+
+void
+CPUSimFrame::OnIRQ(wxCommandEvent& event)
+{
+    cpu->SetIRQ(event.IsChecked());
+}
+
+// Body of the emulation thread
+void
+CPUSimFrame::RunThread(void)
+{
+    CPU::StopReason reason = CPU::stop_pause;
+    std::string error;
+    try {
+        reason = cpu->Run();
+    }
+    catch (CPUExcept const &err) {
+        error = err.what();
+    }
+
+    // Report back on the GUI thread
+    CallAfter([this, reason, error]() { RunStopped(reason, error); });
+}
+
+void
+CPUSimFrame::RunStopped(CPU::StopReason reason, const std::string& error)
+{
+    if (m_run_thread.joinable()) {
+        m_run_thread.join();
+    }
+    SetRunning(false);
+
+    char status[40];
+    if (!error.empty()) {
+        std::snprintf(status, sizeof(status), "Stopped at $%04" PRIX64,
+                cpu->GetPC());
+    } else if (reason == CPU::stop_watchpoint) {
+        auto const &hit = cpu->GetMemory()->GetWatchHit();
+        std::snprintf(status, sizeof(status),
+                "%s $%02X %s $%04" PRIX64 " at $%04" PRIX64,
+                (hit.kind == Memory::watch_write) ? "Wrote" : "Read",
+                hit.value,
+                (hit.kind == Memory::watch_write) ? "to" : "from",
+                static_cast<std::uint64_t>(hit.addr), cpu->GetPC());
+    } else if (reason == CPU::stop_breakpoint) {
+        std::snprintf(status, sizeof(status), "Breakpoint at $%04" PRIX64
+                ", hit %lu", cpu->GetPC(), cpu->GetBreakpointHits(cpu->GetPC()));
+    } else {
+        std::snprintf(status, sizeof(status), "Paused at $%04" PRIX64,
+                cpu->GetPC());
+    }
+    SetStatusText(status);
+
+    UpdateAll();
+    disassembly->SetAddress(cpu->GetPC());
+    if (!error.empty()) {
+        wxMessageBox(error, "Error", wxOK | wxICON_ERROR);
+    }
+}
+
+void
+CPUSimFrame::OnSample(wxTimerEvent& event)
+{
+    char buf[30];
+    std::snprintf(buf, sizeof(buf), "%10lu", cpu->GetRunCycles());
+    m_cycles->SetLabel(buf);
+    m_cycles_sizer->Layout();
+}
+
+void
+CPUSimFrame::OnClose(wxCloseEvent& event)
+{
+    // Stop the emulation thread before the CPU goes away
+    if (m_run_thread.joinable()) {
+        cpu->Pause();
+        m_run_thread.join();
+    }
+    try {
+        cpu->StopTrace();
+    }
+    catch (CPUExcept const &err) {
+        wxMessageBox(err.what(), "Error", wxOK | wxICON_ERROR);
+    }
+    event.Skip();
+}
+
+// Enable or disable controls that must not touch the CPU while it runs
+void
+CPUSimFrame::SetRunning(bool running)
+{
+    static const int step_ids[] = {
+        ID_Load, ID_StepInto, ID_StepOver, ID_Return, ID_Run
+    };
+
+    m_running = running;
+    auto menuBar = GetMenuBar();
+    auto toolbar = GetToolBar();
+    for (auto id : step_ids) {
+        menuBar->Enable(id, !running);
+        toolbar->EnableTool(id, !running);
+    }
+    menuBar->Enable(ID_Pause, running);
+    menuBar->Enable(ID_JIT, !running);
+    menuBar->Enable(ID_Watch, !running);
+    menuBar->Enable(ID_ClearWatch, !running);
+    menuBar->Enable(ID_Reset, !running);
+    menuBar->Enable(ID_NMI, !running);
+    menuBar->Enable(ID_IRQ, !running);
+    menuBar->Enable(ID_Snapshot, !running);
+    menuBar->Enable(ID_Restore, !running && m_snapshot != nullptr);
+    menuBar->Enable(ID_History, !running);
+    menuBar->Enable(ID_Trace, !running);
+    menuBar->Enable(ID_Profile, !running);
+    menuBar->Enable(ID_Coverage, !running);
+    menuBar->Enable(ID_SaveCoverage, !running);
+    menuBar->Enable(ID_MergeCoverage, !running);
+    menuBar->Enable(ID_ClearCoverage, !running);
+    menuBar->Enable(ID_StepBack, !running && m_history);
+    menuBar->Enable(ID_ReverseContinue, !running && m_history);
+    toolbar->EnableTool(ID_Pause, running);
+
+    m_clear->Enable(!running);
+    registers->Enable(!running);
+    disassembly->Enable(!running);
+    for (auto z = zones.begin(); z != zones.end(); ++z) {
+        (*z)->Enable(!running);
+    }
+    memoryWin->Enable(!running);
+
+    if (running) {
+        m_sample_timer.Start(100);
+    } else {
+        m_sample_timer.Stop();
+    }
+}
+
 void
 CPUSimFrame::OnUpdateAll(wxEvent& event)
 {
@@ -330,3 +914,63 @@ setBold(wxWindow *window)
     font.MakeBold();
     window->SetFont(font);
 }
+
+// Read a watchpoint as start[-end] [r|w|rw] [=value], in hexadecimal
+static bool
+parseWatch(const std::string& spec, Memory::Watchpoint& watch)
+{
+    const char *p = spec.c_str();
+    char *end;
+
+    auto start = std::strtoul(p, &end, 16);
+    if (end == p) {
+        return false;
+    }
+    auto last = start;
+    for (p = end; *p == ' '; ++p) {}
+    if (*p == '-') {
+        ++p;
+        last = std::strtoul(p, &end, 16);
+        if (end == p || last < start) {
+            return false;
+        }
+        p = end;
+    }
+    watch.start = start;
+    watch.size = last - start + 1;
+
+    unsigned kind = 0;
+    for (; *p == ' '; ++p) {}
+    for (; std::isalpha(static_cast<unsigned char>(*p)); ++p) {
+        switch (std::tolower(static_cast<unsigned char>(*p))) {
+        case 'r':
+            kind |= Memory::watch_read;
+            break;
+
+        case 'w':
+            kind |= Memory::watch_write;
+            break;
+
+        default:
+            return false;
+        }
+    }
+    watch.kind = static_cast<Memory::WatchKind>(
+            kind != 0 ? kind : Memory::watch_access);
+
+    watch.match = false;
+    watch.value = 0;
+    for (; *p == ' '; ++p) {}
+    if (*p == '=') {
+        ++p;
+        auto value = std::strtoul(p, &end, 16);
+        if (end == p || value > 0xFF) {
+            return false;
+        }
+        watch.match = true;
+        watch.value = value;
+        p = end;
+    }
+    for (; *p == ' '; ++p) {}
+    return *p == '\0';
+}
@@ -1,13 +1,35 @@
 // memory.cpp
 
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
 #include "memory.h"
 
-Memory::Memory(std::size_t size) : bytes(size)
+struct MemorySnapshot {
+    std::vector<std::shared_ptr<const std::vector<std::uint8_t>>> pages;
+};
+
+Memory::Memory(std::size_t size) :
+    bytes(size),
+    load_generation(0),
+    watch_triggered(false),
+    coverage_on(false),
+    read_journal(nullptr)
 {
     // Set a bit mask to wrap addresses
     std::size_t p2;
     for (p2 = 1; p2 < size && p2 != 0; p2 <<= 1) {}
     mask = p2 - 1;
+
+    page_tags.resize((mask >> page_shift) + 1);
+    page_loads.resize((mask >> page_shift) + 1);
+    page_types.resize(page_tags.size(), map_ram);
+    page_devices.resize(page_tags.size());
+    read_pages.resize(page_tags.size());
+    write_pages.resize(page_tags.size());
+    for (std::size_t page = 0; page < page_tags.size(); ++page) {
+        UpdateFastPage(page);
+    }
 }
 
 Memory::~Memory(void)
@@ -15,11 +37,28 @@ Memory::~Memory(void)
     // Empty destructor so subclasses can inherit
 }
 
+MemoryDevice::~MemoryDevice(void)
+{
+    // Empty destructor so subclasses can inherit
+}
+
+std::uint8_t
+MemoryDevice::Peek(std::size_t offset) const
+{
+    return 0xFF;
+}
+
 std::uint8_t
 Memory::Peek8(std::size_t addr) const
 {
     addr &= mask;
-    if (addr < bytes.size()) {
+    auto page = addr >> page_shift;
+    if (page_types[page] == map_device) {
+        auto const &mapping = page_devices[page];
+        return mapping.device->Peek((addr - mapping.start) & mask);
+    } else if (page_types[page] == map_unmapped) {
+        return 0xFF;
+    } else if (addr < bytes.size()) {
         return bytes[addr];
     } else {
         return 0xFF;
@@ -30,19 +69,120 @@ std::uint8_t
 Memory::Read8(std::size_t addr) const
 {
     addr &= mask;
-    if (addr < bytes.size()) {
-        return bytes[addr];
-    } else {
-        return 0xFF;
+    std::uint8_t data = ReadMapped(addr);
+    auto tags = page_tags[addr >> page_shift];
+    if (tags & (watch_read | page_cover_read)) {
+        if (tags & page_cover_read) {
+            coverage[addr] |= cover_read;
+        }
+        if (tags & watch_read) {
+            CheckWatch(addr, watch_read, data);
+        }
+    }
+    return data;
+}
+
+// FastRead8() of a page without a pointer
+std::uint8_t
+Memory::SlowRead8(std::size_t addr) const
+{
+    if (read_journal == nullptr || IsPlainPage(addr)) {
+        return Read8(addr);
     }
+    auto &journal = *read_journal;
+    if (journal.next < journal.bytes.size()) {
+        return journal.bytes[journal.next++];
+    }
+    std::uint8_t data = Read8(addr);
+    journal.bytes.push_back(data);
+    ++journal.next;
+    return data;
 }
 
 void
 Memory::Write8(std::size_t addr, std::uint8_t data)
 {
     addr &= mask;
-    if (addr < bytes.size()) {
-        bytes[addr] = data;
+    if (page_tags[addr >> page_shift] & page_code) {
+        page_loads[addr >> page_shift] = ++load_generation;
+    }
+    Store8(addr, data);
+}
+
+// FastWrite8() of a page without a pointer. The write is the CPU's own, and
+// is not a load of a code page; a page that a subclass handles still goes
+// to its Write8.
+void
+Memory::SlowWrite8(std::size_t addr, std::uint8_t data)
+{
+    if (IsPlainPage(addr)) {
+        Store8(addr & mask, data);
+    } else {
+        Write8(addr, data);
+    }
+}
+
+// Write8(), without counting a write to a code page as a load; addr is
+// masked
+void
+Memory::Store8(std::size_t addr, std::uint8_t data)
+{
+    auto tags = page_tags[addr >> page_shift];
+    if (tags & (watch_write | page_clean | page_cover_write)) {
+        if (tags & page_cover_write) {
+            coverage[addr] |= cover_write;
+        }
+        if (tags & watch_write) {
+            CheckWatch(addr, watch_write, data);
+        }
+    }
+    WriteMapped(addr, data);
+}
+
+// Slow paths for an access, by the type of the page; addr is masked
+std::uint8_t
+Memory::ReadMapped(std::size_t addr) const
+{
+    auto page = addr >> page_shift;
+    switch (page_types[page]) {
+    case map_device:
+        {
+            auto const &mapping = page_devices[page];
+            return mapping.device->Read((addr - mapping.start) & mask);
+        }
+
+    case map_unmapped:
+        return 0xFF;
+
+    default:
+        return (addr < bytes.size()) ? bytes[addr] : 0xFF;
+    }
+}
+
+void
+Memory::WriteMapped(std::size_t addr, std::uint8_t data)
+{
+    auto page = addr >> page_shift;
+    switch (page_types[page]) {
+    case map_ram:
+        if (page_tags[page] & page_clean) {
+            MarkDirty(page);
+        }
+        if (addr < bytes.size()) {
+            bytes[addr] = data;
+        }
+        break;
+
+    case map_device:
+        {
+            auto const &mapping = page_devices[page];
+            mapping.device->Write((addr - mapping.start) & mask, data);
+        }
+        break;
+
+    default:
+        // ROM and unmapped pages ignore writes
+        break;
     }
 }
 
@@ -50,16 +190,412 @@ void
 Memory::Load8(std::size_t addr, std::uint8_t data)
 {
     addr &= mask;
+    page_loads[addr >> page_shift] = ++load_generation;
+    if (page_tags[addr >> page_shift] & page_clean) {
+        MarkDirty(addr >> page_shift);
+    }
     if (addr < bytes.size()) {
         bytes[addr] = data;
     }
 }
 
+// The bytes from addr, which is masked, to the end of its page or of the
+// address space, up to size
+std::size_t
+Memory::ChunkSize(std::size_t addr, std::size_t size) const
+{
+    std::size_t to_end = std::min((addr | page_mask) + 1, mask + 1) - addr;
+    return std::min(size, to_end);
+}
+
+void
+Memory::ReadBlock(std::size_t addr, std::uint8_t *data,
+                  std::size_t size) const
+{
+    while (size != 0) {
+        addr &= mask;
+        auto chunk = ChunkSize(addr, size);
+        auto page = read_pages[addr >> page_shift];
+        if (page != nullptr) {
+            std::memcpy(data, page + (addr & page_mask), chunk);
+        } else {
+            for (std::size_t i = 0; i < chunk; ++i) {
+                data[i] = Read8(addr + i);
+            }
+        }
+        addr += chunk;
+        data += chunk;
+        size -= chunk;
+    }
+}
+
+void
+Memory::WriteBlock(std::size_t addr, const std::uint8_t *data,
+                   std::size_t size)
+{
+    while (size != 0) {
+        addr &= mask;
+        auto chunk = ChunkSize(addr, size);
+        if (page_tags[addr >> page_shift] & page_code) {
+            page_loads[addr >> page_shift] = ++load_generation;
+        }
+        auto page = write_pages[addr >> page_shift];
+        if (page != nullptr) {
+            std::memcpy(page + (addr & page_mask), data, chunk);
+        } else {
+            for (std::size_t i = 0; i < chunk; ++i) {
+                Write8(addr + i, data[i]);
+            }
+        }
+        addr += chunk;
+        data += chunk;
+        size -= chunk;
+    }
+}
+
+void
+Memory::LoadBlock(std::size_t addr, const std::uint8_t *data,
+                  std::size_t size)
+{
+    while (size != 0) {
+        addr &= mask;
+        auto chunk = ChunkSize(addr, size);
+        auto page = addr >> page_shift;
+        page_loads[page] = ++load_generation;
+        if (page_tags[page] & page_clean) {
+            MarkDirty(page);
+        }
+        if (addr < bytes.size()) {
+            auto stored = std::min(chunk, bytes.size() - addr);
+            std::copy(data, data + stored, bytes.begin() + addr);
+        }
+        addr += chunk;
+        data += chunk;
+        size -= chunk;
+    }
+}
+
+void
+Memory::AddWatchpoint(const Watchpoint& watch)
+{
+    watchpoints.push_back(watch);
+    TagWatchPages();
+}
+
+// Remove all watchpoints that begin at start
+void
+Memory::RemoveWatchpoint(std::size_t start)
+{
+    std::vector<Watchpoint> kept;
+    for (auto const &watch : watchpoints) {
+        if (watch.start != start) {
+            kept.push_back(watch);
+        }
+    }
+    watchpoints.swap(kept);
+    TagWatchPages();
+}
+
+void
+Memory::ClearWatchpoints(void)
+{
+    watchpoints.clear();
+    TagWatchPages();
+}
+
+// Mark each page with the kinds of access that any watchpoint on it wants
+void
+Memory::TagWatchPages(void)
+{
+    for (auto &tags : page_tags) {
+        tags &= page_clean | page_cover_read | page_cover_write | page_slow
+              | page_code;
+    }
+    for (auto const &watch : watchpoints) {
+        if (watch.size == 0) {
+            continue;
+        }
+        std::size_t first = (watch.start & mask) >> page_shift;
+        std::size_t last = ((watch.start + watch.size - 1) & mask) >> page_shift;
+        if (watch.size > mask || last < first) {
+            // Covers or wraps around the whole address space
+            first = 0;
+            last = page_tags.size() - 1;
+        }
+        for (std::size_t page = first; page <= last; ++page) {
+            page_tags[page] |= watch.kind;
+        }
+    }
+    for (std::size_t page = 0; page < page_tags.size(); ++page) {
+        UpdateFastPage(page);
+    }
+}
+
+void
+Memory::MapRAM(std::size_t start, std::size_t size)
+{
+    MapPages(start, size, map_ram, nullptr);
+}
+
+void
+Memory::MapROM(std::size_t start, std::size_t size)
+{
+    MapPages(start, size, map_rom, nullptr);
+}
+
+void
+Memory::MapDevice(std::size_t start, std::size_t size,
+                  const std::shared_ptr<MemoryDevice>& device)
+{
+    if (!device) {
+        throw std::invalid_argument("No device to map");
+    }
+    MapPages(start, size, map_device, device);
+}
+
+void
+Memory::Unmap(std::size_t start, std::size_t size)
+{
+    MapPages(start, size, map_unmapped, nullptr);
+}
+
+// Remapping a page counts as a load of it, so that a CPU drops any code
+// that it decoded there
+void
+Memory::MapPages(std::size_t start, std::size_t size, PageType type,
+                 const std::shared_ptr<MemoryDevice>& device)
+{
+    if (size == 0) {
+        return;
+    }
+    std::size_t first = (start & mask) >> page_shift;
+    std::size_t count = ((start & ((1 << page_shift) - 1)) + size - 1)
+                      >> page_shift;
+    count = std::min(count + 1, page_types.size());
+    for (std::size_t i = 0; i < count; ++i) {
+        auto page = (first + i) & (page_types.size() - 1);
+        page_types[page] = type;
+        page_devices[page] = { device, start & mask };
+        page_loads[page] = ++load_generation;
+        UpdateFastPage(page);
+    }
+}
+
+void
+Memory::SetSlowPages(std::size_t start, std::size_t size)
+{
+    if (size == 0) {
+        return;
+    }
+    std::size_t first = start >> page_shift;
+    std::size_t last = (start + size - 1) >> page_shift;
+    for (std::size_t page = first; page <= last; ++page) {
+        auto p = page & (page_tags.size() - 1);
+        page_tags[p] |= page_slow;
+        page_loads[p] = ++load_generation;
+        UpdateFastPage(p);
+    }
+}
+
+// Point the fast path at a page of plain RAM, or send it to the slow path
+void
+Memory::UpdateFastPage(std::size_t page)
+{
+    auto tags = page_tags[page];
+    auto type = page_types[page];
+    std::uint8_t *data = nullptr;
+    if (((page + 1) << page_shift) <= bytes.size()) {
+        data = bytes.data() + (page << page_shift);
+    }
+    read_pages[page] = (tags & (watch_read | page_cover_read | page_slow))
+                    || (type != map_ram && type != map_rom)
+                     ? nullptr : data;
+    write_pages[page] = (tags & (watch_write | page_clean | page_cover_write
+                                 | page_slow))
+                     || type != map_ram
+                      ? nullptr : data;
+}
+
+// Slow path for an access to a watched page
+void
+Memory::CheckWatch(std::size_t addr, WatchKind kind, std::uint8_t data) const
+{
+    if (watch_triggered) {
+        return;
+    }
+    for (auto const &watch : watchpoints) {
+        if ((watch.kind & kind) != 0
+        &&  ((addr - watch.start) & mask) < watch.size
+        &&  (!watch.match || watch.value == data)) {
+            watch_hit.addr = addr;
+            watch_hit.kind = kind;
+            watch_hit.value = data;
+            watch_triggered = true;
+            return;
+        }
+    }
+}
+
+void
+Memory::MarkDirty(std::size_t page)
+{
+    page_tags[page] &= ~page_clean;
+    UpdateFastPage(page);
+    dirty_pages.push_back(page);
+}
+
+std::shared_ptr<const MemorySnapshot>
+Memory::TakeSnapshot(void)
+{
+    if (base && dirty_pages.empty()) {
+        return base;
+    }
+
+    auto copy_page = [this](std::size_t page) {
+        auto start = bytes.begin() + (page << page_shift);
+        auto end = bytes.begin()
+                 + std::min(bytes.size(), (page + 1) << page_shift);
+        return std::make_shared<const std::vector<std::uint8_t>>(start, end);
+    };
+
+    auto snapshot = std::make_shared<MemorySnapshot>();
+    if (base) {
+        // Share the pages not written since the last snapshot
+        snapshot->pages = base->pages;
+        for (auto page : dirty_pages) {
+            snapshot->pages[page] = copy_page(page);
+            page_tags[page] |= page_clean;
+            UpdateFastPage(page);
+        }
+    } else {
+        for (std::size_t page = 0; page < NumPages(); ++page) {
+            snapshot->pages.push_back(copy_page(page));
+            page_tags[page] |= page_clean;
+            UpdateFastPage(page);
+        }
+    }
+    dirty_pages.clear();
+    base = snapshot;
+    return base;
+}
+
+void
+Memory::RestoreSnapshot(const std::shared_ptr<const MemorySnapshot>& snapshot)
+{
+    if (!snapshot || snapshot->pages.size() != NumPages()) {
+        throw std::invalid_argument("Snapshot is of another size of memory");
+    }
+    if (snapshot == base && dirty_pages.empty()) {
+        return;
+    }
+
+    // A clean page already holds what its page in base holds, which
+    // matches the snapshot if the two share it
+    for (std::size_t page = 0; page < NumPages(); ++page) {
+        auto const &from = snapshot->pages[page];
+        if (base && (page_tags[page] & page_clean) != 0
+        &&  base->pages[page] == from) {
+            continue;
+        }
+        std::copy(from->begin(), from->end(),
+                  bytes.begin() + (page << page_shift));
+        page_tags[page] |= page_clean;
+        UpdateFastPage(page);
+        page_loads[page] = ++load_generation;
+    }
+    dirty_pages.clear();
+    base = snapshot;
+}
+
+std::size_t
+Memory::GetSnapshotCost(void) const
+{
+    if (base && dirty_pages.empty()) {
+        return 0;
+    }
+    std::size_t pages = base ? dirty_pages.size() : NumPages();
+    return sizeof(MemorySnapshot)
+         + NumPages() * sizeof(std::shared_ptr<const std::vector<std::uint8_t>>)
+         + pages * (sizeof(std::vector<std::uint8_t>) + (1 << page_shift));
+}
+
+void
+Memory::SetCoverage(bool enable)
+{
+    if (enable && coverage.empty()) {
+        coverage.resize(mask + 1);
+    }
+    coverage_on = enable;
+    for (std::size_t page = 0; page < page_tags.size(); ++page) {
+        if (enable) {
+            page_tags[page] |= page_cover_read | page_cover_write;
+        } else {
+            page_tags[page] &= ~(page_cover_read | page_cover_write);
+        }
+        UpdateFastPage(page);
+    }
+}
+
+void
+Memory::ClearCoverage(void)
+{
+    std::fill(coverage.begin(), coverage.end(), 0);
+}
+
+void
+Memory::MergeCoverage(const std::vector<std::uint8_t>& marks)
+{
+    if (marks.size() != mask + 1) {
+        throw std::invalid_argument("Coverage is of another size of memory");
+    }
+    if (coverage.empty()) {
+        coverage.resize(mask + 1);
+    }
+    for (std::size_t addr = 0; addr < coverage.size(); ++addr) {
+        coverage[addr] |= marks[addr];
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+// Wide accesses that FastReadSpan() or FastWriteSpan() allows are one
+// unaligned load or store, with the bytes swapped where the host's order
+// differs from the memory's
+
+static const bool host_big_endian = __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__;
+
+static std::uint16_t ByteSwap(std::uint16_t x) { return __builtin_bswap16(x); }
+static std::uint32_t ByteSwap(std::uint32_t x) { return __builtin_bswap32(x); }
+static std::uint64_t ByteSwap(std::uint64_t x) { return __builtin_bswap64(x); }
+
+template <typename T, bool big_endian>
+static T
+LoadWide(const std::uint8_t *bytes)
+{
+    T data;
+    std::memcpy(&data, bytes, sizeof(data));
+    return (big_endian == host_big_endian) ? data : ByteSwap(data);
+}
+
+template <typename T, bool big_endian>
+static void
+StoreWide(std::uint8_t *bytes, T data)
+{
+    if (big_endian != host_big_endian) {
+        data = ByteSwap(data);
+    }
+    std::memcpy(bytes, &data, sizeof(data));
+}
+
 //////////////////////////////////////////////////////////////////////////////
 
 std::uint16_t
 BigEndianMemory::Read16(std::size_t addr) const
 {
+    auto bytes = FastReadSpan(addr, 2);
+    if (bytes != nullptr) {
+        return LoadWide<std::uint16_t, true>(bytes);
+    }
     return (static_cast<std::uint16_t>(Read8(addr+0)) << 8)
          | (static_cast<std::uint16_t>(Read8(addr+1)) << 0);
 }
@@ -67,6 +603,10 @@ BigEndianMemory::Read16(std::size_t addr) const
 std::uint32_t
 BigEndianMemory::Read32(std::size_t addr) const
 {
+    auto bytes = FastReadSpan(addr, 4);
+    if (bytes != nullptr) {
+        return LoadWide<std::uint32_t, true>(bytes);
+    }
     return (static_cast<std::uint32_t>(Read8(addr+0)) << 24)
          | (static_cast<std::uint32_t>(Read8(addr+1)) << 16)
          | (static_cast<std::uint32_t>(Read8(addr+2)) <<  8)
@@ -76,6 +616,10 @@ BigEndianMemory::Read32(std::size_t addr) const
 std::uint64_t
 BigEndianMemory::Read64(std::size_t addr) const
 {
+    auto bytes = FastReadSpan(addr, 8);
+    if (bytes != nullptr) {
+        return LoadWide<std::uint64_t, true>(bytes);
+    }
     return (static_cast<std::uint64_t>(Read8(addr+0)) << 56)
          | (static_cast<std::uint64_t>(Read8(addr+1)) << 48)
          | (static_cast<std::uint64_t>(Read8(addr+2)) << 40)
@@ -89,6 +633,11 @@ BigEndianMemory::Read64(std::size_t addr) const
 void
 BigEndianMemory::Write16(std::size_t addr, std::uint16_t data)
 {
+    auto bytes = FastWriteSpan(addr, 2);
+    if (bytes != nullptr) {
+        StoreWide<std::uint16_t, true>(bytes, data);
+        return;
+    }
     Write8(addr+0, static_cast<std::uint8_t>(data >> 8));
     Write8(addr+1, static_cast<std::uint8_t>(data >> 0));
 }
@@ -96,6 +645,11 @@ BigEndianMemory::Write16(std::size_t addr, std::uint16_t data)
 void
 BigEndianMemory::Write32(std::size_t addr, std::uint32_t data)
 {
+    auto bytes = FastWriteSpan(addr, 4);
+    if (bytes != nullptr) {
+        StoreWide<std::uint32_t, true>(bytes, data);
+        return;
+    }
     Write8(addr+0, static_cast<std::uint8_t>(data >> 24));
     Write8(addr+1, static_cast<std::uint8_t>(data >> 16));
     Write8(addr+2, static_cast<std::uint8_t>(data >>  8));
@@ -105,6 +659,11 @@ BigEndianMemory::Write32(std::size_t addr, std::uint32_t data)
 void
 BigEndianMemory::Write64(std::size_t addr, std::uint64_t data)
 {
+    auto bytes = FastWriteSpan(addr, 8);
+    if (bytes != nullptr) {
+        StoreWide<std::uint64_t, true>(bytes, data);
+        return;
+    }
     Write8(addr+0, static_cast<std::uint8_t>(data >> 56));
     Write8(addr+1, static_cast<std::uint8_t>(data >> 48));
     Write8(addr+2, static_cast<std::uint8_t>(data >> 40));
@@ -120,6 +679,10 @@ BigEndianMemory::Write64(std::size_t addr, std::uint64_t data)
 std::uint16_t
 LittleEndianMemory::Read16(std::size_t addr) const
 {
+    auto bytes = FastReadSpan(addr, 2);
+    if (bytes != nullptr) {
+        return LoadWide<std::uint16_t, false>(bytes);
+    }
     return (static_cast<std::uint16_t>(Read8(addr+0)) << 0)
          | (static_cast<std::uint16_t>(Read8(addr+1)) << 8);
 }
@@ -127,6 +690,10 @@ LittleEndianMemory::Read16(std::size_t addr) const
 std::uint32_t
 LittleEndianMemory::Read32(std::size_t addr) const
 {
+    auto bytes = FastReadSpan(addr, 4);
+    if (bytes != nullptr) {
+        return LoadWide<std::uint32_t, false>(bytes);
+    }
     return (static_cast<std::uint32_t>(Read8(addr+0)) <<  0)
          | (static_cast<std::uint32_t>(Read8(addr+1)) <<  8)
          | (static_cast<std::uint32_t>(Read8(addr+2)) << 16)
@@ -136,6 +703,10 @@ LittleEndianMemory::Read32(std::size_t addr) const
 std::uint64_t
 LittleEndianMemory::Read64(std::size_t addr) const
 {
+    auto bytes = FastReadSpan(addr, 8);
+    if (bytes != nullptr) {
+        return LoadWide<std::uint64_t, false>(bytes);
+    }
     return (static_cast<std::uint64_t>(Read8(addr+0)) <<  0)
          | (static_cast<std::uint64_t>(Read8(addr+1)) <<  8)
          | (static_cast<std::uint64_t>(Read8(addr+2)) << 16)
@@ -149,6 +720,11 @@ LittleEndianMemory::Read64(std::size_t addr) const
 void
 LittleEndianMemory::Write16(std::size_t addr, std::uint16_t data)
 {
+    auto bytes = FastWriteSpan(addr, 2);
+    if (bytes != nullptr) {
+        StoreWide<std::uint16_t, false>(bytes, data);
+        return;
+    }
     Write8(addr+0, static_cast<std::uint8_t>(data >> 0));
     Write8(addr+1, static_cast<std::uint8_t>(data >> 8));
 }
@@ -156,6 +732,11 @@ LittleEndianMemory::Write16(std::size_t addr, std::uint16_t data)
 void
 LittleEndianMemory::Write32(std::size_t addr, std::uint32_t data)
 {
+    auto bytes = FastWriteSpan(addr, 4);
+    if (bytes != nullptr) {
+        StoreWide<std::uint32_t, false>(bytes, data);
+        return;
+    }
     Write8(addr+0, static_cast<std::uint8_t>(data >>  0));
     Write8(addr+1, static_cast<std::uint8_t>(data >>  8));
     Write8(addr+2, static_cast<std::uint8_t>(data >> 16));
@@ -165,6 +746,11 @@ LittleEndianMemory::Write32(std::size_t addr, std::uint32_t data)
 void
 LittleEndianMemory::Write64(std::size_t addr, std::uint64_t data)
 {
+    auto bytes = FastWriteSpan(addr, 8);
+    if (bytes != nullptr) {
+        StoreWide<std::uint64_t, false>(bytes, data);
+        return;
+    }
     Write8(addr+0, static_cast<std::uint8_t>(data >>  0));
     Write8(addr+1, static_cast<std::uint8_t>(data >>  8));
     Write8(addr+2, static_cast<std::uint8_t>(data >> 16));
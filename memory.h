@@ -3,18 +3,58 @@
 #ifndef MEMORY_H
 #define MEMORY_H
 
+#include <deque>
+#include <memory>
 #include <vector>
 #include <cstdint>
 
+// The contents of memory at some moment; see Memory::TakeSnapshot()
+struct MemorySnapshot;
+
+// A peripheral mapped into memory; see Memory::MapDevice(). The offset is
+// from the start of the range that the device is mapped at.
+class MemoryDevice {
+public:
+    virtual ~MemoryDevice(void);
+
+    virtual std::uint8_t Read(std::size_t offset) = 0;
+    virtual void Write(std::size_t offset, std::uint8_t data) = 0;
+
+    // Read without side effects, for display; by default, as unmapped
+    virtual std::uint8_t Peek(std::size_t offset) const;
+};
+
 class Memory {
 public:
     Memory(std::size_t size);
     virtual ~Memory(void);
 
+    // The page pointers point into the contents
+    Memory(const Memory&) = delete;
+    Memory& operator=(const Memory&) = delete;
+
+    // Bytes of address space
+    std::size_t GetSize(void) const { return mask + 1; }
+
     // Access memory contents, without side effects, for load and display
     virtual void Load8(std::size_t addr, std::uint8_t data);
     virtual std::uint8_t Peek8(std::size_t addr) const;
 
+    // Changes whenever Load8 is called, so that a CPU can tell that memory
+    // changed outside of its control. Each 256-byte page also records the
+    // generation of its last load, so that a CPU can tell which pages.
+    std::uint64_t GetLoadGeneration(void) const { return load_generation; }
+    std::uint64_t GetPageLoadGeneration(std::size_t page) const
+        { return page_loads[page & (page_loads.size() - 1)]; }
+
+    // A CPU that keeps code decoded from memory marks the pages that it
+    // decodes. Write8, WriteBlock and the wide writes to a marked page then
+    // count as loads of it, as they come from outside the CPU: an event, a
+    // device or the user. The CPU's own writes, through FastWrite8(), do
+    // not, as it keeps its code current itself. The mark stays.
+    void MarkCodePage(std::size_t addr)
+        { page_tags[(addr & mask) >> page_shift] |= page_code; }
+
     virtual std::uint8_t Read8(std::size_t addr) const;
     virtual std::uint16_t Read16(std::size_t addr) const = 0;
     virtual std::uint32_t Read32(std::size_t addr) const = 0;
@@ -25,9 +65,263 @@ public:
     virtual void Write32(std::size_t addr, std::uint32_t data) = 0;
     virtual void Write64(std::size_t addr, std::uint64_t data) = 0;
 
+    // Blocks of bytes. ReadBlock and WriteBlock act as Read8 and Write8 on
+    // each byte in turn, and LoadBlock as Load8, but copy whole runs of
+    // plain memory at once. Addresses wrap as for the single bytes. A
+    // subclass that overrides Load8 overrides LoadBlock to match.
+    virtual void ReadBlock(std::size_t addr, std::uint8_t *data,
+                           std::size_t size) const;
+    virtual void WriteBlock(std::size_t addr, const std::uint8_t *data,
+                            std::size_t size);
+    virtual void LoadBlock(std::size_t addr, const std::uint8_t *data,
+                           std::size_t size);
+
+    // Read8() and Write8() for the CPU cores. Plain RAM is reached through
+    // a table of page pointers, without a call; a page that is watched,
+    // marked for coverage, held clean by a snapshot, past the end of
+    // memory, mapped to anything but RAM or set slow by a subclass has no
+    // pointer, and its accesses go through the virtual functions. ROM has
+    // a pointer for reads only.
+    std::uint8_t FastRead8(std::size_t addr) const
+    {
+        auto page = read_pages[(addr & mask) >> page_shift];
+        return (page != nullptr) ? page[addr & page_mask] : SlowRead8(addr);
+    }
+    void FastWrite8(std::size_t addr, std::uint8_t data)
+    {
+        auto page = write_pages[(addr & mask) >> page_shift];
+        if (page != nullptr) {
+            page[addr & page_mask] = data;
+        } else {
+            SlowWrite8(addr, data);
+        }
+    }
+
+    // The page pointers of FastRead8() and FastWrite8(), indexed by
+    // (addr & (GetSize() - 1)) >> 8, for translated code that reaches RAM
+    // as they do. The tables stay in place for the life of the Memory.
+    std::uint8_t *const *GetReadPages(void) const { return read_pages.data(); }
+    std::uint8_t *const *GetWritePages(void) const
+        { return write_pages.data(); }
+
+    // Bytes that FastRead8() read from devices and from pages that a
+    // subclass handles, for a CPU that goes back over its execution: each
+    // is appended to bytes, unless next is short of the end, when the read
+    // takes the byte at next instead of reaching the device, as going over
+    // the same instructions again must read the same. Null for none.
+    struct ReadJournal {
+        std::deque<std::uint8_t> bytes;
+        std::size_t next;
+
+        ReadJournal(void) : next(0) {}
+    };
+    void SetReadJournal(ReadJournal *journal) { read_journal = journal; }
+
+    // The memory map. Each 256-byte page is RAM, which all pages are to
+    // begin with; ROM, which ignores writes; a device, whose accesses go
+    // to its Read and Write; or unmapped, which reads as FF and ignores
+    // writes. A range covers every page that it touches. Load8 stores into
+    // RAM and ROM alike, and Peek8 calls the device's Peek. Snapshots hold
+    // the contents of RAM and ROM, but not the state of devices.
+    enum PageType {
+        map_ram,
+        map_rom,
+        map_device,
+        map_unmapped
+    };
+    void MapRAM(std::size_t start, std::size_t size);
+    void MapROM(std::size_t start, std::size_t size);
+    void MapDevice(std::size_t start, std::size_t size,
+                   const std::shared_ptr<MemoryDevice>& device);
+    void Unmap(std::size_t start, std::size_t size);
+    PageType GetPageType(std::size_t addr) const
+    {
+        auto page = (addr & mask) >> page_shift;
+        return static_cast<PageType>(page_types[page]);
+    }
+
+    // Whether the page holding addr is RAM or ROM that no subclass handles,
+    // so that reading it has no effect and gives what Peek8 does; a CPU may
+    // keep code that it decodes there
+    bool IsPlainPage(std::size_t addr) const
+    {
+        auto page = (addr & mask) >> page_shift;
+        return (page_types[page] == map_ram || page_types[page] == map_rom)
+            && (page_tags[page] & page_slow) == 0;
+    }
+
+    // Data watchpoints. A Read8 or Write8 that matches one is recorded for
+    // the CPU to stop on. Each 256-byte page is tagged with the kinds of
+    // access watched on it, and only accesses to tagged pages are checked.
+    enum WatchKind {
+        watch_read = 1,
+        watch_write = 2,
+        watch_access = 3
+    };
+    struct Watchpoint {
+        std::size_t start;
+        std::size_t size;
+        WatchKind kind;
+        bool match;             // If true, only when the byte is value
+        std::uint8_t value;
+    };
+    struct WatchHit {
+        std::size_t addr;
+        WatchKind kind;         // watch_read or watch_write
+        std::uint8_t value;     // Byte read or written
+    };
+    void AddWatchpoint(const Watchpoint& watch);
+    void RemoveWatchpoint(std::size_t start);
+    void ClearWatchpoints(void);
+    const std::vector<Watchpoint>& GetWatchpoints(void) const
+        { return watchpoints; }
+    bool AnyWatchpoints(void) const { return !watchpoints.empty(); }
+
+    // The first access to match since ResetWatchHit()
+    bool WatchTriggered(void) const { return watch_triggered; }
+    const WatchHit& GetWatchHit(void) const { return watch_hit; }
+    void ResetWatchHit(void) { watch_triggered = false; }
+
+    // Snapshots of the contents. A snapshot is kept in 256-byte pages,
+    // which are shared with other snapshots until memory changes them:
+    // taking one copies only the pages written since the last snapshot or
+    // restore, and restoring one copies only the pages that differ.
+    // Restoring counts as a load of the pages it changes. The snapshot
+    // must be of this memory or of one of the same size; otherwise
+    // RestoreSnapshot throws std::invalid_argument.
+    std::shared_ptr<const MemorySnapshot> TakeSnapshot(void);
+    void RestoreSnapshot(const std::shared_ptr<const MemorySnapshot>& snapshot);
+
+    // Bytes that TakeSnapshot() would allocate now, for the pages it would
+    // copy and its table of pages
+    std::size_t GetSnapshotCost(void) const;
+
+    // Coverage: which bytes were executed as opcodes and as operands, read
+    // and written while coverage was on. Read8 and Write8 mark reads and
+    // writes, and the CPU marks what it executes with MarkExecuted(). The
+    // marks are one byte of CoverKind bits for each address, and stay until
+    // ClearCoverage(); MergeCoverage() adds marks from another run, of the
+    // same size of memory. GetCoverage() is empty until coverage is first
+    // turned on.
+    enum CoverKind {
+        cover_opcode = 1,
+        cover_operand = 2,
+        cover_read = 4,
+        cover_write = 8
+    };
+    void SetCoverage(bool enable);
+    bool CoverageEnabled(void) const { return coverage_on; }
+    void ClearCoverage(void);
+    void MergeCoverage(const std::vector<std::uint8_t>& marks);
+    const std::vector<std::uint8_t>& GetCoverage(void) const
+        { return coverage; }
+    void MarkExecuted(std::size_t addr, unsigned length)
+    {
+        coverage[addr & mask] |= cover_opcode;
+        for (unsigned i = 1; i < length; ++i) {
+            coverage[(addr + i) & mask] |= cover_operand;
+        }
+    }
+
+protected:
+    // For the wide accesses of subclasses: the contents at addr, if the
+    // size bytes there, no more than a page, are on pages that FastRead8()
+    // or FastWrite8() reach directly and do not wrap around the end of
+    // the address space; otherwise null, and the access goes byte by byte.
+    // A write to a code page goes byte by byte, to count as a load.
+    const std::uint8_t *FastReadSpan(std::size_t addr, std::size_t size) const
+    {
+        addr &= mask;
+        if (addr + size - 1 > mask) {
+            return nullptr;
+        }
+        auto first = read_pages[addr >> page_shift];
+        auto last = read_pages[(addr + size - 1) >> page_shift];
+        return (first != nullptr && last != nullptr)
+             ? first + (addr & page_mask) : nullptr;
+    }
+    std::uint8_t *FastWriteSpan(std::size_t addr, std::size_t size)
+    {
+        addr &= mask;
+        if (addr + size - 1 > mask) {
+            return nullptr;
+        }
+        auto first = write_pages[addr >> page_shift];
+        auto last = write_pages[(addr + size - 1) >> page_shift];
+        auto tags = page_tags[addr >> page_shift]
+                  | page_tags[(addr + size - 1) >> page_shift];
+        return (first != nullptr && last != nullptr
+                && (tags & page_code) == 0)
+             ? first + (addr & page_mask) : nullptr;
+    }
+
+    // A subclass that overrides Read8() or Write8() for some addresses, as
+    // for memory-mapped I/O, must send the pages that hold them to the slow
+    // path, so that FastRead8() and FastWrite8() call it there
+    void SetSlowPages(std::size_t start, std::size_t size);
+
 private:
+    // Each page is tagged with the kinds of access watched on it, with
+    // page_clean once a snapshot holds it and it has not been written since,
+    // with the kinds of access that coverage marks, with page_slow if a
+    // subclass handles it, and with page_code once a CPU decodes code there
+    static const unsigned page_shift = 8;
+    static const std::size_t page_mask = (1 << page_shift) - 1;
+    static const std::uint8_t page_clean = 4;
+    static const std::uint8_t page_cover_read = 8;
+    static const std::uint8_t page_cover_write = 16;
+    static const std::uint8_t page_slow = 32;
+    static const std::uint8_t page_code = 64;
+
+    std::uint8_t SlowRead8(std::size_t addr) const;
+    void SlowWrite8(std::size_t addr, std::uint8_t data);
+    void Store8(std::size_t addr, std::uint8_t data);
+    void CheckWatch(std::size_t addr, WatchKind kind, std::uint8_t data) const;
+    void TagWatchPages(void);
+    void MapPages(std::size_t start, std::size_t size, PageType type,
+                  const std::shared_ptr<MemoryDevice>& device);
+    std::uint8_t ReadMapped(std::size_t addr) const;
+    void WriteMapped(std::size_t addr, std::uint8_t data);
+    void MarkDirty(std::size_t page);
+    std::size_t NumPages(void) const
+        { return (bytes.size() + (1 << page_shift) - 1) >> page_shift; }
+
     std::vector<std::uint8_t> bytes;
     std::size_t mask;
+    std::uint64_t load_generation;
+    std::vector<std::uint64_t> page_loads;
+
+    std::vector<Watchpoint> watchpoints;
+    std::vector<std::uint8_t> page_tags;
+
+    // The PageType of each page, and for a device page, the device and the
+    // address that its range starts at
+    struct DeviceMapping {
+        std::shared_ptr<MemoryDevice> device;
+        std::size_t start;
+    };
+    std::vector<std::uint8_t> page_types;
+    std::vector<DeviceMapping> page_devices;
+
+    // Pointers to the bytes of each page, for FastRead8() and FastWrite8(),
+    // or null where its tags call for the slow path; kept up to date with
+    // UpdateFastPage() whenever the tags change
+    std::vector<std::uint8_t *> read_pages;
+    std::vector<std::uint8_t *> write_pages;
+    void UpdateFastPage(std::size_t page);
+    std::size_t ChunkSize(std::size_t addr, std::size_t size) const;
+
+    // The last snapshot taken or restored, which holds every clean page,
+    // and the pages written since; both empty until the first snapshot
+    std::shared_ptr<const MemorySnapshot> base;
+    std::vector<std::size_t> dirty_pages;
+    mutable bool watch_triggered;
+    mutable WatchHit watch_hit;
+
+    bool coverage_on;
+    mutable std::vector<std::uint8_t> coverage;
+
+    ReadJournal *read_journal;
 };
 
 class LittleEndianMemory : public Memory {
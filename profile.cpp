@@ -0,0 +1,113 @@
+// profile.cpp
+
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <cinttypes>
+#include <cstdio>
+#include "profile.h"
+
+CallProfile::CallProfile(std::uint64_t start, unsigned long cycles) :
+    current(0),
+    last_cycles(cycles)
+{
+    nodes.push_back({ start, 0, 0, 0, {} });
+}
+
+void
+CallProfile::Call(std::uint64_t target, std::uint64_t stack,
+                  unsigned long cycles)
+{
+    Update(cycles);
+    std::size_t child;
+    auto p = nodes[current].children.find(target);
+    if (p != nodes[current].children.end()) {
+        child = p->second;
+    } else {
+        child = nodes.size();
+        nodes.push_back({ target, current, 0, 0, {} });
+        nodes[current].children[target] = child;
+    }
+    ++nodes[child].calls;
+    frames.push_back({ child, stack });
+    current = child;
+}
+
+void
+CallProfile::Return(std::uint64_t stack, unsigned long cycles)
+{
+    Update(cycles);
+    while (!frames.empty() && frames.back().stack <= stack) {
+        frames.pop_back();
+    }
+    current = frames.empty() ? 0 : frames.back().node;
+}
+
+void
+CallProfile::Update(unsigned long cycles)
+{
+    // The cycle count may have been cleared or restored since
+    if (cycles > last_cycles) {
+        nodes[current].cycles += cycles - last_cycles;
+    }
+    last_cycles = cycles;
+}
+
+void
+CallProfile::WriteCollapsed(std::ostream& out) const
+{
+    // Nodes come after their parents, so each path extends one already
+    // made
+    std::vector<std::string> paths(nodes.size());
+    for (std::size_t i = 0; i < nodes.size(); ++i) {
+        char name[24];
+        std::snprintf(name, sizeof(name), "$%04" PRIX64, nodes[i].addr);
+        paths[i] = (i == 0) ? name : paths[nodes[i].parent] + ";" + name;
+        if (nodes[i].cycles != 0) {
+            out << paths[i] << ' ' << nodes[i].cycles << '\n';
+        }
+    }
+}
+
+std::vector<CallProfile::Routine>
+CallProfile::GetRoutines(void) const
+{
+    // Total the cycles of each subtree, children before parents
+    std::vector<unsigned long long> totals(nodes.size());
+    for (std::size_t i = nodes.size(); i-- > 0; ) {
+        totals[i] += nodes[i].cycles;
+        if (i != 0) {
+            totals[nodes[i].parent] += totals[i];
+        }
+    }
+
+    // A node adds its subtree to its routine's inclusive cycles unless
+    // the routine is already further down the stack
+    std::unordered_map<std::uint64_t, Routine> routines;
+    for (std::size_t i = 0; i < nodes.size(); ++i) {
+        auto addr = nodes[i].addr;
+        auto &routine = routines[addr];
+        routine.addr = addr;
+        routine.calls += nodes[i].calls;
+        routine.exclusive += nodes[i].cycles;
+        bool nested = false;
+        for (auto n = i; n != 0 && !nested; ) {
+            n = nodes[n].parent;
+            nested = nodes[n].addr == addr;
+        }
+        if (!nested) {
+            routine.inclusive += totals[i];
+        }
+    }
+
+    std::vector<Routine> result;
+    for (auto const &r : routines) {
+        result.push_back(r.second);
+    }
+    std::sort(result.begin(), result.end(),
+              [](const Routine& a, const Routine& b) {
+                  return a.inclusive != b.inclusive ? a.inclusive > b.inclusive
+                                                    : a.addr < b.addr;
+              });
+    return result;
+}
@@ -0,0 +1,74 @@
+// profile.h
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <vector>
+
+// Cycles spent in each subroutine, from a shadow of the call stack. The CPU
+// reports each call, interrupt and return, with its cycle count at the
+// time; the cycles since the last report go to the routine on top of the
+// stack, as reached through the routines below it. The stack of the CPU
+// is taken to grow down.
+class CallProfile {
+public:
+    // start is the address where execution was when profiling began,
+    // which names the bottom of the stack
+    CallProfile(std::uint64_t start, unsigned long cycles);
+
+    // A call to target, which a return leaves with the stack pointer at
+    // stack, or at any higher address
+    void Call(std::uint64_t target, std::uint64_t stack, unsigned long cycles);
+
+    // A return that left the stack pointer at stack. It ends each call
+    // whose return was to leave it there or below, so that routines that
+    // drop their return address to get out of nested calls are followed.
+    // A return that ends no call, as when one is used as a jump, is not a
+    // return from the routine.
+    void Return(std::uint64_t stack, unsigned long cycles);
+
+    // Give the cycles up to now to the routine on top of the stack
+    void Update(unsigned long cycles);
+
+    // Write each stack that was seen, with its own cycles, in the collapsed
+    // form read by flame graph tools: routines from the bottom up, by
+    // address, separated by semicolons, then a space and the cycles
+    void WriteCollapsed(std::ostream& out) const;
+
+    // Totals for each routine, most cycles first. Inclusive cycles
+    // count those of the routines that it called; a routine that calls
+    // itself is counted once.
+    struct Routine {
+        std::uint64_t addr;
+        unsigned long calls;
+        unsigned long long inclusive;
+        unsigned long long exclusive;
+    };
+    std::vector<Routine> GetRoutines(void) const;
+
+private:
+    // The stacks seen form a tree, with a node for each routine as reached
+    // through each chain of callers
+    struct Node {
+        std::uint64_t addr;
+        std::size_t parent;
+        unsigned long calls;
+        unsigned long long cycles;     // Its own, not those of callees
+        std::map<std::uint64_t, std::size_t> children;
+    };
+    std::vector<Node> nodes;
+
+    struct Frame {
+        std::size_t node;
+        std::uint64_t stack;            // Where the return leaves it
+    };
+    std::vector<Frame> frames;
+    std::size_t current;
+    unsigned long last_cycles;
+};
+
+#endif
@@ -0,0 +1,193 @@
+// runvectors.cpp
+//
+// Run 6502 test vectors from files, on all cores, and report any that fail:
+//     cpusim-vectors [options] file.json...
+// Options:
+//     --6502 --6502-undocumented --65c02 --w65c02
+//                      The CPU variant, as for cpusim; the default is --6502
+//     --jit            Enable native translation
+//     --threads N      Number of threads; the default is one per core
+//     --show N         Show at most N failures; the default is 20
+// The exit status is 0 if every vector passes, 1 if any fails, and 2 for an
+// error in the options or in a file.
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "cpu6502.h"
+#include "memory.h"
+#include "vectors.h"
+#include "workpool.h"
+
+// Vectors in each task; enough to outweigh the cost of taking a task,
+// and few enough for idle workers to have something to steal
+static const std::size_t chunk_size = 256;
+
+struct Failure {
+    std::string file;
+    std::string name;
+    std::string mismatch;
+
+    bool operator<(const Failure& other) const
+    {
+        return file != other.file ? file < other.file : name < other.name;
+    }
+};
+
+// What each worker has, used only by its own thread. The alignment keeps
+// workers' counters out of each other's cache lines.
+struct alignas(64) WorkerState {
+    std::unique_ptr<CPU6502> cpu;
+    Memory *memory;
+    unsigned long vectors;
+    unsigned long instructions;
+    unsigned long cycles;
+    std::vector<Failure> failures;
+
+    WorkerState(void) : memory(nullptr), vectors(0), instructions(0),
+                        cycles(0) {}
+};
+
+static void
+usage(const char *prog)
+{
+    std::fprintf(stderr,
+            "Usage: %s [--6502 | --6502-undocumented | --65c02 | --w65c02]\n"
+            "       [--jit] [--threads N] [--show N] file.json...\n", prog);
+    std::exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+    CPU6502::Variant variant = CPU6502::nmos;
+    bool jit = false;
+    unsigned threads = 0;
+    unsigned long show = 20;
+    std::vector<std::string> files;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--6502") {
+            variant = CPU6502::nmos;
+        } else if (arg == "--6502-undocumented") {
+            variant = CPU6502::nmos_undocumented;
+        } else if (arg == "--65c02") {
+            variant = CPU6502::cmos;
+        } else if (arg == "--w65c02") {
+            variant = CPU6502::wdc;
+        } else if (arg == "--jit") {
+            jit = true;
+        } else if ((arg == "--threads" || arg == "--show") && i + 1 < argc) {
+            char *end;
+            unsigned long num = std::strtoul(argv[++i], &end, 10);
+            if (*end != '\0') {
+                usage(argv[0]);
+            }
+            if (arg == "--threads") {
+                threads = num;
+            } else {
+                show = num;
+            }
+        } else if (arg.compare(0, 2, "--") == 0) {
+            usage(argv[0]);
+        } else {
+            files.push_back(arg);
+        }
+    }
+    if (files.empty()) {
+        usage(argv[0]);
+    }
+
+    WorkPool pool(threads);
+    std::vector<WorkerState> workers(pool.GetWorkers());
+
+    // Each file is a task, which loads it and pushes a task for each chunk
+    // of its vectors. Each worker builds its own CPU and memory on first
+    // use, and keeps them from vector to vector.
+    auto run_chunk = [&workers, variant, jit](
+            const std::string& file,
+            std::shared_ptr<const std::vector<TestVector>> vectors,
+            std::size_t start, unsigned worker) {
+        auto& state = workers[worker];
+        if (!state.cpu) {
+            state.memory = new LittleEndianMemory(65536);
+            state.cpu.reset(new CPU6502(state.memory, variant));
+            state.cpu->SetJIT(jit);
+        }
+        auto end = std::min(start + chunk_size, vectors->size());
+        for (auto i = start; i < end; ++i) {
+            auto const &vector = (*vectors)[i];
+            auto result = RunVector(state.cpu.get(), state.memory, vector);
+            ++state.vectors;
+            state.instructions += result.instructions;
+            state.cycles += result.cycles;
+            if (!result.passed) {
+                state.failures.push_back({ file, vector.name,
+                                           result.mismatch });
+            }
+        }
+    };
+
+    for (std::size_t f = 0; f < files.size(); ++f) {
+        const std::string& file = files[f];
+        pool.Push(f, [&pool, &file, run_chunk](unsigned worker) {
+            auto vectors = std::make_shared<const std::vector<TestVector>>(
+                    LoadVectors(file));
+            for (std::size_t start = 0; start < vectors->size();
+                 start += chunk_size) {
+                pool.Push(worker, [&file, vectors, start, run_chunk](
+                        unsigned w) {
+                    run_chunk(file, vectors, start, w);
+                });
+            }
+        });
+    }
+
+    auto start_time = std::chrono::steady_clock::now();
+    try {
+        pool.Run();
+    }
+    catch (const std::exception& e) {
+        std::fprintf(stderr, "%s: %s\n", argv[0], e.what());
+        return 2;
+    }
+    std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start_time;
+
+    std::vector<Failure> failures;
+    unsigned long vectors = 0, instructions = 0, cycles = 0;
+    for (auto& state : workers) {
+        vectors += state.vectors;
+        instructions += state.instructions;
+        cycles += state.cycles;
+        failures.insert(failures.end(), state.failures.begin(),
+                        state.failures.end());
+    }
+    std::sort(failures.begin(), failures.end());
+
+    for (std::size_t i = 0; i < failures.size() && i < show; ++i) {
+        std::printf("%s: %s: %s\n", failures[i].file.c_str(),
+                    failures[i].name.c_str(), failures[i].mismatch.c_str());
+    }
+    if (failures.size() > show) {
+        std::printf("... and %lu more\n",
+                    static_cast<unsigned long>(failures.size() - show));
+    }
+
+    double secs = std::max(elapsed.count(), 1e-9);
+    std::printf("%lu vectors, %lu failed, in %.3f s on %u threads\n",
+                vectors, static_cast<unsigned long>(failures.size()), secs,
+                pool.GetWorkers());
+    std::printf("%.0f vectors/s, %.2f M instructions/s, %.2f M cycles/s\n",
+                vectors / secs, instructions / secs / 1e6,
+                cycles / secs / 1e6);
+
+    return failures.empty() ? 0 : 1;
+}
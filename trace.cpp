@@ -0,0 +1,111 @@
+// trace.cpp
+
+#include <zlib.h>
+#include "trace.h"
+
+TraceWriter::TraceWriter(const std::string& path, const std::string& header) :
+    file(nullptr),
+    buffer(chunk_size * num_chunks),
+    chunk_used(num_chunks),
+    chunk_bytes(0),
+    filled(0),
+    drained(0),
+    finishing(false),
+    failed(false)
+{
+    // Speed matters more than size here; level 1 keeps up with the core
+    auto gz = gzopen(path.c_str(), "wb1");
+    if (gz == nullptr) {
+        throw TraceExcept(path + ": cannot create");
+    }
+    std::string line = header + "\n";
+    if (gzwrite(gz, line.data(), line.size()) != static_cast<int>(line.size())) {
+        gzclose(gz);
+        throw TraceExcept(path + ": cannot write");
+    }
+    file = gz;
+
+    chunk_start = buffer.data();
+    chunk_end = chunk_start + chunk_size;
+    next = chunk_start;
+    thread = std::thread(&TraceWriter::Drain, this);
+}
+
+TraceWriter::~TraceWriter(void)
+{
+    try {
+        Finish();
+    }
+    catch (const TraceExcept&) {
+    }
+}
+
+// Hand the current chunk to the thread, and wait for the next one to be
+// free
+void
+TraceWriter::NextChunk(void)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    chunk_used[filled % num_chunks] = next - chunk_start;
+    chunk_bytes += next - chunk_start;
+    ++filled;
+    cond.notify_all();
+    cond.wait(guard, [this] { return filled - drained < num_chunks; });
+
+    chunk_start = buffer.data() + (filled % num_chunks) * chunk_size;
+    chunk_end = chunk_start + chunk_size;
+    next = chunk_start;
+}
+
+void
+TraceWriter::Finish(void)
+{
+    if (file == nullptr) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        chunk_used[filled % num_chunks] = next - chunk_start;
+        chunk_bytes += next - chunk_start;
+        ++filled;
+        finishing = true;
+        cond.notify_all();
+    }
+    thread.join();
+    chunk_start = chunk_end = next = nullptr;
+
+    bool closed = gzclose(static_cast<gzFile>(file)) == Z_OK;
+    file = nullptr;
+    if (failed || !closed) {
+        throw TraceExcept("Error writing the trace file");
+    }
+}
+
+// Body of the thread: compress and write each chunk as it is filled
+void
+TraceWriter::Drain(void)
+{
+    auto gz = static_cast<gzFile>(file);
+    std::unique_lock<std::mutex> guard(lock);
+    while (true) {
+        cond.wait(guard, [this] { return drained < filled || finishing; });
+        if (drained == filled) {
+            break;
+        }
+
+        // The core does not touch a filled chunk until it is drained
+        auto index = drained % num_chunks;
+        auto used = chunk_used[index];
+        guard.unlock();
+        bool ok = used == 0
+               || gzwrite(gz, buffer.data() + index * chunk_size, used)
+                  == static_cast<int>(used);
+        guard.lock();
+
+        if (!ok) {
+            failed = true;
+        }
+        ++drained;
+        cond.notify_all();
+    }
+}
@@ -0,0 +1,87 @@
+// trace.h
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+class TraceExcept : public std::runtime_error {
+public:
+    TraceExcept(const std::string& msg) : std::runtime_error(msg) {}
+    TraceExcept(const char *msg) : std::runtime_error(msg) {}
+};
+
+// A trace file being written: a line of text naming the format, then the
+// records of a CPU core, all compressed with gzip. The core appends records
+// to a ring of chunks in memory, and a thread compresses the full chunks
+// and writes them out. The core waits for a chunk only if it gets a whole
+// ring ahead of the thread.
+class TraceWriter {
+public:
+    // No record is longer than this
+    static const std::size_t max_record = 64;
+
+    // Create the file at path, and write the header line, which should
+    // name the CPU and the version of its record format. Throws
+    // TraceExcept if the file cannot be created.
+    TraceWriter(const std::string& path, const std::string& header);
+    ~TraceWriter(void);
+
+    // Room for the next record; write at most max_record bytes there, and
+    // pass the end of what was written to Commit()
+    std::uint8_t *Reserve(void)
+    {
+        if (chunk_end - next < static_cast<std::ptrdiff_t>(max_record)) {
+            NextChunk();
+        }
+        return next;
+    }
+    void Commit(std::uint8_t *end) { next = end; }
+
+    // Write out everything and close the file. Throws TraceExcept if
+    // anything could not be written; the destructor does the same but
+    // does not report errors.
+    void Finish(void);
+
+    // Bytes of records written so far, before compression
+    std::uint64_t GetRecordBytes(void) const
+        { return chunk_bytes + (next - chunk_start); }
+
+private:
+    static const std::size_t chunk_size = 1 << 16;
+    static const unsigned num_chunks = 32;
+
+    void NextChunk(void);
+    void Drain(void);
+
+    void *file;
+    std::vector<std::uint8_t> buffer;
+    std::vector<std::size_t> chunk_used;
+
+    // The core's place in the current chunk
+    std::uint8_t *chunk_start;
+    std::uint8_t *chunk_end;
+    std::uint8_t *next;
+    std::uint64_t chunk_bytes;      // In chunks already handed over
+
+    // Chunks handed to the thread, and chunks it has written; each chunk
+    // is free again once written. These are shared with the thread, under
+    // lock, which is taken once per chunk.
+    std::mutex lock;
+    unsigned long filled;
+    unsigned long drained;
+    bool finishing;
+    bool failed;
+    std::condition_variable cond;
+    std::thread thread;
+};
+
+#endif
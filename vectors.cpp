@@ -0,0 +1,380 @@
+// vectors.cpp
+
+#include <fstream>
+#include <sstream>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include "cpu.h"
+#include "memory.h"
+#include "vectors.h"
+
+namespace {
+
+// Enough JSON for test vectors: objects, arrays, numbers and strings.
+// Strings keep their escapes undecoded, as names are only displayed.
+struct JsonValue {
+    enum Kind { json_null, json_bool, json_number, json_string, json_array,
+                json_object };
+    Kind kind;
+    double number;
+    std::string text;
+    std::vector<JsonValue> items;
+    std::vector<std::pair<std::string, JsonValue>> members;
+
+    JsonValue(void) : kind(json_null), number(0) {}
+
+    // nullptr if there is no such member
+    const JsonValue *Find(const char *key) const
+    {
+        for (auto const &member : members) {
+            if (member.first == key) {
+                return &member.second;
+            }
+        }
+        return nullptr;
+    }
+};
+
+class JsonParser {
+public:
+    JsonParser(const std::string& text_) :
+        text(text_), pos(0) {}
+
+    void Parse(JsonValue& value)
+    {
+        ParseValue(value);
+        SkipSpace();
+        if (pos != text.size()) {
+            Error("text after the end");
+        }
+    }
+
+private:
+    void ParseValue(JsonValue& value);
+    void ParseString(std::string& str);
+    void SkipSpace(void);
+    void Expect(char ch);
+    [[noreturn]] void Error(const char *msg) const;
+
+    const std::string& text;
+    std::size_t pos;
+};
+
+void
+JsonParser::ParseValue(JsonValue& value)
+{
+    SkipSpace();
+    if (pos >= text.size()) {
+        Error("unexpected end");
+    }
+
+    char ch = text[pos];
+    if (ch == '{') {
+        value.kind = JsonValue::json_object;
+        ++pos;
+        SkipSpace();
+        if (pos < text.size() && text[pos] == '}') {
+            ++pos;
+            return;
+        }
+        do {
+            value.members.emplace_back();
+            SkipSpace();
+            ParseString(value.members.back().first);
+            Expect(':');
+            ParseValue(value.members.back().second);
+            SkipSpace();
+        } while (pos < text.size() && text[pos++] == ',');
+        if (text[pos - 1] != '}') {
+            Error("expected , or }");
+        }
+    } else if (ch == '[') {
+        value.kind = JsonValue::json_array;
+        ++pos;
+        SkipSpace();
+        if (pos < text.size() && text[pos] == ']') {
+            ++pos;
+            return;
+        }
+        do {
+            value.items.emplace_back();
+            ParseValue(value.items.back());
+            SkipSpace();
+        } while (pos < text.size() && text[pos++] == ',');
+        if (text[pos - 1] != ']') {
+            Error("expected , or ]");
+        }
+    } else if (ch == '"') {
+        value.kind = JsonValue::json_string;
+        ParseString(value.text);
+    } else if (ch == '-' || std::isdigit(static_cast<unsigned char>(ch))) {
+        value.kind = JsonValue::json_number;
+        char *end;
+        value.number = std::strtod(text.c_str() + pos, &end);
+        pos = end - text.c_str();
+    } else if (text.compare(pos, 4, "true") == 0) {
+        value.kind = JsonValue::json_bool;
+        value.number = 1;
+        pos += 4;
+    } else if (text.compare(pos, 5, "false") == 0) {
+        value.kind = JsonValue::json_bool;
+        pos += 5;
+    } else if (text.compare(pos, 4, "null") == 0) {
+        pos += 4;
+    } else {
+        Error("unexpected character");
+    }
+}
+
+void
+JsonParser::ParseString(std::string& str)
+{
+    if (pos >= text.size() || text[pos] != '"') {
+        Error("expected a string");
+    }
+    auto start = ++pos;
+    while (pos < text.size() && text[pos] != '"') {
+        pos += (text[pos] == '\\') ? 2 : 1;
+    }
+    if (pos >= text.size()) {
+        Error("unterminated string");
+    }
+    str = text.substr(start, pos - start);
+    ++pos;
+}
+
+void
+JsonParser::SkipSpace(void)
+{
+    while (pos < text.size()
+    &&     std::isspace(static_cast<unsigned char>(text[pos]))) {
+        ++pos;
+    }
+}
+
+void
+JsonParser::Expect(char ch)
+{
+    SkipSpace();
+    if (pos >= text.size() || text[pos] != ch) {
+        char msg[20];
+        std::snprintf(msg, sizeof(msg), "expected %c", ch);
+        Error(msg);
+    }
+    ++pos;
+}
+
+void
+JsonParser::Error(const char *msg) const
+{
+    // Give the line, counting from 1
+    unsigned long line = 1;
+    for (std::size_t i = 0; i < pos && i < text.size(); ++i) {
+        line += text[i] == '\n';
+    }
+    throw VectorExcept("line " + std::to_string(line) + ": " + msg);
+}
+
+// Registers of the 6502 by their names in the vectors
+const struct {
+    const char *key;
+    const char *reg;
+} register_keys[] = {
+    { "pc", "PC"    },
+    { "s",  "S"     },
+    { "a",  "A"     },
+    { "x",  "X"     },
+    { "y",  "Y"     },
+    { "p",  "FLAGS" },
+    { nullptr, nullptr }
+};
+
+// Bits of P that are stored, and so compared
+const std::uint64_t flags_mask = 0xCF;
+
+std::uint64_t
+getNumber(const JsonValue& value, const char *what)
+{
+    if (value.kind != JsonValue::json_number || value.number < 0) {
+        throw VectorExcept(std::string("bad number for ") + what);
+    }
+    return static_cast<std::uint64_t>(value.number);
+}
+
+void
+getState(const JsonValue& value, VectorState& state)
+{
+    if (value.kind != JsonValue::json_object) {
+        throw VectorExcept("state is not an object");
+    }
+    for (unsigned i = 0; register_keys[i].key != nullptr; ++i) {
+        auto reg = value.Find(register_keys[i].key);
+        if (reg != nullptr) {
+            state.registers.emplace_back(register_keys[i].reg,
+                    getNumber(*reg, register_keys[i].key));
+        }
+    }
+
+    auto ram = value.Find("ram");
+    if (ram == nullptr) {
+        return;
+    }
+    if (ram->kind != JsonValue::json_array) {
+        throw VectorExcept("ram is not an array");
+    }
+    for (auto const &item : ram->items) {
+        if (item.kind != JsonValue::json_array || item.items.size() != 2) {
+            throw VectorExcept("ram entry is not [address, value]");
+        }
+        auto addr = getNumber(item.items[0], "address");
+        auto byte = getNumber(item.items[1], "byte");
+        if (addr > 0xFFFF || byte > 0xFF) {
+            throw VectorExcept("ram entry out of range");
+        }
+        state.ram.emplace_back(addr, byte);
+    }
+}
+
+}
+
+std::vector<TestVector>
+LoadVectors(const std::string& path)
+{
+    std::ifstream fp(path, std::ios::binary);
+    if (!fp) {
+        throw VectorExcept(path + ": cannot open");
+    }
+    std::ostringstream contents;
+    contents << fp.rdbuf();
+    std::string text = contents.str();
+
+    std::vector<TestVector> vectors;
+    try {
+        JsonValue root;
+        JsonParser(text).Parse(root);
+        if (root.kind != JsonValue::json_array) {
+            throw VectorExcept("not an array of vectors");
+        }
+
+        vectors.reserve(root.items.size());
+        for (auto const &item : root.items) {
+            TestVector vector;
+            vector.steps = 1;
+            vector.cycles = -1;
+
+            auto name = item.Find("name");
+            auto initial = item.Find("initial");
+            auto final = item.Find("final");
+            if (initial == nullptr || final == nullptr) {
+                throw VectorExcept("vector without initial or final state");
+            }
+            vector.name = (name != nullptr) ? name->text
+                        : std::to_string(vectors.size());
+            getState(*initial, vector.initial);
+            getState(*final, vector.final);
+
+            auto steps = item.Find("steps");
+            if (steps != nullptr) {
+                vector.steps = getNumber(*steps, "steps");
+            }
+            auto cycles = item.Find("cycles");
+            if (cycles != nullptr) {
+                vector.cycles = (cycles->kind == JsonValue::json_array)
+                              ? cycles->items.size()
+                              : getNumber(*cycles, "cycles");
+            }
+            vectors.push_back(std::move(vector));
+        }
+    }
+    catch (const VectorExcept& e) {
+        throw VectorExcept(path + ": " + e.what());
+    }
+    return vectors;
+}
+
+VectorResult
+RunVector(CPU *cpu, Memory *memory, const TestVector& vector)
+{
+    VectorResult result;
+    result.passed = true;
+    result.instructions = 0;
+    result.cycles = 0;
+
+    for (auto const &reg : vector.initial.registers) {
+        char str[20];
+        if (reg.first == "FLAGS") {
+            // SetRegister takes flags as letters
+            static const char letters[] = "NV-BDIZC";
+            for (unsigned i = 0; i < 8; ++i) {
+                str[i] = (reg.second & (0x80 >> i)) ? letters[i] : '-';
+            }
+            str[8] = '\0';
+        } else {
+            std::snprintf(str, sizeof(str), "%llX",
+                          static_cast<unsigned long long>(reg.second));
+        }
+        cpu->SetRegister(reg.first, str);
+    }
+    for (auto const &ram : vector.initial.ram) {
+        memory->Load8(ram.first, ram.second);
+    }
+
+    std::string mismatch;
+    try {
+        auto run = cpu->RunInstructions(vector.steps);
+        result.instructions = run.instructions;
+        result.cycles = run.cycles;
+    }
+    catch (const CPUExcept& e) {
+        mismatch = std::string("exception: ") + e.what();
+    }
+
+    if (mismatch.empty()) {
+        char str[80];
+        for (auto const &reg : vector.final.registers) {
+            auto value = cpu->GetRegisterValue(
+                    cpu->GetRegisterIndex(reg.first));
+            auto expected = reg.second;
+            if (reg.first == "FLAGS") {
+                value &= flags_mask;
+                expected &= flags_mask;
+            }
+            if (value != expected) {
+                std::snprintf(str, sizeof(str), "; %s $%llX, expected $%llX",
+                        reg.first.c_str(),
+                        static_cast<unsigned long long>(value),
+                        static_cast<unsigned long long>(expected));
+                mismatch += str;
+            }
+        }
+        for (auto const &ram : vector.final.ram) {
+            auto byte = memory->Peek8(ram.first);
+            if (byte != ram.second) {
+                std::snprintf(str, sizeof(str), "; [$%04X] $%02X, expected $%02X",
+                              ram.first, byte, ram.second);
+                mismatch += str;
+            }
+        }
+        if (vector.cycles >= 0
+        &&  result.cycles != static_cast<unsigned long>(vector.cycles)) {
+            std::snprintf(str, sizeof(str), "; %lu cycles, expected %ld",
+                          result.cycles, vector.cycles);
+            mismatch += str;
+        }
+        if (!mismatch.empty()) {
+            mismatch.erase(0, 2);
+        }
+    }
+
+    for (auto const &ram : vector.initial.ram) {
+        memory->Load8(ram.first, 0);
+    }
+    for (auto const &ram : vector.final.ram) {
+        memory->Load8(ram.first, 0);
+    }
+
+    result.passed = mismatch.empty();
+    result.mismatch = mismatch;
+    return result;
+}
@@ -0,0 +1,65 @@
+// vectors.h
+
+#ifndef VECTORS_H
+#define VECTORS_H
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+class CPU;
+class Memory;
+
+class VectorExcept : public std::runtime_error {
+public:
+    VectorExcept(const std::string& msg) : std::runtime_error(msg) {}
+    VectorExcept(const char *msg) : std::runtime_error(msg) {}
+};
+
+// The state of a 6502 and its memory, as a test vector gives it. Registers
+// are named as by CPU6502; FLAGS is a number here, as the P register.
+struct VectorState {
+    std::vector<std::pair<std::string, std::uint64_t>> registers;
+    std::vector<std::pair<std::uint16_t, std::uint8_t>> ram;
+};
+
+// A test vector: a state to start from, the number of instructions to
+// execute, and the state and cycle count that should result. Files of them
+// are JSON, in the format of the single-step 65x02 tests:
+//     [ { "name": "a9 40 ba",
+//         "initial": { "pc": 512, "s": 253, "a": 0, "x": 0, "y": 0,
+//                      "p": 36, "ram": [ [512, 169], [513, 64] ] },
+//         "final": { "pc": 514, "s": 253, "a": 64, "x": 0, "y": 0,
+//                    "p": 36, "ram": [ [512, 169], [513, 64] ] },
+//         "cycles": [ [512, 169, "read"], [513, 64, "read"] ] },
+//       ... ]
+// "cycles" lists the bus cycles, and only their number is checked. A
+// vector may also give "steps", the number of instructions, so that a
+// small program can be a vector; the default is one.
+struct TestVector {
+    std::string name;
+    VectorState initial;
+    VectorState final;
+    unsigned long steps;
+    long cycles;            // -1 if not given
+};
+
+// Throws VectorExcept if the file cannot be read or is not valid
+std::vector<TestVector> LoadVectors(const std::string& path);
+
+struct VectorResult {
+    bool passed;
+    std::string mismatch;       // What differed, if not passed
+    unsigned long instructions;
+    unsigned long cycles;
+};
+
+// Set cpu and its memory to the initial state of a vector, run it, and
+// compare the outcome with the final state. The B flag and bit 5 of P are
+// not compared, as they are not stored in the 6502. Memory that the vector
+// names is cleared afterwards, so that the next vector starts clean.
+VectorResult RunVector(CPU *cpu, Memory *memory, const TestVector& vector);
+
+#endif
@@ -0,0 +1,107 @@
+// workpool.cpp
+
+#include <algorithm>
+#include <thread>
+#include "workpool.h"
+
+WorkPool::WorkPool(unsigned workers) :
+    pending(0),
+    failed(false)
+{
+    if (workers == 0) {
+        workers = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for (unsigned i = 0; i < workers; ++i) {
+        queues.emplace_back(new Queue);
+    }
+}
+
+void
+WorkPool::Push(unsigned worker, Task task)
+{
+    pending.fetch_add(1, std::memory_order_relaxed);
+    auto& queue = *queues[worker % queues.size()];
+    std::lock_guard<std::mutex> guard(queue.lock);
+    queue.tasks.push_back(std::move(task));
+}
+
+void
+WorkPool::Run(void)
+{
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < queues.size(); ++i) {
+        threads.emplace_back(&WorkPool::Work, this, i);
+    }
+    // The calling thread is worker 0
+    Work(0);
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    if (failed.load()) {
+        // Drop what was not run, so that the pool can be used again
+        for (auto& queue : queues) {
+            queue->tasks.clear();
+        }
+        pending.store(0);
+        failed.store(false);
+        std::rethrow_exception(failure);
+    }
+}
+
+// Take the newest task of a worker's own queue, or else steal the oldest of
+// another's. Return false if every queue is empty.
+bool
+WorkPool::Take(unsigned worker, Task& task)
+{
+    {
+        auto& own = *queues[worker];
+        std::lock_guard<std::mutex> guard(own.lock);
+        if (!own.tasks.empty()) {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            return true;
+        }
+    }
+
+    // Start with the next worker, so that thieves spread out
+    for (unsigned i = 1; i < queues.size(); ++i) {
+        auto& other = *queues[(worker + i) % queues.size()];
+        std::lock_guard<std::mutex> guard(other.lock);
+        if (!other.tasks.empty()) {
+            task = std::move(other.tasks.front());
+            other.tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void
+WorkPool::Work(unsigned worker)
+{
+    Task task;
+    while (!failed.load(std::memory_order_relaxed)) {
+        if (!Take(worker, task)) {
+            // Queues can be empty while a running task is about to push
+            // more; only stop when no task is left anywhere
+            if (pending.load() == 0) {
+                break;
+            }
+            std::this_thread::yield();
+            continue;
+        }
+        try {
+            task(worker);
+        }
+        catch (...) {
+            std::lock_guard<std::mutex> guard(failure_lock);
+            if (!failed.load()) {
+                failure = std::current_exception();
+                failed.store(true);
+            }
+        }
+        task = nullptr;
+        pending.fetch_sub(1);
+    }
+}
@@ -0,0 +1,57 @@
+// workpool.h
+
+#ifndef WORKPOOL_H
+#define WORKPOOL_H
+
+#include <atomic>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// A pool of threads that share tasks by work stealing. Each worker has its
+// own queue, and takes its newest task first; a worker with nothing to do
+// takes the oldest task of another. A task may push more tasks, which go to
+// its own worker's queue, so that work stays local until others are idle.
+class WorkPool {
+public:
+    // The argument is the number of the worker running the task, from 0 to
+    // GetWorkers() - 1, for use as an index into per-worker state
+    typedef std::function<void(unsigned worker)> Task;
+
+    // Zero means one thread per hardware thread
+    explicit WorkPool(unsigned workers = 0);
+
+    unsigned GetWorkers(void) const { return queues.size(); }
+
+    // Add a task to the queue of a worker. Before Run(), tasks can be
+    // spread over the workers; during it, a task should push to its own.
+    void Push(unsigned worker, Task task);
+
+    // Run all tasks, including those they push, and return when none are
+    // left. An exception from a task stops the run and is thrown again
+    // here, once the other workers finish their current tasks.
+    void Run(void);
+
+private:
+    struct Queue {
+        std::mutex lock;
+        std::deque<Task> tasks;
+    };
+
+    bool Take(unsigned worker, Task& task);
+    void Work(unsigned worker);
+
+    std::vector<std::unique_ptr<Queue>> queues;
+
+    // Tasks pushed and not yet finished; the run ends when this reaches 0
+    std::atomic<unsigned long> pending;
+
+    std::atomic<bool> failed;
+    std::exception_ptr failure;
+    std::mutex failure_lock;
+};
+
+#endif